@@ -83,6 +83,12 @@
 /* Define to 1 if you have the `dup2' function. */
 #define HAVE_DUP2 1
 
+/* Define to 1 if you have the `epoll_create1' function. */
+#define HAVE_EPOLL 1
+
+/* Define to 1 if you have the `eventfd' function. */
+#define HAVE_EVENTFD 1
+
 /* Define to 1 if you have the `fcntl' function. */
 #define HAVE_FCNTL 1
 
@@ -146,6 +152,10 @@
 /* Define to 1 if you have the <inttypes.h> header file. */
 #define HAVE_INTTYPES_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file, and the
+   io_uring_setup and io_uring_enter system calls. */
+#define HAVE_IO_URING 1
+
 /* Linux IPv6 */
 #define HAVE_IPV6 1
 
@@ -290,6 +300,9 @@
 /* prctl */
 #define HAVE_PR_SET_KEEPCAPS /**/
 
+/* Define to 1 if you have the `recvmmsg' function. */
+#define HAVE_RECVMMSG 1
+
 /* Have RFC3678 protocol-independed API */
 #define HAVE_RFC3678 1
 
@@ -302,12 +315,18 @@
 /* Define to 1 if you have the `select' function. */
 #define HAVE_SELECT 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#define HAVE_SENDMMSG 1
+
 /* Have setproctitle */
 /* #undef HAVE_SETPROCTITLE */
 
 /* Define to 1 if you have the <signal.h> header file. */
 #define HAVE_SIGNAL_H 1
 
+/* Define to 1 if you have the `signalfd' function. */
+#define HAVE_SIGNALFD 1
+
 /* SNMP */
 /* #undef HAVE_SNMP */
 
@@ -514,6 +533,12 @@
 /* Old Linux 2.4 TCP MD5 Signature Patch */
 /* #undef HAVE_TCP_MD5_LINUX24 */
 
+/* Linux packet socket rings, version 3 */
+#define HAVE_TPACKET_V3 1
+
+/* Define to 1 if you have the `timerfd_create' function. */
+#define HAVE_TIMERFD 1
+
 /* Define to 1 if you have the <time.h> header file. */
 #define HAVE_TIME_H 1
 
@@ -9,8 +9,25 @@
 #include "zclient.h"
 #include "linklist.h"
 #include "log.h"
+#include "thread.h"
+#include "if.h"
 
 #include "ha_debug.h"
+#include "ha_deamon.h"
+
+/* Router id update, once the address lists are up to date. */
+static struct thread *t_router_id_update;
+
+static int
+ha_router_id_update_event (struct thread *thread)
+{
+  struct ha *ha;
+
+  t_router_id_update = NULL;
+  if ((ha = ha_lookup ()) != NULL)
+    ha_router_id_update (ha);
+  return 0;
+}
 
 /* Interface up information. */
 void
@@ -59,6 +76,10 @@ kroute_interface_address_add_update (struct interface *ifp,
 		  inet_ntop (p->family, &p->u.prefix, buf, INET6_ADDRSTRLEN),
 		  p->prefixlen, ifc->ifp->name);
     }
+
+  if (t_router_id_update == NULL)
+    t_router_id_update = thread_add_event (master, ha_router_id_update_event,
+					   NULL, 0);
 }
 
 /* Interface address deletion. */
@@ -77,6 +98,10 @@ kroute_interface_address_delete_update (struct interface *ifp,
 		  inet_ntop (p->family, &p->u.prefix, buf, INET6_ADDRSTRLEN),
 		 p->prefixlen, ifc->ifp->name);
     }
+
+  if (t_router_id_update == NULL)
+    t_router_id_update = thread_add_event (master, ha_router_id_update_event,
+					   NULL, 0);
 }
 
 void
@@ -994,8 +994,8 @@ extern struct thread_master *master;
 static int
 kernel_read (struct thread *thread)
 {
+  /* Persistent, and netlink_parse_info reads until the socket is empty. */
   netlink_parse_info (netlink_information_fetch, &netlink);
-  thread_add_read (hm->master, kernel_read, NULL, netlink.sock);
 
   return 0;
 }
@@ -1058,6 +1058,6 @@ kernel_init (void)
 	netlink_recvbuf (&netlink, nl_rcvbufsize);
 
       netlink_install_filter (netlink.sock, netlink_cmd.snl.nl_pid);
-      thread_add_read (hm->master, kernel_read, NULL, netlink.sock);
+      thread_add_read_persist (hm->master, kernel_read, NULL, netlink.sock);
     }
 }
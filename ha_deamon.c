@@ -14,10 +14,19 @@
 #include "zclient.h"
 #include "plist.h"
 #include "sockopt.h"
+#include "hash.h"
+#include "md5.h"
+#include "keychain.h"
 
 #include "ha_deamon.h"
 #include "ha_packet.h"
+#include "ha_peer.h"
+#include "ha_ring.h"
+#include "ha_udp.h"
+#include "ha_stats.h"
+#include "ha_auth.h"
 #include "ha_debug.h"
+#include "ha_hbthread.h"
 
 /* HA process wide configuration. */
 static struct ha_master ha_master;
@@ -25,30 +34,221 @@ static struct ha_master ha_master;
 /* HA process wide configuration pointer to export. */
 struct ha_master *hm;
 
+static void ha_group_start (struct ha_group *);
+static void ha_group_stop (struct ha_group *);
+
+/* Open the configured transport and start reading it, then the groups.
+   Heartbeat thread only. */
+static void
+ha_transport_open (struct ha *ha)
+{
+  int id;
+
+  if (ha->hb.transport == HA_TRANSPORT_UDP)
+    {
+      if (ha_udp_open (ha) < 0)
+	return;
+    }
+  else
+    {
+      if ((ha->fd = ha_sock_init ()) < 0)
+	{
+	  zlog_err ("HA: can't open the HA socket, hellos are not sent");
+	  return;
+	}
+      ha->maxsndbuflen = getsockopt_so_sendbuf (ha->fd);
+      if (IS_DEBUG_HA (kroute, KROUTE_INTERFACE))
+	zlog_debug ("%s: starting with HA send buffer size %d",
+		    __func__, ha->maxsndbuflen);
+#ifdef SO_ATTACH_FILTER
+      ha_sock_filter_update (ha);
+#endif /* SO_ATTACH_FILTER */
+      ha->t_read = thread_add_read_persist (hm->hb_master, ha_read, ha,
+					    ha->fd);
+      thread_set_priority (ha->t_read, THREAD_PRIO_CRITICAL);
+#ifdef HAVE_TPACKET_V3
+      if (ha->hb.receive_ring && ha_ring_open (ha) < 0)
+	zlog_warn ("HA: no receive ring, reading the HA socket");
+#endif /* HAVE_TPACKET_V3 */
+    }
+
+  ha->transport_up = 1;
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if (ha->hb_group[id])
+      ha_group_start (ha->hb_group[id]);
+}
+
+/* Stop the groups and close the transport.  Heartbeat thread only. */
+static void
+ha_transport_close (struct ha *ha)
+{
+  int id;
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if (ha->hb_group[id])
+      ha_group_stop (ha->hb_group[id]);
+  ha->transport_up = 0;
+
+  THREAD_WRITE_OFF (ha->t_write);
+  THREAD_READ_OFF (ha->t_read);
+#ifdef HAVE_TPACKET_V3
+  ha_ring_close (ha);
+#endif /* HAVE_TPACKET_V3 */
+  if (ha->fd >= 0)
+    {
+      close (ha->fd);
+      ha->fd = -1;
+    }
+  ha_udp_close (ha);
+}
+
+/* Opened by an event, rather than by ha_new itself, so that while the
+   configuration is being read, only the transport it asks for is. */
+static int
+ha_transport_event (struct thread *thread)
+{
+  struct ha *ha = THREAD_ARG (thread);
+
+  ha->t_transport = NULL;
+#ifdef HAVE_RECVMMSG
+  ha_recv_batch_alloc (ha, ha->hb.read_batch);
+#endif /* HAVE_RECVMMSG */
+  ha_transport_open (ha);
+  return 0;
+}
+
+/* For ha_new once the heartbeat thread is running. */
+static int
+ha_transport_start (void *arg)
+{
+  struct ha *ha = arg;
+
+  ha->t_transport = thread_add_event (hm->hb_master, ha_transport_event,
+				      ha, 0);
+  return 0;
+}
+
+static void
+ha_params_get (struct ha *ha, struct ha_params *params)
+{
+  params->router_id = ha->router_id;
+  params->read_batch = ha->read_batch;
+  params->receive_ring = ha->receive_ring;
+  params->transport = ha->transport;
+  params->udp_port = ha->udp_port;
+  params->stats_export = ha->stats_export;
+}
+
+/* The instance's configuration, for the heartbeat thread. */
+struct ha_params_msg
+{
+  struct ha *ha;
+  struct ha_params params;
+};
+
+static int
+ha_params_apply (void *arg)
+{
+  struct ha_params_msg *msg = arg;
+  struct ha *ha = msg->ha;
+  struct ha_params old = ha->hb;
+
+  ha->hb = msg->params;
+  XFREE (MTYPE_TMP, msg);
+
+#ifdef HAVE_RECVMMSG
+  if (ha->hb.read_batch != old.read_batch)
+    ha_recv_batch_alloc (ha, ha->hb.read_batch);
+#endif /* HAVE_RECVMMSG */
+
+  if (ha->hb.transport != old.transport || ha->hb.udp_port != old.udp_port)
+    {
+      /* Until the event has opened it, there is nothing to reopen. */
+      if (ha->t_transport == NULL)
+	{
+	  ha_transport_close (ha);
+	  ha_transport_open (ha);
+	}
+    }
+  else
+    {
+#ifdef HAVE_TPACKET_V3
+      /* The ring is for the raw socket, and is opened along with it. */
+      if (ha->hb.receive_ring != old.receive_ring && ha->fd >= 0)
+	{
+	  if (!ha->hb.receive_ring)
+	    ha_ring_close (ha);
+	  else if (ha_ring_open (ha) < 0)
+	    zlog_warn ("HA: no receive ring, reading the HA socket");
+	}
+#endif /* HAVE_TPACKET_V3 */
+#ifdef SO_ATTACH_FILTER
+      if (ha->hb.router_id.s_addr != old.router_id.s_addr)
+	ha_sock_filter_update (ha);
+#endif /* SO_ATTACH_FILTER */
+    }
+
+  if (ha->hb.stats_export != old.stats_export)
+    {
+      if (ha->hb.stats_export)
+	ha_stats_export_start (ha);
+      else
+	ha_stats_export_stop (ha);
+    }
+  return 0;
+}
+
+/* Pass the instance's configuration over to the heartbeat thread.
+   Main thread only. */
+static void
+ha_params_update (struct ha *ha)
+{
+  struct ha_params_msg *msg;
+
+  msg = XCALLOC (MTYPE_TMP, sizeof (struct ha_params_msg));
+  msg->ha = ha;
+  ha_params_get (ha, &msg->params);
+  ha_hb_call (ha_params_apply, msg);
+}
+
 /* Allocate new ha structure. */
 static struct ha *
 ha_new (void)
 {
   struct ha *new = XCALLOC (MTYPE_HA_TOP, sizeof (struct ha));
 
-  if ((new->fd = ha_sock_init()) < 0)
-    {
-      zlog_err("ha_new: fatal error: ha_sock_init was unable to open "
-	       "a socket");
-      exit(1);
-    }
-  new->maxsndbuflen = getsockopt_so_sendbuf (new->fd);
-  if (IS_DEBUG_HA (kroute, KROUTE_INTERFACE))
-    zlog_debug ("%s: starting with HA send buffer size %d",
-      __func__, new->maxsndbuflen);
+  new->fd = -1;
   if ((new->ibuf = stream_new(HA_MAX_PACKET_SIZE+1)) == NULL)
     {
       zlog_err("ha_new: fatal error: stream_new(%u) failed allocating ibuf",
 	       HA_MAX_PACKET_SIZE+1);
       exit(1);
     }
-  new->t_read = thread_add_read (master, ha_read, new, new->fd);
   new->oi_write_q = list_new ();
+  new->peers = ha_peer_hash_new ();
+  new->read_batch = HA_READ_BATCH;
+  new->rx_signed = XCALLOC (MTYPE_HA_BATCH,
+			    HA_AUTH_BATCH * sizeof (struct ha_rx_signed));
+#ifdef HAVE_TPACKET_V3
+  new->ring_fd = -1;
+#endif /* HAVE_TPACKET_V3 */
+  new->transport = HA_TRANSPORT_IP;
+  new->udp_port = HA_UDP_PORT;
+  new->udp_peers = ha_udp_peer_hash_new ();
+  new->stats_fd = -1;
+  ha_params_get (new, &new->hb);
+
+  /* Tells peers our sequence numbers have started over. */
+  new->instance = (u_int32_t) time (NULL) ^ ((u_int32_t) getpid () << 16);
+  ha_router_id_update (new);
+
+  /* Last, the heartbeat thread may pick it up straight away.  Until
+     it is running, nothing else touches its thread master, so the
+     event can be added from here. */
+  if (ha_hbthread_running ())
+    ha_hb_call (ha_transport_start, new);
+  else
+    ha_transport_start (new);
 
   return new;
 }
@@ -89,6 +289,476 @@ ha_get ()
   return ha;
 }
 
+/* The configured router id, or else the highest address on a non
+   loopback interface.  Main thread only. */
+void
+ha_router_id_update (struct ha *ha)
+{
+  struct listnode *node, *cnode;
+  struct interface *ifp;
+  struct connected *ifc;
+  struct in_addr router_id;
+
+  router_id = ha->router_id_static;
+  if (router_id.s_addr == 0)
+    for (ALL_LIST_ELEMENTS_RO (iflist, node, ifp))
+      {
+	if (if_is_loopback (ifp))
+	  continue;
+	for (ALL_LIST_ELEMENTS_RO (ifp->connected, cnode, ifc))
+	  if (ifc->address->family == AF_INET
+	      && ntohl (ifc->address->u.prefix4.s_addr)
+		 > ntohl (router_id.s_addr))
+	    router_id = ifc->address->u.prefix4;
+      }
+
+  if (router_id.s_addr == ha->router_id.s_addr)
+    return;
+
+  ha->router_id = router_id;
+  zlog_info ("HA router id is now %s", inet_ntoa (router_id));
+  ha_params_update (ha);
+}
+
+static int ha_group_hello_timer (struct thread *);
+
+/* Hellos go out on whole milliseconds of the monotonic clock, so those
+   of groups due in the same millisecond expire together, and ha_write
+   sends them with one system call. */
+static void
+ha_group_hello_on (struct ha_group *group, struct timeval when)
+{
+  if (when.tv_usec % 1000)
+    {
+      when.tv_usec += 1000 - when.tv_usec % 1000;
+      if (when.tv_usec >= 1000000)
+	{
+	  when.tv_sec++;
+	  when.tv_usec -= 1000000;
+	}
+    }
+
+  group->t_hello = thread_add_timer_hr_at (hm->hb_master,
+					   ha_group_hello_timer, group, &when);
+  thread_set_priority (group->t_hello, THREAD_PRIO_CRITICAL);
+}
+
+/* Send the group's hellos, every interval from the last one rather
+   than from when we got round to it. */
+static int
+ha_group_hello_timer (struct thread *thread)
+{
+  struct ha_group *group = THREAD_ARG (thread);
+  struct timeval next = thread->u.sands;
+  struct timeval now = recent_relative_time ();
+
+  next.tv_sec += group->hb.interval / 1000;
+  next.tv_usec += (group->hb.interval % 1000) * 1000;
+  if (next.tv_usec >= 1000000)
+    {
+      next.tv_sec++;
+      next.tv_usec -= 1000000;
+    }
+
+  /* Too far behind to catch up, start again from now. */
+  ha_group_hello_on (group, timercmp (&next, &now, <) ? now : next);
+
+  ha_hello_send (group);
+  return 0;
+}
+
+static void
+ha_group_stop (struct ha_group *group)
+{
+  struct ha *ha = group->ha;
+
+  if (!group->running)
+    return;
+
+  THREAD_TIMER_OFF (group->t_hello);
+  if (group->on_write_q)
+    {
+      listnode_delete (ha->oi_write_q, group);
+      group->on_write_q = 0;
+    }
+  if (group->joined.s_addr)
+    setsockopt_ipv4_multicast (ha_packet_fd (ha), IP_DROP_MEMBERSHIP,
+			       group->joined.s_addr, group->joined_ifindex);
+  group->joined.s_addr = 0;
+  group->running = 0;
+}
+
+static void
+ha_group_start (struct ha_group *group)
+{
+  struct ha *ha = group->ha;
+
+  if (group->hb.ifindex == 0 || !ha->transport_up)
+    return;
+
+  /* Remembered, as the configuration may have changed by the time it
+     is left. */
+  if (IN_MULTICAST (ntohl (group->hb.destination.s_addr)))
+    {
+      if (setsockopt_ipv4_multicast (ha_packet_fd (ha), IP_ADD_MEMBERSHIP,
+				     group->hb.destination.s_addr,
+				     group->hb.ifindex) < 0)
+	zlog_warn ("HA group %d: can't join %s on %s: %s", group->id,
+		   inet_ntoa (group->hb.destination), group->hb.ifname,
+		   safe_strerror (errno));
+      else
+	{
+	  group->joined = group->hb.destination;
+	  group->joined_ifindex = group->hb.ifindex;
+	}
+    }
+
+  group->running = 1;
+  ha_group_hello_on (group, recent_relative_time ());
+}
+
+/* What the heartbeat thread is to go by, from the group's
+   configuration.  Main thread only. */
+static void
+ha_group_params_get (struct ha_group *group, struct ha_group_params *params)
+{
+  memcpy (params->ifname, group->ifname, sizeof (params->ifname));
+  params->ifindex = group->ifname[0] ? if_nametoindex (group->ifname) : 0;
+  params->interval = group->interval;
+  params->priority = group->priority;
+  params->dead_multiplier = group->dead_multiplier;
+  params->phi_threshold = group->phi_threshold;
+  params->destination = group->destination;
+}
+
+/* On the heartbeat thread, for ha_group_get: from here on, ha_read
+   finds the group. */
+static int
+ha_group_add (void *arg)
+{
+  struct ha_group *group = arg;
+
+  group->ha->hb_group[group->id] = group;
+#ifdef SO_ATTACH_FILTER
+  ha_sock_filter_update (group->ha);
+#endif /* SO_ATTACH_FILTER */
+  return 0;
+}
+
+/* On the heartbeat thread, for ha_group_delete. */
+static int
+ha_group_free (void *arg)
+{
+  struct ha_group *group = arg;
+  struct ha *ha = group->ha;
+  int i;
+
+  ha->hb_group[group->id] = NULL;
+#ifdef SO_ATTACH_FILTER
+  ha_sock_filter_update (ha);
+#endif /* SO_ATTACH_FILTER */
+  ha_group_stop (group);
+  ha_peer_group_clean (group->ha, group);
+  for (i = 0; i < group->nunicast; i++)
+    ha_udp_peer_put (group->ha, group->unicast[i]);
+  if (group->unicast)
+    XFREE (MTYPE_HA_NEIGHBOR, group->unicast);
+  if (group->auth)
+    ha_auth_free (group->auth);
+  stream_free (group->obuf);
+  XFREE (MTYPE_HA_GROUP, group);
+  return 0;
+}
+
+static void
+ha_group_neighbor_free (void *neighbor)
+{
+  XFREE (MTYPE_HA_NEIGHBOR, neighbor);
+}
+
+struct ha_group *
+ha_group_get (struct ha *ha, u_char id)
+{
+  struct ha_group *group;
+
+  if ((group = ha->group[id]) != NULL)
+    return group;
+
+  group = XCALLOC (MTYPE_HA_GROUP, sizeof (struct ha_group));
+  group->ha = ha;
+  group->id = id;
+  group->interval = HA_GROUP_INTERVAL_DEFAULT;
+  group->priority = HA_GROUP_PRIORITY_DEFAULT;
+  group->dead_multiplier = HA_GROUP_DEAD_MULTIPLIER_DEFAULT;
+  group->destination.s_addr = htonl (HA_ALLHAROUTERS);
+  ha_group_params_get (group, &group->hb);
+  group->obuf = stream_new (HA_HELLO_SIZE_MAX);
+  group->neighbors = list_new ();
+  group->neighbors->del = ha_group_neighbor_free;
+  ha->group[id] = group;
+  ha_hb_call (ha_group_add, group);
+
+  return group;
+}
+
+/* A group's configuration, for the heartbeat thread. */
+struct ha_group_msg
+{
+  struct ha_group *group;
+  struct ha_group_params params;
+};
+
+static int
+ha_group_apply (void *arg)
+{
+  struct ha_group_msg *msg = arg;
+  struct ha_group *group = msg->group;
+  struct ha_group_params old = group->hb;
+
+  group->hb = msg->params;
+  XFREE (MTYPE_TMP, msg);
+
+  /* The next hello goes out with the new priority as it is, but where
+     hellos go and how often takes a fresh start. */
+  if (group->hb.ifindex != old.ifindex
+      || group->hb.interval != old.interval
+      || group->hb.destination.s_addr != old.destination.s_addr)
+    {
+      ha_group_stop (group);
+      ha_group_start (group);
+    }
+  return 0;
+}
+
+/* Pass the group's configuration over to the heartbeat thread.  Main
+   thread only. */
+void
+ha_group_update (struct ha_group *group)
+{
+  struct ha_group_msg *msg;
+
+  msg = XCALLOC (MTYPE_TMP, sizeof (struct ha_group_msg));
+  msg->group = group;
+  ha_group_params_get (group, &msg->params);
+  if (group->ifname[0] && msg->params.ifindex == 0)
+    zlog_warn ("HA group %d: no interface %s", group->id, group->ifname);
+
+  ha_hb_call (ha_group_apply, msg);
+}
+
+/* New keys for a group, for the heartbeat thread. */
+struct ha_group_auth_msg
+{
+  struct ha_group *group;
+  struct ha_auth *auth;
+};
+
+static int
+ha_group_auth_apply (void *arg)
+{
+  struct ha_group_auth_msg *msg = arg;
+
+  /* A hello waiting to go out goes signed with the keys it was built
+     for. */
+  if (msg->group->sign_pending)
+    ha_hello_sign (msg->group);
+  if (msg->group->auth)
+    ha_auth_free (msg->group->auth);
+  msg->group->auth = msg->auth;
+  XFREE (MTYPE_TMP, msg);
+  return 0;
+}
+
+/* Take the group's keys from its key chain again. */
+static void
+ha_group_auth_update (struct ha_group *group)
+{
+  struct ha_group_auth_msg *msg;
+
+  msg = XCALLOC (MTYPE_TMP, sizeof (struct ha_group_auth_msg));
+  msg->group = group;
+  if (group->auth_keychain)
+    msg->auth = ha_auth_new (group, group->auth_keychain);
+
+  ha_hb_call (ha_group_auth_apply, msg);
+}
+
+/* Main thread only. */
+void
+ha_group_auth_set (struct ha_group *group, const char *keychain)
+{
+  if (group->auth_keychain)
+    XFREE (MTYPE_HA_AUTH, group->auth_keychain);
+  group->auth_keychain = keychain ? XSTRDUP (MTYPE_HA_AUTH, keychain) : NULL;
+  ha_group_auth_update (group);
+}
+
+/* A key chain has changed, from keychain_add_hook. */
+void
+ha_keychain_update (const char *name)
+{
+  struct ha *ha;
+  struct ha_group *group;
+  int id;
+
+  if ((ha = ha_lookup ()) == NULL)
+    return;
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if ((group = ha->group[id]) != NULL && group->auth_keychain
+	&& strcmp (group->auth_keychain, name) == 0)
+      ha_group_auth_update (group);
+}
+
+/* How many packets to take from the socket per wakeup.  Main thread
+   only. */
+void
+ha_read_batch_set (struct ha *ha, int batch)
+{
+  ha->read_batch = batch;
+  ha_params_update (ha);
+}
+
+#ifdef HAVE_TPACKET_V3
+/* Main thread only. */
+void
+ha_receive_ring_set (struct ha *ha, int on)
+{
+  ha->receive_ring = on;
+  ha_params_update (ha);
+}
+#endif /* HAVE_TPACKET_V3 */
+
+/* Main thread only. */
+void
+ha_transport_set (struct ha *ha, int transport, u_int16_t port)
+{
+  if (transport == ha->transport && port == ha->udp_port)
+    return;
+
+  ha->transport = transport;
+  ha->udp_port = port;
+  ha_params_update (ha);
+}
+
+/* A neighbor added to or taken from a group, for the heartbeat
+   thread. */
+struct ha_group_neighbor_msg
+{
+  struct ha_group *group;
+  struct in_addr addr;
+  int add;
+};
+
+static int
+ha_group_neighbor_apply (void *arg)
+{
+  struct ha_group_neighbor_msg *msg = arg;
+  struct ha_group *group = msg->group;
+  int i;
+
+  if (msg->add)
+    {
+      group->unicast = XREALLOC (MTYPE_HA_NEIGHBOR, group->unicast,
+				 (group->nunicast + 1)
+				 * sizeof (struct in_addr));
+      group->unicast[group->nunicast++] = msg->addr;
+      ha_udp_peer_get (group->ha, msg->addr);
+    }
+  else
+    for (i = 0; i < group->nunicast; i++)
+      if (group->unicast[i].s_addr == msg->addr.s_addr)
+	{
+	  group->unicast[i] = group->unicast[--group->nunicast];
+	  ha_udp_peer_put (group->ha, msg->addr);
+	  break;
+	}
+
+  /* A hello part way out starts over, to the neighbors there are
+     now. */
+  group->tx_next = 0;
+  XFREE (MTYPE_TMP, msg);
+  return 0;
+}
+
+static void
+ha_group_neighbor_update (struct ha_group *group, struct in_addr addr,
+			  int add)
+{
+  struct ha_group_neighbor_msg *msg;
+
+  msg = XCALLOC (MTYPE_TMP, sizeof (struct ha_group_neighbor_msg));
+  msg->group = group;
+  msg->addr = addr;
+  msg->add = add;
+  ha_hb_call (ha_group_neighbor_apply, msg);
+}
+
+static struct in_addr *
+ha_group_neighbor_lookup (struct ha_group *group, struct in_addr addr)
+{
+  struct listnode *node;
+  struct in_addr *neighbor;
+
+  for (ALL_LIST_ELEMENTS_RO (group->neighbors, node, neighbor))
+    if (neighbor->s_addr == addr.s_addr)
+      return neighbor;
+  return NULL;
+}
+
+/* Send the group's hellos to addr, with the udp transport, rather
+   than to its destination.  Main thread only. */
+int
+ha_group_neighbor_set (struct ha_group *group, struct in_addr addr)
+{
+  struct in_addr *neighbor;
+
+  if (ha_group_neighbor_lookup (group, addr))
+    return 0;
+
+  neighbor = XMALLOC (MTYPE_HA_NEIGHBOR, sizeof (struct in_addr));
+  *neighbor = addr;
+  listnode_add (group->neighbors, neighbor);
+  ha_group_neighbor_update (group, addr, 1);
+  return 0;
+}
+
+int
+ha_group_neighbor_unset (struct ha_group *group, struct in_addr addr)
+{
+  struct in_addr *neighbor;
+
+  if ((neighbor = ha_group_neighbor_lookup (group, addr)) == NULL)
+    return -1;
+
+  listnode_delete (group->neighbors, neighbor);
+  ha_group_neighbor_free (neighbor);
+  ha_group_neighbor_update (group, addr, 0);
+  return 0;
+}
+
+/* Main thread only. */
+void
+ha_stats_export_set (struct ha *ha, u_int32_t interval)
+{
+  ha->stats_export = interval;
+  ha_params_update (ha);
+}
+
+void
+ha_group_delete (struct ha_group *group)
+{
+  struct ha *ha = group->ha;
+
+  /* The heartbeat thread takes it out of its own table before it
+     frees it. */
+  ha->group[group->id] = NULL;
+  if (group->auth_keychain)
+    XFREE (MTYPE_HA_AUTH, group->auth_keychain);
+  list_delete (group->neighbors);
+  ha_hb_call (ha_group_free, group);
+}
+
 /* Shut down the entire process */
 void
 ha_terminate (void)
@@ -115,15 +785,47 @@ ha_terminate (void)
    */
 }
 
+/* On the heartbeat thread, after the groups have been freed. */
+static int
+ha_free (void *arg)
+{
+  struct ha *ha = arg;
+
+  THREAD_OFF (ha->t_transport);
+  ha_transport_close (ha);
+  ha_stats_export_stop (ha);
+#ifdef HAVE_RECVMMSG
+  ha_recv_batch_free (ha);
+#endif /* HAVE_RECVMMSG */
+  hash_free (ha->peers);
+  hash_free (ha->udp_peers);
+  list_delete (ha->oi_write_q);
+  XFREE (MTYPE_HA_BATCH, ha->rx_signed);
+  stream_free (ha->ibuf);
+  XFREE (MTYPE_HA_TOP, ha);
+  return 0;
+}
+
 void
 ha_finish (struct ha *ha)
 {
-      
-  /* if ha_deferred_shutdown returns, then ha_finish_final is
-   * deferred to expiry of G-S timer thread. Return back up, hopefully
-   * to thread scheduler.
-   */
-  return;
+  int id;
+
+  /* Peers find out we are gone soon enough, there is nothing to tell
+     them on the way out.  Monitoring is told by the snapshot going. */
+  if (CHECK_FLAG (hm->options, HA_MASTER_SHUTDOWN))
+    {
+      if (ha->stats_export)
+	shm_unlink (HA_STATS_SHM_NAME);
+      exit (0);
+    }
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if (ha->group[id])
+      ha_group_delete (ha->group[id]);
+
+  ha_delete (ha);
+  ha_hb_call (ha_free, ha);
 }
 
 void
@@ -134,5 +836,6 @@ ha_master_init ()
   hm = &ha_master;
   hm->ha = list_new ();
   hm->master = thread_master_create ();
+  hm->hb_master = hm->master;
   hm->start_time = bane_time (NULL);
 }
@@ -26,6 +26,7 @@
 #include <kroute.h>
 
 #include "prefix.h"
+#include "if.h"
 #include "filter.h"
 #include "log.h"
 
@@ -34,6 +35,11 @@
 /* VTY port number. */
 #define HA_VTY_PORT          2609
 
+/* UDP port for hellos, with the udp transport, and most sockets
+   sharing it, one a CPU. */
+#define HA_UDP_PORT          2610
+#define HA_UDP_SHARDS_MAX      64
+
 /* IP TTL for HA protocol. */
 #define HA_IP_TTL             1
 #define HA_VL_IP_TTL          100
@@ -100,6 +106,20 @@
 #define HA_MTU_IGNORE_DEFAULT             0
 #define HA_FAST_HELLO_DEFAULT             0
 
+/* Heartbeat groups. */
+#define HA_GROUP_MAX                    255
+#define HA_GROUP_INTERVAL_DEFAULT      1000	/* msec */
+#define HA_GROUP_INTERVAL_MIN            10
+#define HA_GROUP_INTERVAL_MAX         60000
+#define HA_GROUP_PRIORITY_DEFAULT       100
+#define HA_GROUP_DEAD_MULTIPLIER_DEFAULT  3
+#define HA_GROUP_PHI_THRESHOLD_DEFAULT    0	/* fixed dead interval */
+#define HA_ALLHAROUTERS               0xe0000069      /* 224.0.0.105 */
+
+/* How hellos are carried. */
+#define HA_TRANSPORT_IP                   0	/* raw IP, IPPROTO_HA */
+#define HA_TRANSPORT_UDP                  1
+
 /* HA options. */
 #define HA_OPTION_T                    0x01  /* TOS. */
 #define HA_OPTION_E                    0x02
@@ -127,6 +147,10 @@ struct ha_master
   /* HA thread master. */
   struct thread_master *master;
 
+  /* Thread master of the HA socket, advert timers and failure
+     detection.  Same as master unless there is a heartbeat thread. */
+  struct thread_master *hb_master;
+
   /* Kroute interface list. */
   struct list *iflist;
 
@@ -150,6 +174,30 @@ struct ha_master
 #define HA_MAX_ROUTES						40000
 };
 
+/* What of the instance's configuration the heartbeat thread goes by.
+   It has a copy of its own, passed over by ha_params_update. */
+struct ha_params
+{
+  struct in_addr router_id;
+  int read_batch;
+  int receive_ring;
+  int transport;
+  u_int16_t udp_port;
+  u_int32_t stats_export;
+};
+
+/* The same for a group, passed over by ha_group_update. */
+struct ha_group_params
+{
+  char ifname[INTERFACE_NAMSIZ + 1];
+  unsigned int ifindex;
+  u_int32_t interval;			/* msec */
+  u_char priority;
+  u_char dead_multiplier;
+  u_char phi_threshold;			/* 0 for the fixed dead interval */
+  struct in_addr destination;
+};
+
 /* HA instance structure. */
 struct ha
 {
@@ -269,7 +317,103 @@ struct ha
   int fd;
   int maxsndbuflen;
   struct stream *ibuf;
-  struct list *oi_write_q;
+  struct list *oi_write_q;		/* groups with a hello to send */
+
+  /* Packets to read per wakeup, as configured. */
+  int read_batch;
+#ifdef HAVE_RECVMMSG
+  /* recvmmsg buffers, for rbatch packets.  Heartbeat thread only. */
+  int rbatch;
+  struct mmsghdr *rmsgs;
+  struct iovec *riov;
+  char *rbuf;
+  char *rcmsg;
+  struct sockaddr_in *rname;		/* senders, for udp */
+#endif /* HAVE_RECVMMSG */
+
+  /* Read from a packet ring instead, as configured. */
+  int receive_ring;
+#ifdef HAVE_TPACKET_V3
+  /* The ring, while it is on.  Heartbeat thread only. */
+  int ring_fd;
+  u_char *ring;
+  unsigned int ring_block;		/* next one to look at */
+  struct thread *t_ring;
+#endif /* HAVE_TPACKET_V3 */
+
+  /* How hellos are carried, as configured. */
+  int transport;
+  u_int16_t udp_port;
+  /* Whether it is open, and the event that first opens it.  Heartbeat
+     thread only. */
+  int transport_up;
+  struct thread *t_transport;
+  /* With the udp transport, the sockets sharing its port: one a CPU,
+     which the kernel spreads what comes in over, and one connected to
+     each neighbor, which it hands that neighbor's hellos to.
+     Heartbeat thread only. */
+  int udp_nshards;
+  int udp_fd[HA_UDP_SHARDS_MAX];
+  struct thread *t_udp[HA_UDP_SHARDS_MAX];
+  int udp_tx;				/* shard the next hellos go out of */
+  struct hash *udp_peers;		/* struct ha_udp_peer, by address */
+
+  /* The router id, and the settings marked as configured here, as the
+     heartbeat thread has them.  Heartbeat thread only. */
+  struct ha_params hb;
+
+  /* Signed packets read, waiting to have their digests checked
+     together, HA_AUTH_BATCH at most, in the order they came.
+     Heartbeat thread only. */
+  struct ha_rx_signed *rx_signed;
+  int rx_signed_n;
+
+  /* Heartbeat groups, by id.  Only changed by configuration, on the
+     main thread. */
+  struct ha_group *group[HA_GROUP_MAX + 1];
+  /* The same, as the heartbeat thread has them: each goes in once it
+     is set up, and comes out before it is freed.  Heartbeat thread
+     only. */
+  struct ha_group *hb_group[HA_GROUP_MAX + 1];
+
+  /* Peers heard from, by router id.  Heartbeat thread only. */
+  struct hash *peers;
+
+  /* Msec between peer statistics snapshots in shared memory, as
+     configured, 0 for none. */
+  u_int32_t stats_export;
+  /* The snapshot.  Heartbeat thread only. */
+  int stats_fd;
+  struct ha_stats_shm *stats_shm;
+  size_t stats_size;
+  struct thread *t_stats;
+
+  /* Sent in every packet, so peers can tell our packets apart from
+     those of an earlier run. */
+  u_int32_t instance;
+
+  /* Of the last hello to each group.  Peers keep track of us per
+     group, and here it outlives the group being deleted and added
+     again.  Heartbeat thread only. */
+  u_int32_t seq[HA_GROUP_MAX + 1];
+
+  /* Heartbeat counters. */
+  struct
+  {
+    unsigned long tx;
+    unsigned long tx_err;
+    unsigned long rx;
+    unsigned long rx_short;
+    unsigned long rx_trunc;
+    unsigned long rx_blocks;		/* ring blocks taken */
+    unsigned long rx_version;
+    unsigned long rx_checksum;
+    unsigned long rx_type;
+    unsigned long rx_self;
+    unsigned long rx_group;
+    unsigned long rx_ifindex;
+    unsigned long rx_auth;
+  } stats;
   
   /* Distribute lists out of other route sources. */
   struct 
@@ -329,6 +473,43 @@ struct ha
 
 };
 
+/* HA heartbeat group.  Each group sends hellos on one interface, and
+   failure detection is done for the peers heard in it. */
+struct ha_group
+{
+  struct ha *ha;
+  u_char id;
+
+  /* Configuration, set from the main thread. */
+  char ifname[INTERFACE_NAMSIZ + 1];
+  u_int32_t interval;			/* msec */
+  u_char priority;
+  u_char dead_multiplier;
+  u_char phi_threshold;			/* 0 for the fixed dead interval */
+  struct in_addr destination;
+  char *auth_keychain;			/* sign and check hellos with */
+  struct list *neighbors;		/* struct in_addr *, for udp */
+
+  /* Heartbeat thread only. */
+  struct ha_group_params hb;		/* as of the last ha_group_update */
+  int running;
+  u_char phi_y_threshold;		/* phi_y is worked out for */
+  double phi_y;
+  struct ha_auth *auth;			/* from auth_keychain */
+  int on_write_q;
+  int sign_pending;			/* obuf's hello still to be signed */
+  struct in_addr *unicast;		/* neighbors, sent to with udp */
+  int nunicast;
+  int tx_next;				/* of obuf's destinations */
+  struct in_addr joined;		/* multicast group joined, and */
+  unsigned int joined_ifindex;		/* where */
+  struct thread *t_hello;
+  struct stream *obuf;
+  unsigned long peers_up;
+  unsigned long tx;
+  unsigned long rx;
+};
+
 /* HA area structure. */
 struct ha_area
 {
@@ -559,6 +740,17 @@ extern struct ha *ha_lookup (void);
 extern struct ha *ha_get (void);
 extern void ha_finish (struct ha *);
 extern void ha_router_id_update (struct ha *ha);
+extern struct ha_group *ha_group_get (struct ha *, u_char);
+extern void ha_group_delete (struct ha_group *);
+extern void ha_group_update (struct ha_group *);
+extern void ha_read_batch_set (struct ha *, int);
+extern void ha_receive_ring_set (struct ha *, int);
+extern void ha_stats_export_set (struct ha *, u_int32_t);
+extern void ha_group_auth_set (struct ha_group *, const char *);
+extern void ha_keychain_update (const char *);
+extern void ha_transport_set (struct ha *, int, u_int16_t);
+extern int ha_group_neighbor_set (struct ha_group *, struct in_addr);
+extern int ha_group_neighbor_unset (struct ha_group *, struct in_addr);
 extern int ha_network_set (struct ha *, struct prefix_ipv4 *,
 			     struct in_addr);
 extern int ha_network_unset (struct ha *, struct prefix_ipv4 *,
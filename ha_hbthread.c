@@ -0,0 +1,212 @@
+#include <kroute.h>
+
+#include "thread.h"
+#include "linklist.h"
+#include "memory.h"
+#include "log.h"
+#include "spscq.h"
+
+#include "ha_deamon.h"
+#include "ha_hbthread.h"
+
+/* Heartbeat pthread, when there is one. */
+static struct
+{
+  int enabled;
+  int running;
+  pthread_t pthread;
+
+  /* CPU to pin to, or -1, and SCHED_FIFO priority, or 0. */
+  int cpu;
+  int priority;
+
+  /* main -> heartbeat, and heartbeat -> main. */
+  struct spscq *to_hb;
+  struct spscq *to_main;
+} ha_hbthread;
+
+static void *
+ha_hbthread_run (void *arg)
+{
+  struct thread_master *m = arg;
+  struct thread thread;
+  int ret;
+
+  if (ha_hbthread.cpu >= 0)
+    {
+      cpu_set_t cpus;
+
+      CPU_ZERO (&cpus);
+      CPU_SET (ha_hbthread.cpu, &cpus);
+      if ((ret = pthread_setaffinity_np (pthread_self (), sizeof (cpus),
+					 &cpus)) != 0)
+	zlog_warn ("heartbeat thread: can't pin to cpu %d: %s",
+		   ha_hbthread.cpu, safe_strerror (ret));
+    }
+
+  if (ha_hbthread.priority > 0)
+    {
+      struct sched_param param;
+
+      memset (&param, 0, sizeof (param));
+      param.sched_priority = ha_hbthread.priority;
+      if ((ret = pthread_setschedparam (pthread_self (), SCHED_FIFO,
+					&param)) != 0)
+	zlog_warn ("heartbeat thread: can't set SCHED_FIFO priority %d: %s",
+		   ha_hbthread.priority, safe_strerror (ret));
+    }
+
+  while (thread_fetch (m, &thread))
+    thread_call (&thread);
+
+  return NULL;
+}
+
+/* Give the heartbeat its own thread master.  Must be called before
+   anything is scheduled on hm->hb_master, and before the config is
+   read. */
+void
+ha_hbthread_init (int cpu, int priority)
+{
+  ha_hbthread.cpu = cpu;
+  ha_hbthread.priority = priority;
+
+  ha_hbthread.to_hb = spscq_new ("heartbeat queue", HA_HBTHREAD_QUEUE_SIZE);
+  ha_hbthread.to_main = spscq_new ("main queue", HA_HBTHREAD_QUEUE_SIZE);
+  if (ha_hbthread.to_hb == NULL || ha_hbthread.to_main == NULL)
+    {
+      zlog_err ("heartbeat thread: can't create queues, running the "
+		"heartbeat from the main thread");
+      if (ha_hbthread.to_hb)
+	spscq_free (ha_hbthread.to_hb);
+      if (ha_hbthread.to_main)
+	spscq_free (ha_hbthread.to_main);
+      return;
+    }
+
+  hm->hb_master = thread_master_create ();
+  spscq_start (ha_hbthread.to_hb, hm->hb_master, THREAD_PRIO_CRITICAL);
+  spscq_start (ha_hbthread.to_main, hm->master, THREAD_PRIO_NORMAL);
+  ha_hbthread.enabled = 1;
+}
+
+/* Start the heartbeat pthread, after any fork to become a daemon. */
+void
+ha_hbthread_start (void)
+{
+  sigset_t all, old;
+  int ret;
+
+  if (!ha_hbthread.enabled)
+    return;
+
+  /* Keep the heartbeat out of the way of page faults.  Failing that is
+     not fatal, it is just not as well protected. */
+  if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+    zlog_warn ("heartbeat thread: mlockall: %s", safe_strerror (errno));
+
+  /* Signals are left to the main thread, the new one inherits the
+     mask. */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  ret = pthread_create (&ha_hbthread.pthread, NULL, ha_hbthread_run,
+			hm->hb_master);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (ret != 0)
+    {
+      zlog_err ("heartbeat thread: pthread_create: %s", safe_strerror (ret));
+      exit (1);
+    }
+  ha_hbthread.running = 1;
+
+  zlog_notice ("heartbeat thread started, cpu %d, SCHED_FIFO priority %d",
+	       ha_hbthread.cpu, ha_hbthread.priority);
+}
+
+int
+ha_hbthread_running (void)
+{
+  return ha_hbthread.running;
+}
+
+int
+ha_hb_call (int (*func) (void *), void *arg)
+{
+  if (!ha_hbthread.running)
+    return (*func) (arg);
+
+  /* The heartbeat thread never waits on this one, so it is bound to
+     make room.  Dropping the call instead would lose what the caller
+     has already acted on, like a group it has unlinked. */
+  spscq_put_wait (ha_hbthread.to_hb, func, arg);
+  return 0;
+}
+
+/* For ha_hb_call_wait. */
+struct ha_hb_wait
+{
+  int (*func) (void *);
+  void *arg;
+  int ret;
+  int done;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+static int
+ha_hb_call_wait_run (void *arg)
+{
+  struct ha_hb_wait *wait = arg;
+  int ret;
+
+  ret = (*wait->func) (wait->arg);
+
+  pthread_mutex_lock (&wait->mutex);
+  wait->ret = ret;
+  wait->done = 1;
+  pthread_cond_signal (&wait->cond);
+  pthread_mutex_unlock (&wait->mutex);
+  return 0;
+}
+
+/* Run func on the heartbeat thread and wait for it, for what has to
+   look at heartbeat thread state as a whole, like walking the peers.
+   The heartbeat thread never waits on the main thread, so this can't
+   deadlock, but it holds up the main thread for as long as func
+   takes. */
+int
+ha_hb_call_wait (int (*func) (void *), void *arg)
+{
+  struct ha_hb_wait wait;
+
+  if (!ha_hbthread.running)
+    return (*func) (arg);
+
+  memset (&wait, 0, sizeof (wait));
+  wait.func = func;
+  wait.arg = arg;
+  pthread_mutex_init (&wait.mutex, NULL);
+  pthread_cond_init (&wait.cond, NULL);
+
+  ha_hb_call (ha_hb_call_wait_run, &wait);
+  pthread_mutex_lock (&wait.mutex);
+  while (!wait.done)
+    pthread_cond_wait (&wait.cond, &wait.mutex);
+  pthread_mutex_unlock (&wait.mutex);
+
+  pthread_mutex_destroy (&wait.mutex);
+  pthread_cond_destroy (&wait.cond);
+  return wait.ret;
+}
+
+/* The heartbeat thread must not wait on the main thread, so calls it
+   can't queue are dropped, and counted in the queue. */
+int
+ha_main_call (int (*func) (void *), void *arg)
+{
+  if (!ha_hbthread.running)
+    return (*func) (arg);
+
+  return spscq_put (ha_hbthread.to_main, func, arg);
+}
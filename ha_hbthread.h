@@ -0,0 +1,51 @@
+/*
+ * HAd heartbeat thread.
+ *
+ * This file is part of GNU Kroute.
+ *
+ * GNU Kroute is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * GNU Kroute is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with GNU Kroute; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _BANE_HA_HBTHREAD_H
+#define _BANE_HA_HBTHREAD_H
+
+/* The HA socket, the advert timers and failure detection run from
+ * hm->hb_master.  Normally that is the main thread master, but it can
+ * be given a pthread of its own, so that config parsing, netlink dumps
+ * or vty output on the main thread can't hold up liveness detection.
+ *
+ * Anything the two sides want from each other goes through
+ * ha_hb_call () and ha_main_call (), which just make the call when
+ * there is no heartbeat thread.
+ */
+
+/* Messages in flight, each way. */
+#define HA_HBTHREAD_QUEUE_SIZE 1024
+
+/* Prototypes. */
+extern void ha_hbthread_init (int cpu, int priority);
+extern void ha_hbthread_start (void);
+extern int ha_hbthread_running (void);
+
+/* Run func on the heartbeat thread, from the main thread.  Waits for
+   room when the queue is full, it never drops the call. */
+extern int ha_hb_call (int (*func) (void *), void *arg);
+/* The same, and wait for it to be done. */
+extern int ha_hb_call_wait (int (*func) (void *), void *arg);
+/* Run func on the main thread, from the heartbeat thread. */
+extern int ha_main_call (int (*func) (void *), void *arg);
+
+#endif /* _BANE_HA_HBTHREAD_H */
@@ -39,12 +39,15 @@
 #include "privs.h"
 #include "sigevent.h"
 #include "zclient.h"
+#include "keychain.h"
+#include "checksum.h"
 
 #include "ha_deamon.h"
 #include "ha_debug.h"
 #include "interface.h"
 #include "ha_vty.h"
 #include "ha_kroute.h"
+#include "ha_hbthread.h"
 
 /* Configuration filename and directory. */
 char config_default[] = SYSCONFDIR HA_DEFAULT_CONFIG;
@@ -69,6 +72,10 @@ struct option longopts[] =
 #ifdef HAVE_NETLINK
   { "nl-bufsize",  required_argument, NULL, 's'},
 #endif /* HAVE_NETLINK */
+  { "event-backend", required_argument, NULL, 'e'},
+  { "hb-thread",   no_argument,       NULL, 'H'},
+  { "hb-cpu",      required_argument, NULL, 'C'},
+  { "hb-priority", required_argument, NULL, 'R'},
   { "version",     no_argument,       NULL, 'v'},
   { 0 }
 };
@@ -96,7 +103,11 @@ usage (char *progname, int status)
             -A, --vty_addr     Set vty's bind address\n\
             -P, --vty_port     Set vty's port number\n\
             -u, --user         User to run as\n\
-            -g, --group        Group to run as\n", progname);
+            -g, --group        Group to run as\n\
+            -e, --event-backend Set I/O event backend (epoll|io_uring|select)\n\
+            -H, --hb-thread    Run heartbeats from a thread of their own\n\
+            -C, --hb-cpu       Pin the heartbeat thread to a cpu\n\
+            -R, --hb-priority  Run the heartbeat thread SCHED_FIFO at priority\n", progname);
 #ifdef HAVE_NETLINK
       printf ("-s, --nl-bufsize   Set netlink receive buffer size\n");
 #endif /* HAVE_NETLINK */
@@ -162,6 +173,9 @@ main (int argc, char **argv)
   char *config_file = NULL;
   char *progname;
   struct thread thread;
+  int hb_thread = 0;
+  int hb_cpu = -1;
+  int hb_priority = 0;
 
   /* Set umask before anything for security */
   umask (0027);
@@ -174,9 +188,10 @@ main (int argc, char **argv)
       int opt;
 
 #ifdef HAVE_NETLINK  
-      opt = getopt_long (argc, argv, "df:i:z:hA:P:u:g:s:v", longopts, 0);
+      opt = getopt_long (argc, argv, "df:i:z:hA:P:u:g:s:e:HC:R:v",
+			 longopts, 0);
 #else
-      opt = getopt_long (argc, argv, "df:i:z:hA:P:u:g:v", longopts, 0);
+      opt = getopt_long (argc, argv, "df:i:z:hA:P:u:g:e:HC:R:v", longopts, 0);
 #endif /* HAVE_NETLINK */
     
       if (opt == EOF)
@@ -218,6 +233,33 @@ main (int argc, char **argv)
       nl_rcvbufsize = atoi (optarg);
       break;
 #endif /* HAVE_NETLINK */
+	case 'e':
+	  if (thread_poll_set_default (optarg) < 0)
+	    {
+	      fprintf (stderr, "Unknown event backend \"%s\"\n", optarg);
+	      usage (progname, 1);
+	    }
+	  break;
+	case 'H':
+	  hb_thread = 1;
+	  break;
+	case 'C':
+	  hb_cpu = atoi (optarg);
+	  if (hb_cpu < 0 || hb_cpu >= CPU_SETSIZE)
+	    {
+	      fprintf (stderr, "Invalid heartbeat cpu \"%s\"\n", optarg);
+	      usage (progname, 1);
+	    }
+	  break;
+	case 'R':
+	  hb_priority = atoi (optarg);
+	  if (hb_priority < sched_get_priority_min (SCHED_FIFO)
+	      || hb_priority > sched_get_priority_max (SCHED_FIFO))
+	    {
+	      fprintf (stderr, "Invalid heartbeat priority \"%s\"\n", optarg);
+	      usage (progname, 1);
+	    }
+	  break;
 	case 'v':
 	  print_version (progname);
 	  exit (0);
@@ -247,6 +289,10 @@ main (int argc, char **argv)
 
   /* Initializations. */
   master = hm->master;
+  /* Before the heartbeat thread can checksum anything. */
+  checksum_init ();
+  if (hb_thread || hb_cpu >= 0 || hb_priority > 0)
+    ha_hbthread_init (hb_cpu, hb_priority);
 
   /* Library inits. */
   signal_init (master, Q_SIGC(ha_signals), ha_signals);
@@ -254,6 +300,7 @@ main (int argc, char **argv)
   debug_init ();
   vty_init (master);
   memory_init ();
+  keychain_init (master);
 
   /* HAd inits. */
   ha_if_init ();
@@ -275,14 +322,21 @@ main (int argc, char **argv)
       exit (1);
     }
 
+  if (daemon_mode)
+    signal_after_fork ();
+
   /* Process id file create. */
   pid_output (pid_file);
 
+  /* Threads don't survive daemon (), so only now. */
+  ha_hbthread_start ();
+
   /* Create VTY socket */
   vty_serv_sock (vty_addr, vty_port, HA_VTYSH_PATH);
 
   /* Print banner. */
-  zlog_notice ("HAd %s starting: vty@%d", BANE_VERSION, vty_port);
+  zlog_notice ("HAd %s starting: vty@%d, %s event backend", BANE_VERSION,
+	       vty_port, thread_poll_name (master));
 
   /* Fetch next active thread. */
   while (thread_fetch (master, &thread))
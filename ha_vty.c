@@ -2,6 +2,7 @@
 
 #include "memory.h"
 #include "thread.h"
+#include "linklist.h"
 #include "prefix.h"
 #include "table.h"
 #include "vty.h"
@@ -9,8 +10,15 @@
 #include "plist.h"
 #include "log.h"
 #include "zclient.h"
+#include "if.h"
+#include "hash.h"
+#include "keychain.h"
 
 #include "ha_deamon.h"
+#include "ha_packet.h"
+#include "ha_peer.h"
+#include "ha_hbthread.h"
+#include "ha_stats.h"
 
 static struct cmd_node ha_node =
 {
@@ -25,7 +33,7 @@ DEFUN (ha,
        "Start HA configuration\n")
 {
   vty->node = HA_NODE;
-//  vty->index = ha_get ();
+  vty->index = ha_get ();
  
   return CMD_SUCCESS;
 }
@@ -50,19 +58,763 @@ DEFUN (no_ha,
   return CMD_SUCCESS;
 }
 
+DEFUN (ha_router_id,
+       ha_router_id_cmd,
+       "router-id A.B.C.D",
+       "Router id for this HA instance\n"
+       "HA router id in IP address format\n")
+{
+  struct ha *ha = vty->index;
+  struct in_addr router_id;
+
+  VTY_GET_IPV4_ADDRESS ("router id", router_id, argv[0]);
+  ha->router_id_static = router_id;
+  ha_router_id_update (ha);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_router_id,
+       no_ha_router_id_cmd,
+       "no router-id",
+       NO_STR
+       "Router id for this HA instance\n")
+{
+  struct ha *ha = vty->index;
+
+  ha->router_id_static.s_addr = 0;
+  ha_router_id_update (ha);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (ha_receive_batch,
+       ha_receive_batch_cmd,
+       "receive-batch <1-1024>",
+       "Packets to read from the HA socket at a time\n"
+       "Number of packets\n")
+{
+  struct ha *ha = vty->index;
+  int batch;
+
+  VTY_GET_INTEGER_RANGE ("receive batch", batch, argv[0],
+			 1, HA_READ_BATCH_MAX);
+  ha_read_batch_set (ha, batch);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_receive_batch,
+       no_ha_receive_batch_cmd,
+       "no receive-batch",
+       NO_STR
+       "Packets to read from the HA socket at a time\n")
+{
+  struct ha *ha = vty->index;
+
+  ha_read_batch_set (ha, HA_READ_BATCH);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_receive_batch,
+       no_ha_receive_batch_val_cmd,
+       "no receive-batch <1-1024>",
+       NO_STR
+       "Packets to read from the HA socket at a time\n"
+       "Number of packets\n")
+
+#ifdef HAVE_TPACKET_V3
+DEFUN (ha_receive_ring,
+       ha_receive_ring_cmd,
+       "receive-ring",
+       "Read HA packets from a packet socket ring\n")
+{
+  struct ha *ha = vty->index;
+
+  ha_receive_ring_set (ha, 1);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_receive_ring,
+       no_ha_receive_ring_cmd,
+       "no receive-ring",
+       NO_STR
+       "Read HA packets from a packet socket ring\n")
+{
+  struct ha *ha = vty->index;
+
+  ha_receive_ring_set (ha, 0);
+
+  return CMD_SUCCESS;
+}
+#endif /* HAVE_TPACKET_V3 */
+
+DEFUN (ha_transport_udp,
+       ha_transport_udp_cmd,
+       "transport udp",
+       "How hellos are carried\n"
+       "In UDP rather than raw IP, spread over a socket a CPU\n")
+{
+  struct ha *ha = vty->index;
+  int port = HA_UDP_PORT;
+
+  if (argc > 0)
+    VTY_GET_INTEGER_RANGE ("port", port, argv[0], 1, 65535);
+  ha_transport_set (ha, HA_TRANSPORT_UDP, port);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (ha_transport_udp,
+       ha_transport_udp_port_cmd,
+       "transport udp port <1-65535>",
+       "How hellos are carried\n"
+       "In UDP rather than raw IP, spread over a socket a CPU\n"
+       "UDP port\n"
+       "Port number\n")
+
+DEFUN (no_ha_transport,
+       no_ha_transport_cmd,
+       "no transport",
+       NO_STR
+       "How hellos are carried\n")
+{
+  struct ha *ha = vty->index;
+
+  ha_transport_set (ha, HA_TRANSPORT_IP, HA_UDP_PORT);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_transport,
+       no_ha_transport_udp_cmd,
+       "no transport udp",
+       NO_STR
+       "How hellos are carried\n"
+       "In UDP rather than raw IP, spread over a socket a CPU\n")
+
+ALIAS (no_ha_transport,
+       no_ha_transport_udp_port_cmd,
+       "no transport udp port <1-65535>",
+       NO_STR
+       "How hellos are carried\n"
+       "In UDP rather than raw IP, spread over a socket a CPU\n"
+       "UDP port\n"
+       "Port number\n")
+
+#define HA_GROUP_STR "Heartbeat group\n" "Group id\n"
+
+/* The group of a config command, created if need be. */
+#define HA_VTY_GET_GROUP(G,STR)                                         \
+  do {                                                                  \
+    int id_;                                                            \
+    VTY_GET_INTEGER_RANGE ("group", id_, (STR), 1, HA_GROUP_MAX);       \
+    (G) = ha_group_get (vty->index, id_);                               \
+  } while (0)
+
+DEFUN (ha_stats_export,
+       ha_stats_export_cmd,
+       "stats-export",
+       "Export peer statistics in shared memory, " HA_STATS_SHM_NAME "\n")
+{
+  struct ha *ha = vty->index;
+  int interval = HA_STATS_EXPORT_INTERVAL_DEFAULT;
+
+  if (argc > 0)
+    VTY_GET_INTEGER_RANGE ("stats export interval", interval, argv[0],
+			   10, 60000);
+  ha_stats_export_set (ha, interval);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (ha_stats_export,
+       ha_stats_export_interval_cmd,
+       "stats-export interval <10-60000>",
+       "Export peer statistics in shared memory, " HA_STATS_SHM_NAME "\n"
+       "Time between snapshots\n"
+       "Milliseconds\n")
+
+DEFUN (no_ha_stats_export,
+       no_ha_stats_export_cmd,
+       "no stats-export",
+       NO_STR
+       "Export peer statistics in shared memory, " HA_STATS_SHM_NAME "\n")
+{
+  struct ha *ha = vty->index;
+
+  ha_stats_export_set (ha, 0);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_stats_export,
+       no_ha_stats_export_interval_cmd,
+       "no stats-export interval <10-60000>",
+       NO_STR
+       "Export peer statistics in shared memory, " HA_STATS_SHM_NAME "\n"
+       "Time between snapshots\n"
+       "Milliseconds\n")
+
+DEFUN (ha_group_interface,
+       ha_group_interface_cmd,
+       "group <1-255> interface IFNAME",
+       HA_GROUP_STR
+       "Interface to send and receive the group's hellos on\n"
+       "Interface name\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  strncpy (group->ifname, argv[1], INTERFACE_NAMSIZ);
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_interface,
+       no_ha_group_interface_cmd,
+       "no group <1-255> interface",
+       NO_STR
+       HA_GROUP_STR
+       "Interface to send and receive the group's hellos on\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->ifname[0] = '\0';
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (ha_group_interval,
+       ha_group_interval_cmd,
+       "group <1-255> interval <10-60000>",
+       HA_GROUP_STR
+       "Time between hellos\n"
+       "Milliseconds\n")
+{
+  struct ha_group *group;
+  u_int32_t interval;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_INTEGER_RANGE ("interval", interval, argv[1],
+			 HA_GROUP_INTERVAL_MIN, HA_GROUP_INTERVAL_MAX);
+  group->interval = interval;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_interval,
+       no_ha_group_interval_cmd,
+       "no group <1-255> interval",
+       NO_STR
+       HA_GROUP_STR
+       "Time between hellos\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->interval = HA_GROUP_INTERVAL_DEFAULT;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_interval,
+       no_ha_group_interval_val_cmd,
+       "no group <1-255> interval <10-60000>",
+       NO_STR
+       HA_GROUP_STR
+       "Time between hellos\n"
+       "Milliseconds\n")
+
+DEFUN (ha_group_priority,
+       ha_group_priority_cmd,
+       "group <1-255> priority <1-254>",
+       HA_GROUP_STR
+       "Priority to advertise\n"
+       "Priority value\n")
+{
+  struct ha_group *group;
+  int priority;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_INTEGER_RANGE ("priority", priority, argv[1], 1, 254);
+  group->priority = priority;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_priority,
+       no_ha_group_priority_cmd,
+       "no group <1-255> priority",
+       NO_STR
+       HA_GROUP_STR
+       "Priority to advertise\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->priority = HA_GROUP_PRIORITY_DEFAULT;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_priority,
+       no_ha_group_priority_val_cmd,
+       "no group <1-255> priority <1-254>",
+       NO_STR
+       HA_GROUP_STR
+       "Priority to advertise\n"
+       "Priority value\n")
+
+DEFUN (ha_group_dead_multiplier,
+       ha_group_dead_multiplier_cmd,
+       "group <1-255> dead-multiplier <2-255>",
+       HA_GROUP_STR
+       "Hello intervals a peer may miss before it is down\n"
+       "Number of intervals\n")
+{
+  struct ha_group *group;
+  int multiplier;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_INTEGER_RANGE ("dead multiplier", multiplier, argv[1], 2, 255);
+  group->dead_multiplier = multiplier;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_dead_multiplier,
+       no_ha_group_dead_multiplier_cmd,
+       "no group <1-255> dead-multiplier",
+       NO_STR
+       HA_GROUP_STR
+       "Hello intervals a peer may miss before it is down\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->dead_multiplier = HA_GROUP_DEAD_MULTIPLIER_DEFAULT;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_dead_multiplier,
+       no_ha_group_dead_multiplier_val_cmd,
+       "no group <1-255> dead-multiplier <2-255>",
+       NO_STR
+       HA_GROUP_STR
+       "Hello intervals a peer may miss before it is down\n"
+       "Number of intervals\n")
+
+DEFUN (ha_group_phi_threshold,
+       ha_group_phi_threshold_cmd,
+       "group <1-255> phi-threshold <1-16>",
+       HA_GROUP_STR
+       "Suspicion level at which a peer is down, rather than after the dead interval\n"
+       "Phi value\n")
+{
+  struct ha_group *group;
+  int threshold;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_INTEGER_RANGE ("phi threshold", threshold, argv[1], 1, 16);
+  group->phi_threshold = threshold;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_phi_threshold,
+       no_ha_group_phi_threshold_cmd,
+       "no group <1-255> phi-threshold",
+       NO_STR
+       HA_GROUP_STR
+       "Suspicion level at which a peer is down, rather than after the dead interval\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->phi_threshold = HA_GROUP_PHI_THRESHOLD_DEFAULT;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_phi_threshold,
+       no_ha_group_phi_threshold_val_cmd,
+       "no group <1-255> phi-threshold <1-16>",
+       NO_STR
+       HA_GROUP_STR
+       "Suspicion level at which a peer is down, rather than after the dead interval\n"
+       "Phi value\n")
+
+DEFUN (ha_group_authentication,
+       ha_group_authentication_cmd,
+       "group <1-255> authentication key-chain WORD",
+       HA_GROUP_STR
+       "Sign hellos, and accept only signed ones\n"
+       "HMAC-MD5 with keys from a key chain\n"
+       "Name of the key chain\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  ha_group_auth_set (group, argv[1]);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_authentication,
+       no_ha_group_authentication_cmd,
+       "no group <1-255> authentication",
+       NO_STR
+       HA_GROUP_STR
+       "Sign hellos, and accept only signed ones\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  ha_group_auth_set (group, NULL);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_authentication,
+       no_ha_group_authentication_val_cmd,
+       "no group <1-255> authentication key-chain WORD",
+       NO_STR
+       HA_GROUP_STR
+       "Sign hellos, and accept only signed ones\n"
+       "HMAC-MD5 with keys from a key chain\n"
+       "Name of the key chain\n")
+
+DEFUN (ha_group_destination,
+       ha_group_destination_cmd,
+       "group <1-255> destination A.B.C.D",
+       HA_GROUP_STR
+       "Where to send hellos, instead of the all HA routers group\n"
+       "Multicast or unicast address\n")
+{
+  struct ha_group *group;
+  struct in_addr destination;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_IPV4_ADDRESS ("destination", destination, argv[1]);
+  group->destination = destination;
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_destination,
+       no_ha_group_destination_cmd,
+       "no group <1-255> destination",
+       NO_STR
+       HA_GROUP_STR
+       "Where to send hellos, instead of the all HA routers group\n")
+{
+  struct ha_group *group;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  group->destination.s_addr = htonl (HA_ALLHAROUTERS);
+  ha_group_update (group);
+
+  return CMD_SUCCESS;
+}
+
+ALIAS (no_ha_group_destination,
+       no_ha_group_destination_val_cmd,
+       "no group <1-255> destination A.B.C.D",
+       NO_STR
+       HA_GROUP_STR
+       "Where to send hellos, instead of the all HA routers group\n"
+       "Multicast or unicast address\n")
+
+DEFUN (ha_group_neighbor,
+       ha_group_neighbor_cmd,
+       "group <1-255> neighbor A.B.C.D",
+       HA_GROUP_STR
+       "With the udp transport, send hellos to a neighbor rather than to "
+       "the destination\n"
+       "Unicast address of the neighbor\n")
+{
+  struct ha_group *group;
+  struct in_addr addr;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_IPV4_ADDRESS ("neighbor", addr, argv[1]);
+  if (IN_MULTICAST (ntohl (addr.s_addr)))
+    {
+      vty_out (vty, "A neighbor is a unicast address%s", VTY_NEWLINE);
+      return CMD_WARNING;
+    }
+  ha_group_neighbor_set (group, addr);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group_neighbor,
+       no_ha_group_neighbor_cmd,
+       "no group <1-255> neighbor A.B.C.D",
+       NO_STR
+       HA_GROUP_STR
+       "With the udp transport, send hellos to a neighbor rather than to "
+       "the destination\n"
+       "Unicast address of the neighbor\n")
+{
+  struct ha_group *group;
+  struct in_addr addr;
+
+  HA_VTY_GET_GROUP (group, argv[0]);
+  VTY_GET_IPV4_ADDRESS ("neighbor", addr, argv[1]);
+  if (ha_group_neighbor_unset (group, addr) < 0)
+    {
+      vty_out (vty, "No neighbor %s in group %d%s", argv[1], group->id,
+	       VTY_NEWLINE);
+      return CMD_WARNING;
+    }
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (no_ha_group,
+       no_ha_group_cmd,
+       "no group <1-255>",
+       NO_STR
+       HA_GROUP_STR)
+{
+  struct ha *ha = vty->index;
+  int id;
+
+  VTY_GET_INTEGER_RANGE ("group", id, argv[0], 1, HA_GROUP_MAX);
+  if (ha->group[id] == NULL)
+    {
+      vty_out (vty, "No group %d%s", id, VTY_NEWLINE);
+      return CMD_WARNING;
+    }
+  ha_group_delete (ha->group[id]);
+
+  return CMD_SUCCESS;
+}
+
+/* The counters belong to the heartbeat thread, so they may be a
+   packet or two out. */
+DEFUN (show_ha,
+       show_ha_cmd,
+       "show ha",
+       SHOW_STR
+       HA_STR)
+{
+  struct ha *ha;
+  struct ha_group *group;
+  int id;
+
+  if ((ha = ha_lookup ()) == NULL)
+    {
+      vty_out (vty, "There isn't active ha instance%s", VTY_NEWLINE);
+      return CMD_SUCCESS;
+    }
+
+  vty_out (vty, " HA router id %s, instance %08x%s",
+	   inet_ntoa (ha->router_id), ha->instance, VTY_NEWLINE);
+  vty_out (vty, " Packets sent %lu, send errors %lu%s",
+	   ha->stats.tx, ha->stats.tx_err, VTY_NEWLINE);
+  vty_out (vty, " Packets received %lu, dropped: short %lu, truncated %lu, "
+	   "version %lu, checksum %lu, type %lu, own %lu, group %lu, "
+	   "interface %lu, authentication %lu%s",
+	   ha->stats.rx, ha->stats.rx_short, ha->stats.rx_trunc,
+	   ha->stats.rx_version,
+	   ha->stats.rx_checksum, ha->stats.rx_type, ha->stats.rx_self,
+	   ha->stats.rx_group, ha->stats.rx_ifindex, ha->stats.rx_auth,
+	   VTY_NEWLINE);
+#ifdef HAVE_TPACKET_V3
+  if (ha->ring)
+    vty_out (vty, " Receiving from a packet ring, %lu blocks taken%s",
+	     ha->stats.rx_blocks, VTY_NEWLINE);
+#endif /* HAVE_TPACKET_V3 */
+  if (ha->udp_nshards)
+    vty_out (vty, " Transport udp, port %d, %d sockets, %lu neighbors%s",
+	     ha->udp_port, ha->udp_nshards, ha->udp_peers->count,
+	     VTY_NEWLINE);
+  vty_out (vty, " Peers %lu%s", ha->peers->count, VTY_NEWLINE);
+  vty_out (vty, "%s Group Interface        Interval Prio Dead  Peers up"
+	   "        Sent    Received%s", VTY_NEWLINE, VTY_NEWLINE);
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if ((group = ha->group[id]) != NULL)
+      vty_out (vty, " %5d %-16s %6ums %4d %4d %9lu %11lu %11lu%s",
+	       group->id, group->ifname[0] ? group->ifname : "-",
+	       group->interval, group->priority, group->dead_multiplier,
+	       group->peers_up, group->tx, group->rx, VTY_NEWLINE);
+
+  return CMD_SUCCESS;
+}
+
+struct ha_peer_show_arg
+{
+  struct vty *vty;
+  int detail;
+  struct in_addr router_id;		/* just the one, if set */
+};
+
+static int
+ha_peer_show_hb (void *arg)
+{
+  struct ha_peer_show_arg *show = arg;
+  struct vty *vty = show->vty;
+  struct ha *ha;
+
+  if ((ha = ha_lookup ()) == NULL)
+    {
+      vty_out (vty, "There isn't active ha instance%s", VTY_NEWLINE);
+      return 0;
+    }
+  if (show->router_id.s_addr)
+    return ha_peer_show_one (vty, ha, show->router_id);
+  return ha_peer_show (vty, ha, show->detail);
+}
+
+/* Peers belong to the heartbeat thread, and come and go, so they are
+   shown from there. */
+DEFUN (show_ha_peer,
+       show_ha_peer_cmd,
+       "show ha peer",
+       SHOW_STR
+       HA_STR
+       "Peers and their failure detection\n")
+{
+  struct ha_peer_show_arg show = { vty, 0, { 0 } };
+
+  if (ha_hb_call_wait (ha_peer_show_hb, &show) < 0)
+    vty_out (vty, "Heartbeat thread busy, try again%s", VTY_NEWLINE);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (show_ha_peer_detail,
+       show_ha_peer_detail_cmd,
+       "show ha peer detail",
+       SHOW_STR
+       HA_STR
+       "Peers and their failure detection\n"
+       "With arrival timing, jitter and loss\n")
+{
+  struct ha_peer_show_arg show = { vty, 1, { 0 } };
+
+  if (ha_hb_call_wait (ha_peer_show_hb, &show) < 0)
+    vty_out (vty, "Heartbeat thread busy, try again%s", VTY_NEWLINE);
+
+  return CMD_SUCCESS;
+}
+
+DEFUN (show_ha_peer_router,
+       show_ha_peer_router_cmd,
+       "show ha peer A.B.C.D",
+       SHOW_STR
+       HA_STR
+       "Peers and their failure detection\n"
+       "Router ID of the peer, to show its last gaps too\n")
+{
+  struct ha_peer_show_arg show = { vty, 1, { 0 } };
+
+  VTY_GET_IPV4_ADDRESS ("router id", show.router_id, argv[0]);
+
+  if (ha_hb_call_wait (ha_peer_show_hb, &show) < 0)
+    vty_out (vty, "Heartbeat thread busy, try again%s", VTY_NEWLINE);
+
+  return CMD_SUCCESS;
+}
+
 /* HA configuration write function. */
 static int
 ha_config_write (struct vty *vty)
 {
-    int write = 0;
+  struct ha *ha;
+  struct ha_group *group;
+  struct listnode *node;
+  struct in_addr *neighbor;
+  int id;
+
+  if ((ha = ha_lookup ()) == NULL)
+    return 0;
+
+  vty_out (vty, "ha%s", VTY_NEWLINE);
+  if (ha->router_id_static.s_addr)
+    vty_out (vty, " router-id %s%s", inet_ntoa (ha->router_id_static),
+	     VTY_NEWLINE);
+  if (ha->read_batch != HA_READ_BATCH)
+    vty_out (vty, " receive-batch %d%s", ha->read_batch, VTY_NEWLINE);
+  if (ha->receive_ring)
+    vty_out (vty, " receive-ring%s", VTY_NEWLINE);
+  if (ha->transport == HA_TRANSPORT_UDP)
+    {
+      if (ha->udp_port == HA_UDP_PORT)
+	vty_out (vty, " transport udp%s", VTY_NEWLINE);
+      else
+	vty_out (vty, " transport udp port %d%s", ha->udp_port, VTY_NEWLINE);
+    }
+  if (ha->stats_export == HA_STATS_EXPORT_INTERVAL_DEFAULT)
+    vty_out (vty, " stats-export%s", VTY_NEWLINE);
+  else if (ha->stats_export)
+    vty_out (vty, " stats-export interval %u%s", ha->stats_export,
+	     VTY_NEWLINE);
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    {
+      if ((group = ha->group[id]) == NULL)
+	continue;
+
+      if (group->ifname[0])
+	vty_out (vty, " group %d interface %s%s", id, group->ifname,
+		 VTY_NEWLINE);
+      if (group->interval != HA_GROUP_INTERVAL_DEFAULT)
+	vty_out (vty, " group %d interval %u%s", id, group->interval,
+		 VTY_NEWLINE);
+      if (group->priority != HA_GROUP_PRIORITY_DEFAULT)
+	vty_out (vty, " group %d priority %d%s", id, group->priority,
+		 VTY_NEWLINE);
+      if (group->dead_multiplier != HA_GROUP_DEAD_MULTIPLIER_DEFAULT)
+	vty_out (vty, " group %d dead-multiplier %d%s", id,
+		 group->dead_multiplier, VTY_NEWLINE);
+      if (group->phi_threshold != HA_GROUP_PHI_THRESHOLD_DEFAULT)
+	vty_out (vty, " group %d phi-threshold %d%s", id,
+		 group->phi_threshold, VTY_NEWLINE);
+      if (group->auth_keychain)
+	vty_out (vty, " group %d authentication key-chain %s%s", id,
+		 group->auth_keychain, VTY_NEWLINE);
+      if (group->destination.s_addr != htonl (HA_ALLHAROUTERS))
+	vty_out (vty, " group %d destination %s%s", id,
+		 inet_ntoa (group->destination), VTY_NEWLINE);
+      for (ALL_LIST_ELEMENTS_RO (group->neighbors, node, neighbor))
+	vty_out (vty, " group %d neighbor %s%s", id, inet_ntoa (*neighbor),
+		 VTY_NEWLINE);
+    }
 
-    return write;
+  return 1;
 }
 
 void
 ha_vty_show_init (void)
 {
-
+  install_element (VIEW_NODE, &show_ha_cmd);
+  install_element (ENABLE_NODE, &show_ha_cmd);
+  install_element (VIEW_NODE, &show_ha_peer_cmd);
+  install_element (ENABLE_NODE, &show_ha_peer_cmd);
+  install_element (VIEW_NODE, &show_ha_peer_detail_cmd);
+  install_element (ENABLE_NODE, &show_ha_peer_detail_cmd);
+  install_element (VIEW_NODE, &show_ha_peer_router_cmd);
+  install_element (ENABLE_NODE, &show_ha_peer_router_cmd);
 }
 
 /* Install HA related vty commands. */
@@ -72,8 +824,54 @@ ha_vty_init (void)
   /* Install ha top node. */
   install_node (&ha_node, ha_config_write);
 
+  /* Keys for group authentication. */
+  keychain_add_hook (ha_keychain_update);
+
   /* ha commands. */
   install_element (CONFIG_NODE, &ha_cmd);
   install_element (CONFIG_NODE, &no_ha_cmd);
+
+  install_default (HA_NODE);
+  install_element (HA_NODE, &ha_router_id_cmd);
+  install_element (HA_NODE, &no_ha_router_id_cmd);
+  install_element (HA_NODE, &ha_receive_batch_cmd);
+  install_element (HA_NODE, &no_ha_receive_batch_cmd);
+  install_element (HA_NODE, &no_ha_receive_batch_val_cmd);
+#ifdef HAVE_TPACKET_V3
+  install_element (HA_NODE, &ha_receive_ring_cmd);
+  install_element (HA_NODE, &no_ha_receive_ring_cmd);
+#endif /* HAVE_TPACKET_V3 */
+  install_element (HA_NODE, &ha_transport_udp_cmd);
+  install_element (HA_NODE, &ha_transport_udp_port_cmd);
+  install_element (HA_NODE, &no_ha_transport_cmd);
+  install_element (HA_NODE, &no_ha_transport_udp_cmd);
+  install_element (HA_NODE, &no_ha_transport_udp_port_cmd);
+  install_element (HA_NODE, &ha_stats_export_cmd);
+  install_element (HA_NODE, &ha_stats_export_interval_cmd);
+  install_element (HA_NODE, &no_ha_stats_export_cmd);
+  install_element (HA_NODE, &no_ha_stats_export_interval_cmd);
+  install_element (HA_NODE, &ha_group_interface_cmd);
+  install_element (HA_NODE, &no_ha_group_interface_cmd);
+  install_element (HA_NODE, &ha_group_interval_cmd);
+  install_element (HA_NODE, &no_ha_group_interval_cmd);
+  install_element (HA_NODE, &no_ha_group_interval_val_cmd);
+  install_element (HA_NODE, &ha_group_priority_cmd);
+  install_element (HA_NODE, &no_ha_group_priority_cmd);
+  install_element (HA_NODE, &no_ha_group_priority_val_cmd);
+  install_element (HA_NODE, &ha_group_dead_multiplier_cmd);
+  install_element (HA_NODE, &no_ha_group_dead_multiplier_cmd);
+  install_element (HA_NODE, &no_ha_group_dead_multiplier_val_cmd);
+  install_element (HA_NODE, &ha_group_phi_threshold_cmd);
+  install_element (HA_NODE, &no_ha_group_phi_threshold_cmd);
+  install_element (HA_NODE, &no_ha_group_phi_threshold_val_cmd);
+  install_element (HA_NODE, &ha_group_authentication_cmd);
+  install_element (HA_NODE, &no_ha_group_authentication_cmd);
+  install_element (HA_NODE, &no_ha_group_authentication_val_cmd);
+  install_element (HA_NODE, &ha_group_destination_cmd);
+  install_element (HA_NODE, &no_ha_group_destination_cmd);
+  install_element (HA_NODE, &no_ha_group_destination_val_cmd);
+  install_element (HA_NODE, &ha_group_neighbor_cmd);
+  install_element (HA_NODE, &no_ha_group_neighbor_cmd);
+  install_element (HA_NODE, &no_ha_group_cmd);
 }
 
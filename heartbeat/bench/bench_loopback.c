@@ -0,0 +1,520 @@
+/*
+ * Loopback benchmark: hellos from made-up peers to a daemon on this
+ * host, paced at their interval, and what they cost the daemon.
+ *
+ * usage: bench_loopback [-n peers] [-i msec] [-t seconds] [-g groups]
+ *			 [-d destination] [-p pid | -l [-r priority]] [-f]
+ *			 [-k key]
+ *	(default 1000 peers at 20ms for 10s, to group 1 at 127.0.0.1)
+ *
+ * With -g each peer sends to groups 1 to groups, which the daemon is to
+ * have on lo with the destination, and a dead-multiplier that allows
+ * for a loaded host.  With -p, the daemon's CPU over the run after the
+ * first second, from /proc, and with stats-export on, the hellos it
+ * took in and the peers it has up, from its snapshot.  With -f, hellos
+ * go out as fast as they can instead, and the hellos the kernel dropped
+ * for want of room on the daemon's sockets are counted too, so that
+ * receive-batch settings can be compared under a flood.  With -k,
+ * hellos are signed with HMAC-MD5 as key id 1 of the group's key chain,
+ * to compare with unsigned ones.
+ *
+ * With -l there is no daemon: the daemon's own receive engine, ha_read
+ * on a raw socket of its own, through to ha_peer_hello_recv and the
+ * dead timers, runs on a thread master in a pthread of this process,
+ * with the groups set up as -g, -d and -k say, the default dead
+ * multiplier, and no key chain.  Its CPU time over the run after the
+ * first second, from that pthread's own clock, the hellos it took in,
+ * and the peers it has up at the end are reported.  With -r the
+ * pthread runs SCHED_FIFO at that priority, as the heartbeat thread of
+ * a daemon started with -H can.
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+#include "prefix.h"
+#include "if.h"
+#include "hash.h"
+#include "stream.h"
+#include "log.h"
+#include "checksum.h"
+#include "md5.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_peer.h"
+#include "ha_stats.h"
+#include "ha_auth.h"
+
+#define BENCH_WARMUP_MSEC     1000
+
+/* What the receive engine takes from ha_deamon.c and ha_debug.c. */
+struct ha_master *hm;
+unsigned long term_debug_ha_packet[5];
+unsigned long term_debug_ha_kroute;
+
+struct bench_daemon
+{
+  double cpu;				/* seconds */
+  unsigned long drops;			/* by its sockets */
+  double updated;			/* of the snapshot, seconds */
+  u_int64_t rx;
+  u_int32_t up;
+  u_int32_t npeers;
+};
+
+/* The receive engine, with -l. */
+struct bench_engine
+{
+  struct ha_master hm;
+  struct ha *ha;
+  pthread_t pthread;
+  int stop;
+};
+
+/* Taken on the engine's pthread, between its threads. */
+struct bench_engine_sample
+{
+  double now;
+  double cpu;				/* seconds */
+  unsigned long rx;
+};
+
+static struct bench_engine engine;
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_engine_sample (struct thread *thread)
+{
+  struct bench_engine_sample *s = THREAD_ARG (thread);
+  struct timespec ts;
+
+  clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+  s->cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+  s->rx = engine.ha->stats.rx;
+  s->now = bench_now ();
+  engine.stop = THREAD_VAL (thread);
+  return 0;
+}
+
+static void *
+bench_engine_run (void *arg)
+{
+  struct thread thread;
+
+  while (!engine.stop && thread_fetch (engine.hm.hb_master, &thread))
+    thread_call (&thread);
+  return NULL;
+}
+
+/* Set up an instance as ha_new and ha_transport_open do, with groups 1
+   to groups on lo, and start reading. */
+static int
+bench_engine_start (int groups, int interval, struct in_addr dst,
+		    const char *key, int priority)
+{
+  struct sched_param param;
+  pthread_attr_t attr;
+  struct ha_group *group;
+  struct ha_auth *auth = NULL;
+  struct ha *ha;
+  int id;
+
+  /* Peers coming up are news to a daemon's log, not here. */
+  zlog_default = openzlog ("bench_loopback", ZLOG_NONE, 0, LOG_DAEMON);
+  zlog_set_level (NULL, ZLOG_DEST_MONITOR, ZLOG_DISABLED);
+
+  hm = &engine.hm;
+  hm->master = hm->hb_master = thread_master_create ();
+
+  engine.ha = ha = calloc (1, sizeof (struct ha));
+  ha->ibuf = stream_new (HA_MAX_PACKET_SIZE + 1);
+  ha->peers = ha_peer_hash_new ();
+  ha->rx_signed = calloc (HA_AUTH_BATCH, sizeof (struct ha_rx_signed));
+  ha->hb.router_id.s_addr = htonl (0x0a0000fe);
+  ha->hb.read_batch = HA_READ_BATCH;
+#ifdef HAVE_RECVMMSG
+  ha_recv_batch_alloc (ha, ha->hb.read_batch);
+#endif /* HAVE_RECVMMSG */
+
+  if (key)
+    {
+      auth = calloc (1, sizeof (struct ha_auth));
+      auth->key[0].id = 1;
+      hmac_md5_init (&auth->key[0].hmac, (const uint8_t *) key,
+		     strlen (key));
+      auth->nkeys = 1;
+    }
+
+  for (id = 1; id <= groups; id++)
+    {
+      group = calloc (1, sizeof (struct ha_group));
+      group->ha = ha;
+      group->id = id;
+      group->hb.ifindex = if_nametoindex ("lo");
+      group->hb.interval = interval;
+      group->hb.dead_multiplier = HA_GROUP_DEAD_MULTIPLIER_DEFAULT;
+      group->hb.destination = dst;
+      group->auth = auth;
+      group->running = 1;
+      ha->group[id] = ha->hb_group[id] = group;
+    }
+
+  if ((ha->fd = ha_sock_init ()) < 0)
+    return -1;
+#ifdef SO_ATTACH_FILTER
+  ha_sock_filter_update (ha);
+#endif /* SO_ATTACH_FILTER */
+  ha->t_read = thread_add_read_persist (hm->hb_master, ha_read, ha, ha->fd);
+  thread_set_priority (ha->t_read, THREAD_PRIO_CRITICAL);
+
+  pthread_attr_init (&attr);
+  if (priority)
+    {
+      param.sched_priority = priority;
+      pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+      pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+      pthread_attr_setschedparam (&attr, &param);
+    }
+  return pthread_create (&engine.pthread, &attr, bench_engine_run, NULL);
+}
+
+static void
+bench_engine_down (struct hash_backet *backet, void *arg)
+{
+  struct ha_peer *peer = backet->data;
+
+  *(unsigned long *) arg += peer->down;
+}
+
+/* User and system time of a process, seconds. */
+static double
+bench_cpu (pid_t pid)
+{
+  char path[64], buf[1024], *p;
+  unsigned long utime, stime;
+  ssize_t len;
+  int fd;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return -1;
+  len = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+
+  /* After the command, which may have anything in it. */
+  if ((p = strrchr (buf, ')')) == NULL
+      || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		 "%lu %lu", &utime, &stime) != 2)
+    return -1;
+  return (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+}
+
+/* Packets dropped by the kernel on raw sockets for IPPROTO_HA, other
+   than ours, from /proc/net/raw. */
+static unsigned long
+bench_drops (ino_t self)
+{
+  char line[256];
+  unsigned long inode, drops, total = 0;
+  unsigned int proto;
+  FILE *fp;
+
+  if ((fp = fopen ("/proc/net/raw", "r")) == NULL)
+    return 0;
+  while (fgets (line, sizeof (line), fp))
+    if (sscanf (line, "%*d: %*x:%x %*x:%*x %*x %*x:%*x %*x:%*x %*x %*u %*u "
+		"%lu %*d %*x %lu", &proto, &inode, &drops) == 3
+	&& proto == IPPROTO_HA && inode != self)
+      total += drops;
+  fclose (fp);
+  return total;
+}
+
+/* Totals of the daemon's statistics snapshot, taken the way a reader
+   is to take them.  Zero if there isn't one. */
+static int
+bench_snapshot (struct bench_daemon *d)
+{
+  struct ha_stats_shm *shm;
+  struct stat st;
+  u_int32_t seq, i;
+  int fd, done = 0;
+
+  d->updated = 0;
+  if ((fd = shm_open (HA_STATS_SHM_NAME, O_RDONLY, 0)) < 0)
+    return 0;
+
+  while (!done)
+    {
+      if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (*shm)
+	  || (shm = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+	     == MAP_FAILED)
+	break;
+
+      /* Until a copy is had, or the mapping is too short for it. */
+      for (;;)
+	{
+	  seq = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE);
+	  if (shm->size > (u_int64_t) st.st_size)
+	    break;
+	  if (seq & 1)
+	    continue;
+	  d->rx = 0;
+	  d->up = 0;
+	  d->npeers = shm->npeers;
+	  for (i = 0; i < d->npeers; i++)
+	    {
+	      d->rx += shm->peer[i].rx;
+	      d->up += shm->peer[i].state == HA_PEER_UP;
+	    }
+	  d->updated = shm->updated / 1e6;
+	  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+	  if (__atomic_load_n (&shm->seq, __ATOMIC_RELAXED) == seq)
+	    {
+	      done = 1;
+	      break;
+	    }
+	}
+      munmap (shm, st.st_size);
+    }
+
+  close (fd);
+  return done;
+}
+
+static void
+bench_daemon (pid_t pid, ino_t self, struct bench_daemon *d)
+{
+  d->cpu = bench_cpu (pid);
+  d->drops = bench_drops (self);
+  bench_snapshot (d);
+}
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "usage: %s [-n peers] [-i msec] [-t seconds] "
+	   "[-g groups] [-d destination] [-p pid | -l [-r priority]] [-f] "
+	   "[-k key]\n",
+	   progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  int npeers = 1000, interval = 20, seconds = 10, groups = 1, flood = 0;
+  int local = 0, priority = 0;
+  struct sock_filter drop = BPF_STMT (BPF_RET|BPF_K, 0);
+  struct sock_fprog prog = { 1, &drop };
+  struct sockaddr_in sa;
+  struct stat st;
+  hmac_md5_ctxt hmac;
+  const char *key = NULL;
+  size_t size = HA_HEADER_SIZE;
+  struct ha_header *hah;
+  struct bench_daemon d0, d1;
+  struct bench_engine_sample e0, e1;
+  unsigned long up, down;
+  struct timespec tick;
+  u_char packet[HA_HEADER_SIZE + HA_AUTH_DIGEST_SIZE];
+  u_int32_t *seq, instance = getpid ();
+  long total, sent = 0, errors = 0, due, k, msec;
+  pid_t pid = 0;
+  double t0, t, cpu, rx;
+  int fd, opt;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  while ((opt = getopt (argc, argv, "n:i:t:g:d:p:lr:fk:")) != -1)
+    switch (opt)
+      {
+      case 'n':
+	npeers = atoi (optarg);
+	break;
+      case 'i':
+	interval = atoi (optarg);
+	break;
+      case 't':
+	seconds = atoi (optarg);
+	break;
+      case 'g':
+	groups = atoi (optarg);
+	break;
+      case 'd':
+	if (inet_pton (AF_INET, optarg, &sa.sin_addr) != 1)
+	  usage (argv[0]);
+	break;
+      case 'p':
+	pid = atoi (optarg);
+	break;
+      case 'l':
+	local = 1;
+	break;
+      case 'r':
+	priority = atoi (optarg);
+	break;
+      case 'f':
+	flood = 1;
+	break;
+      case 'k':
+	key = optarg;
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (npeers < 1 || npeers > 0xffff || interval < 1 || interval > 0xffff
+      || seconds < 1 || groups < 1 || groups > HA_GROUP_MAX
+      || ((pid || local) && seconds * 1000 <= BENCH_WARMUP_MSEC)
+      || (pid && local) || priority < 0
+      || (priority && (!local || priority < sched_get_priority_min (SCHED_FIFO)
+		       || priority > sched_get_priority_max (SCHED_FIFO))))
+    usage (argv[0]);
+
+  /* The socket gets every hello there is, ours included, and has no
+     use for any of them. */
+  if ((fd = socket (AF_INET, SOCK_RAW, IPPROTO_HA)) < 0
+      || setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		     sizeof (prog)) < 0
+      || fstat (fd, &st) < 0)
+    {
+      perror ("socket");
+      return 1;
+    }
+
+  /* Hellos go out in turn, peer by peer and then group by group, so
+     each peer's are one interval apart in each group. */
+  total = (long) npeers * groups;
+  seq = calloc (total, sizeof (u_int32_t));
+  hah = (struct ha_header *) packet;
+  if (key)
+    {
+      hmac_md5_init (&hmac, (const uint8_t *) key, strlen (key));
+      size += HA_AUTH_DIGEST_SIZE;
+    }
+
+  memset (&e0, 0, sizeof (e0));
+  memset (&e1, 0, sizeof (e1));
+  if (local && bench_engine_start (groups, interval, sa.sin_addr, key,
+				   priority) != 0)
+    {
+      fprintf (stderr, "can't start the receive engine\n");
+      return 1;
+    }
+
+  memset (&d0, 0, sizeof (d0));
+  t0 = bench_now ();
+  clock_gettime (CLOCK_MONOTONIC, &tick);
+  for (msec = 0; msec < seconds * 1000L; msec++)
+    {
+      if (pid && msec == BENCH_WARMUP_MSEC)
+	bench_daemon (pid, st.st_ino, &d0);
+      if (local && msec == BENCH_WARMUP_MSEC)
+	thread_add_event_mt (hm->hb_master, bench_engine_sample, &e0, 0);
+
+      due = flood ? LONG_MAX : (msec + 1) * total / interval;
+      while (sent + errors < due)
+	{
+	  if (flood && bench_now () - t0 >= (msec + 1) / 1000.0)
+	    break;
+	  k = (sent + errors) % total;
+
+	  memset (packet, 0, sizeof (packet));
+	  hah->version = HA_VERSION;
+	  hah->type = HA_MSG_HELLO;
+	  hah->length = htons (HA_HEADER_SIZE);
+	  hah->router_id.s_addr = htonl (0x0a010000 + k % npeers + 1);
+	  hah->group = k / npeers + 1;
+	  hah->priority = 100;
+	  hah->auth_type = key ? HA_AUTH_CRYPTOGRAPHIC : HA_AUTH_NULL;
+	  hah->key_id = key ? 1 : 0;
+	  hah->instance = htonl (instance);
+	  hah->seq = htonl (++seq[k]);
+	  hah->interval = htons (interval);
+	  hah->checksum = in_cksum (hah, HA_HEADER_SIZE);
+	  if (key)
+	    hmac_md5_digest (&hmac, hah, HA_HEADER_SIZE,
+			     packet + HA_HEADER_SIZE);
+
+	  if (sendto (fd, packet, size, 0, (struct sockaddr *) &sa,
+		      sizeof (sa)) == (ssize_t) size)
+	    sent++;
+	  else
+	    errors++;
+	}
+      if (flood)
+	continue;
+
+      tick.tv_nsec += 1000000;
+      if (tick.tv_nsec >= 1000000000)
+	{
+	  tick.tv_sec++;
+	  tick.tv_nsec -= 1000000000;
+	}
+      clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &tick, NULL);
+    }
+  t = bench_now () - t0;
+
+  printf ("%d peers in %d groups %s, %s: sent %ld in %.1fs, %.0f/s, "
+	  "%ld send errors\n", npeers, groups, flood ? "flooding" : "paced",
+	  key ? "signed" : "unsigned", sent, t, sent / t, errors);
+
+  if (pid)
+    {
+      bench_daemon (pid, st.st_ino, &d1);
+      if (d0.cpu < 0 || d1.cpu < 0)
+	{
+	  fprintf (stderr, "no process %d\n", (int) pid);
+	  return 1;
+	}
+      cpu = (d1.cpu - d0.cpu) / (t - BENCH_WARMUP_MSEC / 1000.0);
+      printf ("daemon: cpu %.1f%%", 100 * cpu);
+      if (d0.updated && d1.updated > d0.updated && d1.rx > d0.rx)
+	{
+	  rx = (d1.rx - d0.rx) / (d1.updated - d0.updated);
+	  printf (", received %.0f/s, %.0f ns a hello, peers up %u of %u",
+		  rx, cpu * 1e9 / rx, d1.up, d1.npeers);
+	}
+      else
+	printf (", no stats-export snapshot");
+      if (flood)
+	printf (", kernel drops %.0f/s",
+		(d1.drops - d0.drops) / (t - BENCH_WARMUP_MSEC / 1000.0));
+      printf ("\n");
+    }
+
+  if (local)
+    {
+      thread_add_event_mt (hm->hb_master, bench_engine_sample, &e1, 1);
+      pthread_join (engine.pthread, NULL);
+
+      up = down = 0;
+      for (k = 1; k <= groups; k++)
+	up += engine.ha->hb_group[k]->peers_up;
+      hash_iterate (engine.ha->peers, bench_engine_down, &down);
+
+      cpu = (e1.cpu - e0.cpu) / (e1.now - e0.now);
+      rx = (e1.rx - e0.rx) / (e1.now - e0.now);
+      printf ("engine: cpu %.1f%%, received %.0f/s, %.0f ns a hello, "
+	      "peers up %lu of %lu, went down %lu times\n", 100 * cpu, rx,
+	      rx ? cpu * 1e9 / rx : 0, up, engine.ha->peers->count, down);
+    }
+
+  free (seq);
+  close (fd);
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "linklist.h"
+#include "prefix.h"
+#include "if.h"
+#include "log.h"
+#include "md5.h"
+#include "keychain.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_auth.h"
+
+static void
+ha_auth_key_set (struct ha_auth_key *akey, struct key *key)
+{
+  const char *string = key->string ? key->string : "";
+
+  akey->id = key->index;
+  hmac_md5_init (&akey->hmac, (const uint8_t *) string, strlen (string));
+}
+
+static int
+ha_auth_key_id_ok (struct ha_group *group, struct key *key)
+{
+  if (key->index <= 255)
+    return 1;
+
+  zlog_warn ("HA group %d: key %u is left out, HA key ids go up to 255",
+	     group->id, key->index);
+  return 0;
+}
+
+/* The keys of the named chain that are good now.  Main thread. */
+struct ha_auth *
+ha_auth_new (struct ha_group *group, const char *name)
+{
+  struct ha_auth *auth;
+  struct keychain *keychain;
+  struct key *key;
+  u_int32_t i;
+
+  auth = XCALLOC (MTYPE_HA_AUTH, sizeof (struct ha_auth));
+
+  if ((keychain = keychain_lookup (name)) == NULL)
+    {
+      zlog_warn ("HA group %d: no key chain %s, hellos are not sent",
+		 group->id, name);
+      return auth;
+    }
+
+  if ((key = key_lookup_for_send (keychain)) != NULL
+      && ha_auth_key_id_ok (group, key))
+    {
+      ha_auth_key_set (&auth->send_key, key);
+      auth->send = &auth->send_key;
+    }
+  else
+    zlog_warn ("HA group %d: no key to send with in key chain %s, hellos "
+	       "are not sent", group->id, name);
+
+  for (i = 0; i < keychain->accept_count; i++)
+    {
+      key = keychain->accept[i];
+      if (!ha_auth_key_id_ok (group, key))
+	continue;
+      if (auth->nkeys == HA_AUTH_KEYS_MAX)
+	{
+	  zlog_warn ("HA group %d: more than %d keys in key chain %s, the "
+		     "rest are not accepted", group->id, HA_AUTH_KEYS_MAX,
+		     name);
+	  break;
+	}
+      ha_auth_key_set (&auth->key[auth->nkeys++], key);
+    }
+
+  return auth;
+}
+
+void
+ha_auth_free (struct ha_auth *auth)
+{
+  /* The pads are as good as the keys. */
+  memset (auth, 0, sizeof (struct ha_auth));
+  XFREE (MTYPE_HA_AUTH, auth);
+}
+
+/* Digest a hello, whose header says it is signed, and by which key,
+   and has its checksum in. */
+void
+ha_auth_sign (struct ha_auth *auth, struct ha_header *hah, u_char *digest)
+{
+  hmac_md5_digest (&auth->send->hmac, hah, ntohs (hah->length), digest);
+}
+
+/* The same for n hellos, each with its own group's keys, hashed side
+   by side. */
+void
+ha_auth_sign_mb (struct ha_auth **auth, struct ha_header **hah, int n)
+{
+  const hmac_md5_ctxt *hctxt[HA_AUTH_BATCH];
+  const void *text[HA_AUTH_BATCH];
+  uint text_len[HA_AUTH_BATCH];
+  uint8_t *digest[HA_AUTH_BATCH];
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      hctxt[i] = &auth[i]->send->hmac;
+      text[i] = hah[i];
+      text_len[i] = ntohs (hah[i]->length);
+      digest[i] = (uint8_t *) hah[i] + text_len[i];
+    }
+  hmac_md5_digest_mb (hctxt, text, text_len, digest, n);
+}
+
+/* The key a signed hello says it is signed with, if it is one of
+   ours. */
+struct ha_auth_key *
+ha_auth_key_find (struct ha_auth *auth, u_char key_id)
+{
+  int k;
+
+  for (k = 0; k < auth->nkeys; k++)
+    if (auth->key[k].id == key_id)
+      return &auth->key[k];
+  return NULL;
+}
+
+/* Compared in full, so the time taken says nothing about how much of
+   it matched. */
+static int
+ha_auth_digest_equal (const u_char *want, const u_char *digest)
+{
+  u_char diff = 0;
+  unsigned int i;
+
+  for (i = 0; i < HA_AUTH_DIGEST_SIZE; i++)
+    diff |= want[i] ^ digest[i];
+  return diff == 0;
+}
+
+/* Whether a signed hello's digest is right, by any key it may be
+   signed with. */
+int
+ha_auth_check (struct ha_auth *auth, struct ha_header *hah,
+	       const u_char *digest)
+{
+  u_char want[HA_AUTH_DIGEST_SIZE];
+  struct ha_auth_key *key;
+
+  if ((key = ha_auth_key_find (auth, hah->key_id)) == NULL)
+    return 0;
+
+  hmac_md5_digest (&key->hmac, hah, ntohs (hah->length), want);
+  return ha_auth_digest_equal (want, digest);
+}
+
+/* The same for n hellos whose keys have been found, with their
+   digests following them, hashed side by side.  ok[i] is set for
+   each hello that is right. */
+void
+ha_auth_check_mb (struct ha_auth_key **key, struct ha_header **hah,
+		  int *ok, int n)
+{
+  const hmac_md5_ctxt *hctxt[HA_AUTH_BATCH];
+  const void *text[HA_AUTH_BATCH];
+  uint text_len[HA_AUTH_BATCH];
+  uint8_t want[HA_AUTH_BATCH][HA_AUTH_DIGEST_SIZE];
+  uint8_t *digest[HA_AUTH_BATCH];
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      hctxt[i] = &key[i]->hmac;
+      text[i] = hah[i];
+      text_len[i] = ntohs (hah[i]->length);
+      digest[i] = want[i];
+    }
+  hmac_md5_digest_mb (hctxt, text, text_len, digest, n);
+
+  for (i = 0; i < n; i++)
+    ok[i] = ha_auth_digest_equal (want[i],
+				  (u_char *) hah[i] + text_len[i]);
+}
@@ -0,0 +1,42 @@
+#ifndef _KROUTE_HA_AUTH_H
+#define _KROUTE_HA_AUTH_H
+
+/* Most keys of a key chain that can be good for accepting at once. */
+#define HA_AUTH_KEYS_MAX      16
+
+/* Most hellos signed or checked together. */
+#define HA_AUTH_BATCH         64
+
+/* A key, with its HMAC pads already hashed. */
+struct ha_auth_key
+{
+  u_char id;
+  hmac_md5_ctxt hmac;
+};
+
+/* What a group signs and checks hellos with, taken from its key chain
+   on the main thread, and handed to the heartbeat thread whole, which
+   then has it to itself. */
+struct ha_auth
+{
+  struct ha_auth_key *send;		/* NULL if no key is good for it */
+  int nkeys;
+  struct ha_auth_key key[HA_AUTH_KEYS_MAX];	/* good for accepting */
+  struct ha_auth_key send_key;
+};
+
+struct ha_group;
+struct ha_header;
+
+extern struct ha_auth *ha_auth_new (struct ha_group *, const char *);
+extern void ha_auth_free (struct ha_auth *);
+extern void ha_auth_sign (struct ha_auth *, struct ha_header *,
+			  u_char *digest);
+extern void ha_auth_sign_mb (struct ha_auth **, struct ha_header **, int);
+extern struct ha_auth_key *ha_auth_key_find (struct ha_auth *, u_char);
+extern int ha_auth_check (struct ha_auth *, struct ha_header *,
+			  const u_char *digest);
+extern void ha_auth_check_mb (struct ha_auth_key **, struct ha_header **,
+			      int *ok, int);
+
+#endif /* _KROUTE_HA_AUTH_H */
@@ -10,11 +10,96 @@
 #include "stream.h"
 #include "log.h"
 #include "sockopt.h"
+#include "network.h"
 #include "checksum.h"
 #include "md5.h"
 
 #include "ha_packet.h"
 #include "ha_deamon.h"
+#include "ha_peer.h"
+#include "ha_ring.h"
+#include "ha_auth.h"
+#include "ha_debug.h"
+
+#ifdef SO_ATTACH_FILTER
+/* What a packet has to be for ha_read to want it, as a classic BPF
+   program starting at the IP header: our version, not one of our own,
+   and for a group we have.  Peers are learned, not configured, so
+   anyone is let through on that count.  Returns the number of
+   instructions, at most HA_FILTER_MAX. */
+int
+ha_packet_filter (struct ha *ha, struct sock_filter *f)
+{
+  int n = 0, ngroups = 0, id, i;
+
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    if (ha->hb_group[id])
+      ngroups++;
+
+  /* ldxb 4*([0]&0xf), loads are from the HA header on. */
+  f[n++] = (struct sock_filter) BPF_STMT (BPF_LDX|BPF_B|BPF_MSH, 0);
+
+  f[n++] = (struct sock_filter)
+    BPF_STMT (BPF_LD|BPF_IND|BPF_B, offsetof (struct ha_header, version));
+  f[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP|BPF_JEQ|BPF_K,
+					  HA_VERSION, 1, 0);
+  f[n++] = (struct sock_filter) BPF_STMT (BPF_RET|BPF_K, 0);
+
+  if (ha->hb.router_id.s_addr)
+    {
+      f[n++] = (struct sock_filter)
+	BPF_STMT (BPF_LD|BPF_IND|BPF_W, offsetof (struct ha_header, router_id));
+      f[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP|BPF_JEQ|BPF_K,
+					      ntohl (ha->hb.router_id.s_addr),
+					      0, 1);
+      f[n++] = (struct sock_filter) BPF_STMT (BPF_RET|BPF_K, 0);
+    }
+
+  /* One compare a group, each jumping past the rest and the drop. */
+  f[n++] = (struct sock_filter)
+    BPF_STMT (BPF_LD|BPF_IND|BPF_B, offsetof (struct ha_header, group));
+  for (id = 1, i = 0; id <= HA_GROUP_MAX; id++)
+    if (ha->hb_group[id])
+      {
+	f[n++] = (struct sock_filter) BPF_JUMP (BPF_JMP|BPF_JEQ|BPF_K, id,
+						ngroups - i, 0);
+	i++;
+      }
+  f[n++] = (struct sock_filter) BPF_STMT (BPF_RET|BPF_K, 0);
+  f[n++] = (struct sock_filter) BPF_STMT (BPF_RET|BPF_K, 0xffff);
+
+  return n;
+}
+
+/* Have the kernel drop what ha_packet_filter doesn't want, so it is
+   not copied out only to be thrown away.  Heartbeat thread only, on
+   every change to the groups or the router id. */
+void
+ha_sock_filter_update (struct ha *ha)
+{
+  struct sock_filter filter[HA_FILTER_MAX];
+  struct sock_fprog prog;
+
+#ifdef HAVE_TPACKET_V3
+  /* The ring takes the packets, the socket is kept quiet. */
+  if (ha->ring)
+    {
+      ha_ring_filter_update (ha);
+      return;
+    }
+#endif /* HAVE_TPACKET_V3 */
+
+  /* With the udp transport there is no raw socket to filter. */
+  if (ha->fd < 0)
+    return;
+
+  prog.len = ha_packet_filter (ha, filter);
+  prog.filter = filter;
+  if (setsockopt (ha->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		  sizeof (prog)) < 0)
+    zlog_warn ("HA socket: can't install filter: %s", safe_strerror (errno));
+}
+#endif /* SO_ATTACH_FILTER */
 
 int
 ha_sock_init (void)
@@ -27,7 +112,8 @@ ha_sock_init (void)
     {
       int save_errno = errno;
       zlog_err ("ha_read_sock_init: socket: %s", safe_strerror (save_errno));
-      exit(1);
+      errno = save_errno;
+      return -1;
     }
     
 #ifdef IP_HDRINCL
@@ -61,44 +147,40 @@ ha_sock_init (void)
   if (ret < 0)
      zlog_warn ("Can't set pktinfo option for fd %d", ha_sock);
 
+#ifdef SO_TIMESTAMPNS
+  /* Receive stamps, so arrival times leave out our own delays. */
+  if (setsockopt (ha_sock, SOL_SOCKET, SO_TIMESTAMPNS, &hincl,
+		  sizeof (hincl)) < 0)
+    zlog_warn ("Can't set SO_TIMESTAMPNS for fd %d: %s", ha_sock,
+	       safe_strerror (errno));
+#endif /* SO_TIMESTAMPNS */
+
+  /* ha_read drains the socket until it would block. */
+  if (set_nonblocking (ha_sock) < 0)
+    zlog_warn ("Can't set non-blocking mode for fd %d", ha_sock);
+
   return ha_sock;
 }
 
-static struct stream *
-ha_recv_packet (int fd, struct interface **ifp, struct stream *ibuf)
+/* IP level checks of a packet just read, common to both ways of
+   reading.  Returns its IP header, in host order. */
+static struct ip *
+ha_packet_ip (u_char *buf, int ret)
 {
-  int ret;
   struct ip *iph;
   u_int16_t ip_len;
-  unsigned int ifindex = 0;
-  struct iovec iov;
-  /* Header and data both require alignment. */
-  char buff [CMSG_SPACE(SOPT_SIZE_CMSG_IFINDEX_IPV4())];
-  struct msghdr msgh;
 
-  memset (&msgh, 0, sizeof (struct msghdr));
-  msgh.msg_iov = &iov;
-  msgh.msg_iovlen = 1;
-  msgh.msg_control = (caddr_t) buff;
-  msgh.msg_controllen = sizeof (buff);
-  
-  ret = stream_recvmsg (ibuf, fd, &msgh, 0, HA_MAX_PACKET_SIZE+1);
-  if (ret < 0)
-    {
-      zlog_warn("stream_recvmsg failed: %s", safe_strerror(errno));
-      return NULL;
-    }
-  if ((unsigned int)ret < sizeof(iph)) /* ret must be > 0 now */
+  if ((unsigned int)ret < sizeof(*iph)) /* ret must be > 0 now */
     {
       zlog_warn("ha_recv_packet: discarding runt packet of length %d "
 		"(ip header size is %u)",
-		ret, (u_int)sizeof(iph));
+		ret, (u_int)sizeof(*iph));
       return NULL;
     }
   
   /* Note that there should not be alignment problems with this assignment
-     because this is at the beginning of the stream data buffer. */
-  iph = (struct ip *) STREAM_DATA(ibuf);
+     because this is at the beginning of the buffer. */
+  iph = (struct ip *) buf;
   sockopt_iphdrincl_swab_systoh (iph);
   
   ip_len = iph->ip_len;
@@ -130,10 +212,6 @@ ha_recv_packet (int fd, struct interface **ifp, struct stream *ibuf)
   ip_len = ntohs(iph->ip_len) + (iph->ip_hl << 2);
 #endif
 
-  ifindex = getsockopt_ifindex (AF_INET, &msgh);
-  
-  *ifp = if_lookup_by_index (ifindex);
-
   if (ret != ip_len)
     {
       zlog_warn ("ha_recv_packet read length mismatch: ip_len is %d, "
@@ -141,27 +219,919 @@ ha_recv_packet (int fd, struct interface **ifp, struct stream *ibuf)
       return NULL;
     }
   
+  return iph;
+}
+
+void
+ha_rx_clock_get (struct ha_rx_clock *clock)
+{
+  clock_gettime (CLOCK_REALTIME, &clock->real);
+  bane_gettime (BANE_CLK_MONOTONIC, &clock->relative);
+}
+
+/* A receive stamp, wall clock, into relative time.  Without one, the
+   packet came in now as far as anyone can tell. */
+void
+ha_rx_time_set (struct ha_rx_time *rxt, struct ha_rx_clock *clock,
+		struct timespec *stamp)
+{
+  long long delay;
+
+  if (stamp == NULL || stamp->tv_sec == 0)
+    {
+      rxt->arrival = recent_relative_time ();
+      rxt->delay = -1;
+      return;
+    }
+
+  delay = (clock->real.tv_sec - stamp->tv_sec) * 1000000LL
+	  + (clock->real.tv_nsec - stamp->tv_nsec) / 1000;
+  /* The wall clock was stepped in between. */
+  if (delay < 0 || delay > HA_RX_DELAY_MAX)
+    {
+      rxt->arrival = clock->relative;
+      rxt->delay = -1;
+      return;
+    }
+
+  rxt->delay = delay;
+  rxt->arrival = clock->relative;
+  rxt->arrival.tv_sec -= delay / 1000000;
+  rxt->arrival.tv_usec -= delay % 1000000;
+  if (rxt->arrival.tv_usec < 0)
+    {
+      rxt->arrival.tv_sec--;
+      rxt->arrival.tv_usec += 1000000;
+    }
+}
+
+/* The receive stamp of a message, if it has one. */
+static struct timespec *
+ha_packet_stamp (struct msghdr *msgh)
+{
+#ifdef SO_TIMESTAMPNS
+  struct cmsghdr *cm;
+
+  for (cm = CMSG_FIRSTHDR (msgh); cm; cm = CMSG_NXTHDR (msgh, cm))
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS)
+      return (struct timespec *) CMSG_DATA (cm);
+#endif /* SO_TIMESTAMPNS */
+  return NULL;
+}
+
+static struct stream *
+ha_recv_packet (int fd, unsigned int *ifindex, struct timespec *stamp,
+		struct stream *ibuf)
+{
+  int ret;
+  struct iovec iov;
+  /* Header and data both require alignment. */
+  union
+  {
+    char buf[HA_RECV_CMSG_SIZE];
+    struct cmsghdr align;
+  } cmsg;
+  struct timespec *ts;
+  struct msghdr msgh;
+
+  memset (&msgh, 0, sizeof (struct msghdr));
+  msgh.msg_iov = &iov;
+  msgh.msg_iovlen = 1;
+  msgh.msg_control = (caddr_t) cmsg.buf;
+  msgh.msg_controllen = sizeof (cmsg.buf);
+  
+  ret = stream_recvmsg (ibuf, fd, &msgh, 0, HA_MAX_PACKET_SIZE+1);
+  if (ret < 0)
+    {
+      int save_errno = errno;
+
+      /* Nothing more queued; ha_read uses errno to tell this apart. */
+      if (!ERRNO_IO_RETRY (save_errno))
+        zlog_warn("stream_recvmsg failed: %s", safe_strerror(save_errno));
+      errno = save_errno;
+      return NULL;
+    }
+  if (ha_packet_ip (STREAM_DATA (ibuf), ret) == NULL)
+    return NULL;
+
+  /* Just the index, the interface list belongs to the main thread. */
+  *ifindex = getsockopt_ifindex (AF_INET, &msgh);
+  if ((ts = ha_packet_stamp (&msgh)) != NULL)
+    *stamp = *ts;
+  else
+    stamp->tv_sec = 0;
+
   return ibuf;
 }
 
+static void
+ha_packet_auth_failed (struct ha *ha, struct ip *iph, struct ha_header *hah)
+{
+  ha->stats.rx_auth++;
+  if (IS_DEBUG_HA_PACKET (HA_MSG_HELLO - 1, RECV))
+    zlog_debug ("ha_read: %s failed authentication, type %d key %d",
+		inet_ntoa (iph->ip_src), hah->auth_type, hah->key_id);
+}
+
+/* Check a packet over, all but its digest.  Returns the group it is
+   for, NULL if it is dropped. */
+static struct ha_group *
+ha_packet_check (struct ha *ha, u_char *buf, size_t len,
+		 unsigned int ifindex)
+{
+  struct ip *iph = (struct ip *) buf;
+  struct ha_header *hah;
+  struct ha_group *group;
+  unsigned int hlen = iph->ip_hl << 2;
+  unsigned int length;
+
+  if (len < hlen + HA_HEADER_SIZE)
+    {
+      ha->stats.rx_short++;
+      return NULL;
+    }
+  hah = (struct ha_header *) (buf + hlen);
+  length = ntohs (hah->length);
+
+  if (hah->version != HA_VERSION)
+    {
+      ha->stats.rx_version++;
+      if (IS_DEBUG_HA_PACKET (HA_MSG_HELLO - 1, RECV))
+	zlog_debug ("ha_read: %s sent version %d", inet_ntoa (iph->ip_src),
+		    hah->version);
+      return NULL;
+    }
+
+  if (length < HA_HEADER_SIZE || length > len - hlen
+      || hah->interval == 0)
+    {
+      ha->stats.rx_short++;
+      return NULL;
+    }
+
+  if (in_cksum (hah, length) != 0)
+    {
+      ha->stats.rx_checksum++;
+      return NULL;
+    }
+
+  /* Our own, looped back. */
+  if (hah->router_id.s_addr == ha->hb.router_id.s_addr)
+    {
+      ha->stats.rx_self++;
+      return NULL;
+    }
+
+  group = ha->hb_group[hah->group];
+  if (group == NULL || !group->running)
+    {
+      ha->stats.rx_group++;
+      return NULL;
+    }
+  if (ifindex != group->hb.ifindex)
+    {
+      ha->stats.rx_ifindex++;
+      return NULL;
+    }
+
+  /* Signed if and only if the group signs its own. */
+  if (group->auth
+      ? (hah->auth_type != HA_AUTH_CRYPTOGRAPHIC
+	 || len - hlen < length + HA_AUTH_DIGEST_SIZE)
+      : hah->auth_type != HA_AUTH_NULL)
+    {
+      ha_packet_auth_failed (ha, iph, hah);
+      return NULL;
+    }
+
+  return group;
+}
+
+/* Hand a packet that passed to its type's handler. */
+static void
+ha_packet_accept (struct ha *ha, struct ha_group *group, struct ip *iph,
+		  struct ha_header *hah, unsigned int ifindex,
+		  struct ha_rx_time *rxt)
+{
+  switch (hah->type)
+    {
+    case HA_MSG_HELLO:
+      ha->stats.rx++;
+      ha_peer_hello_recv (ha, group, iph, hah, ifindex, rxt);
+      break;
+    default:
+      ha->stats.rx_type++;
+      break;
+    }
+}
+
+/* Check a packet over and hand it to its type's handler. */
+static void
+ha_packet_dispatch (struct ha *ha, u_char *buf, size_t len,
+		    unsigned int ifindex, struct ha_rx_time *rxt)
+{
+  struct ip *iph = (struct ip *) buf;
+  struct ha_header *hah;
+  struct ha_group *group;
+
+  if ((group = ha_packet_check (ha, buf, len, ifindex)) == NULL)
+    return;
+
+  hah = (struct ha_header *) (buf + (iph->ip_hl << 2));
+  if (group->auth
+      && !ha_auth_check (group->auth, hah,
+			 (u_char *) hah + ntohs (hah->length)))
+    {
+      ha_packet_auth_failed (ha, iph, hah);
+      return;
+    }
+
+  ha_packet_accept (ha, group, iph, hah, ifindex, rxt);
+}
+
+/* Check the digests of the signed packets held back, all together,
+   and hand on those that are right, in the order they came. */
+void
+ha_packet_recv_flush (struct ha *ha)
+{
+  struct ha_auth_key *key[HA_AUTH_BATCH];
+  struct ha_header *hah[HA_AUTH_BATCH];
+  int ok[HA_AUTH_BATCH];
+  struct ha_rx_signed *rs;
+  int i, n = ha->rx_signed_n;
+
+  if (n == 0)
+    return;
+  ha->rx_signed_n = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      key[i] = ha->rx_signed[i].key;
+      hah[i] = ha->rx_signed[i].hah;
+    }
+  ha_auth_check_mb (key, hah, ok, n);
+
+  for (i = 0; i < n; i++)
+    {
+      rs = &ha->rx_signed[i];
+      if (ok[i])
+	ha_packet_accept (ha, rs->group, rs->iph, rs->hah, rs->ifindex,
+			  &rs->rxt);
+      else
+	ha_packet_auth_failed (ha, rs->iph, rs->hah);
+    }
+}
+
+/* Check a packet over and hand it on, as ha_packet_dispatch does,
+   but holding a signed packet back, to have its digest checked along
+   with others, until ha_packet_recv_flush.  buf must last until then. */
+static void
+ha_packet_take (struct ha *ha, u_char *buf, size_t len, unsigned int ifindex,
+		struct ha_rx_time *rxt)
+{
+  struct ip *iph = (struct ip *) buf;
+  struct ha_header *hah;
+  struct ha_group *group;
+  struct ha_auth_key *key;
+  struct ha_rx_signed *rs;
+
+  if ((group = ha_packet_check (ha, buf, len, ifindex)) == NULL)
+    return;
+
+  hah = (struct ha_header *) (buf + (iph->ip_hl << 2));
+  if (group->auth == NULL)
+    {
+      ha_packet_accept (ha, group, iph, hah, ifindex, rxt);
+      return;
+    }
+
+  if ((key = ha_auth_key_find (group->auth, hah->key_id)) == NULL)
+    {
+      ha_packet_auth_failed (ha, iph, hah);
+      return;
+    }
+
+  rs = &ha->rx_signed[ha->rx_signed_n++];
+  rs->group = group;
+  rs->key = key;
+  rs->iph = iph;
+  rs->hah = hah;
+  rs->ifindex = ifindex;
+  rs->rxt = *rxt;
+  if (ha->rx_signed_n == HA_AUTH_BATCH)
+    ha_packet_recv_flush (ha);
+}
+
+/* A packet read some other way than off the HA socket, starting with
+   its IP header, still in network order.  It may be held back until
+   ha_packet_recv_flush, as by ha_packet_take. */
+void
+ha_packet_recv (struct ha *ha, u_char *buf, int len, unsigned int ifindex,
+		struct ha_rx_time *rxt)
+{
+  if (ha_packet_ip (buf, len))
+    ha_packet_take (ha, buf, len, ifindex, rxt);
+}
+
+/* A UDP socket gives the HA packet alone.  An IP header is made up in
+   the room left for it in front, in host order as after ha_packet_ip,
+   so that the packet can be taken like any other.  Returns the start
+   of the IP packet. */
+static u_char *
+ha_packet_udp_ip (u_char *data, int len, struct msghdr *msgh)
+{
+  struct sockaddr_in *from = msgh->msg_name;
+  struct ip *iph = (struct ip *) (data - sizeof (struct ip));
+
+  memset (iph, 0, sizeof (struct ip));
+  iph->ip_v = IPVERSION;
+  iph->ip_hl = sizeof (struct ip) >> 2;
+  iph->ip_len = sizeof (struct ip) + len;
+  iph->ip_p = IPPROTO_HA;
+  iph->ip_src = from->sin_addr;
+  return (u_char *) iph;
+}
+
+#ifdef HAVE_RECVMMSG
+void
+ha_recv_batch_free (struct ha *ha)
+{
+  if (ha->rmsgs == NULL)
+    return;
+
+  XFREE (MTYPE_HA_BATCH, ha->rmsgs);
+  XFREE (MTYPE_HA_BATCH, ha->riov);
+  XFREE (MTYPE_HA_BATCH, ha->rbuf);
+  XFREE (MTYPE_HA_BATCH, ha->rcmsg);
+  XFREE (MTYPE_HA_BATCH, ha->rname);
+  ha->rbatch = 0;
+}
+
+/* Set up the buffers for reading a batch of packets with one
+   recvmmsg.  Only the thread reading the socket may change them. */
+void
+ha_recv_batch_alloc (struct ha *ha, int batch)
+{
+  struct msghdr *msgh;
+  int i;
+
+  if (batch == ha->rbatch)
+    return;
+  ha_recv_batch_free (ha);
+
+  ha->rmsgs = XCALLOC (MTYPE_HA_BATCH, batch * sizeof (struct mmsghdr));
+  ha->riov = XCALLOC (MTYPE_HA_BATCH, batch * sizeof (struct iovec));
+  ha->rbuf = XCALLOC (MTYPE_HA_BATCH, batch * HA_RECV_BUFSIZE);
+  ha->rcmsg = XCALLOC (MTYPE_HA_BATCH, batch * HA_RECV_CMSG_SIZE);
+  ha->rname = XCALLOC (MTYPE_HA_BATCH, batch * sizeof (struct sockaddr_in));
+  ha->rbatch = batch;
+
+  for (i = 0; i < batch; i++)
+    {
+      msgh = &ha->rmsgs[i].msg_hdr;
+      msgh->msg_iov = &ha->riov[i];
+      msgh->msg_iovlen = 1;
+      msgh->msg_control = ha->rcmsg + i * HA_RECV_CMSG_SIZE;
+      msgh->msg_name = &ha->rname[i];
+    }
+}
+
+/* Ready the batch for recvmmsg, with packets read to skip bytes into
+   their buffers.  The kernel shrinks the lengths to what it filled
+   in. */
+static void
+ha_recv_batch_reset (struct ha *ha, size_t skip)
+{
+  struct msghdr *msgh;
+  int i;
+
+  for (i = 0; i < ha->rbatch; i++)
+    {
+      ha->riov[i].iov_base = ha->rbuf + i * HA_RECV_BUFSIZE + skip;
+      ha->riov[i].iov_len = HA_RECV_BUFSIZE - skip;
+      msgh = &ha->rmsgs[i].msg_hdr;
+      msgh->msg_controllen = HA_RECV_CMSG_SIZE;
+      msgh->msg_namelen = sizeof (struct sockaddr_in);
+    }
+}
+
+/* Take up to a batch of packets with one system call. */
+static void
+ha_read_mmsg (struct ha *ha)
+{
+  struct msghdr *msgh;
+  struct ha_rx_clock clock;
+  struct ha_rx_time rxt;
+  int i, n;
+
+  ha_recv_batch_reset (ha, 0);
+  n = recvmmsg (ha->fd, ha->rmsgs, ha->rbatch, MSG_DONTWAIT, NULL);
+  if (n < 0)
+    {
+      if (!ERRNO_IO_RETRY (errno))
+	zlog_warn ("ha_read: recvmmsg failed: %s", safe_strerror (errno));
+      return;
+    }
+
+  ha_rx_clock_get (&clock);
+  for (i = 0; i < n; i++)
+    {
+      msgh = &ha->rmsgs[i].msg_hdr;
+      if (msgh->msg_flags & MSG_TRUNC)
+	{
+	  ha->stats.rx_trunc++;
+	  continue;
+	}
+      ha_rx_time_set (&rxt, &clock, ha_packet_stamp (msgh));
+      ha_packet_recv (ha, ha->riov[i].iov_base, ha->rmsgs[i].msg_len,
+		      getsockopt_ifindex (AF_INET, msgh), &rxt);
+    }
+  ha_packet_recv_flush (ha);
+}
+
+/* The same off one of the udp transport's sockets. */
+static void
+ha_read_udp_mmsg (struct ha *ha, int fd)
+{
+  struct msghdr *msgh;
+  struct ha_rx_clock clock;
+  struct ha_rx_time rxt;
+  u_char *buf;
+  int i, n;
+
+  ha_recv_batch_reset (ha, sizeof (struct ip));
+  n = recvmmsg (fd, ha->rmsgs, ha->rbatch, MSG_DONTWAIT, NULL);
+  if (n < 0)
+    {
+      if (!ERRNO_IO_RETRY (errno))
+	zlog_warn ("ha_read_udp: recvmmsg failed: %s", safe_strerror (errno));
+      return;
+    }
+
+  ha_rx_clock_get (&clock);
+  for (i = 0; i < n; i++)
+    {
+      msgh = &ha->rmsgs[i].msg_hdr;
+      if (msgh->msg_flags & MSG_TRUNC)
+	{
+	  ha->stats.rx_trunc++;
+	  continue;
+	}
+      ha_rx_time_set (&rxt, &clock, ha_packet_stamp (msgh));
+      buf = ha_packet_udp_ip (ha->riov[i].iov_base, ha->rmsgs[i].msg_len,
+			      msgh);
+      ha_packet_take (ha, buf, sizeof (struct ip) + ha->rmsgs[i].msg_len,
+		      getsockopt_ifindex (AF_INET, msgh), &rxt);
+    }
+  ha_packet_recv_flush (ha);
+}
+#endif /* HAVE_RECVMMSG */
+
 /* Starting point of packet process function. */
 int
 ha_read (struct thread *thread)
 {
   struct stream *ibuf;
   struct ha *ha;
-  struct interface *ifp;
+  unsigned int ifindex;
+  struct timespec stamp;
+  struct ha_rx_clock clock;
+  struct ha_rx_time rxt;
+  int count;
 
   /* first of all get interface pointer. */
   ha = THREAD_ARG (thread);
 
-  /* prepare for next packet. */
-  ha->t_read = thread_add_read (master, ha_read, ha, ha->fd);
+  /* ha->t_read is persistent, so there is no need to re-arm it.  Take
+     whatever has queued up, but only up to a batch, so a flood cannot
+     keep the rest of the daemon from running. */
+#ifdef HAVE_RECVMMSG
+  if (ha->rbatch)
+    {
+      ha_read_mmsg (ha);
+      return 0;
+    }
+#endif /* HAVE_RECVMMSG */
+
+  for (count = 0; count < ha->hb.read_batch; count++)
+    {
+      stream_reset(ha->ibuf);
+      errno = 0;
+      if (!(ibuf = ha_recv_packet (ha->fd, &ifindex, &stamp, ha->ibuf)))
+        {
+          if (ERRNO_IO_RETRY (errno))
+            break;
+          continue;
+        }
+      ha_rx_clock_get (&clock);
+      ha_rx_time_set (&rxt, &clock, &stamp);
+      /* This raw packet is known to be at least as big as its IP header. */
+      ha_packet_dispatch (ha, STREAM_DATA (ibuf), stream_get_endp (ibuf),
+			  ifindex, &rxt);
+    }
+
+  return 0;
+}
+
+/* The same for the udp transport's sockets, any of them. */
+int
+ha_read_udp (struct thread *thread)
+{
+  struct ha *ha = THREAD_ARG (thread);
+  int fd = THREAD_FD (thread);
+  struct sockaddr_in from;
+  struct iovec iov;
+  union
+  {
+    char buf[HA_RECV_CMSG_SIZE];
+    struct cmsghdr align;
+  } cmsg;
+  struct msghdr msgh;
+  struct ha_rx_clock clock;
+  struct ha_rx_time rxt;
+  u_char *buf;
+  int count, ret;
+
+#ifdef HAVE_RECVMMSG
+  if (ha->rbatch)
+    {
+      ha_read_udp_mmsg (ha, fd);
+      return 0;
+    }
+#endif /* HAVE_RECVMMSG */
+
+  for (count = 0; count < ha->hb.read_batch; count++)
+    {
+      iov.iov_base = STREAM_DATA (ha->ibuf) + sizeof (struct ip);
+      iov.iov_len = HA_MAX_PACKET_SIZE + 1 - sizeof (struct ip);
+      memset (&msgh, 0, sizeof (struct msghdr));
+      msgh.msg_name = &from;
+      msgh.msg_namelen = sizeof (from);
+      msgh.msg_iov = &iov;
+      msgh.msg_iovlen = 1;
+      msgh.msg_control = (caddr_t) cmsg.buf;
+      msgh.msg_controllen = sizeof (cmsg.buf);
+
+      if ((ret = recvmsg (fd, &msgh, 0)) < 0)
+	{
+	  if (ERRNO_IO_RETRY (errno))
+	    break;
+	  zlog_warn ("ha_read_udp: recvmsg failed: %s", safe_strerror (errno));
+	  continue;
+	}
+
+      ha_rx_clock_get (&clock);
+      ha_rx_time_set (&rxt, &clock, ha_packet_stamp (&msgh));
+      buf = ha_packet_udp_ip (iov.iov_base, ret, &msgh);
+      ha_packet_dispatch (ha, buf, sizeof (struct ip) + ret,
+			  getsockopt_ifindex (AF_INET, &msgh), &rxt);
+    }
+
+  return 0;
+}
+
+/* The socket multicast groups are joined on for the transport that is
+   open, -1 if none is.  With udp that is the first shard only,
+   multicast is not sharded. */
+int
+ha_packet_fd (struct ha *ha)
+{
+  if (ha->udp_nshards)
+    return ha->udp_fd[0];
+  return ha->fd;
+}
+
+/* The socket the next hellos go out of.  With udp the shards take
+   turns, a batch each, so hellos don't all queue behind the one send
+   buffer; any of them can send to any destination. */
+static int
+ha_packet_tx_fd (struct ha *ha)
+{
+  if (ha->udp_nshards)
+    return ha->udp_fd[ha->udp_tx];
+  return ha->fd;
+}
+
+/* On to the next shard, after a batch or a full send buffer. */
+static void
+ha_packet_tx_next (struct ha *ha)
+{
+  if (ha->udp_nshards && ++ha->udp_tx == ha->udp_nshards)
+    ha->udp_tx = 0;
+}
+
+/* Where the group's hello goes: with the udp transport, to each of its
+   neighbors if it has any, else to its destination. */
+static int
+ha_hello_ndst (struct ha_group *group)
+{
+  if (group->ha->udp_nshards && group->nunicast)
+    return group->nunicast;
+  return 1;
+}
+
+static struct in_addr
+ha_hello_dst (struct ha_group *group, int i)
+{
+  if (group->ha->udp_nshards && group->nunicast)
+    return group->unicast[i];
+  return group->hb.destination;
+}
+
+static struct ha_header *
+ha_hello_header (struct ha_group *group)
+{
+  return (struct ha_header *) (STREAM_DATA (group->obuf) + sizeof (struct ip));
+}
+
+/* Sign the hello in the group's obuf, which ha_hello_send leaves for
+   when it goes out, so that hellos going out together are signed
+   together. */
+void
+ha_hello_sign (struct ha_group *group)
+{
+  struct ha_header *hah = ha_hello_header (group);
+
+  ha_auth_sign (group->auth, hah, (u_char *) hah + HA_HEADER_SIZE);
+  group->sign_pending = 0;
+}
+
+/* Fill in a message for the group's hello to its i'th destination, to
+   go out of the group's interface wherever that routes.  A UDP socket
+   puts the IP header on itself.  cmsg must have room for
+   HA_SEND_CMSG_SIZE. */
+static void
+ha_packet_msg (struct ha_group *group, int i, struct msghdr *msgh,
+	       struct sockaddr_in *sa, struct iovec *iov, char *cmsg)
+{
+  struct ha *ha = group->ha;
+  struct cmsghdr *cm;
+  struct in_pktinfo *pi;
+
+  memset (sa, 0, sizeof (*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_addr = ha_hello_dst (group, i);
+
+  iov->iov_base = STREAM_DATA (group->obuf);
+  iov->iov_len = stream_get_endp (group->obuf);
+  if (ha->udp_nshards)
+    {
+      sa->sin_port = htons (ha->hb.udp_port);
+      iov->iov_base = (u_char *) iov->iov_base + sizeof (struct ip);
+      iov->iov_len -= sizeof (struct ip);
+    }
+
+  memset (cmsg, 0, HA_SEND_CMSG_SIZE);
+  memset (msgh, 0, sizeof (*msgh));
+  msgh->msg_name = sa;
+  msgh->msg_namelen = sizeof (*sa);
+  msgh->msg_iov = iov;
+  msgh->msg_iovlen = 1;
+  msgh->msg_control = cmsg;
+  msgh->msg_controllen = HA_SEND_CMSG_SIZE;
+  cm = CMSG_FIRSTHDR (msgh);
+  cm->cmsg_level = IPPROTO_IP;
+  cm->cmsg_type = IP_PKTINFO;
+  cm->cmsg_len = CMSG_LEN (sizeof (struct in_pktinfo));
+  pi = (struct in_pktinfo *) CMSG_DATA (cm);
+  pi->ipi_ifindex = group->hb.ifindex;
+}
 
-  stream_reset(ha->ibuf);
-  if (!(ibuf = ha_recv_packet (ha->fd, &ifp, ha->ibuf)))
-    return -1;
-  /* This raw packet is known to be at least as big as its IP header. */
+static void
+ha_packet_send_error (struct ha *ha, struct ha_group *group, int error)
+{
+  ha->stats.tx_err++;
+  if (IS_DEBUG_HA_PACKET (HA_MSG_HELLO - 1, SEND))
+    zlog_debug ("ha_write: group %d: sendmsg: %s", group->id,
+		safe_strerror (error));
+}
+
+/* Done with the group at the head of oi_write_q. */
+static void
+ha_write_q_pop (struct ha *ha)
+{
+  struct listnode *node = listhead (ha->oi_write_q);
+  struct ha_group *group = listgetdata (node);
+
+  list_delete_node (ha->oi_write_q, node);
+  group->on_write_q = 0;
+}
+
+/* Done with one destination of the hello at the head of oi_write_q,
+   and with the hello once it has been to all of them. */
+static void
+ha_write_q_next (struct ha *ha)
+{
+  struct ha_group *group = listgetdata (listhead (ha->oi_write_q));
+
+  if (++group->tx_next < ha_hello_ndst (group))
+    return;
+  group->tx_next = 0;
+  ha_write_q_pop (ha);
+}
+
+#ifdef HAVE_SENDMMSG
+/* Send the queued hellos, a batch to a system call, until every socket
+   they go out of is full. */
+static void
+ha_write_mmsg (struct ha *ha)
+{
+  struct mmsghdr msgs[HA_WRITE_BATCH];
+  struct sockaddr_in sa[HA_WRITE_BATCH];
+  struct iovec iov[HA_WRITE_BATCH];
+  char cmsg[HA_WRITE_BATCH][HA_SEND_CMSG_SIZE];
+  struct ha_auth *auth[HA_WRITE_BATCH];
+  struct ha_header *hah[HA_WRITE_BATCH];
+  struct listnode *node;
+  struct ha_group *group;
+  int i, n, nsign, ret, full = 0;
+
+  while (!list_isempty (ha->oi_write_q))
+    {
+      n = nsign = 0;
+      for (ALL_LIST_ELEMENTS_RO (ha->oi_write_q, node, group))
+	{
+	  if (n == HA_WRITE_BATCH)
+	    break;
+	  /* A group's hello goes to its destinations from where the
+	     last batch left off, as many as there is room for. */
+	  for (i = group->tx_next; i < ha_hello_ndst (group)
+	       && n < HA_WRITE_BATCH; i++, n++)
+	    ha_packet_msg (group, i, &msgs[n].msg_hdr, &sa[n], &iov[n],
+			   cmsg[n]);
+	  if (group->sign_pending)
+	    {
+	      auth[nsign] = group->auth;
+	      hah[nsign++] = ha_hello_header (group);
+	      group->sign_pending = 0;
+	    }
+	}
+      if (nsign)
+	ha_auth_sign_mb (auth, hah, nsign);
+
+      ret = sendmmsg (ha_packet_tx_fd (ha), msgs, n, 0);
+      if (ret < 0)
+	{
+	  /* Try the next shard, and wait for this one once they have all
+	     been found full. */
+	  if (ERRNO_IO_RETRY (errno))
+	    {
+	      if (++full >= MAX (ha->udp_nshards, 1))
+		return;
+	      ha_packet_tx_next (ha);
+	      continue;
+	    }
+
+	  /* The kernel stops at the first hello it can't send, this one
+	     is dropped and the rest tried again. */
+	  ha_packet_send_error (ha, listgetdata (listhead (ha->oi_write_q)),
+				errno);
+	  ha_write_q_next (ha);
+	  continue;
+	}
+
+      for (i = 0; i < ret; i++)
+	{
+	  group = listgetdata (listhead (ha->oi_write_q));
+	  ha->stats.tx++;
+	  group->tx++;
+	  ha_write_q_next (ha);
+	}
+      full = 0;
+      ha_packet_tx_next (ha);
+    }
+}
+#else
+static int
+ha_packet_send (struct ha *ha, struct ha_group *group)
+{
+  struct sockaddr_in sa;
+  struct iovec iov;
+  struct msghdr msgh;
+  char buff [HA_SEND_CMSG_SIZE];
+  int ret;
+
+  if (group->sign_pending)
+    ha_hello_sign (group);
+  ha_packet_msg (group, group->tx_next, &msgh, &sa, &iov, buff);
+
+  ret = sendmsg (ha_packet_tx_fd (ha), &msgh, 0);
+  if (ret < 0)
+    {
+      int save_errno = errno;
+
+      if (!ERRNO_IO_RETRY (save_errno))
+	ha_packet_send_error (ha, group, save_errno);
+      errno = save_errno;
+      return ret;
+    }
+
+  ha->stats.tx++;
+  group->tx++;
+  ha_packet_tx_next (ha);
+  return ret;
+}
+#endif /* HAVE_SENDMMSG */
+
+/* Send the hellos queued on oi_write_q, until the sockets are full,
+   then wait for the one the next hello is to go out of.  Hellos due on
+   the same pass of the thread master have all been queued by the time
+   this runs, so they go out together. */
+int
+ha_write (struct thread *thread)
+{
+  struct ha *ha = THREAD_ARG (thread);
+#ifndef HAVE_SENDMMSG
+  struct listnode *node;
+#endif /* HAVE_SENDMMSG */
+
+  ha->t_write = NULL;
+
+#ifdef HAVE_SENDMMSG
+  ha_write_mmsg (ha);
+#else
+  while ((node = listhead (ha->oi_write_q)) != NULL)
+    {
+      if (ha_packet_send (ha, listgetdata (node)) < 0
+	  && ERRNO_IO_RETRY (errno))
+	break;
+      ha_write_q_next (ha);
+    }
+#endif /* HAVE_SENDMMSG */
+
+  if (!list_isempty (ha->oi_write_q))
+    {
+      ha->t_write = thread_add_write (thread->master, ha_write, ha,
+				      ha_packet_tx_fd (ha));
+      thread_set_priority (ha->t_write, THREAD_PRIO_CRITICAL);
+    }
 
   return 0;
 }
+
+/* Build a hello into the group's obuf, replacing any still waiting to
+   go out, and queue it. */
+void
+ha_hello_send (struct ha_group *group)
+{
+  struct ha *ha = group->ha;
+  struct stream *s = group->obuf;
+  struct ip *iph;
+  struct ha_header *hah;
+  unsigned int size = HA_HELLO_SIZE;
+
+  if (ha->hb.router_id.s_addr == 0 || group->hb.ifindex == 0
+      || ha_packet_fd (ha) < 0)
+    return;
+  if (group->auth)
+    {
+      /* Better not heard than dropped as unsigned. */
+      if (group->auth->send == NULL)
+	return;
+      size += HA_AUTH_DIGEST_SIZE;
+    }
+
+  stream_reset (s);
+  memset (STREAM_DATA (s), 0, HA_HELLO_SIZE);
+
+  /* Source address, id and checksum are left to the kernel. */
+  iph = (struct ip *) STREAM_DATA (s);
+  iph->ip_v = IPVERSION;
+  iph->ip_hl = sizeof (struct ip) >> 2;
+  iph->ip_tos = IPTOS_PREC_INTERNETCONTROL;
+  iph->ip_len = size;
+  iph->ip_ttl = HA_IP_TTL;
+  iph->ip_p = IPPROTO_HA;
+  iph->ip_dst = group->hb.destination;
+  sockopt_iphdrincl_swab_htosys (iph);
+
+  hah = (struct ha_header *) (iph + 1);
+  hah->version = HA_VERSION;
+  hah->type = HA_MSG_HELLO;
+  hah->length = htons (HA_HEADER_SIZE);
+  hah->router_id = ha->hb.router_id;
+  hah->group = group->id;
+  hah->priority = group->hb.priority;
+  hah->auth_type = group->auth ? HA_AUTH_CRYPTOGRAPHIC : HA_AUTH_NULL;
+  hah->key_id = group->auth ? group->auth->send->id : 0;
+  hah->instance = htonl (ha->instance);
+  hah->seq = htonl (++ha->seq[group->id]);
+  hah->interval = htons (group->hb.interval);
+  hah->checksum = in_cksum (hah, HA_HEADER_SIZE);
+  group->sign_pending = group->auth != NULL;
+  group->tx_next = 0;
+
+  stream_forward_endp (s, size);
+
+  if (!group->on_write_q)
+    {
+      listnode_add (ha->oi_write_q, group);
+      group->on_write_q = 1;
+    }
+  if (ha->t_write == NULL)
+    {
+      ha->t_write = thread_add_write (hm->hb_master, ha_write, ha,
+				      ha_packet_tx_fd (ha));
+      thread_set_priority (ha->t_write, THREAD_PRIO_CRITICAL);
+    }
+}
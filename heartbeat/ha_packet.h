@@ -3,17 +3,117 @@
 
 #define HA_MAX_PACKET_SIZE  65535U   /* includes IP Header size. */
 
+/* Packets read per wakeup before yielding to other threads. */
+#define HA_READ_BATCH         32
+#define HA_READ_BATCH_MAX     1024
+
+/* Batched reads take packets up to an ethernet MTU, anything longer
+   is not a heartbeat. */
+#define HA_RECV_BUFSIZE       2048
+#define HA_RECV_CMSG_SIZE     (CMSG_SPACE (sizeof (struct in_pktinfo)) \
+			       + CMSG_SPACE (sizeof (struct timespec)))
+
+/* Longest socket filter ha_packet_filter makes. */
+#define HA_FILTER_MAX         (HA_GROUP_MAX + 16)
+
+/* Hellos handed to the kernel per sendmmsg. */
+#define HA_WRITE_BATCH        64
+#define HA_SEND_CMSG_SIZE     CMSG_SPACE (sizeof (struct in_pktinfo))
+
 /* Default protocol, port number. */
 #ifndef IPPROTO_HA
-#define IPPROTO_HA            0
-#endif /* IPPROTO_HAIGP */
+#define IPPROTO_HA            253	/* RFC 3692 experimentation */
+#endif /* IPPROTO_HA */
 
 /* IP precedence. */
 #ifndef IPTOS_PREC_INTERNETCONTROL
 #define IPTOS_PREC_INTERNETCONTROL	0xC0
 #endif /* IPTOS_PREC_INTERNETCONTROL */
 
+/* HA packet types. */
+#define HA_MSG_HELLO          1
+
+/* HA packet header, following the IP header.  Multi-byte fields are in
+   network byte order. */
+struct ha_header
+{
+  u_char version;		/* HA_VERSION */
+  u_char type;
+  u_int16_t length;		/* of the HA packet, header included */
+  struct in_addr router_id;	/* of the sender */
+  u_char group;
+  u_char priority;
+  u_char auth_type;
+  u_char key_id;		/* with HA_AUTH_CRYPTOGRAPHIC */
+  u_int32_t instance;		/* new each time the sender starts */
+  u_int32_t seq;		/* per sender and group, one up a hello */
+  u_int16_t interval;		/* hello interval, msec */
+  u_int16_t checksum;		/* of the HA packet */
+};
+
+#define HA_HEADER_SIZE        24U
+#define HA_HELLO_SIZE         (sizeof (struct ip) + HA_HEADER_SIZE)
+
+/* With HA_AUTH_CRYPTOGRAPHIC, the HMAC-MD5 of the HA packet follows
+   it, outside its length but inside the IP packet's. */
+#define HA_AUTH_DIGEST_SIZE   16U
+#define HA_HELLO_SIZE_MAX     (HA_HELLO_SIZE + HA_AUTH_DIGEST_SIZE)
+
+/* When a packet came in, going by the kernel's receive stamp rather
+   than by when the heartbeat thread got round to it. */
+struct ha_rx_time
+{
+  struct timeval arrival;		/* relative time */
+  long delay;				/* usec until read, -1 unknown */
+};
+
+/* Longest a receive stamp is believed to be in the past, usec. */
+#define HA_RX_DELAY_MAX       10000000L
+
+/* Wall clock and relative time together, once per read, to turn
+   receive stamps into relative time. */
+struct ha_rx_clock
+{
+  struct timespec real;
+  struct timeval relative;
+};
+
+struct ha;
+struct ha_group;
+struct ha_auth_key;
+
+/* A signed packet held back by ha_packet_recv, everything else about
+   it checked, until its digest is checked along with others. */
+struct ha_rx_signed
+{
+  struct ha_group *group;
+  struct ha_auth_key *key;
+  struct ip *iph;
+  struct ha_header *hah;
+  unsigned int ifindex;
+  struct ha_rx_time rxt;
+};
+
 extern int ha_read (struct thread *);
+extern int ha_read_udp (struct thread *);
+extern int ha_write (struct thread *);
 extern int ha_sock_init (void);
+extern int ha_packet_fd (struct ha *);
+extern void ha_hello_send (struct ha_group *);
+extern void ha_hello_sign (struct ha_group *);
+extern void ha_packet_recv (struct ha *, u_char *, int, unsigned int,
+			    struct ha_rx_time *);
+extern void ha_packet_recv_flush (struct ha *);
+extern void ha_rx_clock_get (struct ha_rx_clock *);
+extern void ha_rx_time_set (struct ha_rx_time *, struct ha_rx_clock *,
+			    struct timespec *);
+#ifdef SO_ATTACH_FILTER
+extern int ha_packet_filter (struct ha *, struct sock_filter *);
+extern void ha_sock_filter_update (struct ha *);
+#endif /* SO_ATTACH_FILTER */
+#ifdef HAVE_RECVMMSG
+extern void ha_recv_batch_alloc (struct ha *, int);
+extern void ha_recv_batch_free (struct ha *);
+#endif /* HAVE_RECVMMSG */
 
 #endif /* _KROUTE_HA_PACKET_H */
@@ -0,0 +1,575 @@
+#include <kroute.h>
+#include <math.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "linklist.h"
+#include "hash.h"
+#include "jhash.h"
+#include "prefix.h"
+#include "if.h"
+#include "stream.h"
+#include "log.h"
+#include "vty.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_peer.h"
+#include "ha_debug.h"
+
+static unsigned int
+ha_peer_hash_key (void *arg)
+{
+  struct ha_peer *peer = arg;
+
+  return jhash_2words (peer->router_id.s_addr, peer->group->id, 0);
+}
+
+static int
+ha_peer_hash_cmp (const void *a, const void *b)
+{
+  const struct ha_peer *p1 = a;
+  const struct ha_peer *p2 = b;
+
+  return p1->router_id.s_addr == p2->router_id.s_addr
+	 && p1->group == p2->group;
+}
+
+struct hash *
+ha_peer_hash_new (void)
+{
+  return hash_create (ha_peer_hash_key, ha_peer_hash_cmp);
+}
+
+static void *
+ha_peer_new (void *arg)
+{
+  struct ha_peer *key = arg;
+  struct ha_peer *peer;
+
+  peer = XCALLOC (MTYPE_HA_PEER, sizeof (struct ha_peer));
+  peer->router_id = key->router_id;
+  peer->group = key->group;
+  peer->state = HA_PEER_DOWN;
+  peer->instance = key->instance;
+  peer->seq = key->seq;
+  return peer;
+}
+
+static void
+ha_peer_free (struct ha_peer *peer)
+{
+  THREAD_TIMER_OFF (peer->t_dead);
+  XFREE (MTYPE_HA_PEER, peer);
+}
+
+const char *
+ha_peer_state_str (struct ha_peer *peer)
+{
+  return peer->state == HA_PEER_UP ? "Up" : "Down";
+}
+
+/* Microseconds between relative times. */
+static long long
+ha_peer_usec_between (struct timeval *then, struct timeval *now)
+{
+  return (now->tv_sec - then->tv_sec) * 1000000LL
+	 + (now->tv_usec - then->tv_usec);
+}
+
+/* Microseconds since a relative time. */
+static long long
+ha_peer_usec_since (struct timeval *then)
+{
+  struct timeval now = recent_relative_time ();
+
+  return ha_peer_usec_between (then, &now);
+}
+
+/* Milliseconds since a relative time. */
+static long
+ha_peer_msec_since (struct timeval *then)
+{
+  return ha_peer_usec_since (then) / 1000;
+}
+
+static void
+ha_peer_arrival_reset (struct ha_peer *peer)
+{
+  peer->arrival_n = 0;
+  peer->arrival_sum = 0;
+  peer->arrival_sumsq = 0;
+}
+
+static void
+ha_peer_gap_reset (struct ha_peer *peer)
+{
+  peer->gap_min = 0;
+  peer->gap_max = 0;
+  peer->gap_sum = 0;
+  peer->gap_count = 0;
+}
+
+/* Into the ring and the phi window, pushing the oldest gap out of the
+   window once it is full. */
+static void
+ha_peer_arrival_add (struct ha_peer *peer, long long usec)
+{
+  u_int32_t old, gap;
+
+  gap = usec < 0 ? 0 : usec > HA_PHI_SAMPLE_MAX ? HA_PHI_SAMPLE_MAX : usec;
+
+  if (peer->arrival_n == HA_PHI_WINDOW)
+    {
+      old = peer->delta[(peer->delta_next - HA_PHI_WINDOW)
+			& (HA_PEER_DELTAS - 1)];
+      peer->arrival_sum -= old;
+      peer->arrival_sumsq -= (u_int64_t) old * old;
+    }
+  else
+    peer->arrival_n++;
+  peer->arrival_sum += gap;
+  peer->arrival_sumsq += (u_int64_t) gap * gap;
+
+  peer->delta[peer->delta_next] = gap;
+  peer->delta_next = (peer->delta_next + 1) & (HA_PEER_DELTAS - 1);
+  if (peer->delta_n < HA_PEER_DELTAS)
+    peer->delta_n++;
+
+  if (peer->gap_count == 0 || gap < peer->gap_min)
+    peer->gap_min = gap;
+  if (gap > peer->gap_max)
+    peer->gap_max = gap;
+  peer->gap_sum += gap;
+  peer->gap_count++;
+}
+
+/* Mean and standard deviation of the window, usec. */
+static void
+ha_peer_arrival_stats (struct ha_peer *peer, double *mean, double *stddev)
+{
+  double n = peer->arrival_n;
+  double var;
+
+  if (peer->arrival_n == 0)
+    {
+      *mean = *stddev = 0;
+      return;
+    }
+
+  *mean = peer->arrival_sum / n;
+  var = peer->arrival_sumsq / n - *mean * *mean;
+  *stddev = var > 0 ? sqrt (var) : 0;
+}
+
+/* The same, for phi, with the floor on the standard deviation.  Zero
+   if there aren't enough gaps in the window to go by. */
+static int
+ha_peer_phi_stats (struct ha_peer *peer, double *mean, double *stddev)
+{
+  if (peer->arrival_n < HA_PHI_MIN_SAMPLES)
+    return 0;
+
+  ha_peer_arrival_stats (peer, mean, stddev);
+  if (*stddev < *mean / HA_PHI_MIN_STDDEV_DIV)
+    *stddev = *mean / HA_PHI_MIN_STDDEV_DIV;
+  return 1;
+}
+
+/* The normal distribution is approximated by a logistic one, as in
+   the phi accrual paper's implementations: a hello not heard y
+   standard deviations past the mean is still to come with probability
+   1 / (1 + e^g(y)), g(y) = y (1.5976 + 0.070566 y^2).  Worked out in
+   a way that neither overflows nor rounds to nothing at either end. */
+#define HA_PHI_A  1.5976
+#define HA_PHI_B  0.070566
+
+static double
+ha_peer_phi_of (double y)
+{
+  double g = y * (HA_PHI_A + HA_PHI_B * y * y);
+
+  if (g >= 0)
+    return (g + log1p (exp (-g))) / M_LN10;
+  return log1p (exp (g)) / M_LN10;
+}
+
+/* Phi for the time since the peer was last heard, or a negative
+   number if there isn't enough to go by yet. */
+static double
+ha_peer_phi (struct ha_peer *peer)
+{
+  double mean, stddev;
+
+  if (!ha_peer_phi_stats (peer, &mean, &stddev))
+    return -1;
+  return ha_peer_phi_of ((ha_peer_usec_since (&peer->last_recv) - mean)
+			 / stddev);
+}
+
+/* The y at which phi reaches the group's threshold, the one real root
+   of B y^3 + A y = L, L = g(y) for the probability 10^-phi.  Only
+   worked out again when the threshold changes. */
+static double
+ha_peer_phi_y (struct ha_group *group)
+{
+  double l, p, q, d;
+
+  if (group->phi_y_threshold != group->hb.phi_threshold)
+    {
+      l = group->hb.phi_threshold * M_LN10
+	  + log1p (-pow (10, -group->hb.phi_threshold));
+      p = HA_PHI_A / HA_PHI_B;
+      q = l / HA_PHI_B;
+      d = sqrt (q * q / 4 + p * p * p / 27);
+      group->phi_y = cbrt (q / 2 + d) + cbrt (q / 2 - d);
+      group->phi_y_threshold = group->hb.phi_threshold;
+    }
+  return group->phi_y;
+}
+
+/* Msec from the last hello to when the peer is down: the fixed dead
+   interval, or with a phi threshold, when phi reaches it, if that
+   comes first. */
+static long
+ha_peer_dead_interval (struct ha_peer *peer)
+{
+  long fixed = (long) peer->interval * peer->group->hb.dead_multiplier;
+  double mean, stddev, usec;
+
+  if (peer->group->hb.phi_threshold == 0
+      || !ha_peer_phi_stats (peer, &mean, &stddev))
+    return fixed;
+
+  usec = mean + ha_peer_phi_y (peer->group) * stddev;
+  if (usec >= fixed * 1000.0)
+    return fixed;
+  return (long) ceil (usec / 1000);
+}
+
+static void
+ha_peer_state_change (struct ha_peer *peer, u_char state)
+{
+  if (peer->state == state)
+    return;
+
+  peer->state = state;
+  peer->last_change = recent_relative_time ();
+  if (state == HA_PEER_UP)
+    {
+      peer->group->peers_up++;
+      zlog_info ("HA group %d: peer %s up", peer->group->id,
+		 inet_ntoa (peer->router_id));
+    }
+  else
+    {
+      peer->group->peers_up--;
+      peer->down++;
+      if (peer->group->hb.phi_threshold
+	  && peer->arrival_n >= HA_PHI_MIN_SAMPLES)
+	zlog_warn ("HA group %d: peer %s down, nothing heard for %ldms, "
+		   "phi %.1f", peer->group->id, inet_ntoa (peer->router_id),
+		   ha_peer_msec_since (&peer->last_recv), ha_peer_phi (peer));
+      else
+	zlog_warn ("HA group %d: peer %s down, nothing heard for %ldms",
+		   peer->group->id, inet_ntoa (peer->router_id),
+		   ha_peer_msec_since (&peer->last_recv));
+      ha_peer_arrival_reset (peer);
+    }
+}
+
+/* The dead timer is not moved on for every hello.  When it fires it
+   goes back to sleep for whatever is left of the dead interval since
+   the last one, and only if that is nothing is the peer down. */
+static int
+ha_peer_dead_timer (struct thread *thread)
+{
+  struct ha_peer *peer = THREAD_ARG (thread);
+  long left;
+
+  peer->t_dead = NULL;
+
+  left = ha_peer_dead_interval (peer) - ha_peer_msec_since (&peer->last_recv);
+  if (left > 0)
+    {
+      peer->t_dead = thread_add_timer_msec (thread->master, ha_peer_dead_timer,
+					    peer, left);
+      thread_set_priority (peer->t_dead, THREAD_PRIO_CRITICAL);
+      return 0;
+    }
+
+  ha_peer_state_change (peer, HA_PEER_DOWN);
+  return 0;
+}
+
+static void
+ha_peer_dead_timer_on (struct ha_peer *peer)
+{
+  THREAD_TIMER_OFF (peer->t_dead);
+  peer->t_dead = thread_add_timer_msec (hm->hb_master, ha_peer_dead_timer,
+					peer, ha_peer_dead_interval (peer));
+  thread_set_priority (peer->t_dead, THREAD_PRIO_CRITICAL);
+}
+
+/* A hello that got through ha_read's checks. */
+void
+ha_peer_hello_recv (struct ha *ha, struct ha_group *group, struct ip *iph,
+		    struct ha_header *hah, unsigned int ifindex,
+		    struct ha_rx_time *rxt)
+{
+  struct ha_peer key, *peer;
+  u_int32_t instance = ntohl (hah->instance);
+  u_int32_t seq = ntohl (hah->seq);
+  u_int32_t interval = ntohs (hah->interval);
+  int32_t diff;
+  long long gap, off;
+  int steady;
+
+  /* A new peer's sequence numbers start with this hello. */
+  key.router_id = hah->router_id;
+  key.group = group;
+  key.instance = instance;
+  key.seq = seq - 1;
+  peer = hash_get (ha->peers, &key, ha_peer_new);
+
+  /* Whether the gap since the last hello says anything. */
+  steady = (peer->state == HA_PEER_UP && peer->instance == instance
+	    && peer->interval == interval);
+
+  if (peer->instance != instance)
+    {
+      /* Restarted, its sequence numbers start over. */
+      peer->instance = instance;
+      peer->seq = seq - 1;
+      peer->restarts++;
+      ha_peer_arrival_reset (peer);
+    }
+
+  diff = (int32_t) (seq - peer->seq);
+  if (diff <= 0)
+    {
+      if (diff == 0)
+	peer->duplicate++;
+      else
+	peer->reordered++;
+      if (IS_DEBUG_HA_PACKET (HA_MSG_HELLO - 1, RECV))
+	zlog_debug ("HA group %d: peer %s seq %u, expected %u",
+		    group->id, inet_ntoa (peer->router_id), seq,
+		    peer->seq + 1);
+      return;
+    }
+  peer->lost += diff - 1;
+  peer->seq = seq;
+
+  peer->rx++;
+  group->rx++;
+  peer->addr = iph->ip_src;
+  peer->ifindex = ifindex;
+  peer->priority = hah->priority;
+
+  /* Only gaps at the interval it is sending at now go in the window. */
+  if (peer->interval != interval)
+    {
+      ha_peer_arrival_reset (peer);
+      ha_peer_gap_reset (peer);
+    }
+  else if (steady)
+    {
+      gap = ha_peer_usec_between (&peer->last_recv, &rxt->arrival);
+      ha_peer_arrival_add (peer, gap);
+      /* The timer was set for the fixed dead interval, the phi one is
+	 likely to be shorter. */
+      if (peer->arrival_n == HA_PHI_MIN_SAMPLES)
+	THREAD_TIMER_OFF (peer->t_dead);
+
+      off = gap - (long long) diff * interval * 1000;
+      if (off < 0)
+	off = -off;
+      peer->jitter += (off - peer->jitter) / 16;
+    }
+  if (rxt->delay >= 0)
+    {
+      peer->rx_delay += (rxt->delay - peer->rx_delay) / 16;
+      if (rxt->delay > peer->rx_delay_max)
+	peer->rx_delay_max = rxt->delay;
+    }
+  peer->last_recv = rxt->arrival;
+
+  if (peer->interval != interval || peer->t_dead == NULL)
+    {
+      peer->interval = interval;
+      ha_peer_dead_timer_on (peer);
+    }
+
+  ha_peer_state_change (peer, HA_PEER_UP);
+}
+
+static void
+ha_peer_group_clean_one (struct hash_backet *backet, void *arg)
+{
+  struct ha *ha = ((void **) arg)[0];
+  struct ha_group *group = ((void **) arg)[1];
+  struct ha_peer *peer = backet->data;
+
+  if (peer->group != group)
+    return;
+
+  hash_release (ha->peers, peer);
+  ha_peer_free (peer);
+}
+
+/* Forget the peers of a group that is going away. */
+void
+ha_peer_group_clean (struct ha *ha, struct ha_group *group)
+{
+  void *arg[2] = { ha, group };
+
+  hash_iterate (ha->peers, ha_peer_group_clean_one, arg);
+  group->peers_up = 0;
+}
+
+static void
+ha_peer_show_collect (struct hash_backet *backet, void *arg)
+{
+  struct ha_peer ***next = arg;
+
+  *(*next)++ = backet->data;
+}
+
+static int
+ha_peer_show_cmp (const void *a, const void *b)
+{
+  const struct ha_peer *p1 = *(struct ha_peer * const *) a;
+  const struct ha_peer *p2 = *(struct ha_peer * const *) b;
+
+  if (p1->group->id != p2->group->id)
+    return p1->group->id < p2->group->id ? -1 : 1;
+  if (p1->router_id.s_addr != p2->router_id.s_addr)
+    return ntohl (p1->router_id.s_addr) < ntohl (p2->router_id.s_addr)
+	   ? -1 : 1;
+  return 0;
+}
+
+static void
+ha_peer_show_detail (struct vty *vty, struct ha_peer *peer)
+{
+  double mean, stddev;
+  char addr[INET_ADDRSTRLEN];
+
+  ha_peer_arrival_stats (peer, &mean, &stddev);
+  inet_ntop (AF_INET, &peer->addr, addr, sizeof (addr));
+
+  vty_out (vty, " Peer %s, group %d, %s for %lds, address %s%s",
+	   inet_ntoa (peer->router_id), peer->group->id,
+	   ha_peer_state_str (peer), ha_peer_msec_since (&peer->last_change)
+	   / 1000, addr, VTY_NEWLINE);
+  vty_out (vty, "   Hello interval %ums, last heard %ldms ago",
+	   peer->interval, ha_peer_msec_since (&peer->last_recv));
+  if (peer->arrival_n >= HA_PHI_MIN_SAMPLES)
+    vty_out (vty, ", phi %.2f", ha_peer_phi (peer));
+  vty_out (vty, "%s", VTY_NEWLINE);
+  vty_out (vty, "   Gaps: %u in window, mean %.3fms, stddev %.3fms, "
+	   "jitter %.3fms%s", peer->arrival_n, mean / 1000, stddev / 1000,
+	   peer->jitter / 1000.0, VTY_NEWLINE);
+  vty_out (vty, "   Gaps: %lu at this interval, min %.3fms, average %.3fms, "
+	   "max %.3fms%s", peer->gap_count, peer->gap_min / 1000.0,
+	   peer->gap_count ? peer->gap_sum / 1000.0 / peer->gap_count : 0.0,
+	   peer->gap_max / 1000.0, VTY_NEWLINE);
+  vty_out (vty, "   Receive delay %.3fms average, %.3fms most%s",
+	   peer->rx_delay / 1000.0, peer->rx_delay_max / 1000.0, VTY_NEWLINE);
+  vty_out (vty, "   Sent %lu, received %lu, lost %lu (%.2f%%), duplicate %lu, "
+	   "reordered %lu%s", peer->group->tx, peer->rx, peer->lost,
+	   peer->rx + peer->lost
+	   ? 100.0 * peer->lost / (peer->rx + peer->lost) : 0.0,
+	   peer->duplicate, peer->reordered, VTY_NEWLINE);
+  vty_out (vty, "   Restarts %lu, down %lu%s", peer->restarts, peer->down,
+	   VTY_NEWLINE);
+}
+
+/* The peers by group and router id, with what failure detection makes
+   of them.  On the heartbeat thread, through ha_hb_call_wait, so the
+   main thread is waiting and its vty is ours to write to. */
+int
+ha_peer_show (struct vty *vty, struct ha *ha, int detail)
+{
+  struct ha_peer **peers, **next, *peer;
+  unsigned long i, count = ha->peers->count;
+  double mean, stddev;
+  char addr[INET_ADDRSTRLEN];
+  char phi[16];
+
+  if (count == 0)
+    return 0;
+
+  peers = next = XCALLOC (MTYPE_TMP, count * sizeof (struct ha_peer *));
+  hash_iterate (ha->peers, ha_peer_show_collect, &next);
+  qsort (peers, count, sizeof (struct ha_peer *), ha_peer_show_cmp);
+
+  if (detail)
+    {
+      for (i = 0; i < count; i++)
+	ha_peer_show_detail (vty, peers[i]);
+      XFREE (MTYPE_TMP, peers);
+      return 0;
+    }
+
+  vty_out (vty, "Router ID       Group State Address         Interval "
+	   "Samples    Mean  Stddev   Heard     Phi   Received   Lost  "
+	   "Stale%s", VTY_NEWLINE);
+
+  for (i = 0; i < count; i++)
+    {
+      peer = peers[i];
+      ha_peer_arrival_stats (peer, &mean, &stddev);
+      if (peer->arrival_n >= HA_PHI_MIN_SAMPLES)
+	snprintf (phi, sizeof (phi), "%7.2f", ha_peer_phi (peer));
+      else
+	snprintf (phi, sizeof (phi), "%7s", "-");
+
+      inet_ntop (AF_INET, &peer->addr, addr, sizeof (addr));
+      vty_out (vty, "%-15s %5d %-5s %-15s %6ums %7u %5.1fms %4.1fms "
+	       "%5ldms %s %10lu %6lu %6lu%s",
+	       inet_ntoa (peer->router_id), peer->group->id,
+	       ha_peer_state_str (peer), addr, peer->interval,
+	       peer->arrival_n, mean / 1000, stddev / 1000,
+	       ha_peer_msec_since (&peer->last_recv), phi, peer->rx,
+	       peer->lost, peer->duplicate + peer->reordered, VTY_NEWLINE);
+    }
+
+  XFREE (MTYPE_TMP, peers);
+  return 0;
+}
+
+/* One router, in each group it is a peer in, with the gaps in its
+   ring, newest first. */
+int
+ha_peer_show_one (struct vty *vty, struct ha *ha, struct in_addr router_id)
+{
+  struct ha_peer key, *peer;
+  struct ha_group *group;
+  unsigned int i;
+  int id, found = 0;
+
+  key.router_id = router_id;
+  for (id = 1; id <= HA_GROUP_MAX; id++)
+    {
+      if ((group = ha->hb_group[id]) == NULL)
+	continue;
+      key.group = group;
+      if ((peer = hash_lookup (ha->peers, &key)) == NULL)
+	continue;
+      found = 1;
+
+      ha_peer_show_detail (vty, peer);
+      vty_out (vty, "   Last %u gaps, msec, newest first:", peer->delta_n);
+      for (i = 0; i < peer->delta_n; i++)
+	vty_out (vty, "%s%9.3f", i % 8 ? "" : VTY_NEWLINE,
+		 peer->delta[(peer->delta_next - 1 - i) & (HA_PEER_DELTAS - 1)]
+		 / 1000.0);
+      vty_out (vty, "%s", VTY_NEWLINE);
+    }
+
+  if (!found)
+    vty_out (vty, "No peer %s%s", inet_ntoa (router_id), VTY_NEWLINE);
+  return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _KROUTE_HA_PEER_H
+#define _KROUTE_HA_PEER_H
+
+/* Phi accrual failure detection.  The last HA_PHI_WINDOW gaps between
+   hellos give the mean and spread the next one is expected with, and
+   phi is how unlikely it is, -log10, that it is still on its way.
+   Until there are HA_PHI_MIN_SAMPLES the fixed dead interval is used,
+   and the spread is taken to be at least 1/HA_PHI_MIN_STDDEV_DIV of
+   the mean, so that a peer that has been very regular isn't down the
+   moment it is a little late. */
+#define HA_PHI_WINDOW         128
+#define HA_PHI_MIN_SAMPLES    4
+#define HA_PHI_MIN_STDDEV_DIV 4
+#define HA_PHI_SAMPLE_MAX     (1U << 28)	/* usec, keeps the sums exact */
+
+/* Gaps between hellos kept per peer, for statistics.  A power of two,
+   and at least HA_PHI_WINDOW, the phi window being the newest of
+   them. */
+#define HA_PEER_DELTAS        1024
+
+/* A router heard from, in a group it sends hellos for.  Peers live
+   in ha->peers, keyed by router id and group, so a router in several
+   groups is a peer in each of them.  Only the heartbeat thread touches
+   them. */
+struct ha_peer
+{
+  struct in_addr router_id;
+  struct ha_group *group;
+  struct in_addr addr;			/* source of the last hello */
+  unsigned int ifindex;
+
+  u_char state;
+#define HA_PEER_DOWN          0
+#define HA_PEER_UP            1
+  u_char priority;
+
+  /* From its last hello. */
+  u_int32_t instance;
+  u_int32_t seq;
+  u_int32_t interval;			/* msec */
+
+  struct timeval last_recv;		/* relative time */
+  struct timeval last_change;
+  struct thread *t_dead;
+
+  /* Gaps between in order hellos while up, usec, oldest first from
+     delta_next once all HA_PEER_DELTAS are in.  The newest arrival_n
+     of them are the phi window, whose sums are kept as gaps go in and
+     out, so the mean and variance come cheap. */
+  u_int32_t delta[HA_PEER_DELTAS];
+  unsigned int delta_n;
+  unsigned int delta_next;
+  unsigned int arrival_n;
+  u_int64_t arrival_sum;
+  u_int64_t arrival_sumsq;
+
+  /* Every gap since it started sending at this interval, usec. */
+  u_int32_t gap_min;
+  u_int32_t gap_max;
+  u_int64_t gap_sum;
+  unsigned long gap_count;
+
+  /* From receive stamps, usec.  Jitter is how far gaps are off what
+     the interval and sequence numbers say they should be, smoothed the
+     way RFC 3550 does it; delay is from the stamp to our reading the
+     packet, so that is ours, not the network's. */
+  long jitter;
+  long rx_delay;
+  long rx_delay_max;
+
+  /* Counters. */
+  unsigned long rx;
+  unsigned long lost;			/* gaps in seq */
+  unsigned long duplicate;
+  unsigned long reordered;		/* behind the newest seq */
+  unsigned long restarts;
+  unsigned long down;
+};
+
+struct vty;
+
+/* Prototypes. */
+extern struct hash *ha_peer_hash_new (void);
+extern void ha_peer_hello_recv (struct ha *, struct ha_group *,
+				struct ip *, struct ha_header *,
+				unsigned int ifindex, struct ha_rx_time *);
+extern void ha_peer_group_clean (struct ha *, struct ha_group *);
+extern const char *ha_peer_state_str (struct ha_peer *);
+extern int ha_peer_show (struct vty *, struct ha *, int detail);
+extern int ha_peer_show_one (struct vty *, struct ha *, struct in_addr);
+
+#endif /* _KROUTE_HA_PEER_H */
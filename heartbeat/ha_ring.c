@@ -0,0 +1,248 @@
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "linklist.h"
+#include "prefix.h"
+#include "if.h"
+#include "stream.h"
+#include "log.h"
+#include "checksum.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_ring.h"
+#include "ha_debug.h"
+
+#ifdef HAVE_TPACKET_V3
+/* Only what comes in, and only IPv4 HA packets, and of those only
+   what the HA socket would let through.  The packet socket is
+   SOCK_DGRAM, so offsets are from the IP header. */
+static int
+ha_ring_install_filter (struct ha *ha, int sock)
+{
+  struct sock_filter filter[HA_FILTER_MAX + 16] = {
+    /* 0: ldb pkttype              */
+    BPF_STMT(BPF_LD|BPF_ABS|BPF_B, SKF_AD_OFF + SKF_AD_PKTTYPE),
+    /* 1: jeq OUTGOING jt 2 jf 3   */
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, 0, 1),
+    /* 2: ret 0                    */
+    BPF_STMT(BPF_RET|BPF_K, 0),
+    /* 3: ldb [0]                  */
+    BPF_STMT(BPF_LD|BPF_ABS|BPF_B, 0),
+    /* 4: and #0xf0                */
+    BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xf0),
+    /* 5: jeq 0x40 jt 7 jf 6       */
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x40, 1, 0),
+    /* 6: ret 0                    */
+    BPF_STMT(BPF_RET|BPF_K, 0),
+    /* 7: ldb [9]                  */
+    BPF_STMT(BPF_LD|BPF_ABS|BPF_B, offsetof (struct ip, ip_p)),
+    /* 8: jeq IPPROTO_HA jt 10 jf 9 */
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_HA, 1, 0),
+    /* 9: ret 0                    */
+    BPF_STMT(BPF_RET|BPF_K, 0),
+    /* 10: ha_packet_filter        */
+  };
+
+  struct sock_fprog prog = {
+    .len = 10,
+    .filter = filter,
+  };
+
+  prog.len += ha_packet_filter (ha, filter + prog.len);
+  return setsockopt (sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+void
+ha_ring_filter_update (struct ha *ha)
+{
+  if (ha_ring_install_filter (ha, ha->ring_fd) < 0)
+    zlog_warn ("HA ring: can't install filter: %s", safe_strerror (errno));
+}
+
+/* While the ring is on, the HA socket is for sending only. */
+static void
+ha_ring_sock_mute (int sock)
+{
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_RET|BPF_K, 0),
+  };
+
+  struct sock_fprog prog = {
+    .len = sizeof(filter) / sizeof(filter[0]),
+    .filter = filter,
+  };
+
+  if (setsockopt (sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    zlog_warn ("HA socket: can't install filter: %s", safe_strerror (errno));
+}
+
+/* A frame from the ring.  The kernel has not looked at the IP header
+   yet, and the frame may carry link layer padding after it. */
+static void
+ha_ring_packet (struct ha *ha, struct tpacket3_hdr *tph,
+		struct ha_rx_clock *clock)
+{
+  struct sockaddr_ll *sll;
+  struct ip *iph;
+  struct timespec stamp;
+  struct ha_rx_time rxt;
+  unsigned int len, ip_len;
+
+  if (tph->tp_snaplen < tph->tp_len)
+    {
+      ha->stats.rx_trunc++;
+      return;
+    }
+
+  iph = (struct ip *) ((u_char *) tph + tph->tp_net);
+  len = tph->tp_snaplen;
+  if (len < sizeof (struct ip) || len < (unsigned int) (iph->ip_hl << 2)
+      || in_cksum (iph, iph->ip_hl << 2) != 0)
+    {
+      ha->stats.rx_short++;
+      return;
+    }
+  ip_len = ntohs (iph->ip_len);
+  if (ip_len < len)
+    len = ip_len;
+
+  sll = (struct sockaddr_ll *) ((u_char *) tph
+				+ TPACKET_ALIGN (sizeof (struct tpacket3_hdr)));
+  stamp.tv_sec = tph->tp_sec;
+  stamp.tv_nsec = tph->tp_nsec;
+  ha_rx_time_set (&rxt, clock, &stamp);
+  ha_packet_recv (ha, (u_char *) iph, len, sll->sll_ifindex, &rxt);
+}
+
+/* Take every block the kernel has handed over, oldest first, parsing
+   the frames where they are, and give them all back. */
+static int
+ha_ring_read (struct thread *thread)
+{
+  struct ha *ha = THREAD_ARG (thread);
+  struct tpacket_block_desc *bd;
+  struct tpacket3_hdr *tph;
+  struct ha_rx_clock clock;
+  unsigned int i, n;
+
+  /* For the frames' receive stamps. */
+  ha_rx_clock_get (&clock);
+  for (n = 0; n < HA_RING_BLOCK_NR; n++)
+    {
+      bd = (struct tpacket_block_desc *)
+	(ha->ring + ha->ring_block * HA_RING_BLOCK_SIZE);
+      if (!(__atomic_load_n (&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+	    & TP_STATUS_USER))
+	break;
+
+      tph = (struct tpacket3_hdr *) ((u_char *) bd
+				     + bd->hdr.bh1.offset_to_first_pkt);
+      for (i = 0; i < bd->hdr.bh1.num_pkts; i++)
+	{
+	  ha_ring_packet (ha, tph, &clock);
+	  tph = (struct tpacket3_hdr *) ((u_char *) tph + tph->tp_next_offset);
+	}
+      /* Signed frames held back are still in the block. */
+      ha_packet_recv_flush (ha);
+
+      __atomic_store_n (&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			__ATOMIC_RELEASE);
+      ha->ring_block = (ha->ring_block + 1) % HA_RING_BLOCK_NR;
+    }
+
+  if (n)
+    ha->stats.rx_blocks += n;
+  return 0;
+}
+
+/* Take HA packets from a TPACKET_V3 ring on a packet socket rather
+   than copying them out of the HA socket.  Heartbeat thread only. */
+int
+ha_ring_open (struct ha *ha)
+{
+  struct tpacket_req3 req;
+  struct sockaddr_ll sll;
+  int sock, version = TPACKET_V3;
+  size_t size = (size_t) HA_RING_BLOCK_SIZE * HA_RING_BLOCK_NR;
+  void *ring;
+
+  if (ha->ring)
+    return 0;
+
+  /* No protocol yet, nothing comes in before the filter is on. */
+  if ((sock = socket (AF_PACKET, SOCK_DGRAM, 0)) < 0)
+    {
+      zlog_warn ("HA ring: socket: %s", safe_strerror (errno));
+      return -1;
+    }
+
+  memset (&req, 0, sizeof (req));
+  req.tp_block_size = HA_RING_BLOCK_SIZE;
+  req.tp_block_nr = HA_RING_BLOCK_NR;
+  req.tp_frame_size = HA_RING_FRAME_SIZE;
+  req.tp_frame_nr = size / HA_RING_FRAME_SIZE;
+  req.tp_retire_blk_tov = HA_RING_BLOCK_TOV;
+
+  if (setsockopt (sock, SOL_PACKET, PACKET_VERSION, &version,
+		  sizeof (version)) < 0
+      || setsockopt (sock, SOL_PACKET, PACKET_RX_RING, &req,
+		     sizeof (req)) < 0
+      || ha_ring_install_filter (ha, sock) < 0)
+    {
+      zlog_warn ("HA ring: can't set up: %s", safe_strerror (errno));
+      close (sock);
+      return -1;
+    }
+
+  ring = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+  if (ring == MAP_FAILED)
+    {
+      zlog_warn ("HA ring: mmap: %s", safe_strerror (errno));
+      close (sock);
+      return -1;
+    }
+
+  memset (&sll, 0, sizeof (sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons (ETH_P_IP);
+  if (bind (sock, (struct sockaddr *) &sll, sizeof (sll)) < 0)
+    {
+      zlog_warn ("HA ring: bind: %s", safe_strerror (errno));
+      munmap (ring, size);
+      close (sock);
+      return -1;
+    }
+
+  ha->ring_fd = sock;
+  ha->ring = ring;
+  ha->ring_block = 0;
+  ha_ring_sock_mute (ha->fd);
+
+  ha->t_ring = thread_add_read_persist (hm->hb_master, ha_ring_read, ha,
+					ha->ring_fd);
+  thread_set_priority (ha->t_ring, THREAD_PRIO_CRITICAL);
+
+  if (IS_DEBUG_HA (kroute, KROUTE_INTERFACE))
+    zlog_debug ("HA ring: %d blocks of %d bytes", HA_RING_BLOCK_NR,
+		HA_RING_BLOCK_SIZE);
+  return 0;
+}
+
+/* Back to reading the HA socket. */
+void
+ha_ring_close (struct ha *ha)
+{
+  if (ha->ring == NULL)
+    return;
+
+  THREAD_READ_OFF (ha->t_ring);
+  munmap (ha->ring, (size_t) HA_RING_BLOCK_SIZE * HA_RING_BLOCK_NR);
+  close (ha->ring_fd);
+  ha->ring = NULL;
+  ha->ring_fd = -1;
+
+  ha_sock_filter_update (ha);
+}
+#endif /* HAVE_TPACKET_V3 */
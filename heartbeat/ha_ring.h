@@ -0,0 +1,20 @@
+#ifndef _KROUTE_HA_RING_H
+#define _KROUTE_HA_RING_H
+
+/* Receive ring geometry.  Blocks must be a multiple of the page size,
+   and a block is handed over once full, or after HA_RING_BLOCK_TOV
+   msec with anything in it. */
+#define HA_RING_BLOCK_SIZE    (1 << 16)
+#define HA_RING_BLOCK_NR      64
+#define HA_RING_FRAME_SIZE    2048
+#define HA_RING_BLOCK_TOV     1
+
+struct ha;
+
+#ifdef HAVE_TPACKET_V3
+extern int ha_ring_open (struct ha *);
+extern void ha_ring_close (struct ha *);
+extern void ha_ring_filter_update (struct ha *);
+#endif /* HAVE_TPACKET_V3 */
+
+#endif /* _KROUTE_HA_RING_H */
@@ -0,0 +1,186 @@
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "linklist.h"
+#include "hash.h"
+#include "prefix.h"
+#include "if.h"
+#include "stream.h"
+#include "log.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_peer.h"
+#include "ha_stats.h"
+#include "ha_debug.h"
+
+#if HA_STATS_DELTAS != HA_PEER_DELTAS
+#error "HA_STATS_DELTAS must match HA_PEER_DELTAS"
+#endif
+
+static size_t
+ha_stats_size (u_int32_t capacity)
+{
+  return sizeof (struct ha_stats_shm)
+	 + (size_t) capacity * sizeof (struct ha_stats_shm_peer);
+}
+
+/* Room for at least npeers, doubling. */
+static int
+ha_stats_grow (struct ha *ha, unsigned long npeers)
+{
+  struct ha_stats_shm *shm;
+  u_int32_t capacity;
+  size_t size;
+
+  capacity = ha->stats_shm ? ha->stats_shm->capacity : HA_STATS_PEERS_MIN;
+  while (capacity < npeers)
+    capacity *= 2;
+  if (ha->stats_shm && capacity == ha->stats_shm->capacity)
+    return 0;
+
+  size = ha_stats_size (capacity);
+  if (ftruncate (ha->stats_fd, size) < 0)
+    {
+      zlog_warn ("HA stats export: ftruncate: %s", safe_strerror (errno));
+      return -1;
+    }
+  shm = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ha->stats_fd, 0);
+  if (shm == MAP_FAILED)
+    {
+      zlog_warn ("HA stats export: mmap: %s", safe_strerror (errno));
+      return -1;
+    }
+
+  /* A reader still on the old mapping sees the same header. */
+  if (ha->stats_shm)
+    munmap (ha->stats_shm, ha->stats_size);
+  else
+    {
+      shm->magic = HA_STATS_MAGIC;
+      shm->version = HA_STATS_VERSION;
+    }
+  shm->capacity = capacity;
+  __atomic_store_n (&shm->size, size, __ATOMIC_RELEASE);
+  ha->stats_shm = shm;
+  ha->stats_size = size;
+  return 0;
+}
+
+static void
+ha_stats_peer (struct ha_stats_shm_peer *sp, struct ha_peer *peer)
+{
+  struct timeval now = recent_relative_time ();
+
+  sp->router_id = peer->router_id.s_addr;
+  sp->addr = peer->addr.s_addr;
+  sp->group = peer->group->id;
+  sp->state = peer->state;
+  sp->priority = peer->priority;
+  sp->interval = peer->interval;
+  sp->last_heard = (now.tv_sec - peer->last_recv.tv_sec) * 1000
+		   + (now.tv_usec - peer->last_recv.tv_usec) / 1000;
+
+  sp->sent = peer->group->tx;
+  sp->rx = peer->rx;
+  sp->lost = peer->lost;
+  sp->duplicate = peer->duplicate;
+  sp->reordered = peer->reordered;
+  sp->restarts = peer->restarts;
+  sp->down = peer->down;
+
+  sp->gap_min = peer->gap_min;
+  sp->gap_max = peer->gap_max;
+  sp->gap_sum = peer->gap_sum;
+  sp->gap_count = peer->gap_count;
+  sp->jitter = peer->jitter;
+  sp->rx_delay = peer->rx_delay;
+  sp->rx_delay_max = peer->rx_delay_max;
+
+  sp->delta_n = peer->delta_n;
+  sp->delta_next = peer->delta_next;
+  memcpy (sp->delta, peer->delta, sizeof (sp->delta));
+}
+
+static void
+ha_stats_peer_one (struct hash_backet *backet, void *arg)
+{
+  struct ha_stats_shm *shm = arg;
+
+  ha_stats_peer (&shm->peer[shm->npeers++], backet->data);
+}
+
+/* Write a snapshot, under the sequence count. */
+static int
+ha_stats_export_timer (struct thread *thread)
+{
+  struct ha *ha = THREAD_ARG (thread);
+  struct ha_stats_shm *shm;
+  struct timeval tv;
+  u_int32_t seq;
+
+  ha->t_stats = thread_add_timer_msec (thread->master, ha_stats_export_timer,
+				       ha, ha->hb.stats_export);
+
+  if (ha_stats_grow (ha, ha->peers->count) < 0)
+    return 0;
+  shm = ha->stats_shm;
+
+  seq = shm->seq;
+  __atomic_store_n (&shm->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  shm->npeers = 0;
+  hash_iterate (ha->peers, ha_stats_peer_one, shm);
+  shm->interval = ha->hb.stats_export;
+  bane_gettime (BANE_CLK_REALTIME, &tv);
+  shm->updated = tv.tv_sec * 1000000ULL + tv.tv_usec;
+
+  __atomic_store_n (&shm->seq, seq + 2, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Start exporting, or carry on at ha->hb.stats_export.  Heartbeat
+   thread only. */
+void
+ha_stats_export_start (struct ha *ha)
+{
+  THREAD_TIMER_OFF (ha->t_stats);
+
+  if (ha->stats_fd < 0)
+    {
+      ha->stats_fd = shm_open (HA_STATS_SHM_NAME, O_RDWR | O_CREAT | O_TRUNC,
+			       0644);
+      if (ha->stats_fd < 0)
+	{
+	  zlog_warn ("HA stats export: shm_open %s: %s", HA_STATS_SHM_NAME,
+		     safe_strerror (errno));
+	  return;
+	}
+      if (ha_stats_grow (ha, 0) < 0)
+	{
+	  ha_stats_export_stop (ha);
+	  return;
+	}
+    }
+
+  ha->t_stats = thread_add_timer_msec (hm->hb_master, ha_stats_export_timer,
+				       ha, 0);
+}
+
+void
+ha_stats_export_stop (struct ha *ha)
+{
+  THREAD_TIMER_OFF (ha->t_stats);
+  if (ha->stats_shm)
+    munmap (ha->stats_shm, ha->stats_size);
+  ha->stats_shm = NULL;
+  ha->stats_size = 0;
+  if (ha->stats_fd >= 0)
+    {
+      close (ha->stats_fd);
+      shm_unlink (HA_STATS_SHM_NAME);
+    }
+  ha->stats_fd = -1;
+}
@@ -0,0 +1,73 @@
+#ifndef _KROUTE_HA_STATS_H
+#define _KROUTE_HA_STATS_H
+
+/* Peer statistics, exported as a snapshot in POSIX shared memory, so
+   monitoring can read them without asking the daemon.  The heartbeat
+   thread rewrites the snapshot every interval; readers take a copy
+   between two reads of seq, and try again if it was odd or moved.
+
+   The mapping only grows.  A reader whose mapping is shorter than
+   size maps it again.  A router in several groups has an entry for
+   each of them.  Times are usec unless said otherwise, and
+   addresses are in network order. */
+#define HA_STATS_SHM_NAME     "/ha_deamon.stats"
+#define HA_STATS_MAGIC        0x48415354	/* "HAST" */
+#define HA_STATS_VERSION      1
+#define HA_STATS_PEERS_MIN    64
+#define HA_STATS_DELTAS       1024	/* HA_PEER_DELTAS */
+
+#define HA_STATS_EXPORT_INTERVAL_DEFAULT 1000	/* msec */
+
+struct ha_stats_shm_peer
+{
+  u_int32_t router_id;
+  u_int32_t addr;
+  u_char group;
+  u_char state;
+  u_char priority;
+  u_char reserved;
+  u_int32_t interval;			/* msec */
+  u_int32_t last_heard;			/* msec ago */
+
+  u_int64_t sent;			/* by us, to its group */
+  u_int64_t rx;
+  u_int64_t lost;
+  u_int64_t duplicate;
+  u_int64_t reordered;
+  u_int64_t restarts;
+  u_int64_t down;
+
+  u_int32_t gap_min;
+  u_int32_t gap_max;
+  u_int64_t gap_sum;
+  u_int64_t gap_count;
+  u_int32_t jitter;
+  u_int32_t rx_delay;
+  u_int32_t rx_delay_max;
+
+  /* The last gaps, oldest first from delta_next once delta_n is
+     HA_STATS_DELTAS. */
+  u_int32_t delta_n;
+  u_int32_t delta_next;
+  u_int32_t delta[HA_STATS_DELTAS];
+};
+
+struct ha_stats_shm
+{
+  u_int32_t magic;
+  u_int32_t version;
+  u_int32_t seq;			/* odd while being written */
+  u_int32_t npeers;
+  u_int32_t capacity;			/* peers there is room for */
+  u_int32_t interval;			/* msec between snapshots */
+  u_int64_t size;			/* of the mapping, bytes */
+  u_int64_t updated;			/* wall clock, usec */
+  struct ha_stats_shm_peer peer[0];
+};
+
+struct ha;
+
+extern void ha_stats_export_start (struct ha *);
+extern void ha_stats_export_stop (struct ha *);
+
+#endif /* _KROUTE_HA_STATS_H */
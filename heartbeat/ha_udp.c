@@ -0,0 +1,263 @@
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "linklist.h"
+#include "hash.h"
+#include "jhash.h"
+#include "prefix.h"
+#include "if.h"
+#include "log.h"
+#include "sockopt.h"
+#include "network.h"
+
+#include "ha_packet.h"
+#include "ha_deamon.h"
+#include "ha_udp.h"
+#include "ha_debug.h"
+
+static unsigned int
+ha_udp_peer_hash_key (void *arg)
+{
+  struct ha_udp_peer *peer = arg;
+
+  return jhash_1word (peer->addr.s_addr, 0);
+}
+
+static int
+ha_udp_peer_hash_cmp (const void *a, const void *b)
+{
+  const struct ha_udp_peer *p1 = a;
+  const struct ha_udp_peer *p2 = b;
+
+  return p1->addr.s_addr == p2->addr.s_addr;
+}
+
+struct hash *
+ha_udp_peer_hash_new (void)
+{
+  return hash_create (ha_udp_peer_hash_key, ha_udp_peer_hash_cmp);
+}
+
+/* A UDP socket on the HA port, set up for reading as the raw socket
+   is, and connected to addr if given.  Every one of them shares the
+   port, so the kernel spreads what comes in over those that are not
+   connected, and gives each connected one what its peer sends. */
+static int
+ha_udp_socket (struct ha *ha, struct in_addr *addr)
+{
+  struct sockaddr_in sin;
+  int sock, on = 1;
+
+  if ((sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+    {
+      zlog_warn ("HA udp: socket: %s", safe_strerror (errno));
+      return -1;
+    }
+
+#ifdef SO_REUSEPORT
+  if (setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0)
+    zlog_warn ("Can't set SO_REUSEPORT for fd %d: %s", sock,
+	       safe_strerror (errno));
+#endif /* SO_REUSEPORT */
+
+  if (setsockopt_ifindex (AF_INET, sock, 1) < 0)
+    zlog_warn ("Can't set pktinfo option for fd %d", sock);
+
+#ifdef SO_TIMESTAMPNS
+  if (setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on)) < 0)
+    zlog_warn ("Can't set SO_TIMESTAMPNS for fd %d: %s", sock,
+	       safe_strerror (errno));
+#endif /* SO_TIMESTAMPNS */
+
+#ifdef IP_MULTICAST_ALL
+  /* Multicast to just the socket that joined, not to every one on the
+     port.  Multicast is not sharded: the kernel doesn't spread it over
+     a SO_REUSEPORT group but gives a copy to every socket that joined,
+     so joining on every shard would have each hello read once a shard.
+     Groups join on the first, which takes all multicast hellos. */
+  on = 0;
+  if (setsockopt (sock, IPPROTO_IP, IP_MULTICAST_ALL, &on, sizeof (on)) < 0)
+    zlog_warn ("Can't unset IP_MULTICAST_ALL for fd %d: %s", sock,
+	       safe_strerror (errno));
+#endif /* IP_MULTICAST_ALL */
+
+  if (set_nonblocking (sock) < 0)
+    zlog_warn ("Can't set non-blocking mode for fd %d", sock);
+
+  memset (&sin, 0, sizeof (sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons (ha->hb.udp_port);
+  if (bind (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+    {
+      zlog_warn ("HA udp: can't bind port %d: %s", ha->hb.udp_port,
+		 safe_strerror (errno));
+      close (sock);
+      return -1;
+    }
+
+  if (addr)
+    {
+      sin.sin_addr = *addr;
+      if (connect (sock, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+	{
+	  zlog_warn ("HA udp: can't connect to %s: %s", inet_ntoa (*addr),
+		     safe_strerror (errno));
+	  close (sock);
+	  return -1;
+	}
+    }
+
+  return sock;
+}
+
+static void
+ha_udp_peer_open (struct ha *ha, struct ha_udp_peer *peer)
+{
+#ifdef SO_REUSEPORT
+  /* Without, a second socket can't have the port, and the neighbor's
+     hellos come in with everyone else's. */
+  if ((peer->fd = ha_udp_socket (ha, &peer->addr)) < 0)
+    return;
+
+  peer->t_read = thread_add_read_persist (hm->hb_master, ha_read_udp, ha,
+					  peer->fd);
+  thread_set_priority (peer->t_read, THREAD_PRIO_CRITICAL);
+#endif /* SO_REUSEPORT */
+}
+
+static void
+ha_udp_peer_close (struct ha_udp_peer *peer)
+{
+  if (peer->fd < 0)
+    return;
+
+  THREAD_READ_OFF (peer->t_read);
+  close (peer->fd);
+  peer->fd = -1;
+}
+
+static void *
+ha_udp_peer_new (void *arg)
+{
+  struct ha_udp_peer *key = arg;
+  struct ha_udp_peer *peer;
+
+  peer = XCALLOC (MTYPE_HA_NEIGHBOR, sizeof (struct ha_udp_peer));
+  peer->addr = key->addr;
+  peer->fd = -1;
+  return peer;
+}
+
+/* A group has addr for a neighbor.  It gets a connected socket of its
+   own, while the udp transport is open. */
+void
+ha_udp_peer_get (struct ha *ha, struct in_addr addr)
+{
+  struct ha_udp_peer key, *peer;
+
+  key.addr = addr;
+  peer = hash_get (ha->udp_peers, &key, ha_udp_peer_new);
+  if (peer->refcnt++ == 0 && ha->udp_nshards)
+    ha_udp_peer_open (ha, peer);
+}
+
+/* A group no longer has addr for a neighbor. */
+void
+ha_udp_peer_put (struct ha *ha, struct in_addr addr)
+{
+  struct ha_udp_peer key, *peer;
+
+  key.addr = addr;
+  if ((peer = hash_lookup (ha->udp_peers, &key)) == NULL
+      || --peer->refcnt > 0)
+    return;
+
+  hash_release (ha->udp_peers, peer);
+  ha_udp_peer_close (peer);
+  XFREE (MTYPE_HA_NEIGHBOR, peer);
+}
+
+static void
+ha_udp_peer_open_one (struct hash_backet *backet, void *arg)
+{
+  ha_udp_peer_open (arg, backet->data);
+}
+
+static void
+ha_udp_peer_close_one (struct hash_backet *backet, void *arg)
+{
+  ha_udp_peer_close (backet->data);
+}
+
+/* Open the udp transport: a socket a CPU, up to HA_UDP_SHARDS_MAX, so
+   packets coming in on different CPUs don't all queue on the one
+   socket, and one connected to each neighbor.  Each of the first is
+   asked for what comes in on its own CPU, where the kernel goes by
+   that, else it takes one by the sender.  Multicast all goes to the
+   first, see ha_udp_socket.  Hellos go out of the first in turn, see
+   ha_packet_tx_fd.  Heartbeat thread only. */
+int
+ha_udp_open (struct ha *ha)
+{
+  long ncpus = 1;
+  int i, fd;
+
+  if (ha->udp_nshards)
+    return 0;
+  ha->udp_tx = 0;
+
+#if defined (SO_REUSEPORT) && defined (_SC_NPROCESSORS_ONLN)
+  if ((ncpus = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    ncpus = 1;
+  if (ncpus > HA_UDP_SHARDS_MAX)
+    ncpus = HA_UDP_SHARDS_MAX;
+#endif /* SO_REUSEPORT && _SC_NPROCESSORS_ONLN */
+
+  for (i = 0; i < ncpus; i++)
+    {
+      if ((fd = ha_udp_socket (ha, NULL)) < 0)
+	break;
+#ifdef SO_INCOMING_CPU
+      if (setsockopt (fd, SOL_SOCKET, SO_INCOMING_CPU, &i, sizeof (i)) < 0)
+	zlog_warn ("Can't set SO_INCOMING_CPU for fd %d: %s", fd,
+		   safe_strerror (errno));
+#endif /* SO_INCOMING_CPU */
+      ha->udp_fd[i] = fd;
+      ha->t_udp[i] = thread_add_read_persist (hm->hb_master, ha_read_udp,
+					      ha, fd);
+      thread_set_priority (ha->t_udp[i], THREAD_PRIO_CRITICAL);
+      ha->udp_nshards++;
+    }
+
+  if (ha->udp_nshards == 0)
+    {
+      zlog_err ("HA udp: no socket on port %d, hellos are not sent",
+		ha->hb.udp_port);
+      return -1;
+    }
+
+  hash_iterate (ha->udp_peers, ha_udp_peer_open_one, ha);
+
+  if (IS_DEBUG_HA (kroute, KROUTE_INTERFACE))
+    zlog_debug ("HA udp: port %d, %d sockets, %lu neighbors",
+		ha->hb.udp_port, ha->udp_nshards, ha->udp_peers->count);
+  return 0;
+}
+
+void
+ha_udp_close (struct ha *ha)
+{
+  int i;
+
+  if (ha->udp_nshards == 0)
+    return;
+
+  hash_iterate (ha->udp_peers, ha_udp_peer_close_one, NULL);
+  for (i = 0; i < ha->udp_nshards; i++)
+    {
+      THREAD_READ_OFF (ha->t_udp[i]);
+      close (ha->udp_fd[i]);
+    }
+  ha->udp_nshards = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef _KROUTE_HA_UDP_H
+#define _KROUTE_HA_UDP_H
+
+/* A neighbor of one or more groups, and, while the udp transport is
+   open, the socket connected to it.  Heartbeat thread only. */
+struct ha_udp_peer
+{
+  struct in_addr addr;
+  unsigned int refcnt;			/* groups it is a neighbor of */
+  int fd;				/* -1 while there is none */
+  struct thread *t_read;
+};
+
+struct ha;
+
+extern struct hash *ha_udp_peer_hash_new (void);
+extern void ha_udp_peer_get (struct ha *, struct in_addr);
+extern void ha_udp_peer_put (struct ha *, struct in_addr);
+extern int ha_udp_open (struct ha *);
+extern void ha_udp_close (struct ha *);
+
+#endif /* _KROUTE_HA_UDP_H */
@@ -0,0 +1,70 @@
+/*
+ * Accounting overhead benchmark: dispatch empty events under each
+ * "service thread-accounting" mode, and report ns per dispatch.
+ *
+ * usage: bench_accounting [dispatches]	(default 3000000)
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+
+static struct thread_master *master;
+static long count, total;
+
+static int
+dispatch_event (struct thread *thread)
+{
+  if (++count < total)
+    thread_add_event (master, dispatch_event, NULL, 0);
+  return 0;
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_run (const char *name, enum thread_cpu_mode mode, unsigned int sample)
+{
+  struct thread thread;
+  double t;
+
+  thread_set_cpu_accounting (mode, sample);
+
+  count = 0;
+  thread_add_event (master, dispatch_event, NULL, 0);
+  t = bench_now ();
+  while (count < total && thread_fetch (master, &thread))
+    thread_call (&thread);
+  t = bench_now () - t;
+
+  printf ("%-26s %6.0f ns/dispatch\n", name, t * 1e9 / total);
+}
+
+int
+main (int argc, char **argv)
+{
+  total = argc > 1 ? atol (argv[1]) : 3000000;
+  if (total < 1)
+    {
+      fprintf (stderr, "usage: %s [dispatches]\n", argv[0]);
+      return 1;
+    }
+
+  master = thread_master_create ();
+
+  bench_run ("rusage", THREAD_CPU_RUSAGE, 1);
+  bench_run ("thread-cputime", THREAD_CPU_THREAD, 1);
+  bench_run ("rusage, sample 16", THREAD_CPU_RUSAGE, 16);
+  bench_run ("thread-cputime, sample 16", THREAD_CPU_THREAD, 16);
+  bench_run ("wall", THREAD_CPU_WALL, 1);
+
+  thread_master_free (master);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Checksum benchmark: in_cksum and fletcher_checksum, as checksum_init
+ * picks them for this CPU, against the plain C versions, from a 20
+ * byte IP header to 64 KiB.  Reports ns a call and GB/s.
+ *
+ * usage: bench_checksum [bytes]	(default 200000000 per length)
+ */
+
+#include <kroute.h>
+
+#include "checksum.h"
+
+#define BENCH_MAX_LEN         65536
+
+static u_char buf[BENCH_MAX_LEN];
+
+static const int bench_lens[] =
+  { 20, 24, 40, 64, 128, 256, 576, 1500, 4096, 9000, 16384, 65536 };
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_report (double t, long n, int len)
+{
+  printf (" %8.1f ns %6.2f GB/s", t * 1e9 / n, (double) len * n / t / 1e9);
+}
+
+int
+main (int argc, char **argv)
+{
+  volatile int sum;
+  long bytes, n, i;
+  unsigned int l;
+  int len;
+  double t;
+
+  bytes = argc > 1 ? atol (argv[1]) : 200000000;
+  if (bytes < 1)
+    {
+      fprintf (stderr, "usage: %s [bytes]\n", argv[0]);
+      return 1;
+    }
+
+  checksum_init ();
+  srandom (1);
+  for (i = 0; i < BENCH_MAX_LEN; i++)
+    buf[i] = random ();
+
+  printf ("length  %-26s %-26s %-26s %s\n", "in_cksum_scalar", "in_cksum",
+	  "fletcher_checksum_scalar", "fletcher_checksum");
+  for (l = 0; l < sizeof (bench_lens) / sizeof (bench_lens[0]); l++)
+    {
+      len = bench_lens[l];
+      n = bytes / (len + 64) + 1;
+      printf ("%6d ", len);
+
+      t = bench_now ();
+      for (i = 0; i < n; i++)
+	sum = in_cksum_scalar (buf, len);
+      bench_report (bench_now () - t, n, len);
+
+      t = bench_now ();
+      for (i = 0; i < n; i++)
+	sum = in_cksum (buf, len);
+      bench_report (bench_now () - t, n, len);
+
+      /* Any offset will do, it is the sum that costs. */
+      t = bench_now ();
+      for (i = 0; i < n; i++)
+	sum = fletcher_checksum_scalar (buf, len, 12);
+      bench_report (bench_now () - t, n, len);
+
+      t = bench_now ();
+      for (i = 0; i < n; i++)
+	sum = fletcher_checksum (buf, len, 12);
+      bench_report (bench_now () - t, n, len);
+
+      printf ("\n");
+    }
+
+  (void) sum;
+  return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Dispatch benchmark: an event that re-adds itself, and a read thread
+ * that re-arms itself on a pipe that is always readable, as ha_read and
+ * kernel_read do.  Reports dispatches per second of each, as the tree
+ * has it and with the copy of the function name that thread_get made
+ * and thread_call freed on every dispatch before names were interned.
+ *
+ * usage: bench_dispatch [dispatches]	(default 3000000)
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+
+static struct thread_master *master;
+static long count, total;
+static int name_copy;
+
+/* strip_funcname as it was, a copy for every thread added. */
+static char *
+bench_strip_funcname (const char *funcname)
+{
+  char buff[100];
+  char tmp, *ret, *e, *b = buff;
+
+  strncpy (buff, funcname, sizeof (buff));
+  buff[sizeof (buff) - 1] = '\0';
+  e = buff + strlen (buff) - 1;
+
+  while (*b == ' ' || *b == '(')
+    ++b;
+  while (*e == ' ' || *e == ')')
+    --e;
+  e++;
+
+  tmp = *e;
+  *e = '\0';
+  ret = XSTRDUP (MTYPE_THREAD_FUNCNAME, b);
+  *e = tmp;
+
+  return ret;
+}
+
+/* What a dispatch cost on top, with name_copy set. */
+static void
+bench_name_copy (const char *funcname)
+{
+  char *name;
+
+  if (name_copy)
+    {
+      name = bench_strip_funcname (funcname);
+      XFREE (MTYPE_THREAD_FUNCNAME, name);
+    }
+}
+
+static int
+dispatch_event (struct thread *thread)
+{
+  if (++count < total)
+    {
+      bench_name_copy ("dispatch_event");
+      thread_add_event (master, dispatch_event, NULL, 0);
+    }
+  return 0;
+}
+
+static int
+dispatch_read (struct thread *thread)
+{
+  if (++count < total)
+    {
+      bench_name_copy ("dispatch_read");
+      thread_add_read (master, dispatch_read, NULL, THREAD_FD (thread));
+    }
+  return 0;
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+bench_run (void)
+{
+  struct thread thread;
+  double t;
+
+  t = bench_now ();
+  while (count < total && thread_fetch (master, &thread))
+    thread_call (&thread);
+  return total / (bench_now () - t);
+}
+
+int
+main (int argc, char **argv)
+{
+  int fds[2];
+
+  total = argc > 1 ? atol (argv[1]) : 3000000;
+  if (total < 1 || pipe (fds) < 0 || write (fds[1], "x", 1) != 1)
+    {
+      fprintf (stderr, "usage: %s [dispatches]\n", argv[0]);
+      return 1;
+    }
+
+  master = thread_master_create ();
+
+  for (name_copy = 1; name_copy >= 0; name_copy--)
+    {
+      printf ("%s\n", name_copy ? "name copied per dispatch (before):"
+			       : "names interned (now):");
+
+      count = 0;
+      thread_add_event (master, dispatch_event, NULL, 0);
+      printf ("  event re-arm: %.0f dispatches/s\n", bench_run ());
+
+      count = 0;
+      thread_add_read (master, dispatch_read, NULL, fds[0]);
+      printf ("  read re-arm:  %.0f dispatches/s\n", bench_run ());
+    }
+
+  thread_master_free (master);
+  return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Event backend benchmark: for each of epoll, io_uring and select,
+ * dispatches per second of read threads that re-arm themselves on one
+ * and on 64 always-readable pipes, of persistent reads on 64 pipes, and
+ * the latency from a write in another pthread to the read thread that
+ * it wakes.
+ *
+ * usage: bench_poll [dispatches [backend]]	(default 2000000, all)
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+#include "log.h"
+
+#define BENCH_FDS	64
+#define BENCH_WAKEUPS	20000
+#define BENCH_WAKEUP_GAP_NSEC 50000
+
+static struct thread_master *master;
+static long count, total;
+
+static int wakeup_fds[2];
+static long wakeups;
+static double latency[BENCH_WAKEUPS];
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+dispatch_read (struct thread *thread)
+{
+  if (++count < total)
+    thread_add_read (master, dispatch_read, NULL, THREAD_FD (thread));
+  return 0;
+}
+
+static int
+dispatch_persist (struct thread *thread)
+{
+  count++;
+  return 0;
+}
+
+static int
+wakeup_read (struct thread *thread)
+{
+  double sent;
+
+  if (read (wakeup_fds[0], &sent, sizeof sent) == sizeof sent)
+    latency[wakeups++] = bench_now () - sent;
+  thread_add_read (master, wakeup_read, NULL, wakeup_fds[0]);
+  return 0;
+}
+
+static void *
+wakeup_writer (void *arg)
+{
+  struct timespec gap = { 0, BENCH_WAKEUP_GAP_NSEC };
+  double sent;
+  int i;
+
+  for (i = 0; i < BENCH_WAKEUPS; i++)
+    {
+      nanosleep (&gap, NULL);
+      sent = bench_now ();
+      if (write (wakeup_fds[1], &sent, sizeof sent) != sizeof sent)
+	break;
+    }
+  return NULL;
+}
+
+static int
+latency_cmp (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Pipes with a byte in them, so they stay readable. */
+static void
+bench_pipes (int fds[][2], int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (pipe (fds[i]) < 0 || write (fds[i][1], "x", 1) != 1)
+      {
+	perror ("pipe");
+	exit (1);
+      }
+}
+
+static void
+bench_close (int fds[][2], int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      close (fds[i][0]);
+      close (fds[i][1]);
+    }
+}
+
+static double
+bench_dispatch (void)
+{
+  struct thread thread;
+  double t;
+
+  t = bench_now ();
+  while (count < total && thread_fetch (master, &thread))
+    thread_call (&thread);
+  return total / (bench_now () - t);
+}
+
+static void
+bench_run (const char *name)
+{
+  int fds[BENCH_FDS][2];
+  struct thread thread;
+  struct rusage r0, r1;
+  pthread_t writer;
+  int i;
+
+  if (thread_poll_set_default (name) < 0)
+    {
+      printf ("%-9s not built\n", name);
+      return;
+    }
+
+  master = thread_master_create ();
+  printf ("%-9s", thread_poll_name (master));
+
+  bench_pipes (fds, 1);
+  count = 0;
+  thread_add_read (master, dispatch_read, NULL, fds[0][0]);
+  printf (" 1 fd re-arm %8.0f/s", bench_dispatch ());
+  thread_master_free (master);
+  bench_close (fds, 1);
+
+  master = thread_master_create ();
+  bench_pipes (fds, BENCH_FDS);
+  count = 0;
+  for (i = 0; i < BENCH_FDS; i++)
+    thread_add_read (master, dispatch_read, NULL, fds[i][0]);
+  printf (" | %d fds re-arm %8.0f/s", BENCH_FDS, bench_dispatch ());
+  thread_master_free (master);
+  bench_close (fds, BENCH_FDS);
+
+  master = thread_master_create ();
+  bench_pipes (fds, BENCH_FDS);
+  count = 0;
+  for (i = 0; i < BENCH_FDS; i++)
+    thread_add_read_persist (master, dispatch_persist, NULL, fds[i][0]);
+  printf (" | %d fds persist %8.0f/s", BENCH_FDS, bench_dispatch ());
+  thread_master_free (master);
+  bench_close (fds, BENCH_FDS);
+
+  master = thread_master_create ();
+  if (pipe (wakeup_fds) < 0)
+    {
+      perror ("pipe");
+      exit (1);
+    }
+  wakeups = 0;
+  thread_add_read (master, wakeup_read, NULL, wakeup_fds[0]);
+  getrusage (RUSAGE_SELF, &r0);
+  pthread_create (&writer, NULL, wakeup_writer, NULL);
+  while (wakeups < BENCH_WAKEUPS && thread_fetch (master, &thread))
+    thread_call (&thread);
+  getrusage (RUSAGE_SELF, &r1);
+  pthread_join (writer, NULL);
+  thread_master_free (master);
+  close (wakeup_fds[0]);
+  close (wakeup_fds[1]);
+
+  qsort (latency, BENCH_WAKEUPS, sizeof (double), latency_cmp);
+  printf (" | wakeup p50 %.1f p99 %.1f us, %ld switches\n",
+	  latency[BENCH_WAKEUPS / 2] * 1e6,
+	  latency[BENCH_WAKEUPS * 99 / 100] * 1e6,
+	  r1.ru_nvcsw - r0.ru_nvcsw);
+}
+
+int
+main (int argc, char **argv)
+{
+  total = argc > 1 ? atol (argv[1]) : 2000000;
+  if (total < 1)
+    {
+      fprintf (stderr, "usage: %s [dispatches [backend]]\n", argv[0]);
+      return 1;
+    }
+
+  zlog_default = openzlog ("bench_poll", ZLOG_NONE, 0, LOG_DAEMON);
+
+  if (argc > 2)
+    bench_run (argv[2]);
+  else
+    {
+      bench_run ("epoll");
+      bench_run ("io_uring");
+      bench_run ("select");
+    }
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Timer microbenchmark: arm, cancel and expire timers on a thread
+ * master, and report the cost of each per timer.  The same timers are
+ * armed and cancelled on a copy of the sorted list timers were kept in
+ * before the heap, for comparison.  At the default, inserting into the
+ * list takes a minute or two.
+ *
+ * usage: bench_timer [timers]		(default 100000)
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+
+/* The sorted list, as funcname_thread_add_timer_timeval and
+   thread_cancel kept it. */
+struct bench_list_timer
+{
+  struct bench_list_timer *next;
+  struct bench_list_timer *prev;
+  struct timeval sands;
+};
+
+struct bench_list
+{
+  struct bench_list_timer *head;
+  struct bench_list_timer *tail;
+  int count;
+};
+
+static long
+bench_timeval_cmp (struct timeval a, struct timeval b)
+{
+  return (a.tv_sec == b.tv_sec
+	  ? a.tv_usec - b.tv_usec : a.tv_sec - b.tv_sec);
+}
+
+static void
+bench_list_add (struct bench_list *list, struct bench_list_timer *timer)
+{
+  struct bench_list_timer *tt;
+
+  /* Sort by timeval. */
+  for (tt = list->head; tt; tt = tt->next)
+    if (bench_timeval_cmp (timer->sands, tt->sands) <= 0)
+      break;
+
+  timer->next = tt;
+  if (tt)
+    {
+      timer->prev = tt->prev;
+      if (tt->prev)
+	tt->prev->next = timer;
+      else
+	list->head = timer;
+      tt->prev = timer;
+    }
+  else
+    {
+      timer->prev = list->tail;
+      if (list->tail)
+	list->tail->next = timer;
+      else
+	list->head = timer;
+      list->tail = timer;
+    }
+  list->count++;
+}
+
+static void
+bench_list_delete (struct bench_list *list, struct bench_list_timer *timer)
+{
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  else
+    list->tail = timer->prev;
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    list->head = timer->next;
+  timer->next = timer->prev = NULL;
+  list->count--;
+}
+
+static int
+timer_nop (struct thread *thread)
+{
+  return 0;
+}
+
+static double
+bench_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct thread_master *m;
+  struct thread **timers;
+  struct thread thread;
+  struct bench_list list;
+  struct bench_list_timer **list_timers;
+  struct timeval now;
+  long *msec;
+  int *order;
+  int i, j, tmp, n = 100000;
+  double t0, t1, t2;
+
+  if (argc > 1)
+    n = atoi (argv[1]);
+  if (n < 1)
+    {
+      fprintf (stderr, "usage: %s [timers]\n", argv[0]);
+      return 1;
+    }
+
+  m = thread_master_create ();
+  timers = calloc (n, sizeof (struct thread *));
+  list_timers = calloc (n, sizeof (struct bench_list_timer *));
+  msec = calloc (n, sizeof (long));
+  order = calloc (n, sizeof (int));
+
+  /* Timers 1 to 61 seconds out, as hello and dead timers would be,
+     cancelled in random order, so neither is emptied from one end. */
+  srandom (1);
+  for (i = 0; i < n; i++)
+    {
+      msec[i] = 1000 + random () % 60000;
+      order[i] = i;
+    }
+  for (i = n - 1; i > 0; i--)
+    {
+      j = random () % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    timers[i] = thread_add_timer_msec (m, timer_nop, NULL, msec[i]);
+  t1 = bench_now ();
+  for (i = 0; i < n; i++)
+    thread_cancel (timers[order[i]]);
+  t2 = bench_now ();
+
+  printf ("%d timers\n", n);
+  printf ("heap:        insert %8.0f ns, cancel %5.0f ns", (t1 - t0) / n,
+	  (t2 - t1) / n);
+  fflush (stdout);
+
+  /* Expiry, through the whole of thread_fetch. */
+  for (i = 0; i < n; i++)
+    thread_add_timer_msec (m, timer_nop, NULL, random () % 50);
+  usleep (60000);
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    thread_fetch (m, &thread);
+  t1 = bench_now ();
+
+  printf (", expire %.0f ns\n", (t1 - t0) / n);
+
+  /* Allocated one at a time, as threads are, and timed with the
+     allocation, as thread_get's was. */
+  memset (&list, 0, sizeof (list));
+  now = recent_relative_time ();
+  t0 = bench_now ();
+  for (i = 0; i < n; i++)
+    {
+      list_timers[i] = calloc (1, sizeof (struct bench_list_timer));
+      list_timers[i]->sands.tv_sec = now.tv_sec + msec[i] / 1000;
+      list_timers[i]->sands.tv_usec = now.tv_usec + msec[i] % 1000 * 1000;
+      if (list_timers[i]->sands.tv_usec >= 1000000)
+	{
+	  list_timers[i]->sands.tv_sec++;
+	  list_timers[i]->sands.tv_usec -= 1000000;
+	}
+      bench_list_add (&list, list_timers[i]);
+    }
+  t1 = bench_now ();
+  for (i = 0; i < n; i++)
+    bench_list_delete (&list, list_timers[order[i]]);
+  t2 = bench_now ();
+
+  printf ("sorted list: insert %8.0f ns, cancel %5.0f ns\n", (t1 - t0) / n,
+	  (t2 - t1) / n);
+
+  for (i = 0; i < n; i++)
+    free (list_timers[i]);
+  free (order);
+  free (msec);
+  free (list_timers);
+  free (timers);
+  thread_master_free (m);
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Checksum test: in_cksum and fletcher_checksum, as checksum_init
+ * picks them for this CPU, against in_cksum_scalar and
+ * fletcher_checksum_scalar.  Every length up to a few KiB, then lengths
+ * up to 64 KiB, around the points the vector versions put their lanes
+ * together in particular, each at every alignment up to a vector's, of
+ * random bytes and of all ones.  Exits non-zero on any difference.
+ *
+ * usage: test_checksum
+ */
+
+#include <kroute.h>
+
+#include "checksum.h"
+
+#define TEST_ALIGN            32		/* widest vector */
+#define TEST_EVERY_LEN        4200
+#define TEST_MAX_LEN          65536
+#define TEST_CHUNK            16384		/* Fletcher lanes, SSE2 */
+
+static u_char buf[TEST_MAX_LEN + TEST_ALIGN];
+static u_char copy[TEST_MAX_LEN];
+static long cases, failures;
+
+static void
+test_fail (const char *name, int len, int align, int pattern, int want,
+	   int got)
+{
+  if (failures++ < 10)
+    printf ("%s: length %d, alignment %d, pattern %d: %04x, "
+	    "should be %04x\n", name, len, align, pattern, got, want);
+}
+
+static void
+test_len (int len)
+{
+  int align, pattern, i, want, got;
+  u_int16_t offset;
+
+  for (pattern = 0; pattern < 2; pattern++)
+    {
+      for (i = 0; i < len + TEST_ALIGN; i++)
+	buf[i] = pattern ? 0xff : random ();
+
+      for (align = 0; align < TEST_ALIGN; align++)
+	{
+	  cases++;
+	  want = in_cksum_scalar (buf + align, len);
+	  got = in_cksum (buf + align, len);
+	  if (got != want)
+	    test_fail ("in_cksum", len, align, pattern, want, got);
+
+	  /* Room for the checksum, which both write into the buffer. */
+	  if (len < 2 || len > 0xffff)
+	    continue;
+	  offset = random () % (len - 1);
+
+	  cases++;
+	  memcpy (copy, buf + align, len);
+	  want = fletcher_checksum_scalar (copy, len, offset);
+	  memcpy (copy, buf + align, len);
+	  got = fletcher_checksum (copy, len, offset);
+	  if (got != want)
+	    test_fail ("fletcher_checksum", len, align, pattern, want, got);
+	}
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  int len, chunk, i;
+
+  checksum_init ();
+  srandom (1);
+
+  for (len = 0; len <= TEST_EVERY_LEN; len++)
+    test_len (len);
+  for (; len <= TEST_MAX_LEN; len += random () % 997 + 1)
+    test_len (len);
+  for (chunk = TEST_CHUNK; chunk <= TEST_MAX_LEN; chunk += TEST_CHUNK)
+    for (i = -64; i <= 64 && chunk + i <= TEST_MAX_LEN; i++)
+      test_len (chunk + i);
+  test_len (TEST_MAX_LEN);
+
+  printf ("%ld cases, %ld failures\n", cases, failures);
+  return failures != 0;
+}
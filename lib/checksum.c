@@ -9,8 +9,22 @@
 #include <kroute.h>
 #include "checksum.h"
 
-int			/* return checksum in low-order 16 bits */
-in_cksum(void *parg, int nbytes)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CHECKSUM_SIMD
+#include <immintrin.h>
+#endif /* __GNUC__ && x86 */
+
+static void fletcher_scalar_sum (const u_char *, size_t, int *, int *);
+
+/* What in_cksum and fletcher_checksum hand the work to, chosen by
+   checksum_init for the CPU we are on. */
+int (*in_cksum_func) (void *, int) = in_cksum_scalar;
+static void (*fletcher_sum_func) (const u_char *, size_t, int *, int *)
+  = fletcher_scalar_sum;
+
+/* The plain C version, which the others must agree with. */
+int
+in_cksum_scalar(void *parg, int nbytes)
 {
 	u_short *ptr = parg;
 	register long		sum;		/* assumes long == 32 bits */
@@ -51,26 +65,12 @@ in_cksum(void *parg, int nbytes)
 
 /* To be consistent, offset is 0-based index, rather than the 1-based 
    index required in the specification ISO 8473, Annex C.1 */
-u_int16_t
-fletcher_checksum(u_char * buffer, const size_t len, const uint16_t offset)
+static void
+fletcher_scalar_sum (const u_char *p, size_t left, int *pc0, int *pc1)
 {
-  u_int8_t *p;
-  int x, y, c0, c1;
-  u_int16_t checksum;
-  u_int16_t *csum;
-  size_t partial_len, i, left = len;
-  
-  checksum = 0;
-
-  assert (offset < len);
-
-  /*
-   * Zero the csum in the packet.
-   */
-  csum = (u_int16_t *) (buffer + offset);
-  *(csum) = 0;
+  int c0, c1;
+  size_t partial_len, i;
 
-  p = buffer;
   c0 = 0;
   c1 = 0;
 
@@ -89,7 +89,32 @@ fletcher_checksum(u_char * buffer, const size_t len, const uint16_t offset)
 
       left -= partial_len;
     }
+
+  *pc0 = c0;
+  *pc1 = c1;
+}
+
+static u_int16_t
+fletcher_checksum_with (void (*sum_func) (const u_char *, size_t, int *, int *),
+			u_char * buffer, const size_t len,
+			const uint16_t offset)
+{
+  int x, y, c0, c1;
+  u_int16_t checksum;
+  u_int16_t *csum;
   
+  checksum = 0;
+
+  assert (offset < len);
+
+  /*
+   * Zero the csum in the packet.
+   */
+  csum = (u_int16_t *) (buffer + offset);
+  *(csum) = 0;
+
+  (*sum_func) (buffer, len, &c0, &c1);
+
   /* The cast is important, to ensure the mod is taken as a signed value. */
   x = (int)((len - offset - 1) * c0 - c1) % 255;
 
@@ -112,3 +137,323 @@ fletcher_checksum(u_char * buffer, const size_t len, const uint16_t offset)
 
   return checksum;
 }
+
+u_int16_t
+fletcher_checksum(u_char * buffer, const size_t len, const uint16_t offset)
+{
+  if (len < 32)
+    return fletcher_checksum_with (fletcher_scalar_sum, buffer, len, offset);
+  return fletcher_checksum_with (fletcher_sum_func, buffer, len, offset);
+}
+
+/* The plain C version, which the others must agree with. */
+u_int16_t
+fletcher_checksum_scalar(u_char * buffer, const size_t len,
+			 const uint16_t offset)
+{
+  return fletcher_checksum_with (fletcher_scalar_sum, buffer, len, offset);
+}
+
+#ifdef HAVE_CHECKSUM_SIMD
+/* Both the Internet checksum and Fletcher's are sums that come out the
+   same however they are split up, so the vector versions add up in
+   independent lanes a chunk at a time, small enough that no lane can
+   overflow, and put the lanes together after each chunk.  Whatever is
+   left over at the end is done a byte or word at a time as above. */
+
+/* Vectors per chunk.  A 32 bit lane gets two 16 bit words per vector,
+   so could take 32768 before overflowing. */
+#define IN_CKSUM_CHUNK      16384
+
+/* 16 bit words, zero extended to 32 bits, both halves of each lane. */
+#define IN_CKSUM_ADD_SSE2(acc, v, mask) \
+  (acc) = _mm_add_epi32 (_mm_add_epi32 ((acc), _mm_and_si128 ((v), (mask))), \
+			 _mm_srli_epi32 ((v), 16))
+
+static u_int64_t
+in_cksum_lanes_sse2 (__m128i acc) __attribute__ ((target ("sse2")));
+static u_int64_t
+in_cksum_lanes_sse2 (__m128i acc)
+{
+  u_int32_t lane[4];
+
+  _mm_storeu_si128 ((__m128i *) lane, acc);
+  return (u_int64_t) lane[0] + lane[1] + lane[2] + lane[3];
+}
+
+/* Fold a sum of 16 bit words into 16 bits and complement it. */
+static int
+in_cksum_fold (u_int64_t sum, const u_char *p, int nbytes)
+{
+  u_short oddbyte;
+
+  while (nbytes > 1)
+    {
+      sum += *(const u_short *) p;
+      p += 2;
+      nbytes -= 2;
+    }
+  if (nbytes == 1)
+    {
+      oddbyte = 0;
+      *((u_char *) &oddbyte) = *p;
+      sum += oddbyte;
+    }
+
+  while (sum >> 16)
+    sum = (sum >> 16) + (sum & 0xffff);
+  return (u_short) ~sum;
+}
+
+static int
+in_cksum_sse2 (void *parg, int nbytes) __attribute__ ((target ("sse2")));
+static int
+in_cksum_sse2 (void *parg, int nbytes)
+{
+  const u_char *p = parg;
+  const __m128i mask = _mm_set1_epi32 (0xffff);
+  __m128i acc0, acc1;
+  u_int64_t sum = 0;
+  int n;
+
+  while (nbytes >= 16)
+    {
+      acc0 = acc1 = _mm_setzero_si128 ();
+      for (n = 0; nbytes >= 32 && n < IN_CKSUM_CHUNK; n += 2)
+	{
+	  IN_CKSUM_ADD_SSE2 (acc0, _mm_loadu_si128 ((const __m128i *) p), mask);
+	  IN_CKSUM_ADD_SSE2 (acc1, _mm_loadu_si128 ((const __m128i *) (p + 16)),
+			     mask);
+	  p += 32;
+	  nbytes -= 32;
+	}
+      if (nbytes >= 16 && n < IN_CKSUM_CHUNK)
+	{
+	  IN_CKSUM_ADD_SSE2 (acc0, _mm_loadu_si128 ((const __m128i *) p), mask);
+	  p += 16;
+	  nbytes -= 16;
+	}
+      sum += in_cksum_lanes_sse2 (_mm_add_epi32 (acc0, acc1));
+    }
+
+  return in_cksum_fold (sum, p, nbytes);
+}
+
+#define IN_CKSUM_ADD_AVX2(acc, v, mask) \
+  (acc) = _mm256_add_epi32 (_mm256_add_epi32 ((acc), \
+					      _mm256_and_si256 ((v), (mask))), \
+			    _mm256_srli_epi32 ((v), 16))
+
+static int
+in_cksum_avx2_long (void *parg, int nbytes) __attribute__ ((target ("avx2")));
+static int
+in_cksum_avx2_long (void *parg, int nbytes)
+{
+  const u_char *p = parg;
+  const __m256i mask = _mm256_set1_epi32 (0xffff);
+  __m256i acc0, acc1;
+  u_int32_t lane[8];
+  u_int64_t sum = 0;
+  int n, i;
+
+  while (nbytes >= 32)
+    {
+      acc0 = acc1 = _mm256_setzero_si256 ();
+      for (n = 0; nbytes >= 64 && n < IN_CKSUM_CHUNK; n += 2)
+	{
+	  IN_CKSUM_ADD_AVX2 (acc0, _mm256_loadu_si256 ((const __m256i *) p),
+			     mask);
+	  IN_CKSUM_ADD_AVX2 (acc1,
+			     _mm256_loadu_si256 ((const __m256i *) (p + 32)),
+			     mask);
+	  p += 64;
+	  nbytes -= 64;
+	}
+      if (nbytes >= 32 && n < IN_CKSUM_CHUNK)
+	{
+	  IN_CKSUM_ADD_AVX2 (acc0, _mm256_loadu_si256 ((const __m256i *) p),
+			     mask);
+	  p += 32;
+	  nbytes -= 32;
+	}
+      _mm256_storeu_si256 ((__m256i *) lane, _mm256_add_epi32 (acc0, acc1));
+      for (i = 0; i < 8; i++)
+	sum += lane[i];
+    }
+
+  /* Leave no upper halves behind to slow down SSE code. */
+  _mm256_zeroupper ();
+  return in_cksum_fold (sum, p, nbytes);
+}
+
+/* Short ones, like IP and HA headers, are not worth the setup, and are
+   sent the SSE2 way before anything touches the upper halves of the
+   AVX registers, as SSE code is slowed down a lot while they are in
+   use. */
+#define CHECKSUM_AVX2_MIN   64
+
+static int
+in_cksum_avx2 (void *parg, int nbytes)
+{
+  if (nbytes < CHECKSUM_AVX2_MIN)
+    return in_cksum_sse2 (parg, nbytes);
+  return in_cksum_avx2_long (parg, nbytes);
+}
+
+/* Fletcher's sums over a block of bytes b[0..k-1] that starts with c0
+   and c1 come to
+
+     c0 + sum b[i]
+     c1 + k * c0 + sum (k - i) * b[i]
+
+   so each block adds its byte sum to c0, its weighted sum to c1, and,
+   for the k * c0 term, the c0 it started with, k times over.  The
+   lanes are put together every FLETCHER_CHUNK blocks, while none of
+   them can have passed 2^31. */
+#define FLETCHER_CHUNK      1024
+
+/* Carry on from c0 and c1 with whatever the vectors left over. */
+static void
+fletcher_tail (const u_char *p, size_t left, int64_t c0, int64_t c1,
+	       int *pc0, int *pc1)
+{
+  while (left--)
+    {
+      c0 += *p++;
+      c1 += c0;
+    }
+  *pc0 = c0 % 255;
+  *pc1 = c1 % 255;
+}
+
+static void
+fletcher_sum_sse2 (const u_char *, size_t, int *, int *)
+  __attribute__ ((target ("sse2")));
+static void
+fletcher_sum_sse2 (const u_char *p, size_t left, int *pc0, int *pc1)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i wlo = _mm_setr_epi16 (16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i whi = _mm_setr_epi16 (8, 7, 6, 5, 4, 3, 2, 1);
+  __m128i v, s0, s1, sp;
+  u_int32_t lane[4];
+  int64_t c0 = 0, c1 = 0;
+  size_t n, blocks;
+
+  while (left >= 16)
+    {
+      blocks = MIN (left / 16, FLETCHER_CHUNK);
+      s0 = s1 = sp = zero;
+      for (n = 0; n < blocks; n++)
+	{
+	  v = _mm_loadu_si128 ((const __m128i *) p);
+	  sp = _mm_add_epi32 (sp, s0);
+	  s0 = _mm_add_epi32 (s0, _mm_sad_epu8 (v, zero));
+	  s1 = _mm_add_epi32 (s1, _mm_madd_epi16 (_mm_unpacklo_epi8 (v, zero),
+						  wlo));
+	  s1 = _mm_add_epi32 (s1, _mm_madd_epi16 (_mm_unpackhi_epi8 (v, zero),
+						  whi));
+	  p += 16;
+	}
+      left -= blocks * 16;
+
+      c1 += (int64_t) blocks * 16 * c0;
+      _mm_storeu_si128 ((__m128i *) lane, sp);
+      c1 += 16 * ((int64_t) lane[0] + lane[2]);
+      _mm_storeu_si128 ((__m128i *) lane, s1);
+      c1 += (int64_t) lane[0] + lane[1] + lane[2] + lane[3];
+      _mm_storeu_si128 ((__m128i *) lane, s0);
+      c0 += (int64_t) lane[0] + lane[2];
+
+      c0 %= 255;
+      c1 %= 255;
+    }
+
+  fletcher_tail (p, left, c0, c1, pc0, pc1);
+}
+
+static void
+fletcher_sum_avx2_long (const u_char *, size_t, int *, int *)
+  __attribute__ ((target ("avx2")));
+static void
+fletcher_sum_avx2_long (const u_char *p, size_t left, int *pc0, int *pc1)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i ones = _mm256_set1_epi16 (1);
+  const __m256i weight = _mm256_setr_epi8 (32, 31, 30, 29, 28, 27, 26, 25,
+					   24, 23, 22, 21, 20, 19, 18, 17,
+					   16, 15, 14, 13, 12, 11, 10, 9,
+					   8, 7, 6, 5, 4, 3, 2, 1);
+  __m256i v, s0, s1, sp;
+  u_int32_t lane[8];
+  int64_t c0 = 0, c1 = 0;
+  size_t n, blocks;
+  int i;
+
+  while (left >= 32)
+    {
+      blocks = MIN (left / 32, FLETCHER_CHUNK);
+      s0 = s1 = sp = zero;
+      for (n = 0; n < blocks; n++)
+	{
+	  v = _mm256_loadu_si256 ((const __m256i *) p);
+	  sp = _mm256_add_epi32 (sp, s0);
+	  s0 = _mm256_add_epi32 (s0, _mm256_sad_epu8 (v, zero));
+	  /* Pairs of byte times weight fit 16 bits signed, 2 * 32 * 255. */
+	  s1 = _mm256_add_epi32 (s1,
+				 _mm256_madd_epi16 (_mm256_maddubs_epi16 (v,
+									  weight),
+						    ones));
+	  p += 32;
+	}
+      left -= blocks * 32;
+
+      c1 += (int64_t) blocks * 32 * c0;
+      _mm256_storeu_si256 ((__m256i *) lane, sp);
+      for (i = 0; i < 8; i += 2)
+	c1 += 32 * (int64_t) lane[i];
+      _mm256_storeu_si256 ((__m256i *) lane, s1);
+      for (i = 0; i < 8; i++)
+	c1 += lane[i];
+      _mm256_storeu_si256 ((__m256i *) lane, s0);
+      for (i = 0; i < 8; i += 2)
+	c0 += lane[i];
+
+      c0 %= 255;
+      c1 %= 255;
+    }
+
+  _mm256_zeroupper ();
+  fletcher_tail (p, left, c0, c1, pc0, pc1);
+}
+
+static void
+fletcher_sum_avx2 (const u_char *p, size_t left, int *pc0, int *pc1)
+{
+  if (left < CHECKSUM_AVX2_MIN)
+    fletcher_sum_sse2 (p, left, pc0, pc1);
+  else
+    fletcher_sum_avx2_long (p, left, pc0, pc1);
+}
+#endif /* HAVE_CHECKSUM_SIMD */
+
+/* Use the widest vectors the CPU has.  Call before starting any other
+   thread; until then, and on other machines, the scalar versions are
+   used. */
+void
+checksum_init (void)
+{
+#ifdef HAVE_CHECKSUM_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      in_cksum_func = in_cksum_avx2;
+      fletcher_sum_func = fletcher_sum_avx2;
+    }
+  else if (__builtin_cpu_supports ("sse2"))
+    {
+      in_cksum_func = in_cksum_sse2;
+      fletcher_sum_func = fletcher_sum_sse2;
+    }
+#endif /* HAVE_CHECKSUM_SIMD */
+}
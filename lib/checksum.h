@@ -1,2 +1,26 @@
-extern int in_cksum(void *, int);
+#ifndef _KROUTE_CHECKSUM_H
+#define _KROUTE_CHECKSUM_H
+
 extern u_int16_t fletcher_checksum(u_char *, const size_t len, const uint16_t offset);
+extern void checksum_init (void);
+
+/* Plain C versions, to test the ones checksum_init picks against. */
+extern int in_cksum_scalar(void *, int);
+extern u_int16_t fletcher_checksum_scalar(u_char *, const size_t len, const uint16_t offset);
+
+/* The in_cksum checksum_init picks for the CPU we are on. */
+extern int (*in_cksum_func) (void *, int);
+
+/* Below this an IP or HA header is done quicker a word at a time, and
+   without going through a pointer first. */
+#define IN_CKSUM_SHORT        64
+
+static inline int	/* return checksum in low-order 16 bits */
+in_cksum (void *parg, int nbytes)
+{
+  if (nbytes < IN_CKSUM_SHORT)
+    return in_cksum_scalar (parg, nbytes);
+  return (*in_cksum_func) (parg, nbytes);
+}
+
+#endif /* _KROUTE_CHECKSUM_H */
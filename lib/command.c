@@ -610,6 +610,10 @@ config_write_host (struct vty *vty)
   if (host.advanced)
     vty_out (vty, "service advanced-vty%s", VTY_NEWLINE);
 
+#ifdef HAVE_RUSAGE
+  thread_config_write (vty);
+#endif /* HAVE_RUSAGE */
+
   if (host.encrypt)
     vty_out (vty, "service password-encryption%s", VTY_NEWLINE);
 
@@ -3646,12 +3650,21 @@ cmd_init (int terminal)
       install_element (CONFIG_NODE, &no_banner_motd_cmd);
       install_element (CONFIG_NODE, &service_terminal_length_cmd);
       install_element (CONFIG_NODE, &no_service_terminal_length_cmd);
+#ifdef HAVE_RUSAGE
+      install_element (CONFIG_NODE, &service_thread_accounting_cmd);
+      install_element (CONFIG_NODE, &service_thread_accounting_sample_cmd);
+      install_element (CONFIG_NODE, &no_service_thread_accounting_cmd);
+#endif /* HAVE_RUSAGE */
 
       install_element (VIEW_NODE, &show_thread_cpu_cmd);
       install_element (ENABLE_NODE, &show_thread_cpu_cmd);
       install_element (RESTRICTED_NODE, &show_thread_cpu_cmd);
+      install_element (VIEW_NODE, &show_thread_latency_cmd);
+      install_element (ENABLE_NODE, &show_thread_latency_cmd);
+      install_element (RESTRICTED_NODE, &show_thread_latency_cmd);
       
       install_element (ENABLE_NODE, &clear_thread_cpu_cmd);
+      install_element (ENABLE_NODE, &clear_thread_latency_cmd);
       install_element (VIEW_NODE, &show_work_queues_cmd);
       install_element (ENABLE_NODE, &show_work_queues_cmd);
     }
@@ -0,0 +1,256 @@
+/*
+ * Bane worker pthread pool.
+ *
+ * This file is part of Bane.
+ *
+ * Bane is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * Bane is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bane; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "log.h"
+#include "jobpool.h"
+
+/* Clock reading in uSec. */
+static unsigned long
+job_clock (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* Runs on the submitting master. */
+static int
+job_done (struct thread *thread)
+{
+  struct job *job = THREAD_ARG (thread);
+  int (*done) (struct thread *) = job->done;
+  void *arg = job->arg;
+  int result = job->result;
+
+  if (job->cancelled)
+    {
+      XFREE (MTYPE_JOB, job);
+      return 0;
+    }
+
+  thread_account_job (thread->master,
+		      (int (*) (struct thread *)) job->work, job->funcname,
+		      job->delay, job->real, job->cpu);
+
+  /* The job is finished with before done gets to see it. */
+  XFREE (MTYPE_JOB, job);
+  if (done)
+    thread_execute (thread->master, done, arg, result);
+  return 0;
+}
+
+static void *
+jobpool_worker (void *arg)
+{
+  struct jobpool *pool = arg;
+  struct job *job;
+  unsigned long start, cpustart;
+
+  pthread_mutex_lock (&pool->lock);
+  while (1)
+    {
+      while (!pool->stop && pool->head == NULL)
+	pthread_cond_wait (&pool->wait, &pool->lock);
+      if (pool->stop)
+	break;
+
+      job = pool->head;
+      pool->head = job->next;
+      if (pool->head)
+	pool->head->prev = NULL;
+      else
+	pool->tail = NULL;
+      job->next = NULL;
+      job->state = JOB_RUNNING;
+      pthread_mutex_unlock (&pool->lock);
+
+      start = job_clock (CLOCK_MONOTONIC);
+      cpustart = job_clock (CLOCK_THREAD_CPUTIME_ID);
+      job->delay = start - job->queued;
+      job->result = (*job->work) (job);
+      job->cpu = job_clock (CLOCK_THREAD_CPUTIME_ID) - cpustart;
+      job->real = job_clock (CLOCK_MONOTONIC) - start;
+
+      pthread_mutex_lock (&pool->lock);
+      job->state = JOB_DONE;
+      if (job->cancelled)
+	{
+	  /* job_cancel is waiting to free it. */
+	  pthread_cond_broadcast (&pool->finished);
+	  continue;
+	}
+      pthread_mutex_unlock (&pool->lock);
+
+      thread_add_event_mt (job->master, job_done, job, 0);
+
+      pthread_mutex_lock (&pool->lock);
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  return NULL;
+}
+
+struct jobpool *
+jobpool_new (const char *name, int nworkers)
+{
+  struct jobpool *pool;
+  sigset_t all, old;
+  int i, ret;
+
+  pool = XCALLOC (MTYPE_JOBPOOL, sizeof (struct jobpool));
+  pool->name = name;
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->wait, NULL);
+  pthread_cond_init (&pool->finished, NULL);
+  pool->workers = XCALLOC (MTYPE_JOBPOOL, nworkers * sizeof (pthread_t));
+
+  /* Signals are for the main thread. */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  for (i = 0; i < nworkers; i++)
+    {
+      if ((ret = pthread_create (&pool->workers[i], NULL, jobpool_worker,
+				 pool)) != 0)
+	{
+	  zlog_err ("%s: pthread_create: %s", name, safe_strerror (ret));
+	  break;
+	}
+      pool->nworkers++;
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+  if (pool->nworkers == 0)
+    {
+      jobpool_free (pool);
+      return NULL;
+    }
+  return pool;
+}
+
+/* Stop the workers, once they are through with what they are running.
+   Jobs still queued are dropped, as are the completions of those that
+   ran, so it is for the end of the process, or once all jobs are
+   done. */
+void
+jobpool_free (struct jobpool *pool)
+{
+  struct job *job;
+  int i;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast (&pool->wait);
+  pthread_mutex_unlock (&pool->lock);
+
+  for (i = 0; i < pool->nworkers; i++)
+    pthread_join (pool->workers[i], NULL);
+
+  while ((job = pool->head) != NULL)
+    {
+      pool->head = job->next;
+      XFREE (MTYPE_JOB, job);
+    }
+
+  pthread_cond_destroy (&pool->finished);
+  pthread_cond_destroy (&pool->wait);
+  pthread_mutex_destroy (&pool->lock);
+  XFREE (MTYPE_JOBPOOL, pool->workers);
+  XFREE (MTYPE_JOBPOOL, pool);
+}
+
+/* Queue a job, to be done from master once a worker has run it. */
+struct job *
+funcname_job_submit (struct jobpool *pool, struct thread_master *master,
+		     int (*work) (struct job *), int (*done) (struct thread *),
+		     void *arg, const char *funcname)
+{
+  struct job *job;
+
+  job = XCALLOC (MTYPE_JOB, sizeof (struct job));
+  job->pool = pool;
+  job->master = master;
+  job->work = work;
+  job->done = done;
+  job->arg = arg;
+  job->funcname = funcname;
+  job->state = JOB_QUEUED;
+  job->queued = job_clock (CLOCK_MONOTONIC);
+
+  pthread_mutex_lock (&pool->lock);
+  job->prev = pool->tail;
+  if (pool->tail)
+    pool->tail->next = job;
+  else
+    pool->head = job;
+  pool->tail = job;
+  pool->submitted++;
+  pthread_cond_signal (&pool->wait);
+  pthread_mutex_unlock (&pool->lock);
+
+  return job;
+}
+
+/* From the submitting master only. */
+void
+job_cancel (struct job *job)
+{
+  struct jobpool *pool = job->pool;
+
+  pthread_mutex_lock (&pool->lock);
+  pool->cancelled++;
+  __atomic_store_n (&job->cancelled, 1, __ATOMIC_RELAXED);
+  switch (job->state)
+    {
+    case JOB_QUEUED:
+      if (job->prev)
+	job->prev->next = job->next;
+      else
+	pool->head = job->next;
+      if (job->next)
+	job->next->prev = job->prev;
+      else
+	pool->tail = job->prev;
+      break;
+    case JOB_RUNNING:
+      while (job->state == JOB_RUNNING)
+	pthread_cond_wait (&pool->finished, &pool->lock);
+      break;
+    case JOB_DONE:
+      /* job_done is on its way, and will free it. */
+      pthread_mutex_unlock (&pool->lock);
+      return;
+    }
+  pthread_mutex_unlock (&pool->lock);
+
+  XFREE (MTYPE_JOB, job);
+}
+
+/* For work functions, to give up early on a cancelled job. */
+int
+job_cancelled (struct job *job)
+{
+  return __atomic_load_n (&job->cancelled, __ATOMIC_RELAXED);
+}
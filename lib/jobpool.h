@@ -0,0 +1,103 @@
+/*
+ * Bane worker pthread pool.
+ *
+ * This file is part of Bane.
+ *
+ * Bane is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * Bane is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bane; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _BANE_JOBPOOL_H
+#define _BANE_JOBPOOL_H
+
+/* Runs blocking or cpu heavy work off the event loop.  The work
+ * function of a job runs on one of the pool's pthreads, so it may only
+ * touch what it is given.  Its return value is handed to the done
+ * function, which runs as an event on the thread master the job was
+ * submitted from, with THREAD_ARG the job's arg and THREAD_VAL the
+ * return value.  The work function's times are accounted to it in
+ * "show thread cpu", as type J.
+ *
+ * Like threads, a job must be forgotten once its done function has
+ * run, and can be cancelled until then.
+ */
+
+struct job
+{
+  struct job *next;
+  struct job *prev;
+  struct jobpool *pool;
+  struct thread_master *master;	/* to run done from */
+
+  int (*work) (struct job *);
+  int (*done) (struct thread *);
+  void *arg;
+  const char *funcname;		/* of work */
+
+  int state;
+#define JOB_QUEUED    0
+#define JOB_RUNNING   1
+#define JOB_DONE      2
+  int cancelled;
+  int result;
+
+  /* Times, in uSec, filled in by the worker. */
+  unsigned long queued;		/* CLOCK_MONOTONIC at submit */
+  unsigned long delay;
+  unsigned long real;
+  unsigned long cpu;
+};
+
+struct jobpool
+{
+  const char *name;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wait;		/* workers wait for jobs */
+  pthread_cond_t finished;	/* job_cancel waits for running jobs */
+
+  /* Queued jobs, oldest first. */
+  struct job *head;
+  struct job *tail;
+
+  pthread_t *workers;
+  int nworkers;
+  int stop;
+
+  unsigned long submitted;
+  unsigned long cancelled;
+};
+
+#define JOB_ARG(X) ((X)->arg)
+
+#define job_submit(p,m,w,d,a) funcname_job_submit(p,m,w,d,a,#w)
+
+/* Prototypes. */
+extern struct jobpool *jobpool_new (const char *name, int nworkers);
+extern void jobpool_free (struct jobpool *);
+
+extern struct job *funcname_job_submit (struct jobpool *,
+					struct thread_master *,
+					int (*work) (struct job *),
+					int (*done) (struct thread *),
+					void *arg, const char *funcname);
+
+/* After job_cancel returns the work function is not running and the
+   done function will not be called.  Work already running is waited
+   for, long running work should check job_cancelled now and then. */
+extern void job_cancel (struct job *);
+extern int job_cancelled (struct job *);
+
+#endif /* _BANE_JOBPOOL_H */
@@ -23,11 +23,159 @@ Boston, MA 02111-1307, USA.  */
 #include "command.h"
 #include "memory.h"
 #include "linklist.h"
+#include "thread.h"
 #include "keychain.h"
 
 /* Master list of key chain. */
 struct list *keychain_list;
 
+/* Told the name of a key chain whose keys have changed. */
+static void (*keychain_update_hook) (const char *);
+
+/* Wakes up at the next lifetime boundary of any key chain.  Lifetimes
+   are wall clock and timers are not, so while there are key chains it
+   looks at least every KEYCHAIN_SCHEDULE_MAX seconds in case the clock
+   has been set, either way. */
+#define KEYCHAIN_SCHEDULE_MAX 60
+
+static struct thread_master *keychain_master;
+static struct thread *keychain_t_schedule;
+
+void
+keychain_add_hook (void (*func) (const char *))
+{
+  keychain_update_hook = func;
+}
+
+static int
+key_range_active (const struct key_range *krange, time_t now)
+{
+  if (krange->start == 0)
+    return 1;
+
+  return krange->start <= now && (krange->end >= now || krange->end == -1);
+}
+
+/* When a range next starts or ends after now, 0 never. */
+static time_t
+key_range_next (const struct key_range *krange, time_t now)
+{
+  if (krange->start == 0)
+    return 0;
+  if (krange->start > now)
+    return krange->start;
+  if (krange->end != -1 && krange->end >= now)
+    return krange->end + 1;
+  return 0;
+}
+
+static void
+keychain_next_min (struct keychain *keychain, time_t next)
+{
+  if (next && (keychain->next == 0 || next < keychain->next))
+    keychain->next = next;
+}
+
+/* Pick out the keys good for sending and accepting at now, so that
+   lookups need neither the time nor a walk of the key list. */
+static void
+keychain_schedule (struct keychain *keychain, time_t now)
+{
+  struct listnode *node;
+  struct key *key;
+
+  if (keychain->accept)
+    XFREE (MTYPE_KEYCHAIN_SCHEDULE, keychain->accept);
+  keychain->send = NULL;
+  keychain->accept_count = 0;
+  keychain->next = 0;
+  keychain->scheduled = now;
+
+  if (listcount (keychain->key))
+    keychain->accept = XCALLOC (MTYPE_KEYCHAIN_SCHEDULE,
+				listcount (keychain->key)
+				* sizeof (struct key *));
+
+  /* The list is by index, so the accept keys are too, and the first
+     good send key has the lowest index. */
+  for (ALL_LIST_ELEMENTS_RO (keychain->key, node, key))
+    {
+      if (keychain->send == NULL && key_range_active (&key->send, now))
+	keychain->send = key;
+      if (key_range_active (&key->accept, now))
+	keychain->accept[keychain->accept_count++] = key;
+
+      keychain_next_min (keychain, key_range_next (&key->send, now));
+      keychain_next_min (keychain, key_range_next (&key->accept, now));
+    }
+}
+
+static int keychain_schedule_expire (struct thread *);
+
+/* One timer for all key chains, at the soonest boundary. */
+static void
+keychain_schedule_timer (time_t now)
+{
+  struct listnode *node;
+  struct keychain *keychain;
+  time_t next = 0, delay;
+
+  THREAD_TIMER_OFF (keychain_t_schedule);
+  if (keychain_master == NULL)
+    return;
+
+  for (ALL_LIST_ELEMENTS_RO (keychain_list, node, keychain))
+    if (keychain->next && (next == 0 || keychain->next < next))
+      next = keychain->next;
+
+  if (listcount (keychain_list) == 0)
+    return;
+  delay = next == 0 ? KEYCHAIN_SCHEDULE_MAX : next > now ? next - now : 0;
+  if (delay > KEYCHAIN_SCHEDULE_MAX)
+    delay = KEYCHAIN_SCHEDULE_MAX;
+  keychain_t_schedule = thread_add_timer (keychain_master,
+					  keychain_schedule_expire, NULL, delay);
+}
+
+/* A key has started or stopped being good, or may have, as the clock
+   has gone back.  Then even a chain with no boundary ahead, next 0, may
+   have keys that have not started yet. */
+static int
+keychain_schedule_expire (struct thread *thread)
+{
+  struct listnode *node, *nnode;
+  struct keychain *keychain;
+  time_t now;
+
+  keychain_t_schedule = NULL;
+  now = time (NULL);
+
+  for (ALL_LIST_ELEMENTS (keychain_list, node, nnode, keychain))
+    if ((keychain->next && keychain->next <= now)
+	|| now < keychain->scheduled)
+      {
+	keychain_schedule (keychain, now);
+	if (keychain_update_hook)
+	  (*keychain_update_hook) (keychain->name);
+      }
+
+  keychain_schedule_timer (now);
+  return 0;
+}
+
+static void
+keychain_update (struct keychain *keychain)
+{
+  time_t now;
+
+  now = time (NULL);
+  keychain_schedule (keychain, now);
+  keychain_schedule_timer (now);
+
+  if (keychain_update_hook && keychain->name)
+    (*keychain_update_hook) (keychain->name);
+}
+
 static struct keychain *
 keychain_new (void)
 {
@@ -117,8 +265,11 @@ keychain_delete (struct keychain *keychain)
     free (keychain->name);
 
   list_delete (keychain->key);
+  if (keychain->accept)
+    XFREE (MTYPE_KEYCHAIN_SCHEDULE, keychain->accept);
   listnode_delete (keychain_list, keychain);
   keychain_free (keychain);
+  keychain_schedule_timer (time (NULL));
 }
 
 static struct key *
@@ -135,69 +286,40 @@ key_lookup (const struct keychain *keychain, u_int32_t index)
   return NULL;
 }
 
+/* The lowest numbered key from index up that is good for accepting
+   now. */
 struct key *
 key_lookup_for_accept (const struct keychain *keychain, u_int32_t index)
 {
-  struct listnode *node;
-  struct key *key;
-  time_t now;
-
-  now = time (NULL);
+  u_int32_t lo = 0, hi = keychain->accept_count, mid;
 
-  for (ALL_LIST_ELEMENTS_RO (keychain->key, node, key))
+  while (lo < hi)
     {
-      if (key->index >= index)
-	{
-	  if (key->accept.start == 0)
-	    return key;
-
-	  if (key->accept.start <= now)
-	    if (key->accept.end >= now || key->accept.end == -1)
-	      return key;
-	}
+      mid = (lo + hi) / 2;
+      if (keychain->accept[mid]->index < index)
+	lo = mid + 1;
+      else
+	hi = mid;
     }
-  return NULL;
+  return lo < keychain->accept_count ? keychain->accept[lo] : NULL;
 }
 
 struct key *
 key_match_for_accept (const struct keychain *keychain, const char *auth_str)
 {
-  struct listnode *node;
-  struct key *key;
-  time_t now;
+  u_int32_t i;
 
-  now = time (NULL);
-
-  for (ALL_LIST_ELEMENTS_RO (keychain->key, node, key))
-    {
-      if (key->accept.start == 0 ||
-	  (key->accept.start <= now &&
-	   (key->accept.end >= now || key->accept.end == -1)))
-	if (strncmp (key->string, auth_str, 16) == 0)
-	  return key;
-    }
+  for (i = 0; i < keychain->accept_count; i++)
+    if (keychain->accept[i]->string
+	&& strncmp (keychain->accept[i]->string, auth_str, 16) == 0)
+      return keychain->accept[i];
   return NULL;
 }
 
 struct key *
 key_lookup_for_send (const struct keychain *keychain)
 {
-  struct listnode *node;
-  struct key *key;
-  time_t now;
-
-  now = time (NULL);
-
-  for (ALL_LIST_ELEMENTS_RO (keychain->key, node, key))
-    {
-      if (key->send.start == 0)
-	return key;
-
-      if (key->send.start <= now)
-	if (key->send.end >= now || key->send.end == -1)
-	  return key;
-    }
-  return NULL;
+  return keychain->send;
 }
 
 static struct key *
@@ -262,6 +384,8 @@ DEFUN (no_key_chain,
     }
 
   keychain_delete (keychain);
+  if (keychain_update_hook)
+    (*keychain_update_hook) (argv[0]);
 
   return CMD_SUCCESS;
 }
@@ -280,6 +404,7 @@ DEFUN (key,
 
   VTY_GET_INTEGER ("key identifier", index, argv[0]);
   key = key_get (keychain, index);
+  keychain_update (keychain);
   vty->index_sub = key;
   vty->node = KEYCHAIN_KEY_NODE;
   
@@ -308,6 +433,7 @@ DEFUN (no_key,
     }
 
   key_delete (keychain, key);
+  keychain_update (keychain);
 
   vty->node = KEYCHAIN_NODE;
 
@@ -327,6 +453,7 @@ DEFUN (key_string,
   if (key->string)
     free (key->string);
   key->string = strdup (argv[0]);
+  keychain_update (vty->index);
 
   return CMD_SUCCESS;
 }
@@ -347,6 +474,7 @@ DEFUN (no_key_string,
       free (key->string);
       key->string = NULL;
     }
+  keychain_update (vty->index);
 
   return CMD_SUCCESS;
 }
@@ -484,6 +612,7 @@ key_lifetime_set (struct vty *vty, struct key_range *krange,
 
   krange->start = time_start;
   krange->end = time_end;
+  keychain_update (vty->index);
 
   return CMD_SUCCESS;
 }
@@ -508,6 +637,7 @@ key_lifetime_duration_set (struct vty *vty, struct key_range *krange,
   VTY_GET_INTEGER ("duration", duration, duration_str);
   krange->duration = 1;
   krange->end = time_start + duration;
+  keychain_update (vty->index);
 
   return CMD_SUCCESS;
 }
@@ -528,6 +658,7 @@ key_lifetime_infinite_set (struct vty *vty, struct key_range *krange,
   krange->start = time_start;
 
   krange->end = -1;
+  keychain_update (vty->index);
 
   return CMD_SUCCESS;
 }
@@ -937,9 +1068,10 @@ keychain_config_write (struct vty *vty)
 }
 
 void
-keychain_init ()
+keychain_init (struct thread_master *master)
 {
   keychain_list = list_new ();
+  keychain_master = master;
 
   install_node (&keychain_node, keychain_config_write);
   install_node (&keychain_key_node, NULL);
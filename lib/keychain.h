@@ -27,6 +27,14 @@ struct keychain
   char *name;
 
   struct list *key;
+
+  /* The keys good now, worked out again whenever the keys change or
+     one of their lifetimes starts or ends. */
+  struct key *send;
+  struct key **accept;			/* by index */
+  u_int32_t accept_count;
+  time_t next;				/* when that is, 0 never */
+  time_t scheduled;			/* the time they were worked out for */
 };
 
 struct key_range
@@ -47,7 +55,10 @@ struct key
   struct key_range accept;
 };
 
-extern void keychain_init (void);
+struct thread_master;
+
+extern void keychain_init (struct thread_master *);
+extern void keychain_add_hook (void (*) (const char *));
 extern struct keychain *keychain_lookup (const char *);
 extern struct key *key_lookup_for_accept (const struct keychain *, u_int32_t);
 extern struct key *key_match_for_accept (const struct keychain *, const char *);
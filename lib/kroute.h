@@ -46,6 +46,8 @@ typedef int socklen_t;
 #include <signal.h>
 #include <string.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <grp.h>
 #ifdef HAVE_STROPTS_H
 #include <stropts.h>
@@ -54,6 +56,24 @@ typedef int socklen_t;
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif /* HAVE_SYS_SELECT_H */
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif /* HAVE_EPOLL */
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif /* HAVE_TIMERFD */
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif /* HAVE_EVENTFD */
+#ifdef HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif /* HAVE_SIGNALFD */
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#endif /* HAVE_IO_URING */
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/param.h>
@@ -176,6 +196,12 @@ typedef int socklen_t;
 #define RT_TABLE_MAIN		0
 #endif /* HAVE_NETLINK */
 
+#ifdef HAVE_TPACKET_V3
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif /* HAVE_TPACKET_V3 */
+
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif /* HAVE_NETDB_H */
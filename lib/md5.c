@@ -371,3 +371,500 @@ caddr_t         digest;		/* caller digest to be filled in */
 					 * hash */
     MD5Final(digest, &context);	/* finish up 2nd pass */
 }
+
+/* RFC 2104 again, but with the key's inner and outer pads put through
+ * the compression function once, up front.  A message of up to 55
+ * bytes then costs one compression for each of the two passes, rather
+ * than two each.
+ */
+void
+hmac_md5_init (hmac_md5_ctxt *hctxt, const uint8_t *key, int key_len)
+{
+	uint8_t tk[16];
+	uint8_t k_ipad[MD5_BUFLEN];
+	uint8_t k_opad[MD5_BUFLEN];
+	md5_ctxt tctx;
+	int i;
+
+	if (key_len > MD5_BUFLEN) {
+		md5_init (&tctx);
+		md5_loop (&tctx, key, key_len);
+		md5_pad (&tctx);
+		md5_result (tk, &tctx);
+		key = tk;
+		key_len = 16;
+	}
+
+	memset (k_ipad, 0, sizeof (k_ipad));
+	memset (k_opad, 0, sizeof (k_opad));
+	memcpy (k_ipad, key, key_len);
+	memcpy (k_opad, key, key_len);
+	for (i = 0; i < MD5_BUFLEN; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	md5_init (&hctxt->inner);
+	md5_loop (&hctxt->inner, k_ipad, MD5_BUFLEN);
+	md5_init (&hctxt->outer);
+	md5_loop (&hctxt->outer, k_opad, MD5_BUFLEN);
+
+	memset (k_ipad, 0, sizeof (k_ipad));
+	memset (k_opad, 0, sizeof (k_opad));
+}
+
+void
+hmac_md5_digest (const hmac_md5_ctxt *hctxt, const void *text, int text_len,
+		 uint8_t *digest)
+{
+	md5_ctxt ctxt;
+
+	ctxt = hctxt->inner;
+	md5_loop (&ctxt, text, text_len);
+	md5_pad (&ctxt);
+	md5_result (digest, &ctxt);
+
+	ctxt = hctxt->outer;
+	md5_loop (&ctxt, digest, 16);
+	md5_pad (&ctxt);
+	md5_result (digest, &ctxt);
+}
+
+/*
+ * Multi-buffer MD5: many independent messages hashed side by side, one
+ * in each lane of the vector registers, 4 with SSE2 and 8 with AVX2.
+ * MD5 has no parallelism within a message, but none is needed across
+ * messages, so a batch of short ones, such as packets, costs about what
+ * a single one did.
+ */
+
+/* Messages set up at a time, each with room for its last, padded,
+ * block or two.
+ */
+#define MD5_MB_JOBS	16
+
+struct md5_mb_job {
+	md5_ctxt	*ctxt;
+	uint8_t		*digest;
+	const uint8_t	*data;		/* whole blocks, straight from text */
+	uint		nblocks;
+	uint		next;		/* block to do next */
+	uint		total;		/* nblocks and the ones in tail */
+	uint8_t		tail[2 * MD5_BUFLEN];
+};
+
+typedef void (*md5_calc_mb_t) (const uint8_t **, md5_ctxt **);
+
+static void md5_calc_x1(const uint8_t **b64, md5_ctxt **ctxt)
+{
+	md5_calc (b64[0], ctxt[0]);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_MD5_MB
+#include <immintrin.h>
+
+/* Unoptimised, every vector operation goes through memory, and the
+ * lanes come out slower than md5_calc.  The tree is built without -O,
+ * so the vector functions are optimised on their own.
+ */
+#define MD5_MB_TARGET(isa) __attribute__ ((target (isa), optimize ("O2")))
+
+/*
+ * The rounds of md5_calc, over whole vectors.  V names the operations
+ * for the vector width in use.
+ */
+#define MD5_MB_F(b, c, d) VXOR ((d), VAND ((b), VXOR ((c), (d))))
+#define MD5_MB_G(b, c, d) VXOR ((c), VAND ((d), VXOR ((b), (c))))
+#define MD5_MB_H(b, c, d) VXOR ((b), VXOR ((c), (d)))
+#define MD5_MB_I(b, c, d) VXOR ((c), VOR ((b), VXOR ((d), VONES)))
+
+#define MD5_MB_STEP(f, a, b, c, d, k, s, i) { \
+	(a) = VADD (VADD ((a), f ((b), (c), (d))), \
+		    VADD (X[(k)], VSET1 (T[(i)]))); \
+	(a) = VOR (VSHL ((a), (s)), VSHR ((a), 32 - (s))); \
+	(a) = VADD ((b), (a)); \
+}
+
+#define MD5_MB_ROUNDS(A, B, C, D) { \
+	MD5_MB_STEP (MD5_MB_F, A, B, C, D,  0, Sa,  1); \
+	MD5_MB_STEP (MD5_MB_F, D, A, B, C,  1, Sb,  2); \
+	MD5_MB_STEP (MD5_MB_F, C, D, A, B,  2, Sc,  3); \
+	MD5_MB_STEP (MD5_MB_F, B, C, D, A,  3, Sd,  4); \
+	MD5_MB_STEP (MD5_MB_F, A, B, C, D,  4, Sa,  5); \
+	MD5_MB_STEP (MD5_MB_F, D, A, B, C,  5, Sb,  6); \
+	MD5_MB_STEP (MD5_MB_F, C, D, A, B,  6, Sc,  7); \
+	MD5_MB_STEP (MD5_MB_F, B, C, D, A,  7, Sd,  8); \
+	MD5_MB_STEP (MD5_MB_F, A, B, C, D,  8, Sa,  9); \
+	MD5_MB_STEP (MD5_MB_F, D, A, B, C,  9, Sb, 10); \
+	MD5_MB_STEP (MD5_MB_F, C, D, A, B, 10, Sc, 11); \
+	MD5_MB_STEP (MD5_MB_F, B, C, D, A, 11, Sd, 12); \
+	MD5_MB_STEP (MD5_MB_F, A, B, C, D, 12, Sa, 13); \
+	MD5_MB_STEP (MD5_MB_F, D, A, B, C, 13, Sb, 14); \
+	MD5_MB_STEP (MD5_MB_F, C, D, A, B, 14, Sc, 15); \
+	MD5_MB_STEP (MD5_MB_F, B, C, D, A, 15, Sd, 16); \
+	\
+	MD5_MB_STEP (MD5_MB_G, A, B, C, D,  1, Se, 17); \
+	MD5_MB_STEP (MD5_MB_G, D, A, B, C,  6, Sf, 18); \
+	MD5_MB_STEP (MD5_MB_G, C, D, A, B, 11, Sg, 19); \
+	MD5_MB_STEP (MD5_MB_G, B, C, D, A,  0, Sh, 20); \
+	MD5_MB_STEP (MD5_MB_G, A, B, C, D,  5, Se, 21); \
+	MD5_MB_STEP (MD5_MB_G, D, A, B, C, 10, Sf, 22); \
+	MD5_MB_STEP (MD5_MB_G, C, D, A, B, 15, Sg, 23); \
+	MD5_MB_STEP (MD5_MB_G, B, C, D, A,  4, Sh, 24); \
+	MD5_MB_STEP (MD5_MB_G, A, B, C, D,  9, Se, 25); \
+	MD5_MB_STEP (MD5_MB_G, D, A, B, C, 14, Sf, 26); \
+	MD5_MB_STEP (MD5_MB_G, C, D, A, B,  3, Sg, 27); \
+	MD5_MB_STEP (MD5_MB_G, B, C, D, A,  8, Sh, 28); \
+	MD5_MB_STEP (MD5_MB_G, A, B, C, D, 13, Se, 29); \
+	MD5_MB_STEP (MD5_MB_G, D, A, B, C,  2, Sf, 30); \
+	MD5_MB_STEP (MD5_MB_G, C, D, A, B,  7, Sg, 31); \
+	MD5_MB_STEP (MD5_MB_G, B, C, D, A, 12, Sh, 32); \
+	\
+	MD5_MB_STEP (MD5_MB_H, A, B, C, D,  5, Si, 33); \
+	MD5_MB_STEP (MD5_MB_H, D, A, B, C,  8, Sj, 34); \
+	MD5_MB_STEP (MD5_MB_H, C, D, A, B, 11, Sk, 35); \
+	MD5_MB_STEP (MD5_MB_H, B, C, D, A, 14, Sl, 36); \
+	MD5_MB_STEP (MD5_MB_H, A, B, C, D,  1, Si, 37); \
+	MD5_MB_STEP (MD5_MB_H, D, A, B, C,  4, Sj, 38); \
+	MD5_MB_STEP (MD5_MB_H, C, D, A, B,  7, Sk, 39); \
+	MD5_MB_STEP (MD5_MB_H, B, C, D, A, 10, Sl, 40); \
+	MD5_MB_STEP (MD5_MB_H, A, B, C, D, 13, Si, 41); \
+	MD5_MB_STEP (MD5_MB_H, D, A, B, C,  0, Sj, 42); \
+	MD5_MB_STEP (MD5_MB_H, C, D, A, B,  3, Sk, 43); \
+	MD5_MB_STEP (MD5_MB_H, B, C, D, A,  6, Sl, 44); \
+	MD5_MB_STEP (MD5_MB_H, A, B, C, D,  9, Si, 45); \
+	MD5_MB_STEP (MD5_MB_H, D, A, B, C, 12, Sj, 46); \
+	MD5_MB_STEP (MD5_MB_H, C, D, A, B, 15, Sk, 47); \
+	MD5_MB_STEP (MD5_MB_H, B, C, D, A,  2, Sl, 48); \
+	\
+	MD5_MB_STEP (MD5_MB_I, A, B, C, D,  0, Sm, 49); \
+	MD5_MB_STEP (MD5_MB_I, D, A, B, C,  7, Sn, 50); \
+	MD5_MB_STEP (MD5_MB_I, C, D, A, B, 14, So, 51); \
+	MD5_MB_STEP (MD5_MB_I, B, C, D, A,  5, Sp, 52); \
+	MD5_MB_STEP (MD5_MB_I, A, B, C, D, 12, Sm, 53); \
+	MD5_MB_STEP (MD5_MB_I, D, A, B, C,  3, Sn, 54); \
+	MD5_MB_STEP (MD5_MB_I, C, D, A, B, 10, So, 55); \
+	MD5_MB_STEP (MD5_MB_I, B, C, D, A,  1, Sp, 56); \
+	MD5_MB_STEP (MD5_MB_I, A, B, C, D,  8, Sm, 57); \
+	MD5_MB_STEP (MD5_MB_I, D, A, B, C, 15, Sn, 58); \
+	MD5_MB_STEP (MD5_MB_I, C, D, A, B,  6, So, 59); \
+	MD5_MB_STEP (MD5_MB_I, B, C, D, A, 13, Sp, 60); \
+	MD5_MB_STEP (MD5_MB_I, A, B, C, D,  4, Sm, 61); \
+	MD5_MB_STEP (MD5_MB_I, D, A, B, C, 11, Sn, 62); \
+	MD5_MB_STEP (MD5_MB_I, C, D, A, B,  2, So, 63); \
+	MD5_MB_STEP (MD5_MB_I, B, C, D, A,  9, Sp, 64); \
+}
+
+/*
+ * Words 4j to 4j + 3 of four blocks, turned so that each vector holds
+ * one word from every block.
+ */
+static void md5_transpose_x4(const uint8_t **b64, int j, __m128i *X)
+	MD5_MB_TARGET ("sse2");
+static void md5_transpose_x4(const uint8_t **b64, int j, __m128i *X)
+{
+	__m128i r0, r1, r2, r3, t0, t1, t2, t3;
+
+	r0 = _mm_loadu_si128 ((const __m128i *) (b64[0] + 16 * j));
+	r1 = _mm_loadu_si128 ((const __m128i *) (b64[1] + 16 * j));
+	r2 = _mm_loadu_si128 ((const __m128i *) (b64[2] + 16 * j));
+	r3 = _mm_loadu_si128 ((const __m128i *) (b64[3] + 16 * j));
+	t0 = _mm_unpacklo_epi32 (r0, r1);
+	t1 = _mm_unpacklo_epi32 (r2, r3);
+	t2 = _mm_unpackhi_epi32 (r0, r1);
+	t3 = _mm_unpackhi_epi32 (r2, r3);
+	X[4 * j + 0] = _mm_unpacklo_epi64 (t0, t1);
+	X[4 * j + 1] = _mm_unpackhi_epi64 (t0, t1);
+	X[4 * j + 2] = _mm_unpacklo_epi64 (t2, t3);
+	X[4 * j + 3] = _mm_unpackhi_epi64 (t2, t3);
+}
+
+#define VADD	_mm_add_epi32
+#define VAND	_mm_and_si128
+#define VOR	_mm_or_si128
+#define VXOR	_mm_xor_si128
+#define VSHL	_mm_slli_epi32
+#define VSHR	_mm_srli_epi32
+#define VSET1	_mm_set1_epi32
+#define VONES	_mm_set1_epi32 (-1)
+
+static void md5_calc_x4(const uint8_t **b64, md5_ctxt **ctxt)
+	MD5_MB_TARGET ("sse2");
+static void md5_calc_x4(const uint8_t **b64, md5_ctxt **ctxt)
+{
+	__m128i X[16];
+	__m128i A, B, C, D, AA, BB, CC, DD;
+	uint32_t st[4][4];
+	int j;
+
+	for (j = 0; j < 4; j++)
+		md5_transpose_x4 (b64, j, X);
+
+	AA = A = _mm_setr_epi32 (ctxt[0]->md5_sta, ctxt[1]->md5_sta,
+				 ctxt[2]->md5_sta, ctxt[3]->md5_sta);
+	BB = B = _mm_setr_epi32 (ctxt[0]->md5_stb, ctxt[1]->md5_stb,
+				 ctxt[2]->md5_stb, ctxt[3]->md5_stb);
+	CC = C = _mm_setr_epi32 (ctxt[0]->md5_stc, ctxt[1]->md5_stc,
+				 ctxt[2]->md5_stc, ctxt[3]->md5_stc);
+	DD = D = _mm_setr_epi32 (ctxt[0]->md5_std, ctxt[1]->md5_std,
+				 ctxt[2]->md5_std, ctxt[3]->md5_std);
+
+	MD5_MB_ROUNDS (A, B, C, D);
+
+	_mm_storeu_si128 ((__m128i *) st[0], VADD (A, AA));
+	_mm_storeu_si128 ((__m128i *) st[1], VADD (B, BB));
+	_mm_storeu_si128 ((__m128i *) st[2], VADD (C, CC));
+	_mm_storeu_si128 ((__m128i *) st[3], VADD (D, DD));
+	for (j = 0; j < 4; j++) {
+		ctxt[j]->md5_sta = st[0][j];
+		ctxt[j]->md5_stb = st[1][j];
+		ctxt[j]->md5_stc = st[2][j];
+		ctxt[j]->md5_std = st[3][j];
+	}
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VSHL
+#undef VSHR
+#undef VSET1
+#undef VONES
+
+#define VADD	_mm256_add_epi32
+#define VAND	_mm256_and_si256
+#define VOR	_mm256_or_si256
+#define VXOR	_mm256_xor_si256
+#define VSHL	_mm256_slli_epi32
+#define VSHR	_mm256_srli_epi32
+#define VSET1	_mm256_set1_epi32
+#define VONES	_mm256_set1_epi32 (-1)
+
+static void md5_calc_x8(const uint8_t **b64, md5_ctxt **ctxt)
+	MD5_MB_TARGET ("avx2");
+static void md5_calc_x8(const uint8_t **b64, md5_ctxt **ctxt)
+{
+	__m128i lo[16], hi[16];
+	__m256i X[16];
+	__m256i A, B, C, D, AA, BB, CC, DD;
+	uint32_t st[4][8];
+	int j;
+
+	/* Two sets of four, side by side. */
+	for (j = 0; j < 4; j++) {
+		md5_transpose_x4 (b64, j, lo);
+		md5_transpose_x4 (b64 + 4, j, hi);
+	}
+	for (j = 0; j < 16; j++)
+		X[j] = _mm256_inserti128_si256 (_mm256_castsi128_si256 (lo[j]),
+						hi[j], 1);
+
+	for (j = 0; j < 8; j++) {
+		st[0][j] = ctxt[j]->md5_sta;
+		st[1][j] = ctxt[j]->md5_stb;
+		st[2][j] = ctxt[j]->md5_stc;
+		st[3][j] = ctxt[j]->md5_std;
+	}
+	AA = A = _mm256_loadu_si256 ((const __m256i *) st[0]);
+	BB = B = _mm256_loadu_si256 ((const __m256i *) st[1]);
+	CC = C = _mm256_loadu_si256 ((const __m256i *) st[2]);
+	DD = D = _mm256_loadu_si256 ((const __m256i *) st[3]);
+
+	MD5_MB_ROUNDS (A, B, C, D);
+
+	_mm256_storeu_si256 ((__m256i *) st[0], VADD (A, AA));
+	_mm256_storeu_si256 ((__m256i *) st[1], VADD (B, BB));
+	_mm256_storeu_si256 ((__m256i *) st[2], VADD (C, CC));
+	_mm256_storeu_si256 ((__m256i *) st[3], VADD (D, DD));
+	_mm256_zeroupper ();
+	for (j = 0; j < 8; j++) {
+		ctxt[j]->md5_sta = st[0][j];
+		ctxt[j]->md5_stb = st[1][j];
+		ctxt[j]->md5_stc = st[2][j];
+		ctxt[j]->md5_std = st[3][j];
+	}
+}
+
+#undef VADD
+#undef VAND
+#undef VOR
+#undef VXOR
+#undef VSHL
+#undef VSHR
+#undef VSET1
+#undef VONES
+#endif /* __GNUC__ && x86 */
+
+/* How many lanes to hash n messages in, and the compression function
+ * for them.  Idle lanes cost as much as busy ones, so a few messages
+ * take narrower vectors, and one takes none.
+ */
+static int md5_mb_lanes(int n, md5_calc_mb_t *calc)
+{
+#ifdef HAVE_MD5_MB
+	if (n > 4 && __builtin_cpu_supports ("avx2")) {
+		*calc = md5_calc_x8;
+		return 8;
+	}
+	if (n > 1 && __builtin_cpu_supports ("sse2")) {
+		*calc = md5_calc_x4;
+		return 4;
+	}
+#endif /* HAVE_MD5_MB */
+	*calc = md5_calc_x1;
+	return 1;
+}
+
+/*
+ * Lay out what md5_loop and md5_pad would do with text, as whole blocks
+ * of text and a padded tail.  A context with bytes already buffered
+ * takes the text the usual way first.
+ */
+static void md5_mb_job_init(struct md5_mb_job *job, md5_ctxt *ctxt,
+			    const void *text, uint len, uint8_t *digest)
+{
+	const uint8_t *rest;
+	uint restlen, taillen, i;
+
+	job->ctxt = ctxt;
+	job->digest = digest;
+	job->next = 0;
+	if (ctxt->md5_i == 0) {
+		job->data = text;
+		job->nblocks = len / MD5_BUFLEN;
+		rest = job->data + job->nblocks * MD5_BUFLEN;
+		restlen = len % MD5_BUFLEN;
+		ctxt->md5_n += (uint64_t) len * 8;
+	} else {
+		md5_loop (ctxt, text, len);
+		job->data = NULL;
+		job->nblocks = 0;
+		rest = ctxt->md5_buf;
+		restlen = ctxt->md5_i;
+	}
+
+	taillen = restlen < MD5_BUFLEN - 8 ? MD5_BUFLEN : 2 * MD5_BUFLEN;
+	memcpy (job->tail, rest, restlen);
+	memcpy (job->tail + restlen, md5_paddat, taillen - 8 - restlen);
+	for (i = 0; i < 8; i++)
+		job->tail[taillen - 8 + i] = (ctxt->md5_n >> (8 * i)) & 0xff;
+	job->total = job->nblocks + taillen / MD5_BUFLEN;
+}
+
+/*
+ * Keep every lane busy with the next block of some job until all are
+ * done.  Jobs of the same length go through in step.
+ */
+static void md5_mb_run(struct md5_mb_job *jobs, int n)
+{
+	static const uint8_t idle_block[MD5_BUFLEN];
+	md5_calc_mb_t calc;
+	struct md5_mb_job *lane[8];
+	const uint8_t *b64[8];
+	md5_ctxt *ctxt[8];
+	md5_ctxt idle;
+	struct md5_mb_job *job;
+	int lanes, l, busy, next = 0;
+
+	lanes = md5_mb_lanes (n, &calc);
+	memset (lane, 0, sizeof (lane));
+
+	for (;;) {
+		busy = 0;
+		for (l = 0; l < lanes; l++) {
+			if (lane[l] == NULL && next < n)
+				lane[l] = &jobs[next++];
+			if ((job = lane[l]) == NULL) {
+				b64[l] = idle_block;
+				ctxt[l] = &idle;
+				continue;
+			}
+			busy++;
+			b64[l] = job->next < job->nblocks
+			    ? job->data + job->next * MD5_BUFLEN
+			    : job->tail + (job->next - job->nblocks) * MD5_BUFLEN;
+			ctxt[l] = job->ctxt;
+		}
+		if (busy == 0)
+			break;
+
+		(*calc) (b64, ctxt);
+
+		for (l = 0; l < lanes; l++) {
+			if ((job = lane[l]) == NULL)
+				continue;
+			if (++job->next == job->total) {
+				md5_result (job->digest, job->ctxt);
+				lane[l] = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * For each i, what md5_loop of text[i], then MD5Final, would do with
+ * ctxt[i], hashing them side by side.  digest[i] may be text[i].
+ */
+void md5_final_mb(md5_ctxt **ctxt, const void **text, const uint *len,
+		  uint8_t **digest, int n)
+{
+	struct md5_mb_job jobs[MD5_MB_JOBS];
+	int i, m;
+
+	for (; n > 0; n -= m) {
+		m = n < MD5_MB_JOBS ? n : MD5_MB_JOBS;
+		for (i = 0; i < m; i++)
+			md5_mb_job_init (&jobs[i], ctxt[i], text[i], len[i],
+					 digest[i]);
+		md5_mb_run (jobs, m);
+
+		ctxt += m;
+		text += m;
+		len += m;
+		digest += m;
+	}
+}
+
+/* hmac_md5_digest for each i, side by side. */
+void
+hmac_md5_digest_mb (const hmac_md5_ctxt **hctxt, const void **text,
+		    const uint *text_len, uint8_t **digest, int n)
+{
+	md5_ctxt ctx[MD5_MB_JOBS], *ctxp[MD5_MB_JOBS];
+	const void *inner[MD5_MB_JOBS];
+	uint len[MD5_MB_JOBS];
+	md5_calc_mb_t calc;
+	int i, m;
+
+	/* Nothing to gain from setting them up side by side. */
+	if (md5_mb_lanes (n, &calc) == 1) {
+		for (i = 0; i < n; i++)
+			hmac_md5_digest (hctxt[i], text[i], text_len[i],
+					 digest[i]);
+		return;
+	}
+
+	for (; n > 0; n -= m) {
+		m = n < MD5_MB_JOBS ? n : MD5_MB_JOBS;
+
+		for (i = 0; i < m; i++) {
+			ctx[i] = hctxt[i]->inner;
+			ctxp[i] = &ctx[i];
+		}
+		md5_final_mb (ctxp, text, text_len, digest, m);
+
+		for (i = 0; i < m; i++) {
+			ctx[i] = hctxt[i]->outer;
+			inner[i] = digest[i];
+			len[i] = 16;
+		}
+		md5_final_mb (ctxp, inner, len, digest, m);
+
+		hctxt += m;
+		text += m;
+		text_len += m;
+		digest += m;
+	}
+}
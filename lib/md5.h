@@ -86,4 +86,21 @@ do {				\
 void hmac_md5(unsigned char* text, int text_len, unsigned char* key,
               int key_len, caddr_t digest);
 
+/* HMAC-MD5 keyed once, for signing many messages with the same key. */
+typedef struct {
+	md5_ctxt inner;		/* after K XOR ipad */
+	md5_ctxt outer;		/* after K XOR opad */
+} hmac_md5_ctxt;
+
+extern void hmac_md5_init (hmac_md5_ctxt *, const uint8_t *, int);
+extern void hmac_md5_digest (const hmac_md5_ctxt *, const void *, int,
+			     uint8_t *);
+
+/* The same for many messages at once, hashed side by side in vector
+   registers where the CPU has them. */
+extern void md5_final_mb (md5_ctxt **, const void **, const uint *,
+			  uint8_t **, int);
+extern void hmac_md5_digest_mb (const hmac_md5_ctxt **, const void **,
+				const uint *, uint8_t **, int);
+
 #endif /* ! _LIBKROUTE_MD5_H_*/
@@ -246,18 +246,19 @@ static struct
 } mstat [MTYPE_MAX];
 #endif /* MEMORY_LOG */
 
-/* Increment allocation counter. */
+/* Increment allocation counter.  Atomic, as memory may be allocated
+   from more than one pthread. */
 static void
 alloc_inc (int type)
 {
-  mstat[type].alloc++;
+  __atomic_add_fetch (&mstat[type].alloc, 1, __ATOMIC_RELAXED);
 }
 
 /* Decrement allocation counter. */
 static void
 alloc_dec (int type)
 {
-  mstat[type].alloc--;
+  __atomic_sub_fetch (&mstat[type].alloc, 1, __ATOMIC_RELAXED);
 }
 
 /* Looking up memory status from vty interface. */
@@ -22,6 +22,7 @@ struct memory_list memory_list_lib[] =
   { MTYPE_THREAD_MASTER,	"Thread master"			},
   { MTYPE_THREAD_STATS,		"Thread stats"			},
   { MTYPE_THREAD_FUNCNAME,	"Thread function name" 		},
+  { MTYPE_THREAD_POLL,		"Thread poll backend"		},
   { MTYPE_VTY,			"VTY"				},
   { MTYPE_VTY_OUT_BUF,		"VTY output buffer"		},
   { MTYPE_VTY_HIST,		"VTY history"			},
@@ -58,6 +59,7 @@ struct memory_list memory_list_lib[] =
   { MTYPE_DESC,			"Command desc"			},
   { MTYPE_KEY,			"Key"				},
   { MTYPE_KEYCHAIN,		"Key chain"			},
+  { MTYPE_KEYCHAIN_SCHEDULE,	"Key chain schedule"		},
   { MTYPE_IF_RMAP,		"Interface route map"		},
   { MTYPE_IF_RMAP_NAME,		"I.f. route map name",		},
   { MTYPE_SOCKUNION,		"Socket union"			},
@@ -69,6 +71,10 @@ struct memory_list memory_list_lib[] =
   { MTYPE_WORK_QUEUE_NAME,	"Work queue name string"	},
   { MTYPE_PQUEUE,		"Priority queue"		},
   { MTYPE_PQUEUE_DATA,		"Priority queue data"		},
+  { MTYPE_SPSCQ,		"SPSC queue"			},
+  { MTYPE_SPSCQ_RING,		"SPSC queue ring"		},
+  { MTYPE_JOBPOOL,		"Job pool"			},
+  { MTYPE_JOB,			"Job"				},
   { MTYPE_HOST,			"Host config"			},
   { -1, NULL },
 };
@@ -77,6 +83,11 @@ struct memory_list memory_list_ha[] =
 {
   { MTYPE_HA_TOP,			"HA Top"		},
   { MTYPE_HA_IF_INFO,       "HA Interface info"        },
+  { MTYPE_HA_GROUP,		"HA group"		},
+  { MTYPE_HA_PEER,		"HA peer"		},
+  { MTYPE_HA_BATCH,		"HA packet batch"	},
+  { MTYPE_HA_AUTH,		"HA authentication"	},
+  { MTYPE_HA_NEIGHBOR,		"HA neighbor"		},
   { -1, NULL },
 };
 
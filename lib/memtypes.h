@@ -16,6 +16,7 @@ enum
   MTYPE_THREAD_MASTER,
   MTYPE_THREAD_STATS,
   MTYPE_THREAD_FUNCNAME,
+  MTYPE_THREAD_POLL,
   MTYPE_VTY,
   MTYPE_VTY_OUT_BUF,
   MTYPE_VTY_HIST,
@@ -52,6 +53,7 @@ enum
   MTYPE_DESC,
   MTYPE_KEY,
   MTYPE_KEYCHAIN,
+  MTYPE_KEYCHAIN_SCHEDULE,
   MTYPE_IF_RMAP,
   MTYPE_IF_RMAP_NAME,
   MTYPE_SOCKUNION,
@@ -63,6 +65,10 @@ enum
   MTYPE_WORK_QUEUE_NAME,
   MTYPE_PQUEUE,
   MTYPE_PQUEUE_DATA,
+  MTYPE_SPSCQ,
+  MTYPE_SPSCQ_RING,
+  MTYPE_JOBPOOL,
+  MTYPE_JOB,
   MTYPE_HOST,
   MTYPE_RTADV_PREFIX,
   MTYPE_VRF,
@@ -199,6 +205,11 @@ enum
   MTYPE_VTYSH_CONFIG_LINE,
   MTYPE_HA_TOP,
   MTYPE_HA_IF_INFO,
+  MTYPE_HA_GROUP,
+  MTYPE_HA_PEER,
+  MTYPE_HA_BATCH,
+  MTYPE_HA_AUTH,
+  MTYPE_HA_NEIGHBOR,
   MTYPE_MAX,
 };
 
@@ -168,3 +168,18 @@ pqueue_dequeue (struct pqueue *queue)
   trickle_down (0, queue);
   return data;
 }
+
+/* Remove the node at INDEX, e.g. as tracked through the update
+   callback, restoring heap order around the node moved into its place. */
+void
+pqueue_remove_at (int index, struct pqueue *queue)
+{
+  queue->array[index] = queue->array[--queue->size];
+
+  if (index > 0
+      && (*queue->cmp) (queue->array[index],
+                        queue->array[PARENT_OF (index)]) < 0)
+    trickle_up (index, queue);
+  else
+    trickle_down (index, queue);
+}
@@ -22,6 +22,7 @@
 #include <kroute.h>
 #include <sigevent.h>
 #include <log.h>
+#include <network.h>
 
 #ifdef SA_SIGINFO
 #ifdef HAVE_UCONTEXT_H
@@ -45,6 +46,11 @@ struct bane_sigevent_master_t
   int sigc;
   
   volatile sig_atomic_t caught;
+
+#ifdef HAVE_SIGNALFD
+  int fd;
+  struct thread *t_read;
+#endif /* HAVE_SIGNALFD */
 } sigmaster;
 
 /* Generic signal handler 
@@ -120,6 +126,87 @@ bane_sigevent_process (void)
   return 0;
 }
 
+#ifdef HAVE_SIGNALFD
+/* Read thread on the signalfd, runs the handlers of what it reads. */
+static int
+bane_signalfd_read (struct thread *t)
+{
+  struct signalfd_siginfo si[8];
+  ssize_t nbytes;
+  size_t i;
+  int j;
+
+  while ((nbytes = read (sigmaster.fd, si, sizeof (si))) > 0)
+    for (i = 0; i < nbytes / sizeof (si[0]); i++)
+      for (j = 0; j < sigmaster.sigc; j++)
+        if (sigmaster.signals[j].signal == (int) si[i].ssi_signo)
+          sigmaster.signals[j].handler ();
+
+  if (nbytes < 0 && !ERRNO_IO_RETRY (errno))
+    zlog_warn ("signalfd read: %s", safe_strerror (errno));
+  return 0;
+}
+
+/* Block the signals and take them from a signalfd instead, so they
+ * are just another read for the event loop.  Nothing needs checking
+ * on every pass of thread_fetch, and a signal arriving between passes
+ * is not left waiting on the poll timeout.  Any pthreads must be
+ * created after this, so they inherit the mask.
+ */
+static int
+signalfd_init (struct thread_master *m)
+{
+  sigset_t mask;
+  int i;
+
+  sigemptyset (&mask);
+  for (i = 0; i < sigmaster.sigc; i++)
+    sigaddset (&mask, sigmaster.signals[i].signal);
+
+  sigmaster.fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigmaster.fd < 0)
+    {
+      zlog_warn ("signalfd: %s, falling back to signal handlers",
+                 safe_strerror (errno));
+      return -1;
+    }
+
+  if (sigprocmask (SIG_BLOCK, &mask, NULL) < 0)
+    {
+      zlog_warn ("signalfd: can't block signals: %s, falling back to "
+                 "signal handlers", safe_strerror (errno));
+      close (sigmaster.fd);
+      sigmaster.fd = -1;
+      return -1;
+    }
+
+  sigmaster.t_read = thread_add_read_persist (m, bane_signalfd_read, NULL,
+                                              sigmaster.fd);
+  thread_set_priority (sigmaster.t_read, THREAD_PRIO_CRITICAL);
+  return 0;
+}
+#endif /* HAVE_SIGNALFD */
+
+/* A signalfd only wakes the poll of the process that armed it, and
+   reads the signals of whoever reads it, so a child must arm it over
+   again or it never hears of its own signals. */
+void
+signal_after_fork (void)
+{
+#ifdef HAVE_SIGNALFD
+  struct thread_master *m;
+
+  if (sigmaster.t_read == NULL)
+    return;
+
+  m = sigmaster.t_read->master;
+  thread_cancel (sigmaster.t_read);
+  sigmaster.t_read = thread_add_read_persist (m, bane_signalfd_read, NULL,
+                                              sigmaster.fd);
+  thread_set_priority (sigmaster.t_read, THREAD_PRIO_CRITICAL);
+#endif /* HAVE_SIGNALFD */
+}
+
 #ifdef SIGEVENT_SCHEDULE_THREAD
 /* timer thread to check signals. Shouldnt be needed */
 int
@@ -321,6 +408,8 @@ signal_init (struct thread_master *m, int sigc,
      the application. */
   trap_default_signals();
   
+  /* The handlers are set even when they are taken from a signalfd, an
+     ignored signal would otherwise be discarded before it got there. */
   while (i < sigc)
     {
       sig = &signals[i];
@@ -332,6 +421,15 @@ signal_init (struct thread_master *m, int sigc,
   sigmaster.sigc = sigc;
   sigmaster.signals = signals;
 
+#ifdef HAVE_SIGNALFD
+  if (signalfd_init (m) == 0)
+    return;
+#endif /* HAVE_SIGNALFD */
+
+  /* Only this master runs the handlers, others may be in pthreads of
+     their own. */
+  m->sigevents = 1;
+
 #ifdef SIGEVENT_SCHEDULE_THREAD  
   sigmaster.t = 
     thread_add_timer (m, bane_signal_timer, &sigmaster, 
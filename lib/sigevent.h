@@ -43,10 +43,17 @@ struct bane_signal_t
  * - number of elements in passed in signals array
  * - array of bane_signal_t's describing signals to handle
  *   and handlers to use for each signal
+ *
+ * the handlers are run from a thread on the master, reading a signalfd
+ * where there is one, or else from thread_fetch once the signal has
+ * been caught.  Either way, call it before creating any pthreads.
  */
 extern void signal_init (struct thread_master *m, int sigc, 
                          struct bane_signal_t *signals);
 
+/* to be called in the child after fork (), daemon () included */
+extern void signal_after_fork (void);
+
 /* check whether there are signals to handle, process any found */
 extern int bane_sigevent_process (void);
 
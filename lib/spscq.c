@@ -0,0 +1,169 @@
+/*
+ * Bane single producer, single consumer message queue.
+ *
+ * This file is part of Bane.
+ *
+ * Bane is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * Bane is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bane; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include <kroute.h>
+
+#include "thread.h"
+#include "memory.h"
+#include "log.h"
+#include "network.h"
+#include "spscq.h"
+
+/* How long spscq_put_wait sleeps between looks at a full ring. */
+#define SPSCQ_PUT_WAIT_USEC 100
+
+struct spscq *
+spscq_new (const char *name, unsigned int size)
+{
+  struct spscq *q;
+  unsigned int n;
+
+  /* Round up to a power of two, so indexes can be masked. */
+  for (n = 1; n < size; n <<= 1)
+    ;
+
+  q = XCALLOC (MTYPE_SPSCQ, sizeof (struct spscq));
+  q->name = name;
+  q->size = n;
+  q->ring = XCALLOC (MTYPE_SPSCQ_RING, n * sizeof (struct spscq_msg));
+
+#ifdef HAVE_EVENTFD
+  q->fd[0] = q->fd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->fd[0] >= 0)
+    return q;
+  zlog_warn ("%s: eventfd: %s, using a pipe", name, safe_strerror (errno));
+#endif /* HAVE_EVENTFD */
+
+  if (pipe (q->fd) < 0)
+    {
+      zlog_err ("%s: pipe: %s", name, safe_strerror (errno));
+      XFREE (MTYPE_SPSCQ_RING, q->ring);
+      XFREE (MTYPE_SPSCQ, q);
+      return NULL;
+    }
+  set_nonblocking (q->fd[0]);
+  set_nonblocking (q->fd[1]);
+  return q;
+}
+
+/* Only the consumer may free a queue, once the producer is gone. */
+void
+spscq_free (struct spscq *q)
+{
+  if (q->t_read)
+    thread_cancel (q->t_read);
+  close (q->fd[0]);
+  if (q->fd[1] != q->fd[0])
+    close (q->fd[1]);
+  XFREE (MTYPE_SPSCQ_RING, q->ring);
+  XFREE (MTYPE_SPSCQ, q);
+}
+
+static void
+spscq_wake (struct spscq *q)
+{
+  u_int64_t one = 1;
+
+  /* A full pipe or a saturated eventfd is already a wakeup. */
+  if (write (q->fd[1], &one, (q->fd[1] == q->fd[0]) ? sizeof (one) : 1) < 0
+      && !ERRNO_IO_RETRY (errno))
+    zlog_warn ("%s: wakeup: %s", q->name, safe_strerror (errno));
+}
+
+static void
+spscq_drain (struct spscq *q)
+{
+  u_int64_t buf[8];
+
+  while (read (q->fd[0], buf, sizeof (buf)) > 0
+	 && q->fd[0] != q->fd[1])
+    ;
+}
+
+int
+spscq_put (struct spscq *q, int (*func) (void *), void *arg)
+{
+  unsigned int tail = q->tail;
+  struct spscq_msg *msg;
+
+  if (tail - __atomic_load_n (&q->head, __ATOMIC_ACQUIRE) >= q->size)
+    {
+      q->drops++;
+      return -1;
+    }
+
+  msg = &q->ring[tail & (q->size - 1)];
+  msg->func = func;
+  msg->arg = arg;
+  __atomic_store_n (&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  /* The consumer only goes back to sleep once head has caught up with
+     a tail it loaded after storing head.  So if it has not caught up
+     with this message it is bound to see it, and if it has it may be
+     asleep. */
+  if (__atomic_load_n (&q->head, __ATOMIC_SEQ_CST) == tail)
+    spscq_wake (q);
+
+  return 0;
+}
+
+/* Producer side, for a producer the consumer never waits on: wait for
+   the consumer to make room instead of failing.  The consumer empties
+   the ring each time it runs, so this waits for one pass of its
+   thread master at most. */
+void
+spscq_put_wait (struct spscq *q, int (*func) (void *), void *arg)
+{
+  while (q->tail - __atomic_load_n (&q->head, __ATOMIC_ACQUIRE) >= q->size)
+    usleep (SPSCQ_PUT_WAIT_USEC);
+
+  spscq_put (q, func, arg);
+}
+
+static int
+spscq_read (struct thread *thread)
+{
+  struct spscq *q = THREAD_ARG (thread);
+  struct spscq_msg msg;
+  unsigned int head, tail;
+
+  spscq_drain (q);
+
+  head = q->head;
+  while (head != (tail = __atomic_load_n (&q->tail, __ATOMIC_SEQ_CST)))
+    while (head != tail)
+      {
+	msg = q->ring[head & (q->size - 1)];
+	/* Hand the slot back before running the message, which may
+	   well put another one on a queue going the other way. */
+	__atomic_store_n (&q->head, ++head, __ATOMIC_SEQ_CST);
+	(*msg.func) (msg.arg);
+      }
+
+  return 0;
+}
+
+void
+spscq_start (struct spscq *q, struct thread_master *m, int priority)
+{
+  q->t_read = thread_add_read_persist (m, spscq_read, q, q->fd[0]);
+  thread_set_priority (q->t_read, priority);
+}
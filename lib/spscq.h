@@ -0,0 +1,80 @@
+/*
+ * Bane single producer, single consumer message queue.
+ *
+ * This file is part of Bane.
+ *
+ * Bane is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * Bane is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bane; see the file COPYING.  If not, write to the Free
+ * Software Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _BANE_SPSCQ_H
+#define _BANE_SPSCQ_H
+
+/* Passes function calls from one pthread to another one running its
+ * own thread_master.  The ring is lock free, and the consumer is woken
+ * through an eventfd (or a pipe) that is a read thread on its master.
+ *
+ * Exactly one pthread may put messages on a queue, and the messages
+ * are only ever run from the consumer's thread_master.
+ */
+
+/* A message is a function to call on the consumer side. */
+struct spscq_msg
+{
+  int (*func) (void *);
+  void *arg;
+};
+
+struct spscq
+{
+  const char *name;
+
+  /* Ring of size slots, size is a power of two. */
+  struct spscq_msg *ring;
+  unsigned int size;
+
+  /* Free running indexes, tail is only written by the producer and
+     head only by the consumer.  Kept apart so they don't share a
+     cache line. */
+  unsigned int tail;
+  char pad[64 - sizeof (unsigned int)];
+  unsigned int head;
+
+  /* fd[0] is read by the consumer, fd[1] written by the producer.
+     They are the same eventfd when it is available. */
+  int fd[2];
+  struct thread *t_read;
+
+  /* Messages refused because the ring was full. */
+  unsigned long drops;
+};
+
+extern struct spscq *spscq_new (const char *name, unsigned int size);
+extern void spscq_free (struct spscq *);
+
+/* Consumer side: run the queue's messages from a thread master.  Must
+   be called from the pthread that owns it, or before that pthread is
+   started. */
+extern void spscq_start (struct spscq *, struct thread_master *,
+			 int priority);
+
+/* Producer side: returns 0, or -1 if the ring is full. */
+extern int spscq_put (struct spscq *, int (*func) (void *), void *arg);
+/* The same, but waits for room, for a producer the consumer never
+   waits on. */
+extern void spscq_put_wait (struct spscq *, int (*func) (void *),
+			    void *arg);
+
+#endif /* _BANE_SPSCQ_H */
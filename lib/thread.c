@@ -29,17 +29,42 @@
 #include "hash.h"
 #include "command.h"
 #include "sigevent.h"
+#include "pqueue.h"
 
-/* Recent absolute time of day */
-struct timeval recent_time;
-static struct timeval last_recent_time;
+/* Recent absolute time of day.  These are per pthread, each thread
+   master's timers are only compared against its own pthread's clock. */
+__thread struct timeval recent_time;
+static __thread struct timeval last_recent_time;
 /* Relative time, since startup */
-static struct timeval relative_time;
+static __thread struct timeval relative_time;
 static struct timeval relative_time_base;
 /* init flag */
 static unsigned short timers_inited;
 
-static struct hash *cpu_record = NULL;
+/* Every thread master keeps its own cpu_record, so the heartbeat
+   pthread never updates an entry the main one is updating too.  show
+   and clear walk the list of masters under this lock, and each
+   master's cpu_record under its own. */
+static struct thread_master *thread_masters;
+static pthread_mutex_t thread_masters_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_RUSAGE
+/* How thread_call measures cpu time, and for 1 in how many calls. */
+static enum thread_cpu_mode thread_cpu_mode = THREAD_CPU_RUSAGE;
+static unsigned int thread_cpu_sample = 1;
+static const char *thread_cpu_mode_str[] =
+{
+  "rusage",
+  "thread-cputime",
+  "wall",
+};
+#endif /* HAVE_RUSAGE */
+
+/* High resolution timers need the timerfd to be on the same clock as
+   relative_time. */
+#if defined (HAVE_TIMERFD) && defined (HAVE_CLOCK_MONOTONIC)
+#define USE_TIMERFD
+#endif
 
 /* Struct timeval's tv_usec one second value.  */
 #define TIMER_SECOND_MICRO 1000000L
@@ -216,6 +241,33 @@ recent_relative_time (void)
   return relative_time;
 }
 
+/* Trim blankspace and "()"s */
+static char *
+strip_funcname (const char *funcname) 
+{
+  char buff[100];
+  char tmp, *ret, *e, *b = buff;
+
+  strncpy(buff, funcname, sizeof(buff));
+  buff[ sizeof(buff) -1] = '\0';
+  e = buff +strlen(buff) -1;
+
+  /* Wont work for funcname ==  "Word (explanation)"  */
+
+  while (*b == ' ' || *b == '(')
+    ++b;
+  while (*e == ' ' || *e == ')')
+    --e;
+  e++;
+
+  tmp = *e;
+  *e = '\0';
+  ret  = XSTRDUP (MTYPE_THREAD_FUNCNAME, b);
+  *e = tmp;
+
+  return ret;
+}
+
 static unsigned int
 cpu_record_hash_key (struct cpu_thread_history *a)
 {
@@ -235,7 +287,8 @@ cpu_record_hash_alloc (struct cpu_thread_history *a)
   struct cpu_thread_history *new;
   new = XCALLOC (MTYPE_THREAD_STATS, sizeof (struct cpu_thread_history));
   new->func = a->func;
-  new->funcname = XSTRDUP(MTYPE_THREAD_FUNCNAME, a->funcname);
+  new->funcname = strip_funcname (a->funcname);
+  new->master = a->master;
   return new;
 }
 
@@ -248,28 +301,142 @@ cpu_record_hash_free (void *a)
   XFREE (MTYPE_THREAD_STATS, hist);
 }
 
+static void
+vty_out_thread_types (struct vty *vty, thread_type types)
+{
+  vty_out(vty, " %c%c%c%c%c%c%c%c",
+	  types & (1 << THREAD_READ) ? 'R':' ',
+	  types & (1 << THREAD_WRITE) ? 'W':' ',
+	  types & (1 << THREAD_TIMER) ? 'T':' ',
+	  types & (1 << THREAD_TIMER_HR) ? 'H':' ',
+	  types & (1 << THREAD_EVENT) ? 'E':' ',
+	  types & (1 << THREAD_EXECUTE) ? 'X':' ',
+	  types & (1 << THREAD_BACKGROUND) ? 'B' : ' ',
+	  types & (1 << THREAD_JOB) ? 'J' : ' ');
+}
+
 static void 
 vty_out_cpu_thread_history(struct vty* vty,
 			   struct cpu_thread_history *a)
 {
 #ifdef HAVE_RUSAGE
-  vty_out(vty, "%7ld.%03ld %9d %8ld %9ld %8ld %9ld",
-	  a->cpu.total/1000, a->cpu.total%1000, a->total_calls,
-	  a->cpu.total/a->total_calls, a->cpu.max,
-	  a->real.total/a->total_calls, a->real.max);
+  if (a->cpu_calls)
+    {
+      /* Scaled up from the calls that were sampled. */
+      unsigned long total = a->cpu.total * a->total_calls / a->cpu_calls;
+
+      vty_out(vty, "%7ld.%03ld %9d %8ld %9ld %8ld %9ld",
+	      total/1000, total%1000, a->total_calls,
+	      a->cpu.total/a->cpu_calls, a->cpu.max,
+	      a->real.total/a->total_calls, a->real.max);
+    }
+  else
+    vty_out(vty, "%7ld.%03ld %9d %8s %9s %8ld %9ld",
+	    a->real.total/1000, a->real.total%1000, a->total_calls,
+	    "-", "-",
+	    a->real.total/a->total_calls, a->real.max);
 #else
   vty_out(vty, "%7ld.%03ld %9d %8ld %9ld",
 	  a->real.total/1000, a->real.total%1000, a->total_calls,
 	  a->real.total/a->total_calls, a->real.max);
 #endif
-  vty_out(vty, " %c%c%c%c%c%c %s%s",
-	  a->types & (1 << THREAD_READ) ? 'R':' ',
-	  a->types & (1 << THREAD_WRITE) ? 'W':' ',
-	  a->types & (1 << THREAD_TIMER) ? 'T':' ',
-	  a->types & (1 << THREAD_EVENT) ? 'E':' ',
-	  a->types & (1 << THREAD_EXECUTE) ? 'X':' ',
-	  a->types & (1 << THREAD_BACKGROUND) ? 'B' : ' ',
-	  a->funcname, VTY_NEWLINE);
+  if (a->timer_calls)
+    vty_out(vty, " %8ld %9ld",
+	    a->late.total/a->timer_calls, a->late.max);
+  else
+    vty_out(vty, " %8s %9s", "-", "-");
+  vty_out_thread_types (vty, a->types);
+  vty_out(vty, " %s%s", a->funcname, VTY_NEWLINE);
+}
+
+/* Add the stats of one entry to those of another. */
+static void
+cpu_record_merge (struct cpu_thread_history *to,
+		  const struct cpu_thread_history *from)
+{
+  int i;
+
+  to->total_calls += from->total_calls;
+  to->real.total += from->real.total;
+  if (to->real.max < from->real.max)
+    to->real.max = from->real.max;
+#ifdef HAVE_RUSAGE
+  to->cpu_calls += from->cpu_calls;
+  to->cpu.total += from->cpu.total;
+  if (to->cpu.max < from->cpu.max)
+    to->cpu.max = from->cpu.max;
+#endif
+  to->timer_calls += from->timer_calls;
+  to->late.total += from->late.total;
+  if (to->late.max < from->late.max)
+    to->late.max = from->late.max;
+  to->delay.total += from->delay.total;
+  if (to->delay.max < from->delay.max)
+    to->delay.max = from->delay.max;
+  for (i = 0; i < THREAD_HIST_BUCKETS; i++)
+    {
+      to->runtime_hist[i] += from->runtime_hist[i];
+      to->delay_hist[i] += from->delay_hist[i];
+    }
+}
+
+/* Entries of the merged cpu_record borrow the name of the first
+   master's entry they were made from. */
+static void *
+cpu_record_merged_alloc (struct cpu_thread_history *a)
+{
+  struct cpu_thread_history *new;
+
+  new = XCALLOC (MTYPE_THREAD_STATS, sizeof (struct cpu_thread_history));
+  new->func = a->func;
+  new->funcname = a->funcname;
+  return new;
+}
+
+static void
+cpu_record_merged_free (void *a)
+{
+  XFREE (MTYPE_THREAD_STATS, a);
+}
+
+static void
+cpu_record_hash_collect (struct hash_backet *bucket, void *arg)
+{
+  struct hash *merged = arg;
+  struct cpu_thread_history *a = bucket->data, *to;
+
+  to = hash_get (merged, a, (void * (*) (void *)) cpu_record_merged_alloc);
+  cpu_record_merge (to, a);
+  to->types |= a->types;
+}
+
+/* Add up the cpu_record of every master, by function, each under its
+   master's lock.  The caller holds thread_masters_mtx until it has done
+   with the result, as the names belong to the masters. */
+static struct hash *
+cpu_record_collect (void)
+{
+  struct hash *merged;
+  struct thread_master *m;
+
+  merged = hash_create_size (1011,
+			     (unsigned int (*) (void *)) cpu_record_hash_key,
+			     (int (*) (const void *, const void *))
+			       cpu_record_hash_cmp);
+  for (m = thread_masters; m; m = m->next)
+    {
+      pthread_mutex_lock (&m->cpu_record_mtx);
+      hash_iterate (m->cpu_record, cpu_record_hash_collect, merged);
+      pthread_mutex_unlock (&m->cpu_record_mtx);
+    }
+  return merged;
+}
+
+static void
+cpu_record_release (struct hash *merged)
+{
+  hash_clean (merged, cpu_record_merged_free);
+  hash_free (merged);
 }
 
 static void
@@ -284,16 +451,10 @@ cpu_record_hash_print(struct hash_backet *bucket,
   a = bucket->data;
   if ( !(a->types & *filter) )
        return;
+  if (a->total_calls == 0)
+       return;
   vty_out_cpu_thread_history(vty,a);
-  totals->total_calls += a->total_calls;
-  totals->real.total += a->real.total;
-  if (totals->real.max < a->real.max)
-    totals->real.max = a->real.max;
-#ifdef HAVE_RUSAGE
-  totals->cpu.total += a->cpu.total;
-  if (totals->cpu.max < a->cpu.max)
-    totals->cpu.max = a->cpu.max;
-#endif
+  cpu_record_merge (totals, a);
 }
 
 static void
@@ -301,88 +462,268 @@ cpu_record_print(struct vty *vty, thread_type filter)
 {
   struct cpu_thread_history tmp;
   void *args[3] = {&tmp, vty, &filter};
+  struct hash *merged;
 
   memset(&tmp, 0, sizeof tmp);
   tmp.funcname = (char *)"TOTAL";
   tmp.types = filter;
 
+  pthread_mutex_lock (&thread_masters_mtx);
 #ifdef HAVE_RUSAGE
+  vty_out(vty, "CPU time from %s", thread_cpu_mode_str[thread_cpu_mode]);
+  if (thread_cpu_sample > 1)
+    vty_out(vty, ", sampled 1 in %u calls", thread_cpu_sample);
+  /* getrusage() counts the whole process, not the caller's pthread. */
+  if (thread_cpu_mode == THREAD_CPU_RUSAGE && thread_masters
+      && thread_masters->next)
+    vty_out(vty, ", of all pthreads at once: use thread-cputime");
+  vty_out(vty, "%s%s", VTY_NEWLINE, VTY_NEWLINE);
+  vty_out(vty, "%21s %18s %18s %18s%s",
+  	  "", "CPU (user+system):", "Real (wall-clock):", "Timer lateness:",
+	  VTY_NEWLINE);
+#else
   vty_out(vty, "%21s %18s %18s%s",
-  	  "", "CPU (user+system):", "Real (wall-clock):", VTY_NEWLINE);
+  	  "", "Real (wall-clock):", "Timer lateness:", VTY_NEWLINE);
 #endif
   vty_out(vty, "Runtime(ms)   Invoked Avg uSec Max uSecs");
 #ifdef HAVE_RUSAGE
   vty_out(vty, " Avg uSec Max uSecs");
 #endif
-  vty_out(vty, "  Type  Thread%s", VTY_NEWLINE);
-  hash_iterate(cpu_record,
+  vty_out(vty, " Avg uSec Max uSecs");
+  vty_out(vty, "  Type    Thread%s", VTY_NEWLINE);
+  merged = cpu_record_collect ();
+  hash_iterate(merged,
 	       (void(*)(struct hash_backet*,void*))cpu_record_hash_print,
 	       args);
+  cpu_record_release (merged);
+  pthread_mutex_unlock (&thread_masters_mtx);
 
   if (tmp.total_calls > 0)
     vty_out_cpu_thread_history(vty, &tmp);
 }
 
-DEFUN(show_thread_cpu,
-      show_thread_cpu_cmd,
-      "show thread cpu [FILTER]",
-      SHOW_STR
-      "Thread information\n"
-      "Thread CPU usage\n"
-      "Display filter (rwtexb)\n")
+/* Count a sample into a latency histogram. */
+static void
+thread_hist_add (unsigned long *hist, unsigned long usec)
 {
-  int i = 0;
-  thread_type filter = (thread_type) -1U;
+  int bucket = 0;
 
-  if (argc > 0)
+  while (usec && bucket < THREAD_HIST_BUCKETS - 1)
+    {
+      usec >>= 1;
+      bucket++;
+    }
+  hist[bucket]++;
+}
+
+static unsigned long
+thread_hist_count (unsigned long *hist)
+{
+  unsigned long total = 0;
+  int i;
+
+  for (i = 0; i < THREAD_HIST_BUCKETS; i++)
+    total += hist[i];
+  return total;
+}
+
+/* Upper bound in uSec of the histogram bucket that holds the given
+   fraction, in thousandths, of the samples. */
+static unsigned long
+thread_hist_percentile (unsigned long *hist, unsigned int permille)
+{
+  unsigned long total, seen = 0, want;
+  int i;
+
+  if ((total = thread_hist_count (hist)) == 0)
+    return 0;
+
+  want = (total * permille + 999) / 1000;
+  for (i = 0; i < THREAD_HIST_BUCKETS - 1; i++)
     {
-      filter = 0;
-      while (argv[0][i] != '\0')
+      seen += hist[i];
+      if (seen >= want)
+	break;
+    }
+  return (i == 0) ? 0 : (1UL << i) - 1;
+}
+
+static void
+vty_out_thread_latency (struct vty *vty, struct cpu_thread_history *a)
+{
+  unsigned long delay[3];
+  unsigned int permille[3] = { 500, 990, 999 };
+  int i;
+
+  /* The bucket bound can overshoot what was actually seen. */
+  for (i = 0; i < 3; i++)
+    {
+      delay[i] = thread_hist_percentile (a->delay_hist, permille[i]);
+      if (delay[i] > a->delay.max)
+	delay[i] = a->delay.max;
+    }
+
+  vty_out(vty, "%9lu  %7lu %7lu %7lu  %7lu %7lu %7lu %9lu",
+	  thread_hist_count (a->runtime_hist),
+	  thread_hist_percentile (a->runtime_hist, 500),
+	  thread_hist_percentile (a->runtime_hist, 990),
+	  thread_hist_percentile (a->runtime_hist, 999),
+	  delay[0], delay[1], delay[2], a->delay.max);
+  vty_out_thread_types (vty, a->types);
+  vty_out(vty, " %s%s", a->funcname, VTY_NEWLINE);
+}
+
+static void
+cpu_record_hash_print_latency (struct hash_backet *bucket, void *args[])
+{
+  struct cpu_thread_history *totals = args[0];
+  struct vty *vty = args[1];
+  thread_type *filter = args[2];
+  struct cpu_thread_history *a = bucket->data;
+
+  if ( !(a->types & *filter) )
+       return;
+  if (thread_hist_count (a->runtime_hist) == 0)
+       return;
+  vty_out_thread_latency (vty, a);
+  cpu_record_merge (totals, a);
+}
+
+static void
+cpu_record_print_latency (struct vty *vty, thread_type filter)
+{
+  struct cpu_thread_history tmp;
+  void *args[3] = {&tmp, vty, &filter};
+  struct hash *merged;
+
+  memset(&tmp, 0, sizeof tmp);
+  tmp.funcname = (char *)"TOTAL";
+  tmp.types = filter;
+
+  vty_out(vty, "%9s  %-23s  %s%s",
+	  "", "Runtime (uSec):", "Ready-list delay (uSec):", VTY_NEWLINE);
+  vty_out(vty, "%9s  %7s %7s %7s  %7s %7s %7s %9s %-8s %s%s",
+	  "Samples", "p50", "p99", "p999", "p50", "p99", "p999", "Max",
+	  "Type", "Thread", VTY_NEWLINE);
+  pthread_mutex_lock (&thread_masters_mtx);
+  merged = cpu_record_collect ();
+  hash_iterate(merged,
+	       (void(*)(struct hash_backet*,void*))cpu_record_hash_print_latency,
+	       args);
+  cpu_record_release (merged);
+  pthread_mutex_unlock (&thread_masters_mtx);
+
+  if (thread_hist_count (tmp.runtime_hist) > 0)
+    vty_out_thread_latency (vty, &tmp);
+}
+
+/* Parse a FILTER argument of the thread show/clear commands into a
+   mask of thread types, returning 0 if it names none. */
+static thread_type
+cpu_record_filter (const char *arg)
+{
+  thread_type filter = 0;
+  int i;
+
+  for (i = 0; arg[i] != '\0'; i++)
+    {
+      switch (arg[i])
 	{
-	  switch ( argv[0][i] )
-	    {
-	    case 'r':
-	    case 'R':
-	      filter |= (1 << THREAD_READ);
-	      break;
-	    case 'w':
-	    case 'W':
-	      filter |= (1 << THREAD_WRITE);
-	      break;
-	    case 't':
-	    case 'T':
-	      filter |= (1 << THREAD_TIMER);
-	      break;
-	    case 'e':
-	    case 'E':
-	      filter |= (1 << THREAD_EVENT);
-	      break;
-	    case 'x':
-	    case 'X':
-	      filter |= (1 << THREAD_EXECUTE);
-	      break;
-	    case 'b':
-	    case 'B':
-	      filter |= (1 << THREAD_BACKGROUND);
-	      break;
-	    default:
-	      break;
-	    }
-	  ++i;
+	case 'r':
+	case 'R':
+	  filter |= (1 << THREAD_READ);
+	  break;
+	case 'w':
+	case 'W':
+	  filter |= (1 << THREAD_WRITE);
+	  break;
+	case 't':
+	case 'T':
+	  filter |= (1 << THREAD_TIMER);
+	  break;
+	case 'h':
+	case 'H':
+	  filter |= (1 << THREAD_TIMER_HR);
+	  break;
+	case 'e':
+	case 'E':
+	  filter |= (1 << THREAD_EVENT);
+	  break;
+	case 'x':
+	case 'X':
+	  filter |= (1 << THREAD_EXECUTE);
+	  break;
+	case 'b':
+	case 'B':
+	  filter |= (1 << THREAD_BACKGROUND);
+	  break;
+	case 'j':
+	case 'J':
+	  filter |= (1 << THREAD_JOB);
+	  break;
+	default:
+	  break;
 	}
-      if (filter == 0)
+    }
+  return filter;
+}
+
+/* Set *filter from the optional FILTER argument, complaining to the vty
+   if it is no good. */
+static int
+cpu_record_filter_arg (struct vty *vty, int argc, const char *argv[],
+		       thread_type *filter)
+{
+  *filter = (thread_type) -1U;
+
+  if (argc > 0)
+    {
+      *filter = cpu_record_filter (argv[0]);
+      if (*filter == 0)
 	{
 	  vty_out(vty, "Invalid filter \"%s\" specified,"
-                  " must contain at least one of 'RWTEXB'%s",
+                  " must contain at least one of 'RWTHEXBJ'%s",
 		  argv[0], VTY_NEWLINE);
 	  return CMD_WARNING;
 	}
     }
+  return CMD_SUCCESS;
+}
+
+DEFUN(show_thread_cpu,
+      show_thread_cpu_cmd,
+      "show thread cpu [FILTER]",
+      SHOW_STR
+      "Thread information\n"
+      "Thread CPU usage\n"
+      "Display filter (rwthexbj)\n")
+{
+  thread_type filter;
+
+  if (cpu_record_filter_arg (vty, argc, argv, &filter) != CMD_SUCCESS)
+    return CMD_WARNING;
 
   cpu_record_print(vty, filter);
   return CMD_SUCCESS;
 }
 
+DEFUN(show_thread_latency,
+      show_thread_latency_cmd,
+      "show thread latency [FILTER]",
+      SHOW_STR
+      "Thread information\n"
+      "Thread runtime and ready-list delay percentiles\n"
+      "Display filter (rwthexbj)\n")
+{
+  thread_type filter;
+
+  if (cpu_record_filter_arg (vty, argc, argv, &filter) != CMD_SUCCESS)
+    return CMD_WARNING;
+
+  cpu_record_print_latency (vty, filter);
+  return CMD_SUCCESS;
+}
+
 static void
 cpu_record_hash_clear (struct hash_backet *bucket, 
 		      void *args)
@@ -394,16 +735,28 @@ cpu_record_hash_clear (struct hash_backet *bucket,
   if ( !(a->types & *filter) )
        return;
   
-  hash_release (cpu_record, bucket->data);
+  /* Scheduled threads point at their entry, so it can only be reset.
+     sample_calls is the owning master's alone, it is left as it is. */
+  memset (&a->total_calls, 0, sizeof (struct cpu_thread_history)
+			      - offsetof (struct cpu_thread_history,
+					  total_calls));
 }
 
+/* Apply a clear to the cpu_record of every master, under its lock. */
 static void
-cpu_record_clear (thread_type filter)
+cpu_record_clear_all (void (*clear) (struct hash_backet *, void *),
+		      thread_type filter)
 {
-  thread_type *tmp = &filter;
-  hash_iterate (cpu_record,
-	        (void (*) (struct hash_backet*,void*)) cpu_record_hash_clear,
-	        tmp);
+  struct thread_master *m;
+
+  pthread_mutex_lock (&thread_masters_mtx);
+  for (m = thread_masters; m; m = m->next)
+    {
+      pthread_mutex_lock (&m->cpu_record_mtx);
+      hash_iterate (m->cpu_record, clear, &filter);
+      pthread_mutex_unlock (&m->cpu_record_mtx);
+    }
+  pthread_mutex_unlock (&thread_masters_mtx);
 }
 
 DEFUN(clear_thread_cpu,
@@ -412,60 +765,132 @@ DEFUN(clear_thread_cpu,
       "Clear stored data\n"
       "Thread information\n"
       "Thread CPU usage\n"
-      "Display filter (rwtexb)\n")
+      "Display filter (rwthexbj)\n")
 {
-  int i = 0;
-  thread_type filter = (thread_type) -1U;
+  thread_type filter;
 
-  if (argc > 0)
+  if (cpu_record_filter_arg (vty, argc, argv, &filter) != CMD_SUCCESS)
+    return CMD_WARNING;
+
+  cpu_record_clear_all (cpu_record_hash_clear, filter);
+  return CMD_SUCCESS;
+}
+
+static void
+cpu_record_hash_clear_latency (struct hash_backet *bucket, void *args)
+{
+  thread_type *filter = args;
+  struct cpu_thread_history *a = bucket->data;
+
+  if ( !(a->types & *filter) )
+       return;
+
+  memset (&a->delay, 0, sizeof (a->delay));
+  memset (a->runtime_hist, 0, sizeof (a->runtime_hist));
+  memset (a->delay_hist, 0, sizeof (a->delay_hist));
+}
+
+DEFUN(clear_thread_latency,
+      clear_thread_latency_cmd,
+      "clear thread latency [FILTER]",
+      "Clear stored data\n"
+      "Thread information\n"
+      "Thread runtime and ready-list delay percentiles\n"
+      "Display filter (rwthexbj)\n")
+{
+  thread_type filter;
+
+  if (cpu_record_filter_arg (vty, argc, argv, &filter) != CMD_SUCCESS)
+    return CMD_WARNING;
+
+  cpu_record_clear_all (cpu_record_hash_clear_latency, filter);
+  return CMD_SUCCESS;
+}
+
+#ifdef HAVE_RUSAGE
+/* Set how thread_call measures cpu time.  Wall clock time is always
+   measured on every call. */
+void
+thread_set_cpu_accounting (enum thread_cpu_mode mode, unsigned int sample)
+{
+  thread_cpu_mode = mode;
+  thread_cpu_sample = sample ? sample : 1;
+}
+
+static int
+thread_cpu_mode_lookup (const char *str, enum thread_cpu_mode *mode)
+{
+  int i;
+
+  for (i = 0; i <= THREAD_CPU_WALL; i++)
+    if (strcmp (str, thread_cpu_mode_str[i]) == 0)
+      {
+	*mode = i;
+	return 0;
+      }
+  return -1;
+}
+
+DEFUN (service_thread_accounting,
+       service_thread_accounting_cmd,
+       "service thread-accounting (rusage|thread-cputime|wall)",
+       "Set up miscellaneous service\n"
+       "How thread CPU time is measured\n"
+       "getrusage(), user plus system time of all pthreads (default)\n"
+       "Per-thread CPU clock, cheaper than getrusage\n"
+       "Wall clock time only, no CPU time\n")
+{
+  enum thread_cpu_mode mode;
+  unsigned int sample = 1;
+
+  if (thread_cpu_mode_lookup (argv[0], &mode) < 0)
     {
-      filter = 0;
-      while (argv[0][i] != '\0')
-	{
-	  switch ( argv[0][i] )
-	    {
-	    case 'r':
-	    case 'R':
-	      filter |= (1 << THREAD_READ);
-	      break;
-	    case 'w':
-	    case 'W':
-	      filter |= (1 << THREAD_WRITE);
-	      break;
-	    case 't':
-	    case 'T':
-	      filter |= (1 << THREAD_TIMER);
-	      break;
-	    case 'e':
-	    case 'E':
-	      filter |= (1 << THREAD_EVENT);
-	      break;
-	    case 'x':
-	    case 'X':
-	      filter |= (1 << THREAD_EXECUTE);
-	      break;
-	    case 'b':
-	    case 'B':
-	      filter |= (1 << THREAD_BACKGROUND);
-	      break;
-	    default:
-	      break;
-	    }
-	  ++i;
-	}
-      if (filter == 0)
-	{
-	  vty_out(vty, "Invalid filter \"%s\" specified,"
-                  " must contain at least one of 'RWTEXB'%s",
-		  argv[0], VTY_NEWLINE);
-	  return CMD_WARNING;
-	}
+      vty_out (vty, "Unknown accounting mode %s%s", argv[0], VTY_NEWLINE);
+      return CMD_WARNING;
     }
+  if (argc > 1)
+    VTY_GET_INTEGER_RANGE ("sample rate", sample, argv[1], 1, 65535);
 
-  cpu_record_clear (filter);
+  thread_set_cpu_accounting (mode, sample);
   return CMD_SUCCESS;
 }
-
+
+ALIAS (service_thread_accounting,
+       service_thread_accounting_sample_cmd,
+       "service thread-accounting (rusage|thread-cputime|wall) sample <1-65535>",
+       "Set up miscellaneous service\n"
+       "How thread CPU time is measured\n"
+       "getrusage(), user plus system time of all pthreads (default)\n"
+       "Per-thread CPU clock, cheaper than getrusage\n"
+       "Wall clock time only, no CPU time\n"
+       "Only measure CPU time for some calls of each task\n"
+       "Measure 1 in this many calls\n")
+
+DEFUN (no_service_thread_accounting,
+       no_service_thread_accounting_cmd,
+       "no service thread-accounting",
+       NO_STR
+       "Set up miscellaneous service\n"
+       "How thread CPU time is measured\n")
+{
+  thread_set_cpu_accounting (THREAD_CPU_RUSAGE, 1);
+  return CMD_SUCCESS;
+}
+
+void
+thread_config_write (struct vty *vty)
+{
+  if (thread_cpu_mode == THREAD_CPU_RUSAGE && thread_cpu_sample == 1)
+    return;
+
+  vty_out (vty, "service thread-accounting %s",
+	   thread_cpu_mode_str[thread_cpu_mode]);
+  if (thread_cpu_sample > 1)
+    vty_out (vty, " sample %u", thread_cpu_sample);
+  vty_out (vty, "%s", VTY_NEWLINE);
+}
+#endif /* HAVE_RUSAGE */
+
 /* List allocation and head/tail print out. */
 static void
 thread_list_debug (struct thread_list *list)
@@ -483,29 +908,979 @@ thread_master_debug (struct thread_master *m)
   thread_list_debug (&m->read);
   printf ("writelist : ");
   thread_list_debug (&m->write);
-  printf ("timerlist : ");
-  thread_list_debug (&m->timer);
+  printf ("timerlist : count [%d]\n", m->timer->size);
   printf ("eventlist : ");
   thread_list_debug (&m->event);
   printf ("unuselist : ");
   thread_list_debug (&m->unuse);
-  printf ("bgndlist : ");
-  thread_list_debug (&m->background);
+  printf ("bgndlist : count [%d]\n", m->background->size);
   printf ("total alloc: [%ld]\n", m->alloc);
   printf ("-----------\n");
 }
 
+/* select(2) backend.  Every wakeup copies the fd_sets and walks the
+   whole read and write lists, and descriptors are capped at FD_SETSIZE. */
+struct thread_select
+{
+  /* Result of the last select call. */
+  fd_set readfd;
+  fd_set writefd;
+  fd_set exceptfd;
+  int num;
+};
+
+static int
+thread_select_init (struct thread_master *m)
+{
+  m->poll_info = XCALLOC (MTYPE_THREAD_POLL, sizeof (struct thread_select));
+  return 0;
+}
+
+static void
+thread_select_finish (struct thread_master *m)
+{
+  XFREE (MTYPE_THREAD_POLL, m->poll_info);
+}
+
+static int
+thread_select_add (struct thread_master *m, struct thread *thread)
+{
+  fd_set *fdset;
+
+  if (THREAD_FD (thread) < 0 || THREAD_FD (thread) >= FD_SETSIZE)
+    {
+      zlog_err ("select: fd %d is outside FD_SETSIZE (%d)",
+		THREAD_FD (thread), FD_SETSIZE);
+      return -1;
+    }
+
+  fdset = (thread->add_type == THREAD_READ) ? &m->readfd : &m->writefd;
+  if (FD_ISSET (THREAD_FD (thread), fdset))
+    {
+      zlog (NULL, LOG_WARNING, "There is already %s fd [%d]",
+	    (thread->add_type == THREAD_READ) ? "read" : "write",
+	    THREAD_FD (thread));
+      return -1;
+    }
+  FD_SET (THREAD_FD (thread), fdset);
+  return 0;
+}
+
+static void
+thread_select_del (struct thread_master *m, struct thread *thread)
+{
+  fd_set *fdset;
+
+  /* Already cleared when it was found ready. */
+  if (thread->type == THREAD_READY)
+    return;
+
+  fdset = (thread->add_type == THREAD_READ) ? &m->readfd : &m->writefd;
+  assert (FD_ISSET (THREAD_FD (thread), fdset));
+  FD_CLR (THREAD_FD (thread), fdset);
+}
+
+static int
+thread_select_wait (struct thread_master *m, struct timeval *timer_wait)
+{
+  struct thread_select *sel = m->poll_info;
+
+  /* Structure copy.  */
+  sel->readfd = m->readfd;
+  sel->writefd = m->writefd;
+  sel->exceptfd = m->exceptfd;
+
+  sel->num = select (FD_SETSIZE, &sel->readfd, &sel->writefd,
+		     &sel->exceptfd, timer_wait);
+  return sel->num;
+}
+
+static int thread_process_fd (struct thread_list *, fd_set *, fd_set *);
+
+static void
+thread_select_process (struct thread_master *m)
+{
+  struct thread_select *sel = m->poll_info;
+
+  if (sel->num <= 0)
+    return;
+
+  /* Normal priority read thead. */
+  thread_process_fd (&m->read, &sel->readfd, &m->readfd);
+  /* Write thead. */
+  thread_process_fd (&m->write, &sel->writefd, &m->writefd);
+  sel->num = 0;
+}
+
+static const struct thread_poll_ops thread_poll_select =
+{
+  .name = "select",
+  .init = thread_select_init,
+  .finish = thread_select_finish,
+  .add = thread_select_add,
+  .del = thread_select_del,
+  .wait = thread_select_wait,
+  .process = thread_select_process,
+};
+
+static void thread_fd_ready (struct thread_master *, struct thread *);
+
+#ifdef HAVE_EPOLL
+/* epoll(7) backend.  Cost per wakeup is proportional to the number of
+   ready descriptors, not the number watched, and there is no FD_SETSIZE
+   limit.
+
+   Descriptors stay registered with the kernel across the one-shot
+   read/write threads that watch them: when a thread fires and its
+   handler re-arms the same descriptor, which is what nearly every
+   handler does, no epoll_ctl() is issued at all.  Interest is dropped
+   only on thread_cancel, when a dispatched handler returns without
+   re-arming (checked before the next dispatch or blocking wait, never
+   from thread_should_yield inside the handler), or when the kernel reports
+   readiness nobody is waiting for.
+
+   Registrations are level-triggered, so a handler that reads only part
+   of what is queued is woken again, exactly as with select.  Because
+   the kernel forgets closed descriptors by itself, any epoll_ctl that
+   fails with ENOENT or EEXIST is retried as the other operation.  The
+   one pattern this cannot see is a handler that closes its own
+   descriptor and, before returning, re-arms a new socket that was
+   handed the same number; such code must use the select backend. */
+#define THREAD_EPOLL_EVENTS_MAX   64
+#define THREAD_EPOLL_FD_INIT     256
+
+struct thread_epoll_fd
+{
+  struct thread *read;
+  struct thread *write;
+  u_int32_t registered;		/* events the kernel has for this fd */
+};
+
+struct thread_epoll
+{
+  int epfd;
+  struct thread_epoll_fd *fds;
+  int fds_size;
+  /* Descriptor whose thread was last dispatched, pending a check that
+     its handler re-armed it. */
+  int linger_fd;
+  /* Result of the last epoll_wait. */
+  struct epoll_event events[THREAD_EPOLL_EVENTS_MAX];
+  int num;
+};
+
+static int
+thread_epoll_init (struct thread_master *m)
+{
+  struct thread_epoll *ep;
+  int epfd;
+
+  if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    {
+      zlog_warn ("epoll_create1: %s", safe_strerror (errno));
+      return -1;
+    }
+
+  ep = XCALLOC (MTYPE_THREAD_POLL, sizeof (struct thread_epoll));
+  ep->epfd = epfd;
+  ep->fds_size = THREAD_EPOLL_FD_INIT;
+  ep->fds = XCALLOC (MTYPE_THREAD_POLL,
+		     ep->fds_size * sizeof (struct thread_epoll_fd));
+  ep->linger_fd = -1;
+  m->poll_info = ep;
+  return 0;
+}
+
+static void
+thread_epoll_finish (struct thread_master *m)
+{
+  struct thread_epoll *ep = m->poll_info;
+
+  close (ep->epfd);
+  XFREE (MTYPE_THREAD_POLL, ep->fds);
+  XFREE (MTYPE_THREAD_POLL, ep);
+  m->poll_info = NULL;
+}
+
+/* Bring the kernel's interest set for FD in line with the threads
+   currently waiting on it. */
+static void
+thread_epoll_sync (struct thread_epoll *ep, int fd)
+{
+  struct thread_epoll_fd *efd = &ep->fds[fd];
+  struct epoll_event ev;
+  u_int32_t want = 0;
+  int op;
+
+  if (efd->read)
+    want |= EPOLLIN;
+  if (efd->write)
+    want |= EPOLLOUT;
+
+  if (want == efd->registered)
+    return;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = want;
+  ev.data.fd = fd;
+
+  if (want == 0)
+    op = EPOLL_CTL_DEL;
+  else if (efd->registered == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  if (epoll_ctl (ep->epfd, op, fd, &ev) < 0)
+    {
+      /* The kernel drops closed descriptors on its own, and a reused
+	 descriptor number may or may not still be known to it. */
+      if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	op = EPOLL_CTL_ADD;
+      else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	op = EPOLL_CTL_MOD;
+      else
+	op = EPOLL_CTL_DEL;
+
+      if (op != EPOLL_CTL_DEL && epoll_ctl (ep->epfd, op, fd, &ev) < 0)
+	{
+	  zlog_err ("epoll_ctl fd %d: %s", fd, safe_strerror (errno));
+	  want = 0;
+	}
+    }
+  efd->registered = want;
+}
+
+static int
+thread_epoll_add (struct thread_master *m, struct thread *thread)
+{
+  struct thread_epoll *ep = m->poll_info;
+  struct thread_epoll_fd *efd;
+  struct thread **slot;
+  int fd = THREAD_FD (thread);
+
+  if (fd < 0)
+    return -1;
+
+  if (fd >= ep->fds_size)
+    {
+      int size = ep->fds_size;
+
+      while (size <= fd)
+	size *= 2;
+      ep->fds = XREALLOC (MTYPE_THREAD_POLL, ep->fds,
+			  size * sizeof (struct thread_epoll_fd));
+      memset (ep->fds + ep->fds_size, 0,
+	      (size - ep->fds_size) * sizeof (struct thread_epoll_fd));
+      ep->fds_size = size;
+    }
+
+  efd = &ep->fds[fd];
+  slot = (thread->add_type == THREAD_READ) ? &efd->read : &efd->write;
+  if (*slot)
+    {
+      zlog (NULL, LOG_WARNING, "There is already %s fd [%d]",
+	    (thread->add_type == THREAD_READ) ? "read" : "write", fd);
+      return -1;
+    }
+  *slot = thread;
+  thread_epoll_sync (ep, fd);
+
+  return (efd->registered ? 0 : (*slot = NULL, -1));
+}
+
+static void
+thread_epoll_del (struct thread_master *m, struct thread *thread)
+{
+  struct thread_epoll *ep = m->poll_info;
+  struct thread_epoll_fd *efd;
+  int fd = THREAD_FD (thread);
+
+  assert (fd >= 0 && fd < ep->fds_size);
+  efd = &ep->fds[fd];
+  if (efd->read == thread)
+    efd->read = NULL;
+  if (efd->write == thread)
+    efd->write = NULL;
+  thread_epoll_sync (ep, fd);
+}
+
+/* Drop interest left over from the last dispatched handler if it did
+   not ask for its descriptor again.  Must run before anything else is
+   dispatched, as that could open a new descriptor with the same number. */
+static void
+thread_epoll_unlinger (struct thread_epoll *ep)
+{
+  if (ep->linger_fd >= 0)
+    {
+      thread_epoll_sync (ep, ep->linger_fd);
+      ep->linger_fd = -1;
+    }
+}
+
+static int
+thread_epoll_wait (struct thread_master *m, struct timeval *timer_wait)
+{
+  struct thread_epoll *ep = m->poll_info;
+  int timeout = -1;
+
+  /* Round up, so we never wake just short of a timer and spin. */
+  if (timer_wait)
+    timeout = timer_wait->tv_sec * 1000
+	      + (timer_wait->tv_usec + 999) / 1000;
+
+  ep->num = epoll_wait (ep->epfd, ep->events, THREAD_EPOLL_EVENTS_MAX,
+			timeout);
+  return ep->num;
+}
+
+static void
+thread_epoll_process (struct thread_master *m)
+{
+  struct thread_epoll *ep = m->poll_info;
+  int i;
+
+  for (i = 0; i < ep->num; i++)
+    {
+      int fd = ep->events[i].data.fd;
+      u_int32_t events = ep->events[i].events;
+      struct thread_epoll_fd *efd = &ep->fds[fd];
+      int claimed = 0;
+
+      /* Errors and hangups are reported to whoever is waiting, as
+	 select does by marking the descriptor readable/writable. */
+      if (events & (EPOLLERR | EPOLLHUP))
+	events |= (EPOLLIN | EPOLLOUT);
+
+      if ((events & EPOLLIN) && efd->read)
+	{
+	  thread_fd_ready (m, efd->read);
+	  efd->read = NULL;
+	  claimed = 1;
+	}
+      if ((events & EPOLLOUT) && efd->write)
+	{
+	  thread_fd_ready (m, efd->write);
+	  efd->write = NULL;
+	  claimed = 1;
+	}
+
+      /* Readiness nobody asked for: the handler that owned it has
+	 since gone away without re-arming.  Claimed descriptors, and
+	 that of a handler still running, which may yet re-arm, are
+	 left for thread_epoll_unlinger once their handler has run. */
+      if (!claimed && fd != ep->linger_fd)
+	thread_epoll_sync (ep, fd);
+    }
+  ep->num = 0;
+}
+
+static const struct thread_poll_ops thread_poll_epoll =
+{
+  .name = "epoll",
+  .init = thread_epoll_init,
+  .finish = thread_epoll_finish,
+  .add = thread_epoll_add,
+  .del = thread_epoll_del,
+  .wait = thread_epoll_wait,
+  .process = thread_epoll_process,
+};
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_IO_URING
+/* io_uring(7) backend.  Interest in a descriptor is a one-shot
+   IORING_OP_POLL_ADD, and all the poll requests queued up by add, del
+   and dispatch since the last wait go to the kernel in the same
+   io_uring_enter() that waits for completions, so a turn of the loop
+   costs one system call however many descriptors changed.  The wait
+   is bounded with the timeout of IORING_ENTER_EXT_ARG rather than a
+   separate timeout request, which would have to be cancelled again.
+
+   Polls are one-shot rather than multishot because a multishot poll
+   only completes again when new data arrives: handlers that read part
+   of what is queued, as the HA and vty readers do, would never be
+   woken for the rest.  A one-shot poll checks the descriptor when it
+   is armed, so it is level-triggered like select and epoll.
+
+   Handlers still do their own reads, the ring only reports readiness.
+   The caveat of the epoll backend about descriptors being closed and
+   reused within one handler applies here too, an outstanding poll
+   holds on to the file it was armed for. */
+#define THREAD_URING_ENTRIES     256
+#define THREAD_URING_CQ_ENTRIES  1024
+#define THREAD_URING_FD_INIT     256
+
+/* user_data of requests whose completion is of no interest. */
+#define THREAD_URING_IGNORE      (~0ULL)
+
+struct thread_uring_fd
+{
+  struct thread *read;
+  struct thread *write;
+  u_int32_t armed;		/* events of the outstanding poll, or 0 */
+  u_int32_t gen;		/* tags that poll's completion */
+  int dirty;			/* on the dirty list */
+};
+
+struct thread_uring
+{
+  int ring_fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  /* Submission queue, the tail is ours. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned to_submit;
+
+  /* Completion queue, the head is ours. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct thread_uring_fd *fds;
+  int fds_size;
+  /* Descriptors whose poll may not match their threads any more. */
+  int *dirty;
+  int dirty_num;
+};
+
+static int
+thread_uring_enter (struct thread_uring *ur, unsigned int to_submit,
+		    unsigned int min_complete, unsigned int flags,
+		    struct __kernel_timespec *ts)
+{
+  struct io_uring_getevents_arg arg;
+  int ret;
+
+  memset (&arg, 0, sizeof (arg));
+  arg.ts = (u_int64_t) (uintptr_t) ts;
+
+  ret = syscall (__NR_io_uring_enter, ur->ring_fd, to_submit, min_complete,
+		 flags | IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+  if (ret > 0)
+    ur->to_submit -= ret;
+  return ret;
+}
+
+static void thread_uring_finish (struct thread_master *);
+
+static int
+thread_uring_init (struct thread_master *m)
+{
+  struct thread_uring *ur;
+  struct io_uring_params p;
+  int fd;
+
+  memset (&p, 0, sizeof (p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = THREAD_URING_CQ_ENTRIES;
+  if ((fd = syscall (__NR_io_uring_setup, THREAD_URING_ENTRIES, &p)) < 0)
+    {
+      zlog_warn ("io_uring_setup: %s", safe_strerror (errno));
+      return -1;
+    }
+
+  /* EXT_ARG for the wait timeout, NODROP so a burst of completions
+     can't be lost, and a single mmap for both rings. */
+  if (!(p.features & IORING_FEAT_EXT_ARG)
+      || !(p.features & IORING_FEAT_NODROP)
+      || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      zlog_warn ("io_uring: kernel lacks needed features (%x)", p.features);
+      close (fd);
+      return -1;
+    }
+
+  ur = XCALLOC (MTYPE_THREAD_POLL, sizeof (struct thread_uring));
+  ur->ring_fd = fd;
+  m->poll_info = ur;
+
+  ur->ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  if (ur->ring_size < p.cq_off.cqes
+		      + p.cq_entries * sizeof (struct io_uring_cqe))
+    ur->ring_size = p.cq_off.cqes
+		    + p.cq_entries * sizeof (struct io_uring_cqe);
+  ur->ring = mmap (NULL, ur->ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ur->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  ur->sqes = mmap (NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ur->ring == MAP_FAILED || ur->sqes == MAP_FAILED)
+    {
+      zlog_warn ("io_uring mmap: %s", safe_strerror (errno));
+      thread_uring_finish (m);
+      return -1;
+    }
+
+  ur->sq_head = (unsigned *) ((char *) ur->ring + p.sq_off.head);
+  ur->sq_tail = (unsigned *) ((char *) ur->ring + p.sq_off.tail);
+  ur->sq_mask = (unsigned *) ((char *) ur->ring + p.sq_off.ring_mask);
+  ur->sq_array = (unsigned *) ((char *) ur->ring + p.sq_off.array);
+  ur->sq_entries = p.sq_entries;
+  ur->cq_head = (unsigned *) ((char *) ur->ring + p.cq_off.head);
+  ur->cq_tail = (unsigned *) ((char *) ur->ring + p.cq_off.tail);
+  ur->cq_mask = (unsigned *) ((char *) ur->ring + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) ((char *) ur->ring + p.cq_off.cqes);
+
+  ur->fds_size = THREAD_URING_FD_INIT;
+  ur->fds = XCALLOC (MTYPE_THREAD_POLL,
+		     ur->fds_size * sizeof (struct thread_uring_fd));
+  ur->dirty = XCALLOC (MTYPE_THREAD_POLL, ur->fds_size * sizeof (int));
+  return 0;
+}
+
+static void
+thread_uring_finish (struct thread_master *m)
+{
+  struct thread_uring *ur = m->poll_info;
+
+  if (ur->sqes && ur->sqes != MAP_FAILED)
+    munmap (ur->sqes, ur->sqes_size);
+  if (ur->ring && ur->ring != MAP_FAILED)
+    munmap (ur->ring, ur->ring_size);
+  close (ur->ring_fd);
+  if (ur->fds)
+    XFREE (MTYPE_THREAD_POLL, ur->fds);
+  if (ur->dirty)
+    XFREE (MTYPE_THREAD_POLL, ur->dirty);
+  XFREE (MTYPE_THREAD_POLL, ur);
+  m->poll_info = NULL;
+}
+
+/* Queue a request, making room by submitting what is queued if the
+   ring is full. */
+static struct io_uring_sqe *
+thread_uring_sqe (struct thread_uring *ur)
+{
+  unsigned int tail = *ur->sq_tail;
+  unsigned int idx;
+  struct io_uring_sqe *sqe;
+
+  while (tail - __atomic_load_n (ur->sq_head, __ATOMIC_ACQUIRE)
+	 >= ur->sq_entries)
+    if (thread_uring_enter (ur, ur->to_submit, 0, 0, NULL) < 0
+	&& errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      {
+	zlog_err ("io_uring_enter: %s", safe_strerror (errno));
+	return NULL;
+      }
+
+  idx = tail & *ur->sq_mask;
+  sqe = &ur->sqes[idx];
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  ur->sq_array[idx] = idx;
+  return sqe;
+}
+
+static void
+thread_uring_sqe_commit (struct thread_uring *ur)
+{
+  __atomic_store_n (ur->sq_tail, *ur->sq_tail + 1, __ATOMIC_RELEASE);
+  ur->to_submit++;
+}
+
+/* Bring the poll outstanding for FD in line with the threads waiting
+   on it. */
+static void
+thread_uring_sync (struct thread_uring *ur, int fd)
+{
+  struct thread_uring_fd *ufd = &ur->fds[fd];
+  struct io_uring_sqe *sqe;
+  u_int32_t want = 0;
+
+  ufd->dirty = 0;
+
+  if (ufd->read)
+    want |= POLLIN;
+  if (ufd->write)
+    want |= POLLOUT;
+
+  if (want == ufd->armed)
+    return;
+
+  if (ufd->armed && (sqe = thread_uring_sqe (ur)) != NULL)
+    {
+      sqe->opcode = IORING_OP_POLL_REMOVE;
+      sqe->fd = -1;
+      sqe->addr = ((u_int64_t) ufd->gen << 32) | fd;
+      sqe->user_data = THREAD_URING_IGNORE;
+      thread_uring_sqe_commit (ur);
+    }
+
+  /* Whatever the old poll still reports is stale from now on. */
+  ufd->gen++;
+  ufd->armed = 0;
+
+  if (want && (sqe = thread_uring_sqe (ur)) != NULL)
+    {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = want;
+      sqe->user_data = ((u_int64_t) ufd->gen << 32) | fd;
+      thread_uring_sqe_commit (ur);
+      ufd->armed = want;
+    }
+}
+
+static void
+thread_uring_dirty (struct thread_uring *ur, int fd)
+{
+  if (!ur->fds[fd].dirty)
+    {
+      ur->fds[fd].dirty = 1;
+      ur->dirty[ur->dirty_num++] = fd;
+    }
+}
+
+static int
+thread_uring_add (struct thread_master *m, struct thread *thread)
+{
+  struct thread_uring *ur = m->poll_info;
+  struct thread_uring_fd *ufd;
+  struct thread **slot;
+  int fd = THREAD_FD (thread);
+
+  if (fd < 0)
+    return -1;
+
+  if (fd >= ur->fds_size)
+    {
+      int size = ur->fds_size;
+
+      while (size <= fd)
+	size *= 2;
+      ur->fds = XREALLOC (MTYPE_THREAD_POLL, ur->fds,
+			  size * sizeof (struct thread_uring_fd));
+      memset (ur->fds + ur->fds_size, 0,
+	      (size - ur->fds_size) * sizeof (struct thread_uring_fd));
+      ur->dirty = XREALLOC (MTYPE_THREAD_POLL, ur->dirty,
+			    size * sizeof (int));
+      ur->fds_size = size;
+    }
+
+  ufd = &ur->fds[fd];
+  slot = (thread->add_type == THREAD_READ) ? &ufd->read : &ufd->write;
+  if (*slot)
+    {
+      zlog (NULL, LOG_WARNING, "There is already %s fd [%d]",
+	    (thread->add_type == THREAD_READ) ? "read" : "write", fd);
+      return -1;
+    }
+  *slot = thread;
+  thread_uring_dirty (ur, fd);
+  return 0;
+}
+
+static void
+thread_uring_del (struct thread_master *m, struct thread *thread)
+{
+  struct thread_uring *ur = m->poll_info;
+  struct thread_uring_fd *ufd;
+  int fd = THREAD_FD (thread);
+
+  assert (fd >= 0 && fd < ur->fds_size);
+  ufd = &ur->fds[fd];
+  if (ufd->read == thread)
+    ufd->read = NULL;
+  if (ufd->write == thread)
+    ufd->write = NULL;
+  thread_uring_dirty (ur, fd);
+}
+
+static int
+thread_uring_wait (struct thread_master *m, struct timeval *timer_wait)
+{
+  struct thread_uring *ur = m->poll_info;
+  struct __kernel_timespec ts;
+  unsigned int ready;
+  int i, ret;
+
+  for (i = 0; i < ur->dirty_num; i++)
+    thread_uring_sync (ur, ur->dirty[i]);
+  ur->dirty_num = 0;
+
+  ready = __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE) - *ur->cq_head;
+
+  /* Nothing to wait for, only submit.  Polling with nothing to submit
+     is just a look at the completion queue. */
+  if (ready || (timer_wait && !timer_wait->tv_sec && !timer_wait->tv_usec))
+    {
+      if (ur->to_submit == 0)
+	return ready;
+      ret = thread_uring_enter (ur, ur->to_submit, 0, 0, NULL);
+    }
+  else
+    {
+      if (timer_wait)
+	{
+	  ts.tv_sec = timer_wait->tv_sec;
+	  ts.tv_nsec = timer_wait->tv_usec * 1000;
+	}
+      ret = thread_uring_enter (ur, ur->to_submit, 1, IORING_ENTER_GETEVENTS,
+				timer_wait ? &ts : NULL);
+    }
+
+  if (ret < 0 && errno != ETIME && errno != EAGAIN && errno != EBUSY)
+    return -1;
+
+  return __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE) - *ur->cq_head;
+}
+
+static void
+thread_uring_process (struct thread_master *m)
+{
+  struct thread_uring *ur = m->poll_info;
+  unsigned int head = *ur->cq_head;
+  unsigned int tail = __atomic_load_n (ur->cq_tail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++)
+    {
+      struct io_uring_cqe *cqe = &ur->cqes[head & *ur->cq_mask];
+      struct thread_uring_fd *ufd;
+      int fd;
+      u_int32_t events;
+
+      if (cqe->user_data == THREAD_URING_IGNORE)
+	continue;
+
+      fd = cqe->user_data & 0xffffffff;
+      if (fd >= ur->fds_size)
+	continue;
+      ufd = &ur->fds[fd];
+      if ((cqe->user_data >> 32) != ufd->gen)
+	continue;
+
+      /* The poll is spent.  Errors, a bad descriptor say, and hangups
+	 are reported to whoever is waiting, as select does. */
+      ufd->armed = 0;
+      events = (cqe->res < 0) ? (POLLIN | POLLOUT) : (u_int32_t) cqe->res;
+      if (events & (POLLERR | POLLHUP | POLLNVAL))
+	events |= (POLLIN | POLLOUT);
+
+      if ((events & POLLIN) && ufd->read)
+	{
+	  thread_fd_ready (m, ufd->read);
+	  ufd->read = NULL;
+	}
+      if ((events & POLLOUT) && ufd->write)
+	{
+	  thread_fd_ready (m, ufd->write);
+	  ufd->write = NULL;
+	}
+
+      /* Re-armed on the next wait, for whoever still or again waits. */
+      thread_uring_dirty (ur, fd);
+    }
+
+  __atomic_store_n (ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static const struct thread_poll_ops thread_poll_uring =
+{
+  .name = "io_uring",
+  .init = thread_uring_init,
+  .finish = thread_uring_finish,
+  .add = thread_uring_add,
+  .del = thread_uring_del,
+  .wait = thread_uring_wait,
+  .process = thread_uring_process,
+};
+#endif /* HAVE_IO_URING */
+
+static const struct thread_poll_ops *thread_poll_backends[] =
+{
+#ifdef HAVE_EPOLL
+  &thread_poll_epoll,
+#endif /* HAVE_EPOLL */
+#ifdef HAVE_IO_URING
+  &thread_poll_uring,
+#endif /* HAVE_IO_URING */
+  &thread_poll_select,
+  NULL,
+};
+
+/* Backend used for masters created from now on. */
+static const struct thread_poll_ops *thread_poll_default = NULL;
+
+/* Choose the I/O backend by name for subsequently created masters.
+   Returns -1 if no such backend was compiled in. */
+int
+thread_poll_set_default (const char *name)
+{
+  const struct thread_poll_ops **ops;
+
+  for (ops = thread_poll_backends; *ops; ops++)
+    if (strcmp ((*ops)->name, name) == 0)
+      {
+	thread_poll_default = *ops;
+	return 0;
+      }
+  return -1;
+}
+
+const char *
+thread_poll_name (struct thread_master *m)
+{
+  return m->poll->name;
+}
+
+/* Timers are kept in a binary heap ordered by expiry; each thread
+   records its heap position so thread_cancel is O(log n). */
+static int
+thread_timer_cmp (void *a, void *b)
+{
+  struct thread *thread_a = a;
+  struct thread *thread_b = b;
+  long cmp;
+
+  cmp = timeval_cmp (thread_a->u.sands, thread_b->u.sands);
+  if (cmp < 0)
+    return -1;
+  if (cmp > 0)
+    return 1;
+  return 0;
+}
+
+static void
+thread_timer_update (void *node, int actual_position)
+{
+  struct thread *thread = node;
+
+  thread->index = actual_position;
+}
+
+#ifdef USE_TIMERFD
+/* High resolution timers.  A poll timeout is only as precise as the
+   backend allows (epoll rounds up to milliseconds) plus kernel slack,
+   so the earliest timer_hr expiry is also programmed into a timerfd
+   as an absolute CLOCK_MONOTONIC time.  The descriptor only serves to
+   wake us up; thread_fetch picks the expired timers off the queue. */
+static int
+thread_timerfd_read (struct thread *thread)
+{
+  struct thread_master *m = THREAD_ARG (thread);
+  uint64_t expirations;
+
+  if (read (m->timerfd, &expirations, sizeof (expirations)) < 0
+      && errno != EAGAIN)
+    zlog_warn ("timerfd read: %s", safe_strerror (errno));
+
+  return 0;
+}
+#endif /* USE_TIMERFD */
+
+/* Point the timerfd at the earliest high resolution timer, if that is
+   not where it already points. */
+static void
+thread_timer_hr_arm (struct thread_master *m)
+{
+#ifdef USE_TIMERFD
+  struct itimerspec its;
+  struct timeval next = { .tv_sec = 0, .tv_usec = 0 };
+
+  if (m->timerfd < 0)
+    return;
+
+  if (m->timer_hr->size)
+    next = ((struct thread *) m->timer_hr->array[0])->u.sands;
+  if (timeval_cmp (next, m->timerfd_armed) == 0)
+    return;
+
+  /* An all-zero expiry disarms the timer, which is what we want for an
+     empty queue; anything already due is covered by the poll timeout. */
+  memset (&its, 0, sizeof (its));
+  its.it_value.tv_sec = next.tv_sec;
+  its.it_value.tv_nsec = next.tv_usec * 1000;
+  if (timerfd_settime (m->timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    {
+      zlog_warn ("timerfd_settime: %s", safe_strerror (errno));
+      return;
+    }
+  m->timerfd_armed = next;
+#endif /* USE_TIMERFD */
+}
+
+static int thread_event_mt_read (struct thread *);
+
 /* Allocate new thread master.  */
 struct thread_master *
 thread_master_create ()
 {
-  if (cpu_record == NULL) 
-    cpu_record 
-      = hash_create_size (1011, (unsigned int (*) (void *))cpu_record_hash_key, 
-                          (int (*) (const void *, const void *))cpu_record_hash_cmp);
-    
-  return (struct thread_master *) XCALLOC (MTYPE_THREAD_MASTER,
-					   sizeof (struct thread_master));
+  struct thread_master *m;
+
+  m = XCALLOC (MTYPE_THREAD_MASTER, sizeof (struct thread_master));
+
+  m->cpu_record
+    = hash_create_size (1011, (unsigned int (*) (void *))cpu_record_hash_key, 
+                        (int (*) (const void *, const void *))cpu_record_hash_cmp);
+  pthread_mutex_init (&m->cpu_record_mtx, NULL);
+  pthread_mutex_lock (&thread_masters_mtx);
+  m->next = thread_masters;
+  thread_masters = m;
+  pthread_mutex_unlock (&thread_masters_mtx);
+
+  m->timer = pqueue_create ();
+  m->timer->cmp = thread_timer_cmp;
+  m->timer->update = thread_timer_update;
+  m->background = pqueue_create ();
+  m->background->cmp = thread_timer_cmp;
+  m->background->update = thread_timer_update;
+  m->timer_hr = pqueue_create ();
+  m->timer_hr->cmp = thread_timer_cmp;
+  m->timer_hr->update = thread_timer_update;
+
+  /* The first compiled-in backend is the preferred one; select is
+     always last and always works.  A backend the kernel turns out not
+     to support falls back to the next one in line. */
+  m->poll = thread_poll_default ? thread_poll_default
+				: thread_poll_backends[0];
+  if (m->poll->init (m) < 0)
+    {
+      const struct thread_poll_ops **ops;
+
+      for (ops = thread_poll_backends; *ops; ops++)
+	if (*ops != m->poll && (*ops)->init (m) == 0)
+	  break;
+      zlog_warn ("%s event backend unavailable, falling back to %s",
+		 m->poll->name, (*ops)->name);
+      m->poll = *ops;
+    }
+
+  m->timerfd = -1;
+#ifdef USE_TIMERFD
+  m->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m->timerfd < 0)
+    zlog_warn ("timerfd_create: %s, high resolution timers will be "
+	       "driven by poll timeouts", safe_strerror (errno));
+  else
+    thread_add_read_persist (m, thread_timerfd_read, m, m->timerfd);
+#endif /* USE_TIMERFD */
+
+  pthread_mutex_init (&m->event_mt_lock, NULL);
+  m->event_fd[0] = m->event_fd[1] = -1;
+#ifdef HAVE_EVENTFD
+  m->event_fd[0] = m->event_fd[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif /* HAVE_EVENTFD */
+  if (m->event_fd[0] < 0)
+    {
+      if (pipe (m->event_fd) < 0)
+	{
+	  zlog_err ("event pipe: %s", safe_strerror (errno));
+	  exit (1);
+	}
+      fcntl (m->event_fd[0], F_SETFL, O_NONBLOCK);
+      fcntl (m->event_fd[1], F_SETFL, O_NONBLOCK);
+    }
+  thread_add_read_persist (m, thread_event_mt_read, m, m->event_fd[0]);
+
+  return m;
 }
 
 /* Add a new thread to the list.  */
@@ -518,23 +1893,7 @@ thread_list_add (struct thread_list *list, struct thread *thread)
     list->tail->next = thread;
   else
     list->head = thread;
-  list->tail = thread;
-  list->count++;
-}
-
-/* Add a new thread just before the point.  */
-static void
-thread_list_add_before (struct thread_list *list, 
-			struct thread *point, 
-			struct thread *thread)
-{
-  thread->next = point;
-  thread->prev = point->prev;
-  if (point->prev)
-    point->prev->next = thread;
-  else
-    list->head = thread;
-  point->prev = thread;
+  list->tail = thread;
   list->count++;
 }
 
@@ -564,7 +1923,6 @@ thread_add_unuse (struct thread_master *m, struct thread *thread)
   assert (thread->prev == NULL);
   assert (thread->type == THREAD_UNUSED);
   thread_list_add (&m->unuse, thread);
-  /* XXX: Should we deallocate funcname here? */
 }
 
 /* Free all unused thread. */
@@ -577,34 +1935,69 @@ thread_list_free (struct thread_master *m, struct thread_list *list)
   for (t = list->head; t; t = next)
     {
       next = t->next;
-      if (t->funcname)
-        XFREE (MTYPE_THREAD_FUNCNAME, t->funcname);
       XFREE (MTYPE_THREAD, t);
       list->count--;
       m->alloc--;
     }
 }
 
+static void
+thread_queue_free (struct thread_master *m, struct pqueue *queue)
+{
+  int i;
+
+  for (i = 0; i < queue->size; i++)
+    {
+      struct thread *t = queue->array[i];
+
+      XFREE (MTYPE_THREAD, t);
+      m->alloc--;
+    }
+  pqueue_delete (queue);
+}
+
 /* Stop thread scheduler. */
 void
 thread_master_free (struct thread_master *m)
 {
+  struct thread_master **mp;
+  int i;
+
   thread_list_free (m, &m->read);
   thread_list_free (m, &m->write);
-  thread_list_free (m, &m->timer);
+  thread_queue_free (m, m->timer);
   thread_list_free (m, &m->event);
-  thread_list_free (m, &m->ready);
+  for (i = 0; i < THREAD_PRIO_MAX; i++)
+    thread_list_free (m, &m->ready[i]);
   thread_list_free (m, &m->unuse);
-  thread_list_free (m, &m->background);
+  thread_queue_free (m, m->background);
+  thread_queue_free (m, m->timer_hr);
+
+  /* Were never counted in alloc. */
+  m->alloc += m->event_mt.count;
+  thread_list_free (m, &m->event_mt);
+  pthread_mutex_destroy (&m->event_mt_lock);
+  close (m->event_fd[0]);
+  if (m->event_fd[1] != m->event_fd[0])
+    close (m->event_fd[1]);
   
-  XFREE (MTYPE_THREAD_MASTER, m);
+  if (m->timerfd >= 0)
+    close (m->timerfd);
+  m->poll->finish (m);
 
-  if (cpu_record)
-    {
-      hash_clean (cpu_record, cpu_record_hash_free);
-      hash_free (cpu_record);
-      cpu_record = NULL;
-    }
+  pthread_mutex_lock (&thread_masters_mtx);
+  for (mp = &thread_masters; *mp; mp = &(*mp)->next)
+    if (*mp == m)
+      {
+	*mp = m->next;
+	break;
+      }
+  pthread_mutex_unlock (&thread_masters_mtx);
+  hash_clean (m->cpu_record, cpu_record_hash_free);
+  hash_free (m->cpu_record);
+  pthread_mutex_destroy (&m->cpu_record_mtx);
+
+  XFREE (MTYPE_THREAD_MASTER, m);
 }
 
 /* Thread list is empty or not.  */
@@ -635,31 +2028,24 @@ thread_timer_remain_second (struct thread *thread)
     return 0;
 }
 
-/* Trim blankspace and "()"s */
-static char *
-strip_funcname (const char *funcname) 
+/* Find a master's cpu_record entry for a task, creating it the first
+   time the function is scheduled on it.  The entry owns the stripped
+   name, which threads then share rather than copy. */
+static struct cpu_thread_history *
+cpu_record_get (struct thread_master *m, int (*func) (struct thread *),
+		const char *funcname)
 {
-  char buff[100];
-  char tmp, *ret, *e, *b = buff;
-
-  strncpy(buff, funcname, sizeof(buff));
-  buff[ sizeof(buff) -1] = '\0';
-  e = buff +strlen(buff) -1;
-
-  /* Wont work for funcname ==  "Word (explanation)"  */
-
-  while (*b == ' ' || *b == '(')
-    ++b;
-  while (*e == ' ' || *e == ')')
-    --e;
-  e++;
+  struct cpu_thread_history tmp, *hist;
 
-  tmp = *e;
-  *e = '\0';
-  ret  = XSTRDUP (MTYPE_THREAD_FUNCNAME, b);
-  *e = tmp;
+  tmp.func = func;
+  tmp.funcname = (char *) funcname;
+  tmp.master = m;
 
-  return ret;
+  pthread_mutex_lock (&m->cpu_record_mtx);
+  hist = hash_get (m->cpu_record, &tmp,
+		   (void * (*) (void *))cpu_record_hash_alloc);
+  pthread_mutex_unlock (&m->cpu_record_mtx);
+  return hist;
 }
 
 /* Get new thread.  */
@@ -670,11 +2056,7 @@ thread_get (struct thread_master *m, u_char type,
   struct thread *thread;
 
   if (!thread_empty (&m->unuse))
-    {
-      thread = thread_trim_head (&m->unuse);
-      if (thread->funcname)
-        XFREE(MTYPE_THREAD_FUNCNAME, thread->funcname);
-    }
+    thread = thread_trim_head (&m->unuse);
   else
     {
       thread = XCALLOC (MTYPE_THREAD, sizeof (struct thread));
@@ -685,8 +2067,11 @@ thread_get (struct thread_master *m, u_char type,
   thread->master = m;
   thread->func = func;
   thread->arg = arg;
+  thread->persist = 0;
+  thread->priority = THREAD_PRIO_NORMAL;
   
-  thread->funcname = strip_funcname(funcname);
+  thread->hist = cpu_record_get (m, func, funcname);
+  thread->funcname = thread->hist->funcname;
 
   return thread;
 }
@@ -700,20 +2085,38 @@ funcname_thread_add_read (struct thread_master *m,
 
   assert (m != NULL);
 
-  if (FD_ISSET (fd, &m->readfd))
+  thread = thread_get (m, THREAD_READ, func, arg, funcname);
+  thread->u.fd = fd;
+  if (m->poll->add (m, thread) < 0)
     {
-      zlog (NULL, LOG_WARNING, "There is already read fd [%d]", fd);
+      thread->type = THREAD_UNUSED;
+      thread_add_unuse (m, thread);
       return NULL;
     }
-
-  thread = thread_get (m, THREAD_READ, func, arg, funcname);
-  FD_SET (fd, &m->readfd);
-  thread->u.fd = fd;
   thread_list_add (&m->read, thread);
 
   return thread;
 }
 
+/* Add persistent read thread.  Unlike an ordinary read thread it stays
+   registered after it runs, until thread_cancel, so the handler must
+   not re-arm it and should drain the descriptor while it is there.
+   Cancel it through the pointer returned here; the thread handed to
+   the handler is a copy. */
+struct thread *
+funcname_thread_add_read_persist (struct thread_master *m,
+				  int (*func) (struct thread *), void *arg,
+				  int fd, const char* funcname)
+{
+  struct thread *thread;
+
+  thread = funcname_thread_add_read (m, func, arg, fd, funcname);
+  if (thread)
+    thread->persist = 1;
+
+  return thread;
+}
+
 /* Add new write thread. */
 struct thread *
 funcname_thread_add_write (struct thread_master *m,
@@ -723,15 +2126,14 @@ funcname_thread_add_write (struct thread_master *m,
 
   assert (m != NULL);
 
-  if (FD_ISSET (fd, &m->writefd))
+  thread = thread_get (m, THREAD_WRITE, func, arg, funcname);
+  thread->u.fd = fd;
+  if (m->poll->add (m, thread) < 0)
     {
-      zlog (NULL, LOG_WARNING, "There is already write fd [%d]", fd);
+      thread->type = THREAD_UNUSED;
+      thread_add_unuse (m, thread);
       return NULL;
     }
-
-  thread = thread_get (m, THREAD_WRITE, func, arg, funcname);
-  FD_SET (fd, &m->writefd);
-  thread->u.fd = fd;
   thread_list_add (&m->write, thread);
 
   return thread;
@@ -746,16 +2148,21 @@ funcname_thread_add_timer_timeval (struct thread_master *m,
                                   const char* funcname)
 {
   struct thread *thread;
-  struct thread_list *list;
+  struct pqueue *queue;
   struct timeval alarm_time;
-  struct thread *tt;
 
   assert (m != NULL);
 
-  assert (type == THREAD_TIMER || type == THREAD_BACKGROUND);
+  assert (type == THREAD_TIMER || type == THREAD_BACKGROUND
+	  || type == THREAD_TIMER_HR);
   assert (time_relative);
   
-  list = ((type == THREAD_TIMER) ? &m->timer : &m->background);
+  if (type == THREAD_TIMER)
+    queue = m->timer;
+  else if (type == THREAD_TIMER_HR)
+    queue = m->timer_hr;
+  else
+    queue = m->background;
   thread = thread_get (m, type, func, arg, funcname);
 
   /* Do we need jitter here? */
@@ -764,15 +2171,7 @@ funcname_thread_add_timer_timeval (struct thread_master *m,
   alarm_time.tv_usec = relative_time.tv_usec + time_relative->tv_usec;
   thread->u.sands = timeval_adjust(alarm_time);
 
-  /* Sort by timeval. */
-  for (tt = list->head; tt; tt = tt->next)
-    if (timeval_cmp (thread->u.sands, tt->u.sands) <= 0)
-      break;
-
-  if (tt)
-    thread_list_add_before (list, tt, thread);
-  else
-    thread_list_add (list, thread);
+  pqueue_enqueue (thread, queue);
 
   return thread;
 }
@@ -812,6 +2211,46 @@ funcname_thread_add_timer_msec (struct thread_master *m,
                                             arg, &trel, funcname);
 }
 
+/* Add high resolution timer thread, expiring after the given number of
+   microseconds.  These run ahead of everything else but signals. */
+struct thread *
+funcname_thread_add_timer_hr (struct thread_master *m,
+                              int (*func) (struct thread *),
+                              void *arg, long timer, const char* funcname)
+{
+  struct timeval trel;
+
+  assert (m != NULL);
+
+  trel.tv_sec = timer / TIMER_SECOND_MICRO;
+  trel.tv_usec = timer % TIMER_SECOND_MICRO;
+
+  return funcname_thread_add_timer_timeval (m, func, THREAD_TIMER_HR,
+                                            arg, &trel, funcname);
+}
+
+/* Add high resolution timer thread expiring at an absolute time on the
+   BANE_CLK_MONOTONIC clock.  A periodic task can add its interval to the
+   u.sands of the thread that just fired, so its schedule does not drift
+   by the dispatch latency of each run. */
+struct thread *
+funcname_thread_add_timer_hr_at (struct thread_master *m,
+                                 int (*func) (struct thread *),
+                                 void *arg, struct timeval *when,
+                                 const char* funcname)
+{
+  struct thread *thread;
+
+  assert (m != NULL);
+  assert (when);
+
+  thread = thread_get (m, THREAD_TIMER_HR, func, arg, funcname);
+  thread->u.sands = timeval_adjust (*when);
+  pqueue_enqueue (thread, m->timer_hr);
+
+  return thread;
+}
+
 /* Add a background thread, with an optional millisec delay */
 struct thread *
 funcname_thread_add_background (struct thread_master *m,
@@ -854,45 +2293,147 @@ funcname_thread_add_event (struct thread_master *m,
   return thread;
 }
 
+/* Add event thread from any pthread, not just the master's own.  The
+   thread is of no use to the caller, it can't be cancelled, so none is
+   returned. */
+void
+funcname_thread_add_event_mt (struct thread_master *m,
+			      int (*func) (struct thread *), void *arg, int val,
+			      const char* funcname)
+{
+  struct thread *thread;
+  u_int64_t one = 1;
+  int wake;
+
+  assert (m != NULL);
+
+  thread = XCALLOC (MTYPE_THREAD, sizeof (struct thread));
+  thread->type = THREAD_EVENT;
+  thread->add_type = THREAD_EVENT;
+  thread->master = m;
+  thread->func = func;
+  thread->arg = arg;
+  thread->u.val = val;
+  thread->priority = THREAD_PRIO_NORMAL;
+  thread->hist = cpu_record_get (m, func, funcname);
+  thread->funcname = thread->hist->funcname;
+
+  pthread_mutex_lock (&m->event_mt_lock);
+  wake = thread_empty (&m->event_mt);
+  thread_list_add (&m->event_mt, thread);
+  pthread_mutex_unlock (&m->event_mt_lock);
+
+  /* Only the first event needs to wake the master, it takes the whole
+     list after it has emptied event_fd. */
+  if (wake
+      && write (m->event_fd[1], &one,
+		(m->event_fd[1] == m->event_fd[0]) ? sizeof (one) : 1) < 0
+      && errno != EAGAIN)
+    zlog_warn ("event wakeup: %s", safe_strerror (errno));
+}
+
+static int
+thread_event_mt_read (struct thread *t)
+{
+  struct thread_master *m = THREAD_ARG (t);
+  struct thread_list list;
+  struct thread *thread;
+  u_int64_t buf[8];
+
+  while (read (m->event_fd[0], buf, sizeof (buf)) > 0
+	 && m->event_fd[0] != m->event_fd[1])
+    ;
+
+  pthread_mutex_lock (&m->event_mt_lock);
+  list = m->event_mt;
+  memset (&m->event_mt, 0, sizeof (struct thread_list));
+  pthread_mutex_unlock (&m->event_mt_lock);
+
+  while ((thread = thread_trim_head (&list)) != NULL)
+    {
+      m->alloc++;
+      thread_list_add (&m->event, thread);
+    }
+
+  return 0;
+}
+
 /* Cancel thread from scheduler. */
 void
 thread_cancel (struct thread *thread)
 {
-  struct thread_list *list;
+  struct thread_list *list = NULL;
+  struct pqueue *queue = NULL;
   
   switch (thread->type)
     {
     case THREAD_READ:
-      assert (FD_ISSET (thread->u.fd, &thread->master->readfd));
-      FD_CLR (thread->u.fd, &thread->master->readfd);
+      thread->master->poll->del (thread->master, thread);
       list = &thread->master->read;
       break;
     case THREAD_WRITE:
-      assert (FD_ISSET (thread->u.fd, &thread->master->writefd));
-      FD_CLR (thread->u.fd, &thread->master->writefd);
+      thread->master->poll->del (thread->master, thread);
       list = &thread->master->write;
       break;
     case THREAD_TIMER:
-      list = &thread->master->timer;
+      queue = thread->master->timer;
       break;
     case THREAD_EVENT:
       list = &thread->master->event;
       break;
     case THREAD_READY:
-      list = &thread->master->ready;
+      if (thread->add_type == THREAD_READ || thread->add_type == THREAD_WRITE)
+        thread->master->poll->del (thread->master, thread);
+      list = &thread->master->ready[thread->priority];
       break;
     case THREAD_BACKGROUND:
-      list = &thread->master->background;
+      queue = thread->master->background;
+      break;
+    case THREAD_TIMER_HR:
+      queue = thread->master->timer_hr;
       break;
     default:
       return;
       break;
     }
-  thread_list_delete (list, thread);
+
+  if (queue)
+    {
+      assert (thread->index >= 0);
+      assert (thread == queue->array[thread->index]);
+      pqueue_remove_at (thread->index, queue);
+      thread->index = -1;
+    }
+  else
+    thread_list_delete (list, thread);
+
   thread->type = THREAD_UNUSED;
   thread_add_unuse (thread->master, thread);
 }
 
+/* Change the scheduling class of a thread, which must be the one
+   returned by thread_add_*, not the copy passed to its handler.  The
+   class sticks for as long as the thread does; persistent read threads
+   keep it across runs.  A NULL thread, from a failed add, is ignored. */
+void
+thread_set_priority (struct thread *thread, int priority)
+{
+  struct thread_master *m;
+
+  assert (priority >= 0 && priority < THREAD_PRIO_MAX);
+
+  if (thread == NULL)
+    return;
+  m = thread->master;
+
+  if (thread->type == THREAD_READY && thread->priority != priority)
+    {
+      thread_list_delete (&m->ready[thread->priority], thread);
+      thread_list_add (&m->ready[priority], thread);
+    }
+  thread->priority = priority;
+}
+
 /* Delete all events which has argument value arg. */
 unsigned int
 thread_cancel_event (struct thread_master *m, void *arg)
@@ -920,27 +2461,138 @@ thread_cancel_event (struct thread_master *m, void *arg)
 }
 
 static struct timeval *
-thread_timer_wait (struct thread_list *tlist, struct timeval *timer_val)
+thread_timer_wait (struct pqueue *queue, struct timeval *timer_val)
 {
-  if (!thread_empty (tlist))
+  if (queue->size)
     {
-      *timer_val = timeval_subtract (tlist->head->u.sands, relative_time);
+      struct thread *next_timer = queue->array[0];
+      *timer_val = timeval_subtract (next_timer->u.sands, relative_time);
       return timer_val;
     }
   return NULL;
 }
 
+/* Settle the descriptor of the last handler, which must have returned.
+   Not for thread_poll_now, which thread_should_yield may call from
+   inside the handler, before it has had the chance to re-arm. */
+static void
+thread_poll_unlinger (struct thread_master *m)
+{
+#ifdef HAVE_EPOLL
+  if (m->poll == &thread_poll_epoll)
+    thread_epoll_unlinger (m->poll_info);
+#endif /* HAVE_EPOLL */
+}
+
 static struct thread *
 thread_run (struct thread_master *m, struct thread *thread,
 	    struct thread *fetch)
 {
+  thread_poll_unlinger (m);
+
+#ifdef HAVE_EPOLL
+  /* Let the epoll backend check after the handler whether it re-armed
+     its descriptor, rather than dropping the registration now. */
+  if (m->poll == &thread_poll_epoll
+      && (thread->add_type == THREAD_READ || thread->add_type == THREAD_WRITE))
+    ((struct thread_epoll *) m->poll_info)->linger_fd = THREAD_FD (thread);
+#endif /* HAVE_EPOLL */
+
   *fetch = *thread;
+
+  /* A persistent read thread goes straight back to waiting, before its
+     handler runs, so the handler is free to cancel it. */
+  if (thread->persist)
+    {
+      thread->type = THREAD_READ;
+      if (m->poll->add (m, thread) == 0)
+	{
+	  thread_list_add (&m->read, thread);
+	  return fetch;
+	}
+      zlog_warn ("%s: lost persistent read on fd %d",
+		 thread->funcname, THREAD_FD (thread));
+    }
+
   thread->type = THREAD_UNUSED;
-  thread->funcname = NULL;  /* thread_call will free fetch's copied pointer */
   thread_add_unuse (m, thread);
   return fetch;
 }
 
+/* Put a thread on the ready list of its class.  relative_time must be
+   recent, it is taken as the time the thread became ready. */
+static void
+thread_ready_add (struct thread_master *m, struct thread *thread)
+{
+  thread->type = THREAD_READY;
+  thread->ready_time = relative_time;
+  thread_list_add (&m->ready[thread->priority], thread);
+}
+
+static int
+thread_ready_empty (struct thread_master *m)
+{
+  int i;
+
+  for (i = 0; i < THREAD_PRIO_MAX; i++)
+    if (m->ready[i].count)
+      return 0;
+  return 1;
+}
+
+static unsigned int thread_timer_process (struct pqueue *, struct timeval *);
+
+/* Look, without blocking, for I/O and foreground timers that have
+   become ready since the last time.  May run inside a handler, so the
+   backend must leave that handler's descriptor as it is. */
+static void
+thread_poll_now (struct thread_master *m)
+{
+  struct timeval zero = { .tv_sec = 0, .tv_usec = 0 };
+
+  m->last_poll = relative_time;
+  thread_timer_process (m->timer, &relative_time);
+  if (m->poll->wait (m, &zero) > 0)
+    m->poll->process (m);
+}
+
+/* Take the next thread to run off the ready lists, highest class first.
+   Before settling for anything below critical, look for critical work
+   that has turned up meanwhile, but at most every THREAD_PRIO_POLL_TIME.
+   The last thread_call left relative_time recent enough for that. */
+static struct thread *
+thread_ready_next (struct thread_master *m)
+{
+  struct thread *thread;
+  int i;
+
+  if ((thread = thread_trim_head (&m->ready[THREAD_PRIO_CRITICAL])) != NULL)
+    return thread;
+  if (thread_ready_empty (m))
+    return NULL;
+
+  if (timeval_elapsed (relative_time, m->last_poll) >= THREAD_PRIO_POLL_TIME)
+    {
+      thread_poll_now (m);
+      if ((thread = thread_trim_head (&m->ready[THREAD_PRIO_CRITICAL])))
+	return thread;
+    }
+
+  for (i = THREAD_PRIO_CRITICAL + 1; i < THREAD_PRIO_MAX; i++)
+    if ((thread = thread_trim_head (&m->ready[i])) != NULL)
+      return thread;
+  return NULL;
+}
+
+/* Move an I/O thread whose descriptor became ready to the ready list. */
+static void
+thread_fd_ready (struct thread_master *m, struct thread *thread)
+{
+  thread_list_delete ((thread->type == THREAD_READ) ? &m->read : &m->write,
+		      thread);
+  thread_ready_add (m, thread);
+}
+
 static int
 thread_process_fd (struct thread_list *list, fd_set *fdset, fd_set *mfdset)
 {
@@ -958,31 +2610,47 @@ thread_process_fd (struct thread_list *list, fd_set *fdset, fd_set *mfdset)
         {
           assert (FD_ISSET (THREAD_FD (thread), mfdset));
           FD_CLR(THREAD_FD (thread), mfdset);
-          thread_list_delete (list, thread);
-          thread_list_add (&thread->master->ready, thread);
-          thread->type = THREAD_READY;
+          thread_fd_ready (thread->master, thread);
           ready++;
         }
     }
   return ready;
 }
 
+/* Take the earliest high resolution timer off its queue if it has
+   expired. */
+static struct thread *
+thread_timer_hr_fetch (struct thread_master *m)
+{
+  struct thread *thread;
+
+  bane_get_relative (NULL);
+  thread = m->timer_hr->array[0];
+  if (timeval_cmp (relative_time, thread->u.sands) < 0)
+    return NULL;
+
+  pqueue_dequeue (m->timer_hr);
+  thread->index = -1;
+  thread->type = THREAD_READY;
+  thread->ready_time = relative_time;
+  return thread;
+}
+
 /* Add all timers that have popped to the ready list. */
 static unsigned int
-thread_timer_process (struct thread_list *list, struct timeval *timenow)
+thread_timer_process (struct pqueue *queue, struct timeval *timenow)
 {
   struct thread *thread;
-  struct thread *next;
   unsigned int ready = 0;
   
-  for (thread = list->head; thread; thread = next)
+  while (queue->size)
     {
-      next = thread->next;
+      thread = queue->array[0];
       if (timeval_cmp (*timenow, thread->u.sands) < 0)
         return ready;
-      thread_list_delete (list, thread);
-      thread->type = THREAD_READY;
-      thread_list_add (&thread->master->ready, thread);
+      pqueue_dequeue (queue);
+      thread->index = -1;
+      thread_ready_add (thread->master, thread);
       ready++;
     }
   return ready;
@@ -996,12 +2664,15 @@ thread_process (struct thread_list *list)
   struct thread *next;
   unsigned int ready = 0;
   
+  /* For the ready list timestamps. */
+  if (list->head)
+    bane_get_relative (NULL);
+
   for (thread = list->head; thread; thread = next)
     {
       next = thread->next;
       thread_list_delete (list, thread);
-      thread->type = THREAD_READY;
-      thread_list_add (&thread->master->ready, thread);
+      thread_ready_add (thread->master, thread);
       ready++;
     }
   return ready;
@@ -1013,25 +2684,32 @@ struct thread *
 thread_fetch (struct thread_master *m, struct thread *fetch)
 {
   struct thread *thread;
-  fd_set readfd;
-  fd_set writefd;
-  fd_set exceptfd;
   struct timeval timer_val = { .tv_sec = 0, .tv_usec = 0 };
   struct timeval timer_val_bg;
+  struct timeval timer_val_hr;
   struct timeval *timer_wait = &timer_val;
   struct timeval *timer_wait_bg;
+  struct timeval *timer_wait_hr;
 
   while (1)
     {
       int num = 0;
       
       /* Signals pre-empt everything */
-      bane_sigevent_process ();
+      if (m->sigevents)
+	bane_sigevent_process ();
        
+      /* High resolution timers go ahead of anything already scheduled,
+       * they are what heartbeats are sent from.
+       */
+      if (m->timer_hr->size
+          && (thread = thread_timer_hr_fetch (m)) != NULL)
+        return thread_run (m, thread, fetch);
+
       /* Drain the ready queue of already scheduled jobs, before scheduling
        * more.
        */
-      if ((thread = thread_trim_head (&m->ready)) != NULL)
+      if ((thread = thread_ready_next (m)) != NULL)
         return thread_run (m, thread, fetch);
       
       /* To be fair to all kinds of threads, and avoid starvation, we
@@ -1042,31 +2720,42 @@ thread_fetch (struct thread_master *m, struct thread *fetch)
       /* Normal event are the next highest priority.  */
       thread_process (&m->event);
       
-      /* Structure copy.  */
-      readfd = m->readfd;
-      writefd = m->writefd;
-      exceptfd = m->exceptfd;
-      
       /* Calculate select wait timer if nothing else to do */
-      if (m->ready.count == 0)
+      if (thread_ready_empty (m))
         {
           bane_get_relative (NULL);
-          timer_wait = thread_timer_wait (&m->timer, &timer_val);
-          timer_wait_bg = thread_timer_wait (&m->background, &timer_val_bg);
+          timer_wait = thread_timer_wait (m->timer, &timer_val);
+          timer_wait_bg = thread_timer_wait (m->background, &timer_val_bg);
           
           if (timer_wait_bg &&
               (!timer_wait || (timeval_cmp (*timer_wait, *timer_wait_bg) > 0)))
             timer_wait = timer_wait_bg;
+
+          /* The timerfd should wake us for these, the timeout is only
+             there in case it cannot. */
+          timer_wait_hr = thread_timer_wait (m->timer_hr, &timer_val_hr);
+          if (timer_wait_hr &&
+              (!timer_wait || (timeval_cmp (*timer_wait, *timer_wait_hr) > 0)))
+            timer_wait = timer_wait_hr;
         }
+      else
+        {
+          /* Just poll, events are waiting. */
+          timer_val.tv_sec = timer_val.tv_usec = 0;
+          timer_wait = &timer_val;
+        }
+
+      thread_timer_hr_arm (m);
+      thread_poll_unlinger (m);
       
-      num = select (FD_SETSIZE, &readfd, &writefd, &exceptfd, timer_wait);
+      num = m->poll->wait (m, timer_wait);
       
       /* Signals should get quick treatment */
       if (num < 0)
         {
           if (errno == EINTR)
             continue; /* signal received - process it */
-          zlog_warn ("select() error: %s", safe_strerror (errno));
+          zlog_warn ("%s() error: %s", m->poll->name, safe_strerror (errno));
             return NULL;
         }
 
@@ -1074,30 +2763,26 @@ thread_fetch (struct thread_master *m, struct thread *fetch)
          priority than I/O threads, so let's push them onto the ready
 	 list in front of the I/O threads. */
       bane_get_relative (NULL);
-      thread_timer_process (&m->timer, &relative_time);
+      m->last_poll = relative_time;
+      thread_timer_process (m->timer, &relative_time);
       
       /* Got IO, process it */
       if (num > 0)
-        {
-          /* Normal priority read thead. */
-          thread_process_fd (&m->read, &readfd, &m->readfd);
-          /* Write thead. */
-          thread_process_fd (&m->write, &writefd, &m->writefd);
-        }
+        m->poll->process (m);
 
 #if 0
       /* If any threads were made ready above (I/O or foreground timer),
          perhaps we should avoid adding background timers to the ready
 	 list at this time.  If this is code is uncommented, then background
 	 timer threads will not run unless there is nothing else to do. */
-      if ((thread = thread_trim_head (&m->ready)) != NULL)
+      if ((thread = thread_ready_next (m)) != NULL)
         return thread_run (m, thread, fetch);
 #endif
 
       /* Background timer/events, lowest priority */
-      thread_timer_process (&m->background, &relative_time);
+      thread_timer_process (m->background, &relative_time);
       
-      if ((thread = thread_trim_head (&m->ready)) != NULL)
+      if ((thread = thread_ready_next (m)) != NULL)
         return thread_run (m, thread, fetch);
     }
 }
@@ -1115,6 +2800,24 @@ thread_consumed_time (RUSAGE_T *now, RUSAGE_T *start, unsigned long *cputime)
   return timeval_elapsed (now->real, start->real);
 }
 
+/* Is there critical work, or a high resolution timer, waiting to run? */
+static int
+thread_critical_pending (struct thread_master *m)
+{
+  if (m->timer_hr->size)
+    {
+      struct thread *next = m->timer_hr->array[0];
+
+      if (timeval_cmp (relative_time, next->u.sands) >= 0)
+        return 1;
+    }
+
+  if (timeval_elapsed (relative_time, m->last_poll) >= THREAD_PRIO_POLL_TIME)
+    thread_poll_now (m);
+
+  return (m->ready[THREAD_PRIO_CRITICAL].count > 0);
+}
+
 /* We should aim to yield after THREAD_YIELD_TIME_SLOT milliseconds. 
    Note: we are using real (wall clock) time for this calculation.
    It could be argued that CPU time may make more sense in certain
@@ -1128,8 +2831,15 @@ int
 thread_should_yield (struct thread *thread)
 {
   bane_get_relative (NULL);
-  return (timeval_elapsed(relative_time, thread->ru.real) >
-  	  THREAD_YIELD_TIME_SLOT);
+  if (timeval_elapsed(relative_time, thread->ru.real) >
+      THREAD_YIELD_TIME_SLOT)
+    return 1;
+
+  /* Bulk work also steps aside as soon as critical work is waiting. */
+  if (thread->master && thread->priority == THREAD_PRIO_BULK)
+    return thread_critical_pending (thread->master);
+
+  return 0;
 }
 
 void
@@ -1150,50 +2860,160 @@ thread_getrusage (RUSAGE_T *r)
 #endif /* HAVE_CLOCK_MONOTONIC */
 }
 
+#ifdef HAVE_RUSAGE
+/* CPU time used so far, in microseconds, as thread_cpu_mode measures it. */
+static unsigned long
+thread_cpu_time (void)
+{
+  struct rusage ru;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec tp;
+#endif
+
+  switch (thread_cpu_mode)
+    {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    case THREAD_CPU_THREAD:
+      if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &tp) == 0)
+	return tp.tv_sec * TIMER_SECOND_MICRO + tp.tv_nsec / 1000;
+      /* fall through */
+#endif
+    case THREAD_CPU_RUSAGE:
+      getrusage (RUSAGE_SELF, &ru);
+      return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * TIMER_SECOND_MICRO
+	     + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    default:
+      return 0;
+    }
+}
+#endif /* HAVE_RUSAGE */
+
+/* Account a job that a worker pthread ran for this master to the
+   master's cpu_record entry of its function.  The delay is the time the
+   job was queued for, and cpu time is always measured for jobs. */
+void
+thread_account_job (struct thread_master *m,
+		    int (*func) (struct thread *), const char *funcname,
+		    unsigned long delay, unsigned long real, unsigned long cpu)
+{
+  struct cpu_thread_history *hist = cpu_record_get (m, func, funcname);
+
+  pthread_mutex_lock (&m->cpu_record_mtx);
+  hist->delay.total += delay;
+  if (hist->delay.max < delay)
+    hist->delay.max = delay;
+  thread_hist_add (hist->delay_hist, delay);
+
+#ifdef HAVE_RUSAGE
+  hist->cpu.total += cpu;
+  if (hist->cpu.max < cpu)
+    hist->cpu.max = cpu;
+  ++(hist->cpu_calls);
+#endif
+
+  hist->real.total += real;
+  if (hist->real.max < real)
+    hist->real.max = real;
+  thread_hist_add (hist->runtime_hist, real);
+
+  ++(hist->total_calls);
+  hist->types |= (1 << THREAD_JOB);
+  pthread_mutex_unlock (&m->cpu_record_mtx);
+}
+
 /* We check thread consumed time. If the system has getrusage, we'll
-   use that to get in-depth stats on the performance of the thread in addition
-   to wall clock time stats from gettimeofday. */
+   use that, or the per-thread cpu clock, to get in-depth stats on the
+   performance of the thread in addition to wall clock time stats. */
 void
 thread_call (struct thread *thread)
 {
-  unsigned long realtime, cputime;
-  RUSAGE_T ru;
+  struct cpu_thread_history *hist;
+  unsigned long realtime, cputime = 0, late = 0, delay = 0;
+  int timer, ready;
+#ifdef HAVE_RUSAGE
+  unsigned long cpustart = 0;
+  int sample;
+#endif
 
- /* Cache a pointer to the relevant cpu history thread, if the thread
-  * does not have it yet.
-  *
-  * Callers submitting 'dummy threads' hence must take care that
-  * thread->cpu is NULL
+ /* Scheduled threads are given their cpu history entry by thread_get.
+  * Callers submitting 'dummy threads' must take care that thread->hist
+  * is NULL, and thread->master set, so it is looked up here.
   */
   if (!thread->hist)
-    {
-      struct cpu_thread_history tmp;
-      
-      tmp.func = thread->func;
-      tmp.funcname = thread->funcname;
-      
-      thread->hist = hash_get (cpu_record, &tmp, 
-                    (void * (*) (void *))cpu_record_hash_alloc);
-    }
+    thread->hist = cpu_record_get (thread->master, thread->func,
+				   thread->funcname);
+  hist = thread->hist;
+
+  /* Wall clock time, and recent_time, are taken for every call, only
+     the cpu time measurement is optional. */
+  bane_get_relative (NULL);
+  thread->ru.real = relative_time;
+#ifdef HAVE_CLOCK_MONOTONIC
+  bane_gettimeofday (&recent_time);
+#endif /* HAVE_CLOCK_MONOTONIC */
+
+  timer = (thread->add_type == THREAD_TIMER
+	   || thread->add_type == THREAD_TIMER_HR);
+  if (timer)
+    late = timeval_elapsed (thread->ru.real, thread->u.sands);
 
-  GETRUSAGE (&thread->ru);
+  /* Executed threads never sat on the ready list. */
+  ready = (thread->add_type != THREAD_EXECUTE);
+  if (ready)
+    delay = timeval_elapsed (thread->ru.real, thread->ready_time);
+
+#ifdef HAVE_RUSAGE
+  sample = (thread_cpu_mode != THREAD_CPU_WALL
+	    && (hist->sample_calls++ % thread_cpu_sample) == 0);
+  if (sample)
+    cpustart = thread_cpu_time ();
+#endif
 
   (*thread->func) (thread);
 
-  GETRUSAGE (&ru);
+#ifdef HAVE_RUSAGE
+  if (sample)
+    cputime = thread_cpu_time () - cpustart;
+#endif
+
+  bane_get_relative (NULL);
+  realtime = timeval_elapsed (relative_time, thread->ru.real);
+
+  pthread_mutex_lock (&hist->master->cpu_record_mtx);
+  if (timer)
+    {
+      hist->late.total += late;
+      if (hist->late.max < late)
+        hist->late.max = late;
+      ++(hist->timer_calls);
+    }
+
+  if (ready)
+    {
+      hist->delay.total += delay;
+      if (hist->delay.max < delay)
+        hist->delay.max = delay;
+      thread_hist_add (hist->delay_hist, delay);
+    }
 
-  realtime = thread_consumed_time (&ru, &thread->ru, &cputime);
-  thread->hist->real.total += realtime;
-  if (thread->hist->real.max < realtime)
-    thread->hist->real.max = realtime;
 #ifdef HAVE_RUSAGE
-  thread->hist->cpu.total += cputime;
-  if (thread->hist->cpu.max < cputime)
-    thread->hist->cpu.max = cputime;
+  if (sample)
+    {
+      hist->cpu.total += cputime;
+      if (hist->cpu.max < cputime)
+	hist->cpu.max = cputime;
+      ++(hist->cpu_calls);
+    }
 #endif
 
-  ++(thread->hist->total_calls);
-  thread->hist->types |= (1 << thread->add_type);
+  hist->real.total += realtime;
+  if (hist->real.max < realtime)
+    hist->real.max = realtime;
+  thread_hist_add (hist->runtime_hist, realtime);
+
+  ++(hist->total_calls);
+  hist->types |= (1 << thread->add_type);
+  pthread_mutex_unlock (&hist->master->cpu_record_mtx);
 
 #ifdef CONSUMED_TIME_CHECK
   if (realtime > CONSUMED_TIME_CHECK)
@@ -1209,8 +3029,6 @@ thread_call (struct thread *thread)
 		 realtime/1000, cputime/1000);
     }
 #endif /* CONSUMED_TIME_CHECK */
-
-  XFREE (MTYPE_THREAD_FUNCNAME, thread->funcname);
 }
 
 /* Execute thread */
@@ -1231,10 +3049,9 @@ funcname_thread_execute (struct thread_master *m,
   dummy.func = func;
   dummy.arg = arg;
   dummy.u.val = val;
-  dummy.funcname = strip_funcname (funcname);
+  dummy.hist = cpu_record_get (m, func, funcname);
+  dummy.funcname = dummy.hist->funcname;
   thread_call (&dummy);
 
-  XFREE (MTYPE_THREAD_FUNCNAME, dummy.funcname);
-
   return NULL;
 }
@@ -44,23 +44,76 @@ struct thread_list
   int count;
 };
 
+struct thread_master;
+struct vty;
+struct hash;
+
+/* Scheduling classes.  Ready threads of a class are all run before any
+   of the class below it. */
+#define THREAD_PRIO_CRITICAL  0	/* heartbeat I/O and timers */
+#define THREAD_PRIO_NORMAL    1
+#define THREAD_PRIO_BULK      2	/* work queues, vty */
+#define THREAD_PRIO_MAX       3
+
+/* While lower classes are being run, how often to look for critical
+   I/O that has become ready. */
+#define THREAD_PRIO_POLL_TIME      1000L /* 1ms */
+
+/* I/O readiness backend.  thread_fetch() hands the wait for descriptor
+   readiness to one of these; timers, events and the ready list are
+   handled identically whichever backend is in use. */
+struct thread_poll_ops
+{
+  const char *name;
+  /* Set up / tear down per-master backend state. */
+  int (*init) (struct thread_master *);
+  void (*finish) (struct thread_master *);
+  /* Register or drop interest in a read/write thread's descriptor.
+     add returns -1 if the descriptor cannot be watched. */
+  int (*add) (struct thread_master *, struct thread *);
+  void (*del) (struct thread_master *, struct thread *);
+  /* Block for at most the given time (NULL is forever), returning the
+     number of ready descriptors or -1. */
+  int (*wait) (struct thread_master *, struct timeval *);
+  /* Move the I/O threads found ready by the last wait onto the ready
+     list.  Kept apart from wait so timers can be queued in between. */
+  void (*process) (struct thread_master *);
+};
+
 /* Master of the theads. */
 struct thread_master
 {
   struct thread_list read;
   struct thread_list write;
-  struct thread_list timer;
+  struct pqueue *timer;
   struct thread_list event;
-  struct thread_list ready;
+  struct thread_list ready[THREAD_PRIO_MAX];	/* one per class */
   struct thread_list unuse;
-  struct thread_list background;
+  struct pqueue *background;
+  struct pqueue *timer_hr;		/* high resolution timers */
+  int timerfd;				/* wakes us for timer_hr, or -1 */
+  struct timeval timerfd_armed;		/* expiry timerfd is set for */
+  struct timeval last_poll;		/* last look for I/O readiness */
   fd_set readfd;
   fd_set writefd;
   fd_set exceptfd;
   unsigned long alloc;
+  const struct thread_poll_ops *poll;	/* I/O readiness backend */
+  void *poll_info;			/* backend private state */
+  int sigevents;			/* runs the signal handlers */
+  /* Events added from other pthreads wait here, under the lock, until
+     event_fd wakes this master's own pthread to take them. */
+  pthread_mutex_t event_mt_lock;
+  struct thread_list event_mt;
+  int event_fd[2];			/* the same eventfd, or a pipe */
+  /* Stats of this master's tasks.  Only its own pthread updates them,
+     under the lock, which show and clear take from any other. */
+  struct hash *cpu_record;
+  pthread_mutex_t cpu_record_mtx;
+  struct thread_master *next;		/* on the list of all masters */
 };
 
-typedef unsigned char thread_type;
+typedef unsigned short thread_type;
 
 /* Thread itself. */
 struct thread
@@ -77,26 +130,53 @@ struct thread
     int fd;			/* file descriptor in case of read/write. */
     struct timeval sands;	/* rest of time sands value. */
   } u;
+  int index;			/* queue position, for timers */
+  int persist;			/* read thread stays registered */
+  int priority;			/* scheduling class, THREAD_PRIO_* */
+  struct timeval ready_time;	/* when it was put on the ready list */
   RUSAGE_T ru;			/* Indepth usage info.  */
   struct cpu_thread_history *hist; /* cache pointer to cpu_history */
-  char* funcname;
+  const char *funcname;		/* points at hist->funcname */
 };
 
+/* Log2 latency histograms: bucket 0 counts 0 uSec, bucket i counts
+   [2^(i-1), 2^i) uSec and the last bucket everything above that. */
+#define THREAD_HIST_BUCKETS   32
+
 struct cpu_thread_history 
 {
   int (*func)(struct thread *);
   char *funcname;
+  struct thread_master *master;		/* whose cpu_record it is in */
+  unsigned int sample_calls;		/* towards the next cpu sample */
   unsigned int total_calls;
   struct time_stats
   {
     unsigned long total, max;
   } real;
 #ifdef HAVE_RUSAGE
+  unsigned int cpu_calls;		/* calls cpu time was measured for */
   struct time_stats cpu;
 #endif
+  /* How long after its expiry a timer actually got to run. */
+  unsigned int timer_calls;
+  struct time_stats late;
+  /* Time spent on the ready list before running, and distributions of
+     that and of the real runtime. */
+  struct time_stats delay;
+  unsigned long runtime_hist[THREAD_HIST_BUCKETS];
+  unsigned long delay_hist[THREAD_HIST_BUCKETS];
   thread_type types;
 };
 
+/* Ways thread_call can measure cpu time. */
+enum thread_cpu_mode
+{
+  THREAD_CPU_RUSAGE = 0,	/* getrusage(), user + system */
+  THREAD_CPU_THREAD,		/* CLOCK_THREAD_CPUTIME_ID */
+  THREAD_CPU_WALL,		/* none, wall clock time only */
+};
+
 /* Clocks supported by Bane */
 enum bane_clkid {
   BANE_CLK_REALTIME = 0,	/* ala gettimeofday() */
@@ -113,6 +193,8 @@ enum bane_clkid {
 #define THREAD_BACKGROUND     5
 #define THREAD_UNUSED         6
 #define THREAD_EXECUTE        7
+#define THREAD_TIMER_HR       8
+#define THREAD_JOB            9	/* worker pthread job, see jobpool.h */
 
 /* Thread yield time.  */
 #define THREAD_YIELD_TIME_SLOT     10 * 1000L /* 10ms */
@@ -146,6 +228,12 @@ enum bane_clkid {
       thread = thread_add_timer_msec (master, func, arg, time); \
   } while (0)
 
+#define THREAD_TIMER_HR_ON(master,thread,func,arg,time) \
+  do { \
+    if (! thread) \
+      thread = thread_add_timer_hr (master, func, arg, time); \
+  } while (0)
+
 #define THREAD_OFF(thread) \
   do { \
     if (thread) \
@@ -160,10 +248,14 @@ enum bane_clkid {
 #define THREAD_TIMER_OFF(thread)  THREAD_OFF(thread)
 
 #define thread_add_read(m,f,a,v) funcname_thread_add_read(m,f,a,v,#f)
+#define thread_add_read_persist(m,f,a,v) funcname_thread_add_read_persist(m,f,a,v,#f)
 #define thread_add_write(m,f,a,v) funcname_thread_add_write(m,f,a,v,#f)
 #define thread_add_timer(m,f,a,v) funcname_thread_add_timer(m,f,a,v,#f)
 #define thread_add_timer_msec(m,f,a,v) funcname_thread_add_timer_msec(m,f,a,v,#f)
+#define thread_add_timer_hr(m,f,a,v) funcname_thread_add_timer_hr(m,f,a,v,#f)
+#define thread_add_timer_hr_at(m,f,a,v) funcname_thread_add_timer_hr_at(m,f,a,v,#f)
 #define thread_add_event(m,f,a,v) funcname_thread_add_event(m,f,a,v,#f)
+#define thread_add_event_mt(m,f,a,v) funcname_thread_add_event_mt(m,f,a,v,#f)
 #define thread_execute(m,f,a,v) funcname_thread_execute(m,f,a,v,#f)
 
 /* The 4th arg to thread_add_background is the # of milliseconds to delay. */
@@ -172,10 +264,15 @@ enum bane_clkid {
 /* Prototypes. */
 extern struct thread_master *thread_master_create (void);
 extern void thread_master_free (struct thread_master *);
+extern int thread_poll_set_default (const char *);
+extern const char *thread_poll_name (struct thread_master *);
 
 extern struct thread *funcname_thread_add_read (struct thread_master *, 
 				                int (*)(struct thread *),
 				                void *, int, const char*);
+extern struct thread *funcname_thread_add_read_persist (struct thread_master *,
+				                        int (*)(struct thread *),
+				                        void *, int, const char*);
 extern struct thread *funcname_thread_add_write (struct thread_master *,
 				                 int (*)(struct thread *),
 				                 void *, int, const char*);
@@ -185,9 +282,19 @@ extern struct thread *funcname_thread_add_timer (struct thread_master *,
 extern struct thread *funcname_thread_add_timer_msec (struct thread_master *,
 				                      int (*)(struct thread *),
 				                      void *, long, const char*);
+extern struct thread *funcname_thread_add_timer_hr (struct thread_master *,
+				                    int (*)(struct thread *),
+				                    void *, long, const char*);
+extern struct thread *funcname_thread_add_timer_hr_at (struct thread_master *,
+				                       int (*)(struct thread *),
+				                       void *, struct timeval *,
+				                       const char*);
 extern struct thread *funcname_thread_add_event (struct thread_master *,
 				                 int (*)(struct thread *),
 				                 void *, int, const char*);
+extern void funcname_thread_add_event_mt (struct thread_master *,
+					  int (*)(struct thread *),
+					  void *, int, const char*);
 extern struct thread *funcname_thread_add_background (struct thread_master *,
                                                int (*func)(struct thread *),
 				               void *arg,
@@ -196,6 +303,7 @@ extern struct thread *funcname_thread_add_background (struct thread_master *,
 extern struct thread *funcname_thread_execute (struct thread_master *,
                                                int (*)(struct thread *),
                                                void *, int, const char *);
+extern void thread_set_priority (struct thread *, int);
 extern void thread_cancel (struct thread *);
 extern unsigned int thread_cancel_event (struct thread_master *, void *);
 extern struct thread *thread_fetch (struct thread_master *, struct thread *);
@@ -205,8 +313,21 @@ extern int thread_should_yield (struct thread *);
 
 /* Internal libkroute exports */
 extern void thread_getrusage (RUSAGE_T *);
+extern void thread_account_job (struct thread_master *,
+				int (*)(struct thread *), const char *,
+				unsigned long delay, unsigned long real,
+				unsigned long cpu);
 extern struct cmd_element show_thread_cpu_cmd;
 extern struct cmd_element clear_thread_cpu_cmd;
+extern struct cmd_element show_thread_latency_cmd;
+extern struct cmd_element clear_thread_latency_cmd;
+#ifdef HAVE_RUSAGE
+extern struct cmd_element service_thread_accounting_cmd;
+extern struct cmd_element service_thread_accounting_sample_cmd;
+extern struct cmd_element no_service_thread_accounting_cmd;
+extern void thread_set_cpu_accounting (enum thread_cpu_mode, unsigned int);
+extern void thread_config_write (struct vty *);
+#endif /* HAVE_RUSAGE */
 
 /* replacements for the system gettimeofday(), clock_gettime() and
  * time() functions, providing support for non-decrementing clock on
@@ -221,8 +342,9 @@ extern unsigned long thread_consumed_time(RUSAGE_T *after, RUSAGE_T *before,
 
 /* Global variable containing a recent result from gettimeofday.  This can
    be used instead of calling gettimeofday if a recent value is sufficient.
-   This is guaranteed to be refreshed before a thread is called. */
-extern struct timeval recent_time;
+   This is guaranteed to be refreshed before a thread is called, and
+   is private to each pthread. */
+extern __thread struct timeval recent_time;
 /* Similar to recent_time, but a monotonically increasing time value */
 extern struct timeval recent_relative_time (void);
 #endif /* _KROUTE_THREAD_H */
@@ -61,6 +61,9 @@ extern struct host host;
 /* Vector which store each vty structure. */
 static vector vtyvec;
 
+/* The pthread that runs the vtys. */
+static pthread_t vty_pthread;
+
 /* Vty timeout value. */
 static unsigned long vty_timeout_val = VTY_TIMEOUT_DEFAULT;
 
@@ -2449,6 +2452,11 @@ vty_log (const char *level, const char *proto_str,
   if (!vtyvec)
     return;
 
+  /* Monitors are only fed from the pthread that owns the vtys, other
+     pthreads still reach syslog and the log file. */
+  if (!pthread_equal (pthread_self (), vty_pthread))
+    return;
+
   for (i = 0; i < vector_active (vtyvec); i++)
     if ((vty = vector_slot (vtyvec, i)) != NULL)
       if (vty->monitor)
@@ -2528,13 +2536,16 @@ vty_event (enum event event, int sock, struct vty *vty)
       break;
     case VTYSH_READ:
       vty->t_read = thread_add_read (master, vtysh_read, vty, sock);
+      thread_set_priority (vty->t_read, THREAD_PRIO_BULK);
       break;
     case VTYSH_WRITE:
       vty->t_write = thread_add_write (master, vtysh_write, vty, sock);
+      thread_set_priority (vty->t_write, THREAD_PRIO_BULK);
       break;
 #endif /* VTYSH */
     case VTY_READ:
       vty->t_read = thread_add_read (master, vty_read, vty, sock);
+      thread_set_priority (vty->t_read, THREAD_PRIO_BULK);
 
       /* Time out treatment. */
       if (vty->v_timeout)
@@ -2547,7 +2558,10 @@ vty_event (enum event event, int sock, struct vty *vty)
       break;
     case VTY_WRITE:
       if (! vty->t_write)
-	vty->t_write = thread_add_write (master, vty_flush, vty, sock);
+	{
+	  vty->t_write = thread_add_write (master, vty_flush, vty, sock);
+	  thread_set_priority (vty->t_write, THREAD_PRIO_BULK);
+	}
       break;
     case VTY_TIMEOUT_RESET:
       if (vty->t_timeout)
@@ -2969,6 +2983,7 @@ vty_init (struct thread_master *master_thread)
   vty_save_cwd ();
 
   vtyvec = vector_init (VECTOR_MIN_SIZE);
+  vty_pthread = pthread_self ();
 
   master = master_thread;
 
@@ -113,6 +113,7 @@ work_queue_schedule (struct work_queue *wq, unsigned int delay)
     {
       wq->thread = thread_add_background (wq->master, work_queue_run, 
                                           wq, delay);
+      thread_set_priority (wq->thread, THREAD_PRIO_BULK);
       return 1;
     }
   else